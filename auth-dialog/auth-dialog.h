@@ -21,6 +21,8 @@
 
 #include "f5vpn_auth.h"
 #include "f5vpn_getsid.h"
+#include "f5vpn_lagmon.h"
+#include "f5vpn_probe.h"
 
 G_DECLARE_FINAL_TYPE (F5VpnAuthDialog, f5vpn_auth_dialog, F5VPN, AUTH_DIALOG, GtkApplication)
 
@@ -34,6 +36,7 @@ struct _F5VpnAuthDialog
 		const char *uuid;
 		const char *service;
 		gboolean allow_interaction;
+		gint dispatch_lag;
 	} cmdopts;
 
 	GHashTable *vpn_opts;
@@ -46,6 +49,8 @@ struct _F5VpnAuthDialog
 
 	F5VpnAuthSession *session;
 	F5VpnGetSid *getsid;
+	F5VpnProbe *probe;
+	F5VpnLagMonitor *lag_monitor;
 };
 
 void browser_auth_begin (F5VpnAuthDialog *auth);
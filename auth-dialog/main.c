@@ -27,6 +27,46 @@
 
 G_DEFINE_TYPE (F5VpnAuthDialog, f5vpn_auth_dialog, GTK_TYPE_APPLICATION)
 
+/* Gateways which do not complete the TLS handshake within this time are ignored */
+#define GATEWAY_PROBE_TIMEOUT_MS 3000
+
+static void
+begin_auth (F5VpnAuthDialog *auth_dialog)
+{
+	const char *use_browser_auth = g_hash_table_lookup (auth_dialog->vpn_opts, "use-browser-auth");
+	if (use_browser_auth && strcmp (use_browser_auth, "true") == 0) {
+		browser_auth_begin (auth_dialog);
+	} else {
+		native_auth_begin (auth_dialog);
+	}
+}
+
+static void
+on_gateways_probed (F5VpnProbe *probe, const F5VpnProbeResult *const *results, void *userdata)
+{
+	(void) probe;
+
+	F5VpnAuthDialog *auth_dialog = F5VPN_AUTH_DIALOG (userdata);
+
+	for (const F5VpnProbeResult *const *r = results; *r; ++r) {
+		if ((*r)->err)
+			g_message ("gateway %s: %s", (*r)->host, (*r)->err->message);
+		else
+			g_message ("gateway %s: tcp %" G_GINT64_FORMAT "us tls %" G_GINT64_FORMAT "us", (*r)->host, (*r)->connect_us, (*r)->tls_us);
+	}
+
+	/* If none is healthy, carry on with the first one and let the auth flow report the error */
+	const char *gateway = results[0]->host;
+	if (results[0]->err)
+		g_message ("no healthy gateway, trying %s anyway", gateway);
+
+	/* Everything downstream, including the service, uses the chosen gateway */
+	g_hash_table_insert (auth_dialog->vpn_opts, g_strdup ("hostname"), g_strdup (gateway));
+	g_hash_table_insert (auth_dialog->vpn_secrets, g_strdup ("f5vpn-gateway"), g_strdup (gateway));
+
+	begin_auth (auth_dialog);
+}
+
 static void
 activate (GtkApplication *app, gpointer user_data)
 {
@@ -35,12 +75,19 @@ activate (GtkApplication *app, gpointer user_data)
 	g_application_hold (G_APPLICATION (app));
 	F5VpnAuthDialog *auth_dialog = F5VPN_AUTH_DIALOG (app);
 
-	const char *use_browser_auth = g_hash_table_lookup (auth_dialog->vpn_opts, "use-browser-auth");
-	if (use_browser_auth && strcmp (use_browser_auth, "true") == 0) {
-		browser_auth_begin (auth_dialog);
+	if (auth_dialog->cmdopts.dispatch_lag > 0)
+		auth_dialog->lag_monitor = f5vpn_lag_monitor_start (g_main_context_default (), F5VPN_LAG_MONITOR_DEFAULT_INTERVAL_MS, auth_dialog->cmdopts.dispatch_lag);
+
+	gchar **gateways = f5vpn_probe_split_hosts (g_hash_table_lookup (auth_dialog->vpn_opts, "hostname"));
+	if (g_strv_length (gateways) > 1) {
+		auth_dialog->probe = f5vpn_probe_begin (g_main_context_default (), (const char *const *) gateways, FALSE, GATEWAY_PROBE_TIMEOUT_MS, on_gateways_probed, auth_dialog);
 	} else {
-		native_auth_begin (auth_dialog);
+		/* As the service does, use the host without separators or blanks */
+		if (gateways[0])
+			g_hash_table_insert (auth_dialog->vpn_opts, g_strdup ("hostname"), g_strdup (gateways[0]));
+		begin_auth (auth_dialog);
 	}
+	g_strfreev (gateways);
 }
 
 static gint
@@ -75,6 +122,14 @@ f5vpn_auth_dialog_finalize (GObject *obj)
 		f5vpn_auth_session_free (auth_dialog->session);
 	if (auth_dialog->getsid)
 		f5vpn_getsid_free (auth_dialog->getsid);
+	if (auth_dialog->probe)
+		f5vpn_probe_free (auth_dialog->probe);
+	if (auth_dialog->lag_monitor) {
+		gchar *dump = f5vpn_lag_monitor_dump (auth_dialog->lag_monitor);
+		g_message ("dispatch lag:\n%s", dump);
+		g_free (dump);
+		f5vpn_lag_monitor_free (auth_dialog->lag_monitor);
+	}
 	G_OBJECT_CLASS (f5vpn_auth_dialog_parent_class)->finalize (obj);
 }
 
@@ -90,6 +145,8 @@ f5vpn_auth_dialog_init (F5VpnAuthDialog *auth_dialog)
 	memset (&auth_dialog->cmdopts, 0, sizeof (auth_dialog->cmdopts));
 	auth_dialog->vpn_opts = NULL;
 	auth_dialog->vpn_secrets = NULL;
+	auth_dialog->probe = NULL;
+	auth_dialog->lag_monitor = NULL;
 }
 
 int
@@ -108,6 +165,7 @@ main (int argc, char **argv)
 	    { "vpn-name", 'n', 0, G_OPTION_ARG_STRING, &auth_dialog->cmdopts.name, "", NULL },
 	    { "vpn-uuid", 'u', 0, G_OPTION_ARG_STRING, &auth_dialog->cmdopts.uuid, "", NULL },
 	    { "vpn-service", 's', 0, G_OPTION_ARG_STRING, &auth_dialog->cmdopts.service, "", NULL },
+	    { "dispatch-lag", 0, 0, G_OPTION_ARG_INT, &auth_dialog->cmdopts.dispatch_lag, "Debugging: log main loop stalls of this many milliseconds", NULL },
 	    { NULL }
 	});
 	/* clang-format on */
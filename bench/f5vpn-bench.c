@@ -0,0 +1,1569 @@
+/*
+ * NetworkManager-f5vpn
+ * Plugin for NetworkManager to access F5 Firepass SSL VPNs
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+#include "f5vpn_auth.h"
+#include "f5vpn_backoff.h"
+#include "f5vpn_connect.h"
+#include "f5vpn_getsid.h"
+#include "f5vpn_stats.h"
+#include "gateway.h"
+#include <arpa/inet.h>
+#include <curl/curl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glib-unix.h>
+#include <glib.h>
+#include <malloc.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pwd.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mount.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/* The benchmark runs in a network namespace of its own, connected through a
+ * veth pair to the stand-in gateway in another one. Two namespaces are needed
+ * as both ends of the PPP link would otherwise be local addresses, and the
+ * kernel would deliver the traffic without ever passing it through the
+ * tunnel. */
+#define GATEWAY_ADDR  "10.200.0.1"
+#define BENCH_ADDR    "10.200.0.2"
+#define GATEWAY_PORT  443
+#define PPP_SERVER_IP "10.201.0.1"
+#define PPP_CLIENT_IP "10.201.0.2"
+#define PPP_LAN       "10.201.0.0/255.255.255.0"
+#define SESSION_KEY   "f5vpn-bench"
+#define BENCH_USER     "bench"
+#define BENCH_PASSWORD "bench"
+#define BENCH_OTC      "bench-otc"
+#define BENCH_RESOURCE "/Common/bench_na_res"
+
+/* Services offered on the gateway's end of the tunnel */
+#define DISCARD_PORT 9
+#define ECHO_PORT    7
+#define DNS_PORT     53
+
+/* Names under this domain are to be resolved by the nameserver behind the
+ * tunnel, as announced in DNS_SPLIT0, all others by one in the benchmark's
+ * namespace. Their answers show where systemd-resolved sent a query. */
+#define INTRANET_DOMAIN "corp.bench.test"
+#define LOCAL_RESOLVER  "127.0.0.1"
+#define TUNNEL_ANSWER   "10.201.0.99"
+#define LOCAL_ANSWER    "192.0.2.99"
+
+#define BULK_CHUNK (64 * 1024)
+
+/* Reconnect delays of --herd, as used by the service */
+#define HERD_BASE_DELAY_MS   1000
+#define HERD_MAX_DELAY_MS    60000
+#define HERD_MAX_ATTEMPTS    10
+#define HERD_BUCKET_MS       100
+
+/* How long --tunnels keeps all tunnels up and idle, long enough for a few
+ * LCP echoes at the default keepalive interval */
+#define SCALE_IDLE_S 10
+
+typedef enum
+{
+	LOAD_BULK_START,
+	LOAD_BULK_DONE,
+	LOAD_LATENCY,
+	LOAD_FAILED
+} LoadEvent;
+
+/* Progress reports of the load generator process */
+typedef struct
+{
+	guint32 event; /* LoadEvent */
+	gint32 mss;    /* of the bulk transfer's connection */
+	gint64 bulk_ns;
+	gint64 rtt_ns[5]; /* p50, p90, p99, p99.9 and max */
+} LoadMsg;
+
+/* Steps of bringing up a tunnel from scratch, as timed by --setup */
+typedef enum
+{
+	SETUP_PORTAL,
+	SETUP_LOGIN,
+	SETUP_GETSID,
+	SETUP_CONNECT_PARAMS,
+	SETUP_TUNNEL_OPEN,
+	SETUP_PPP_UP,
+	SETUP_TOTAL,
+	SETUP_PHASE_COUNT
+} SetupPhase;
+
+static const char *const setup_phase_names[SETUP_PHASE_COUNT] = {
+	"portal", "login", "getsid", "connect.php3", "tunnel", "ppp", "total"
+};
+
+/* CPU time and resident set of the processes making up the client side of
+ * the tunnel */
+typedef struct
+{
+	guint64 self_ms;
+	guint64 openssl_ms;
+	guint64 pppd_ms;
+	guint64 rss_kib; /* of all of them, pages shared counted once per process */
+} CpuSample;
+
+/* Resource usage of the benchmark process, for --soak */
+typedef struct
+{
+	guint64 rss_kib;
+	guint64 heap_kib; /* allocated from the malloc heap */
+	guint fds;
+} ResourceSample;
+
+typedef struct
+{
+	GMainLoop *loop;
+	F5VpnConnection *connection;
+	pid_t gateway_pid;
+	pid_t load_pid;
+	gint bulk_mib;
+	gint rounds;
+	gint message_size;
+	gboolean under_load;
+	gint mtu;
+	gboolean clamp_mss;
+	F5VpnSocketProfile profile;
+	CpuSample cpu_start;
+	int status;
+
+	/* --setup mode */
+	gint setup_runs;
+	gint rtt_ms;
+	gint setup_done;
+	gint64 *setup_us[SETUP_PHASE_COUNT];
+	gint64 run_start_ns;
+	gint64 phase_start_ns;
+	F5VpnAuthSession *auth;
+	F5VpnGetSid *getsid;
+	gchar *resource;
+
+	/* --herd mode, run once without and once with jitter */
+	gint herd_clients;
+	gboolean herd_jitter;
+	gint herd_left;
+	gint herd_failed;
+	gint64 herd_start_ns;
+	GArray *herd_attempt_us; /* when each connect.php3 request was sent */
+	gint64 *herd_done_us;
+
+	/* --tunnels mode */
+	gint scale_tunnels;
+	struct ScaleTunnel *scale;
+	gint scale_up;
+	gint scale_open; /* connections not freed yet */
+	gboolean scale_stopping;
+	CpuSample scale_base;
+	CpuSample scale_all_up;
+
+	/* --dns mode */
+	gint dns_rounds;
+	pid_t resolver_pid;
+
+	/* --soak mode, which repeats the --setup cycle */
+	gint soak_cycles;
+	gint soak_warmup;
+	gint max_rss_growth_kib;
+	gint max_heap_growth_kib;
+	gint max_fd_growth;
+	ResourceSample soak_base;
+} Bench;
+
+static gboolean
+run_cmd (const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start (ap, fmt);
+	gchar *cmd = g_strdup_vprintf (fmt, ap);
+	va_end (ap);
+
+	int status = system (cmd);
+	if (status != 0)
+		fprintf (stderr, "command failed: %s\n", cmd);
+	g_free (cmd);
+	return status == 0;
+}
+
+static gint64
+mono_ns (void)
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (gint64) ts.tv_sec * G_GINT64_CONSTANT (1000000000) + ts.tv_nsec;
+}
+
+static int
+write_all (int fd, const char *buf, size_t len)
+{
+	while (len) {
+		ssize_t n = write (fd, buf, len);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int
+read_exact (int fd, char *buf, size_t len)
+{
+	while (len) {
+		ssize_t n = read (fd, buf, len);
+		if (n <= 0) {
+			if (n == -1 && errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Returns the user and system time and resident set of the process
+ * described by a /proc/<pid>/stat file, along with its parent and command
+ * name */
+static gboolean
+read_proc_stat (const char *path, pid_t *ppid, char *comm, size_t comm_size, guint64 *cpu_ms, guint64 *rss_kib)
+{
+	gchar *stat = NULL;
+	unsigned long utime, stime;
+	long rss;
+	int parent;
+
+	if (!g_file_get_contents (path, &stat, NULL, NULL))
+		return FALSE;
+
+	/* The command name may contain anything, so parse from its end */
+	char *start = strchr (stat, '(');
+	char *end = strrchr (stat, ')');
+	gboolean ok = start && end
+	              && sscanf (end + 2, "%*c %d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu %*d %*d %*d %*d %*d %*d %*u %*u %ld",
+	                         &parent, &utime, &stime, &rss) == 4;
+	if (ok) {
+		*end = '\0';
+		g_strlcpy (comm, start + 1, comm_size);
+		*ppid = parent;
+		*cpu_ms = (utime + stime) * 1000 / sysconf (_SC_CLK_TCK);
+		*rss_kib = MAX (rss, 0) * (sysconf (_SC_PAGESIZE) / 1024);
+	}
+	g_free (stat);
+	return ok;
+}
+
+static void
+sample_cpu (const Bench *b, CpuSample *sample)
+{
+	char comm[32];
+	pid_t ppid, self = getpid ();
+	guint64 cpu_ms, rss_kib;
+
+	memset (sample, 0, sizeof (*sample));
+	if (read_proc_stat ("/proc/self/stat", &ppid, comm, sizeof (comm), &cpu_ms, &rss_kib)) {
+		sample->self_ms = cpu_ms;
+		sample->rss_kib = rss_kib;
+	}
+
+	DIR *dir = opendir ("/proc");
+	if (!dir)
+		return;
+	struct dirent *de;
+	while ((de = readdir (dir))) {
+		pid_t pid = atoi (de->d_name);
+		if (pid <= 0 || pid == b->load_pid || pid == b->gateway_pid)
+			continue;
+		gchar *path = g_strdup_printf ("/proc/%d/stat", pid);
+		if (read_proc_stat (path, &ppid, comm, sizeof (comm), &cpu_ms, &rss_kib) && ppid == self) {
+			if (!strcmp (comm, "openssl")) {
+				sample->openssl_ms += cpu_ms;
+				sample->rss_kib += rss_kib;
+			} else if (!strcmp (comm, "pppd")) {
+				sample->pppd_ms += cpu_ms;
+				sample->rss_kib += rss_kib;
+			}
+		}
+		g_free (path);
+	}
+	closedir (dir);
+}
+
+static int
+connect_to (int port)
+{
+	struct sockaddr_in addr = { 0 };
+
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons (port);
+	inet_pton (AF_INET, PPP_SERVER_IP, &addr.sin_addr);
+
+	/* The gateway's end of the link may come up a little after ours */
+	for (int attempt = 0; attempt < 50; ++attempt) {
+		int fd = socket (AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (connect (fd, (struct sockaddr *) &addr, sizeof (addr)) == 0)
+			return fd;
+		close (fd);
+		g_usleep (100000);
+	}
+	return -1;
+}
+
+static int
+compare_gint64 (const void *a, const void *b)
+{
+	gint64 x = *(const gint64 *) a, y = *(const gint64 *) b;
+	return x < y ? -1 : x > y;
+}
+
+/* Keeps the tunnel busy with a bulk transfer until killed */
+static pid_t
+start_background_bulk (void)
+{
+	pid_t pid = fork ();
+	if (pid == 0) {
+		char buf[BULK_CHUNK] = { 0 };
+		int fd = connect_to (DISCARD_PORT);
+		while (fd != -1 && write_all (fd, buf, sizeof (buf)) == 0)
+			;
+		_exit (EXIT_FAILURE);
+	}
+	return pid;
+}
+
+/* Runs in a process of its own, so that its CPU time is not accounted to
+ * the tunnel */
+static void
+generate_load (const Bench *b, int report_fd)
+{
+	static const int permille[] = { 500, 900, 990, 999, 1000 };
+	LoadMsg msg = { 0 };
+	char *buf = g_malloc (MAX (BULK_CHUNK, b->message_size));
+	gint64 *rtt = g_new (gint64, b->rounds);
+	int one = 1;
+	socklen_t len = sizeof (msg.mss);
+	pid_t background = -1;
+
+	memset (buf, 0x5a, MAX (BULK_CHUNK, b->message_size));
+
+	int fd = connect_to (DISCARD_PORT);
+	if (fd == -1)
+		goto failed;
+	getsockopt (fd, IPPROTO_TCP, TCP_MAXSEG, &msg.mss, &len);
+	msg.event = LOAD_BULK_START;
+	write_all (report_fd, (const char *) &msg, sizeof (msg));
+	gint64 start = mono_ns ();
+	for (gint64 left = (gint64) b->bulk_mib << 20; left > 0; left -= BULK_CHUNK) {
+		if (write_all (fd, buf, MIN (left, BULK_CHUNK)) == -1)
+			goto failed;
+	}
+	/* The sink only closes once it has read everything */
+	shutdown (fd, SHUT_WR);
+	while (read (fd, buf, BULK_CHUNK) > 0)
+		;
+	msg.bulk_ns = mono_ns () - start;
+	msg.event = LOAD_BULK_DONE;
+	write_all (report_fd, (const char *) &msg, sizeof (msg));
+	close (fd);
+
+	if (b->under_load)
+		background = start_background_bulk ();
+	fd = connect_to (ECHO_PORT);
+	if (fd == -1)
+		goto failed;
+	setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+	for (int i = 0; i < b->rounds; ++i) {
+		start = mono_ns ();
+		if (write_all (fd, buf, b->message_size) == -1 || read_exact (fd, buf, b->message_size) == -1)
+			goto failed;
+		rtt[i] = mono_ns () - start;
+	}
+	close (fd);
+	if (background > 0)
+		kill (background, SIGTERM);
+
+	qsort (rtt, b->rounds, sizeof (gint64), compare_gint64);
+	for (gsize i = 0; i < G_N_ELEMENTS (permille); ++i)
+		msg.rtt_ns[i] = rtt[MIN ((gint64) b->rounds * permille[i] / 1000, b->rounds - 1)];
+	msg.event = LOAD_LATENCY;
+	write_all (report_fd, (const char *) &msg, sizeof (msg));
+	_exit (EXIT_SUCCESS);
+
+failed:
+	fprintf (stderr, "load generator: %s\n", strerror (errno));
+	if (background > 0)
+		kill (background, SIGTERM);
+	msg.event = LOAD_FAILED;
+	write_all (report_fd, (const char *) &msg, sizeof (msg));
+	_exit (EXIT_FAILURE);
+}
+
+static void
+report_throughput (const Bench *b, const LoadMsg *msg)
+{
+	CpuSample end;
+	double secs = msg->bulk_ns / 1e9;
+	double gib = b->bulk_mib / 1024.0;
+
+	sample_cpu (b, &end);
+	guint64 self_ms = end.self_ms - b->cpu_start.self_ms;
+	guint64 openssl_ms = end.openssl_ms - b->cpu_start.openssl_ms;
+	guint64 pppd_ms = end.pppd_ms - b->cpu_start.pppd_ms;
+
+	printf ("throughput: %d MiB in %.2f s, %.0f Mbit/s, mss %d\n", b->bulk_mib, secs, b->bulk_mib * 8.388608 / secs, msg->mss);
+	printf ("cpu per GiB: %.2f s (forwarding %.2f s, openssl %.2f s, pppd %.2f s)\n",
+	        (self_ms + openssl_ms + pppd_ms) / 1000.0 / gib, self_ms / 1000.0 / gib, openssl_ms / 1000.0 / gib, pppd_ms / 1000.0 / gib);
+}
+
+static void
+report_latency (const Bench *b, const LoadMsg *msg)
+{
+	printf ("latency (%d byte echo, %d rounds%s): p50 %.1f us, p90 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us\n",
+	        b->message_size, b->rounds, b->under_load ? ", under bulk load" : "", msg->rtt_ns[0] / 1e3, msg->rtt_ns[1] / 1e3, msg->rtt_ns[2] / 1e3, msg->rtt_ns[3] / 1e3, msg->rtt_ns[4] / 1e3);
+}
+
+static gboolean
+on_load_msg (gint fd, GIOCondition condition, gpointer user)
+{
+	(void) condition;
+
+	Bench *b = (Bench *) user;
+	LoadMsg msg;
+
+	if (read_exact (fd, (char *) &msg, sizeof (msg)) == -1)
+		msg.event = LOAD_FAILED;
+
+	switch (msg.event) {
+	case LOAD_BULK_START:
+		sample_cpu (b, &b->cpu_start);
+		return G_SOURCE_CONTINUE;
+	case LOAD_BULK_DONE:
+		report_throughput (b, &msg);
+		return G_SOURCE_CONTINUE;
+	case LOAD_LATENCY:
+		report_latency (b, &msg);
+		b->status = EXIT_SUCCESS;
+		break;
+	default:
+		fprintf (stderr, "load generation failed\n");
+		break;
+	}
+
+	close (fd);
+	waitpid (b->load_pid, NULL, 0);
+	b->load_pid = 0;
+	f5vpn_disconnect (b->connection);
+	return G_SOURCE_REMOVE;
+}
+
+static void
+start_load (Bench *b)
+{
+	int fds[2];
+
+	if (pipe (fds) == -1) {
+		f5vpn_disconnect (b->connection);
+		return;
+	}
+	b->load_pid = fork ();
+	if (b->load_pid == 0) {
+		close (fds[0]);
+		generate_load (b, fds[1]);
+	}
+	close (fds[1]);
+	g_unix_fd_add (fds[0], G_IO_IN, on_load_msg, b);
+}
+
+/* Where systemd-resolved is installed, depending on the distribution */
+static const char *const resolved_paths[] = { "/usr/lib/systemd/systemd-resolved", "/lib/systemd/systemd-resolved" };
+
+static pid_t
+spawn_quiet (const char *const *argv)
+{
+	pid_t pid = fork ();
+	if (pid == 0) {
+		int null = open ("/dev/null", O_WRONLY | O_CLOEXEC);
+		dup2 (null, STDOUT_FILENO);
+		dup2 (null, STDERR_FILENO);
+		execv (argv[0], (char *const *) argv);
+		_exit (EXIT_FAILURE);
+	}
+	return pid;
+}
+
+static void
+stop_child (pid_t pid)
+{
+	if (pid > 0) {
+		kill (pid, SIGTERM);
+		waitpid (pid, NULL, 0);
+	}
+}
+
+static gboolean
+wait_for_cmd (const char *cmd)
+{
+	for (int i = 0; i < 50; ++i) {
+		if (system (cmd) == 0)
+			return TRUE;
+		g_usleep (100000);
+	}
+	fprintf (stderr, "gave up waiting for: %s\n", cmd);
+	return FALSE;
+}
+
+/* Mounts an empty tmpfs over path, creating it if need be */
+static gboolean
+mount_tmpfs (const char *path)
+{
+	gboolean ok = g_mkdir_with_parents (path, 0755) == 0 && mount ("tmpfs", path, "tmpfs", 0, "mode=0755") == 0;
+	if (!ok)
+		fprintf (stderr, "could not mount a tmpfs on %s: %s\n", path, strerror (errno));
+	return ok;
+}
+
+/* Starts a private system bus, as systemd-resolved takes its per-link
+ * configuration from resolvectl over D-Bus */
+static pid_t
+start_system_bus (void)
+{
+	static const char *const argv[] = { "/usr/bin/dbus-daemon", "--system", "--nofork", "--nopidfile", NULL };
+
+	if (!g_file_test (argv[0], G_FILE_TEST_IS_EXECUTABLE)) {
+		fprintf (stderr, "dbus-daemon is not installed\n");
+		return -1;
+	}
+	if (!mount_tmpfs ("/run/dbus"))
+		return -1;
+	pid_t pid = spawn_quiet (argv);
+	if (pid == -1 || !wait_for_cmd ("test -S /run/dbus/system_bus_socket")) {
+		stop_child (pid);
+		return -1;
+	}
+	return pid;
+}
+
+/* Starts systemd-resolved without caching, so that every lookup reaches a
+ * nameserver, and with the nameserver in the benchmark's namespace as the
+ * global one if global_dns is set */
+static pid_t
+start_resolved (gboolean global_dns)
+{
+	const char *argv[] = { NULL, NULL };
+	/* A drop-in in /run overrides whatever the system configured */
+	gchar *conf = g_strdup_printf ("[Resolve]\nDNS=%s\nFallbackDNS=\nDomains=\nCache=no\nDNSSEC=no\nLLMNR=no\nMulticastDNS=no\nReadEtcHosts=no\n",
+	                               global_dns ? LOCAL_RESOLVER : "");
+	gboolean ok = g_file_set_contents ("/run/systemd/resolved.conf.d/f5vpn-bench.conf", conf, -1, NULL);
+	g_free (conf);
+	if (!ok) {
+		fprintf (stderr, "could not configure systemd-resolved\n");
+		return -1;
+	}
+
+	for (guint i = 0; i < G_N_ELEMENTS (resolved_paths) && !argv[0]; ++i)
+		if (g_file_test (resolved_paths[i], G_FILE_TEST_IS_EXECUTABLE))
+			argv[0] = resolved_paths[i];
+	if (!argv[0]) {
+		fprintf (stderr, "systemd-resolved is not installed\n");
+		return -1;
+	}
+	pid_t pid = spawn_quiet (argv);
+	if (pid == -1 || !wait_for_cmd ("resolvectl status >/dev/null 2>&1")) {
+		stop_child (pid);
+		return -1;
+	}
+	return pid;
+}
+
+/* Makes the libc resolver ask resolved's stub listener, unless
+ * /etc/resolv.conf already leads there */
+static gboolean
+use_stub_resolver (void)
+{
+	gchar *target = g_file_read_link ("/etc/resolv.conf", NULL);
+	gboolean ok = target && g_str_has_suffix (target, "/run/systemd/resolve/stub-resolv.conf");
+	g_free (target);
+	if (ok)
+		return TRUE;
+
+	ok = g_file_set_contents ("/run/systemd/f5vpn-bench-resolv.conf", "nameserver 127.0.0.53\n", -1, NULL)
+	     && mount ("/run/systemd/f5vpn-bench-resolv.conf", "/etc/resolv.conf", NULL, MS_BIND, NULL) == 0;
+	if (!ok)
+		fprintf (stderr, "could not point /etc/resolv.conf at systemd-resolved: %s\n", strerror (errno));
+	return ok;
+}
+
+/* Hands the tunnel's nameserver and routing domains to resolved, as the
+ * service does through NetworkManager. NULL domains make the tunnel the
+ * route for every name, as NetworkManager did without split DNS. */
+static gboolean
+configure_link (const NetworkSettings *settings, GSList *domains)
+{
+	char str_dns[INET_ADDRSTRLEN] = "";
+	GString *routing = g_string_new (domains ? "" : " ~.");
+
+	inet_ntop (AF_INET, settings->nameservers->data, str_dns, INET_ADDRSTRLEN);
+	for (GSList *p = domains; p; p = p->next) {
+		const char *domain = (const char *) p->data;
+		g_string_append_printf (routing, " ~%s", g_strcmp0 (domain, "*") ? domain : ".");
+	}
+	gboolean ok = run_cmd ("resolvectl dns %s %s", settings->device, str_dns)
+	              && run_cmd ("resolvectl domain %s%s", settings->device, routing->str)
+	              && run_cmd ("resolvectl default-route %s %s", settings->device, domains ? "no" : "yes");
+	g_string_free (routing, TRUE);
+	return ok;
+}
+
+/* Resolves name through libc, as applications do, and returns the time
+ * taken, or -1 if it failed or was answered by the other nameserver than
+ * expected_answer */
+static gint64
+resolve (const char *name, const char *expected_answer)
+{
+	struct addrinfo hints = { 0 }, *res;
+	char answer[INET_ADDRSTRLEN] = "";
+
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_DGRAM;
+	gint64 start = mono_ns ();
+	int ret = getaddrinfo (name, NULL, &hints, &res);
+	gint64 ns = mono_ns () - start;
+	if (ret) {
+		fprintf (stderr, "looking up %s failed: %s\n", name, gai_strerror (ret));
+		return -1;
+	}
+	inet_ntop (AF_INET, &((struct sockaddr_in *) res->ai_addr)->sin_addr, answer, INET_ADDRSTRLEN);
+	freeaddrinfo (res);
+	if (strcmp (answer, expected_answer)) {
+		fprintf (stderr, "%s was answered by the %s nameserver\n", name, strcmp (expected_answer, TUNNEL_ANSWER) ? "tunnel's" : "local");
+		return -1;
+	}
+	return ns;
+}
+
+static void
+print_lookups (const char *label, gint64 *ns, int rounds)
+{
+	qsort (ns, rounds, sizeof (gint64), compare_gint64);
+	printf ("  %-34s median %8.2f ms, p99 %8.2f ms\n", label, ns[rounds / 2] / 1e6, ns[MIN ((gint64) rounds * 99 / 100, rounds - 1)] / 1e6);
+}
+
+/* Times rounds lookups of each of names, after one untimed lookup each to
+ * let resolved settle on the server's features. Returns FALSE if one
+ * failed. */
+static gboolean
+time_lookups (const char *const *names, guint nr_names, const char *expected_answer, gint64 *ns, int rounds)
+{
+	for (guint i = 0; i < nr_names; ++i)
+		if (resolve (names[i], expected_answer) == -1)
+			return FALSE;
+	for (int i = 0; i < rounds; ++i)
+		if ((ns[i] = resolve (names[i % nr_names], expected_answer)) == -1)
+			return FALSE;
+	return TRUE;
+}
+
+/* Runs in a process of its own, as the tunnel is served by the main loop.
+ * Looks names up through libc and a private systemd-resolved, first with
+ * every name routed through the tunnel, which is what NM did with the
+ * nameservers before split DNS, then with only the DNS_SPLIT0 domains
+ * routed through it as the service now configures them. */
+static void
+measure_dns (const Bench *b, const NetworkSettings *settings)
+{
+	static const char *const internet_names[] = { "www.example.org", "cdn.example.net", "mail.example.com", "api.example.io" };
+	static const char *const intranet_names[] = { "wiki." INTRANET_DOMAIN, "git." INTRANET_DOMAIN };
+	gint64 *before = g_new (gint64, b->dns_rounds);
+	gint64 *after = g_new (gint64, b->dns_rounds);
+	gint64 *intranet = g_new (gint64, b->dns_rounds);
+	struct passwd *pw = getpwnam ("systemd-resolve");
+	pid_t bus = -1, resolved = -1;
+	gboolean ok = FALSE;
+
+	if (!settings->nameservers || !settings->split_domains) {
+		fprintf (stderr, "the gateway announced no nameservers or split DNS domains\n");
+		_exit (EXIT_FAILURE);
+	}
+	if (!pw) {
+		fprintf (stderr, "there is no systemd-resolve user, is systemd-resolved installed?\n");
+		_exit (EXIT_FAILURE);
+	}
+	/* A mount namespace of its own, in which tmpfs mounts hide the system's
+	 * bus and resolved from the ones started here, and go away with this
+	 * process */
+	if (unshare (CLONE_NEWNS) == -1 || mount (NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL) == -1) {
+		fprintf (stderr, "could not isolate the resolver: %s\n", strerror (errno));
+		_exit (EXIT_FAILURE);
+	}
+	if (!mount_tmpfs ("/run/systemd"))
+		goto out;
+	if (mkdir ("/run/systemd/resolved.conf.d", 0755) == -1 || mkdir ("/run/systemd/resolve", 0755) == -1
+	    || chown ("/run/systemd/resolve", pw->pw_uid, pw->pw_gid) == -1) {
+		fprintf (stderr, "could not prepare /run/systemd: %s\n", strerror (errno));
+		goto out;
+	}
+	if ((bus = start_system_bus ()) == -1)
+		goto out;
+
+	if ((resolved = start_resolved (FALSE)) == -1 || !use_stub_resolver () || !configure_link (settings, NULL)
+	    || !time_lookups (internet_names, G_N_ELEMENTS (internet_names), TUNNEL_ANSWER, before, b->dns_rounds))
+		goto out;
+	stop_child (resolved);
+
+	if ((resolved = start_resolved (TRUE)) == -1 || !configure_link (settings, settings->split_domains)
+	    || !time_lookups (internet_names, G_N_ELEMENTS (internet_names), LOCAL_ANSWER, after, b->dns_rounds)
+	    || !time_lookups (intranet_names, G_N_ELEMENTS (intranet_names), TUNNEL_ANSWER, intranet, b->dns_rounds))
+		goto out;
+
+	printf ("dns lookups through systemd-resolved over %d rounds, %d ms injected rtt:\n", b->dns_rounds, b->rtt_ms);
+	print_lookups ("internet, all through the tunnel", before, b->dns_rounds);
+	print_lookups ("internet, split dns", after, b->dns_rounds);
+	print_lookups ("intranet, split dns", intranet, b->dns_rounds);
+	fflush (stdout);
+	ok = TRUE;
+
+out:
+	stop_child (resolved);
+	stop_child (bus);
+	_exit (ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+static void
+on_dns_done (GPid pid, gint status, gpointer user)
+{
+	Bench *b = (Bench *) user;
+
+	g_spawn_close_pid (pid);
+	b->load_pid = 0;
+	if (WIFEXITED (status) && WEXITSTATUS (status) == EXIT_SUCCESS)
+		b->status = EXIT_SUCCESS;
+	f5vpn_disconnect (b->connection);
+}
+
+static void
+start_dns (Bench *b, const NetworkSettings *settings)
+{
+	b->load_pid = fork ();
+	if (b->load_pid == 0)
+		measure_dns (b, settings);
+	if (b->load_pid == -1) {
+		f5vpn_disconnect (b->connection);
+		return;
+	}
+	g_child_watch_add (b->load_pid, on_dns_done, b);
+}
+
+/* One of the clients whose tunnels dropped at the same moment */
+typedef struct
+{
+	Bench *b;
+	guint attempt;
+	F5VpnBackoff backoff;
+} HerdClient;
+
+static void start_herd_round (Bench *b);
+
+static void
+report_herd_round (const Bench *b)
+{
+	GArray *attempts = b->herd_attempt_us;
+	gint64 last = 0;
+
+	for (guint i = 0; i < attempts->len; ++i)
+		last = MAX (last, g_array_index (attempts, gint64, i));
+	guint nr_buckets = last / (HERD_BUCKET_MS * 1000) + 1;
+	guint *buckets = g_new0 (guint, nr_buckets);
+	guint peak = 0;
+	for (guint i = 0; i < attempts->len; ++i) {
+		guint *bucket = &buckets[g_array_index (attempts, gint64, i) / (HERD_BUCKET_MS * 1000)];
+		peak = MAX (peak, ++*bucket);
+	}
+
+	gint done = b->herd_clients - b->herd_failed;
+	qsort (b->herd_done_us, done, sizeof (gint64), compare_gint64);
+	printf ("%d clients reconnecting %s jitter: %u requests, at most %u per %d ms, %d failed\n",
+	        b->herd_clients, b->herd_jitter ? "with" : "without", attempts->len, peak, HERD_BUCKET_MS, b->herd_failed);
+	if (done)
+		printf ("  reconnected: median %.2f s, p99 %.2f s, last %.2f s\n", b->herd_done_us[done / 2] / 1e6,
+		        b->herd_done_us[MIN ((gint64) done * 99 / 100, done - 1)] / 1e6, b->herd_done_us[done - 1] / 1e6);
+	printf ("  requests sent per %d ms after the drop:\n", HERD_BUCKET_MS);
+	for (guint i = 0; i < nr_buckets; ++i) {
+		if (!buckets[i])
+			continue;
+		printf ("  %7.1f s %5u ", i * HERD_BUCKET_MS / 1000.0, buckets[i]);
+		for (guint j = 0; j < MAX (buckets[i] * 50 / peak, 1u); ++j)
+			putchar ('#');
+		putchar ('\n');
+	}
+	fflush (stdout);
+	g_free (buckets);
+}
+
+static void
+herd_client_done (HerdClient *client, gboolean ok)
+{
+	Bench *b = client->b;
+
+	if (ok)
+		b->herd_done_us[b->herd_clients - b->herd_left - b->herd_failed] = (mono_ns () - b->herd_start_ns) / 1000;
+	else
+		b->herd_failed++;
+	free (client);
+	if (--b->herd_left)
+		return;
+
+	report_herd_round (b);
+	if (b->herd_failed == 0)
+		b->status = EXIT_SUCCESS;
+	if (b->herd_jitter) {
+		g_main_loop_quit (b->loop);
+		return;
+	}
+	b->herd_jitter = TRUE;
+	start_herd_round (b);
+}
+
+static gboolean on_herd_attempt (gpointer user);
+
+/* Without jitter, every client waits the same, doubling delay, as clients
+ * retrying on a fixed schedule do */
+static void
+schedule_herd_attempt (HerdClient *client)
+{
+	guint delay = client->b->herd_jitter ? f5vpn_backoff_next (&client->backoff, 0)
+	                                     : MIN ((guint64) HERD_BASE_DELAY_MS << MIN (client->attempt, 16u), HERD_MAX_DELAY_MS);
+	g_timeout_add (delay, on_herd_attempt, client);
+}
+
+static void
+on_herd_params (F5VpnConnectParams *params, void *userdata, GError *err)
+{
+	HerdClient *client = (HerdClient *) userdata;
+
+	f5vpn_connect_params_free (params);
+	if (!err) {
+		herd_client_done (client, TRUE);
+		return;
+	}
+	g_error_free (err);
+	if (++client->attempt == HERD_MAX_ATTEMPTS)
+		herd_client_done (client, FALSE);
+	else
+		schedule_herd_attempt (client);
+}
+
+static gboolean
+on_herd_attempt (gpointer user)
+{
+	HerdClient *client = (HerdClient *) user;
+	gint64 sent_us = (mono_ns () - client->b->herd_start_ns) / 1000;
+
+	g_array_append_val (client->b->herd_attempt_us, sent_us);
+	f5vpn_connect_params_begin (NULL, GATEWAY_ADDR, SESSION_KEY, BENCH_RESOURCE, on_herd_params, client);
+	return G_SOURCE_REMOVE;
+}
+
+/* All clients lose their tunnels now, and schedule their first reconnect */
+static void
+start_herd_round (Bench *b)
+{
+	g_array_set_size (b->herd_attempt_us, 0);
+	b->herd_left = b->herd_clients;
+	b->herd_failed = 0;
+	b->herd_start_ns = mono_ns ();
+	for (gint i = 0; i < b->herd_clients; ++i) {
+		HerdClient *client = calloc (1, sizeof (HerdClient));
+		client->b = b;
+		f5vpn_backoff_init (&client->backoff, HERD_BASE_DELAY_MS, HERD_MAX_DELAY_MS);
+		schedule_herd_attempt (client);
+	}
+}
+
+/* One of the tunnels held open at the same time by --tunnels */
+typedef struct ScaleTunnel
+{
+	Bench *b;
+	F5VpnConnection *connection;
+	gboolean up;
+} ScaleTunnel;
+
+static guint64
+cpu_total_ms (const CpuSample *sample)
+{
+	return sample->self_ms + sample->openssl_ms + sample->pppd_ms;
+}
+
+static void
+stop_scale (Bench *b)
+{
+	b->scale_stopping = TRUE;
+	for (gint i = 0; i < b->scale_tunnels; ++i)
+		if (b->scale[i].connection)
+			f5vpn_disconnect (b->scale[i].connection);
+}
+
+static gboolean
+on_scale_idle_done (gpointer user)
+{
+	Bench *b = (Bench *) user;
+	CpuSample end;
+
+	sample_cpu (b, &end);
+	printf ("idle for %d s: cpu %.1f ms per tunnel (pppd %.1f ms)\n", SCALE_IDLE_S,
+	        (double) (cpu_total_ms (&end) - cpu_total_ms (&b->scale_all_up)) / b->scale_tunnels,
+	        (double) (end.pppd_ms - b->scale_all_up.pppd_ms) / b->scale_tunnels);
+	fflush (stdout);
+	b->status = EXIT_SUCCESS;
+	stop_scale (b);
+	return G_SOURCE_REMOVE;
+}
+
+static void
+on_scale_status (F5VpnConnection *connection, const NetworkSettings *settings, void *userdata, GError *err)
+{
+	ScaleTunnel *t = (ScaleTunnel *) userdata;
+	Bench *b = t->b;
+
+	if (err || !settings) {
+		if (err) {
+			fprintf (stderr, "error: %s\n", err->message);
+			g_error_free (err);
+		}
+		f5vpn_connection_free (connection);
+		t->connection = NULL;
+		/* A tunnel going down before the measurement is over spoils it */
+		if (!b->scale_stopping) {
+			b->status = EXIT_FAILURE;
+			stop_scale (b);
+		}
+		if (--b->scale_open == 0)
+			g_main_loop_quit (b->loop);
+		return;
+	}
+	/* Reported again if IPCP overrode early settings */
+	if (t->up)
+		return;
+	t->up = TRUE;
+	if (++b->scale_up < b->scale_tunnels)
+		return;
+
+	sample_cpu (b, &b->scale_all_up);
+	printf ("%d tunnels up: rss %.0f KiB, setup cpu %.1f ms per tunnel\n", b->scale_tunnels,
+	        ((double) b->scale_all_up.rss_kib - (double) b->scale_base.rss_kib) / b->scale_tunnels,
+	        (double) (cpu_total_ms (&b->scale_all_up) - cpu_total_ms (&b->scale_base)) / b->scale_tunnels);
+	fflush (stdout);
+	g_timeout_add_seconds (SCALE_IDLE_S, on_scale_idle_done, b);
+}
+
+/* Opens all tunnels at once from this process, with the connect.php3
+ * requests sharing their DNS and TLS session caches as f5vpn-cli --tunnels
+ * does */
+static void
+start_scale (Bench *b)
+{
+	f5vpn_connect_share_http_state ();
+	b->scale = g_new0 (ScaleTunnel, b->scale_tunnels);
+	b->scale_open = b->scale_tunnels;
+	sample_cpu (b, &b->scale_base);
+	for (gint i = 0; i < b->scale_tunnels; ++i) {
+		ScaleTunnel *t = &b->scale[i];
+		t->b = b;
+		t->connection = f5vpn_connect (NULL, GATEWAY_ADDR, SESSION_KEY, BENCH_RESOURCE, on_scale_status, t);
+		f5vpn_connection_set_socket_profile (t->connection, &b->profile);
+		f5vpn_connection_set_mtu (t->connection, b->mtu, b->clamp_mss);
+	}
+}
+
+static void
+end_setup_phase (Bench *b, SetupPhase phase)
+{
+	gint64 now = mono_ns ();
+	b->setup_us[phase][b->setup_done] = (now - b->phase_start_ns) / 1000;
+	b->phase_start_ns = now;
+}
+
+static void
+report_setup (const Bench *b)
+{
+	printf ("setup over %d runs, %d ms injected rtt:\n", b->setup_done, b->rtt_ms);
+	for (int i = 0; i < SETUP_PHASE_COUNT; ++i) {
+		gint64 *us = b->setup_us[i];
+		qsort (us, b->setup_done, sizeof (gint64), compare_gint64);
+		printf ("  %-13s median %8.1f ms, p99 %8.1f ms\n", setup_phase_names[i],
+		        us[b->setup_done / 2] / 1e3, us[MIN ((gint64) b->setup_done * 99 / 100, b->setup_done - 1)] / 1e3);
+	}
+}
+
+static void
+fail_setup (Bench *b, GError *err)
+{
+	fprintf (stderr, "error in setup run %d: %s\n", b->setup_done + 1, err->message);
+	g_error_free (err);
+	g_main_loop_quit (b->loop);
+}
+
+static void on_connection_status (F5VpnConnection *connection, const NetworkSettings *settings, void *userdata, GError *err);
+
+static void
+on_sid (F5VpnGetSid *getsid, const char *sid, void *userdata, GError *err)
+{
+	(void) getsid;
+
+	Bench *b = (Bench *) userdata;
+	if (err) {
+		fail_setup (b, err);
+		return;
+	}
+	end_setup_phase (b, SETUP_GETSID);
+
+	b->connection = f5vpn_connect (NULL, GATEWAY_ADDR, sid, b->resource, on_connection_status, b);
+	f5vpn_connection_set_socket_profile (b->connection, &b->profile);
+	f5vpn_connection_set_mtu (b->connection, b->mtu, b->clamp_mss);
+}
+
+static void
+on_login_done (F5VpnAuthSession *session, const char *session_key, const vpn_tunnel *const *tunnels, void *userdata, GError *err)
+{
+	(void) session;
+	(void) session_key;
+
+	Bench *b = (Bench *) userdata;
+	if (err) {
+		fail_setup (b, err);
+		return;
+	}
+	end_setup_phase (b, SETUP_LOGIN);
+
+	/* The session key is ignored: it is exchanged for a One-Time-Code as well,
+	 * as the browser-based flow does */
+	g_free (b->resource);
+	b->resource = g_strdup (tunnels[0]->id);
+	b->getsid = f5vpn_getsid_begin (NULL, GATEWAY_ADDR, BENCH_OTC, on_sid, b);
+}
+
+static void
+on_credentials_requested (F5VpnAuthSession *session, form_field *const *fields, void *userdata, GError *err)
+{
+	Bench *b = (Bench *) userdata;
+	if (err) {
+		fail_setup (b, err);
+		return;
+	}
+	end_setup_phase (b, SETUP_PORTAL);
+
+	for (form_field *const *f = fields; *f; ++f) {
+		if ((*f)->type == FORM_FIELD_TEXT) {
+			free ((*f)->value);
+			(*f)->value = strdup (BENCH_USER);
+		} else if ((*f)->type == FORM_FIELD_PASSWORD) {
+			free ((*f)->value);
+			(*f)->value = strdup (BENCH_PASSWORD);
+		}
+	}
+	f5vpn_auth_session_post_credentials (session, on_login_done, b);
+}
+
+static void
+sample_resources (ResourceSample *sample)
+{
+	gchar *statm = NULL;
+	unsigned long resident = 0;
+
+	memset (sample, 0, sizeof (*sample));
+	if (g_file_get_contents ("/proc/self/statm", &statm, NULL, NULL) && sscanf (statm, "%*u %lu", &resident) == 1)
+		sample->rss_kib = resident * (sysconf (_SC_PAGESIZE) / 1024);
+	g_free (statm);
+
+	sample->heap_kib = mallinfo2 ().uordblks / 1024;
+
+	DIR *dir = opendir ("/proc/self/fd");
+	if (!dir)
+		return;
+	while (readdir (dir))
+		sample->fds++;
+	closedir (dir);
+}
+
+static void
+print_resources (const char *label, const ResourceSample *sample)
+{
+	printf ("%-16s rss %6" G_GUINT64_FORMAT " KiB, heap %6" G_GUINT64_FORMAT " KiB, %u fds\n", label, sample->rss_kib, sample->heap_kib, sample->fds);
+	fflush (stdout);
+}
+
+/* Called before every cycle. The baseline is taken once the warmup cycles
+ * have filled caches and pools, such as curl's connection and DNS caches. */
+static void
+soak_checkpoint (Bench *b)
+{
+	ResourceSample sample;
+	int every = MAX (b->soak_cycles / 10, 1);
+
+	if (b->setup_done == b->soak_warmup) {
+		sample_resources (&b->soak_base);
+		print_resources ("baseline", &b->soak_base);
+	} else if (b->setup_done > b->soak_warmup && b->setup_done % every == 0) {
+		gchar *label = g_strdup_printf ("cycle %d", b->setup_done);
+		sample_resources (&sample);
+		print_resources (label, &sample);
+		g_free (label);
+	}
+}
+
+static int
+report_soak (const Bench *b)
+{
+	ResourceSample end;
+	int measured = b->setup_done - b->soak_warmup;
+
+	sample_resources (&end);
+	print_resources ("end", &end);
+
+	gint64 rss = (gint64) end.rss_kib - (gint64) b->soak_base.rss_kib;
+	gint64 heap = (gint64) end.heap_kib - (gint64) b->soak_base.heap_kib;
+	gint64 fds = (gint64) end.fds - (gint64) b->soak_base.fds;
+	printf ("growth over %d cycles: rss %+" G_GINT64_FORMAT " KiB, heap %+" G_GINT64_FORMAT " KiB, %+" G_GINT64_FORMAT " fds (%.2f KiB heap per 1000 cycles)\n",
+	        measured, rss, heap, fds, heap * 1000.0 / MAX (measured, 1));
+
+	if (rss > b->max_rss_growth_kib || heap > b->max_heap_growth_kib || fds > b->max_fd_growth) {
+		fprintf (stderr, "resource growth exceeds the limits of %d KiB rss, %d KiB heap and %d fds\n",
+		         b->max_rss_growth_kib, b->max_heap_growth_kib, b->max_fd_growth);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+/* Neither the auth session nor the getsid request may be freed from within
+ * their callbacks, so the previous run's are only freed here */
+static gboolean
+start_setup_run (gpointer user)
+{
+	Bench *b = (Bench *) user;
+
+	if (b->auth)
+		f5vpn_auth_session_free (b->auth);
+	if (b->getsid)
+		f5vpn_getsid_free (b->getsid);
+	b->getsid = NULL;
+
+	if (b->soak_cycles)
+		soak_checkpoint (b);
+	b->run_start_ns = b->phase_start_ns = mono_ns ();
+	b->auth = f5vpn_auth_session_new (NULL, GATEWAY_ADDR);
+	f5vpn_auth_session_begin (b->auth, on_credentials_requested, b);
+	return G_SOURCE_REMOVE;
+}
+
+static void
+on_setup_done (Bench *b, F5VpnConnection *connection)
+{
+	const F5VpnStatsSegment *stats = f5vpn_connection_get_stats (connection);
+
+	b->setup_us[SETUP_CONNECT_PARAMS][b->setup_done] = stats->phase_us[F5VPN_STATS_PHASE_CONNECT_PARAMS];
+	b->setup_us[SETUP_TUNNEL_OPEN][b->setup_done] = stats->phase_us[F5VPN_STATS_PHASE_TUNNEL_OPEN];
+	b->setup_us[SETUP_PPP_UP][b->setup_done] = stats->phase_us[F5VPN_STATS_PHASE_PPP_UP];
+	b->setup_us[SETUP_TOTAL][b->setup_done] = (mono_ns () - b->run_start_ns) / 1000;
+	b->setup_done++;
+	f5vpn_disconnect (connection);
+}
+
+static void
+on_connection_status (F5VpnConnection *connection, const NetworkSettings *settings, void *userdata, GError *err)
+{
+	Bench *b = (Bench *) userdata;
+
+	if (err) {
+		fprintf (stderr, "error: %s\n", err->message);
+		g_error_free (err);
+		b->status = EXIT_FAILURE;
+	}
+	if (err || !settings) {
+		f5vpn_connection_free (connection);
+		b->connection = NULL;
+		if (!err && b->setup_runs && b->setup_done < b->setup_runs) {
+			g_idle_add (start_setup_run, b);
+			return;
+		}
+		if (!err && b->soak_cycles) {
+			b->status = report_soak (b);
+		} else if (!err && b->setup_runs) {
+			report_setup (b);
+			b->status = EXIT_SUCCESS;
+		}
+		g_main_loop_quit (b->loop);
+		return;
+	}
+	if (b->setup_runs) {
+		on_setup_done (b, connection);
+		return;
+	}
+
+	const F5VpnStatsSegment *stats = f5vpn_connection_get_stats (connection);
+	printf ("setup: connect.php3 %.1f ms, tunnel %.1f ms, ppp %.1f ms\n",
+	        stats->phase_us[F5VPN_STATS_PHASE_CONNECT_PARAMS] / 1e3,
+	        stats->phase_us[F5VPN_STATS_PHASE_TUNNEL_OPEN] / 1e3,
+	        stats->phase_us[F5VPN_STATS_PHASE_PPP_UP] / 1e3);
+	if (b->dns_rounds)
+		start_dns (b, settings);
+	else
+		start_load (b);
+}
+
+static int
+listen_on (int port)
+{
+	struct sockaddr_in addr = { 0 };
+	int one = 1;
+
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons (port);
+	int fd = socket (AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+	if (bind (fd, (struct sockaddr *) &addr, sizeof (addr)) == -1 || listen (fd, 16) == -1) {
+		fprintf (stderr, "could not listen on port %d: %s\n", port, strerror (errno));
+		_exit (EXIT_FAILURE);
+	}
+	return fd;
+}
+
+/* Discard and echo services behind the gateway, each connection served by a
+ * process of its own */
+static void
+run_sinks (void)
+{
+	struct pollfd fds[2] = { { listen_on (DISCARD_PORT), POLLIN, 0 }, { listen_on (ECHO_PORT), POLLIN, 0 } };
+	char buf[BULK_CHUNK];
+	int one = 1;
+
+	signal (SIGCHLD, SIG_IGN);
+	for (;;) {
+		if (poll (fds, 2, -1) == -1)
+			continue;
+		for (int i = 0; i < 2; ++i) {
+			if (!fds[i].revents)
+				continue;
+			int sock = accept4 (fds[i].fd, NULL, NULL, SOCK_CLOEXEC);
+			if (sock == -1)
+				continue;
+			if (fork () == 0) {
+				gboolean echo = fds[i].fd == fds[1].fd;
+				ssize_t n;
+				setsockopt (sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+				while ((n = read (sock, buf, sizeof (buf))) > 0) {
+					if (echo && write_all (sock, buf, n) == -1)
+						break;
+				}
+				_exit (EXIT_SUCCESS);
+			}
+			close (sock);
+		}
+	}
+}
+
+/* Answers every A query to listen_addr (NULL for any) with answer_addr,
+ * after waiting delay_ms. The one behind the tunnel waits for the injected
+ * rtt, as the gateway's nameservers are as far away as the gateway. */
+static void
+run_resolver (const char *listen_addr, const char *answer_addr, int delay_ms)
+{
+	struct sockaddr_in addr = { 0 }, peer;
+	unsigned char buf[512];
+	unsigned char answer[] = {
+		0xc0, 0x0c,             /* name: pointer to the question */
+		0x00, 0x01, 0x00, 0x01, /* type A, class IN */
+		0x00, 0x00, 0x00, 0x3c, /* ttl 60s */
+		0x00, 0x04, 0, 0, 0, 0
+	};
+
+	inet_pton (AF_INET, answer_addr, answer + sizeof (answer) - 4);
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons (DNS_PORT);
+	if (listen_addr)
+		inet_pton (AF_INET, listen_addr, &addr.sin_addr);
+	int fd = socket (AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (bind (fd, (struct sockaddr *) &addr, sizeof (addr)) == -1) {
+		fprintf (stderr, "could not listen on port %d: %s\n", DNS_PORT, strerror (errno));
+		_exit (EXIT_FAILURE);
+	}
+	for (;;) {
+		socklen_t peer_len = sizeof (peer);
+		ssize_t n = recvfrom (fd, buf, sizeof (buf) - sizeof (answer), 0, (struct sockaddr *) &peer, &peer_len);
+		if (n < 12)
+			continue;
+		if (delay_ms)
+			g_usleep (delay_ms * 1000);
+		buf[2] = 0x81; /* response, recursion desired */
+		buf[3] = 0x80; /* recursion available, no error */
+		buf[7] = 1;    /* one answer */
+		memcpy (buf + n, answer, sizeof (answer));
+		sendto (fd, buf, n + sizeof (answer), 0, (struct sockaddr *) &peer, peer_len);
+	}
+}
+
+/* Moves the benchmark into network and mount namespaces of its own, in which
+ * the stand-in's certificate can replace the trusted CA bundle without
+ * touching the system's */
+static gboolean
+isolate (const char *cert)
+{
+	char *cainfo = NULL;
+	CURL *curl = curl_easy_init ();
+	curl_easy_getinfo (curl, CURLINFO_CAINFO, &cainfo);
+	gchar *bundle = g_strdup (cainfo);
+	curl_easy_cleanup (curl);
+
+	if (!bundle) {
+		fprintf (stderr, "libcurl has no default CA bundle\n");
+		return FALSE;
+	}
+	if (unshare (CLONE_NEWNS | CLONE_NEWNET) == -1 || mount (NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL) == -1 || mount (cert, bundle, NULL, MS_BIND, NULL) == -1) {
+		fprintf (stderr, "could not isolate the benchmark: %s\n", strerror (errno));
+		g_free (bundle);
+		return FALSE;
+	}
+	g_free (bundle);
+
+	/* openssl s_client uses OpenSSL's default verify paths instead */
+	setenv ("SSL_CERT_FILE", cert, 1);
+	return run_cmd ("ip link set lo up");
+}
+
+/* Starts the stand-in gateway in a network namespace of its own, reachable
+ * through a veth pair */
+static pid_t
+spawn_gateway (const char *cert, const char *key, int rtt_ms)
+{
+	int ready[2], go[2];
+	char c = 0;
+
+	if (pipe (ready) == -1 || pipe (go) == -1)
+		return -1;
+
+	pid_t pid = fork ();
+	if (pid == 0) {
+		close (ready[0]);
+		close (go[1]);
+		/* Lets the whole gateway, including its pppd, be killed at once */
+		setpgid (0, 0);
+		if (unshare (CLONE_NEWNET) == -1 || write (ready[1], &c, 1) != 1 || read (go[0], &c, 1) != 1)
+			_exit (EXIT_FAILURE);
+		if (!run_cmd ("ip link set lo up") || !run_cmd ("ip addr add %s/24 dev f5gw", GATEWAY_ADDR) || !run_cmd ("ip link set f5gw up"))
+			_exit (EXIT_FAILURE);
+		if (fork () == 0)
+			run_sinks ();
+		if (fork () == 0)
+			run_resolver (NULL, TUNNEL_ANSWER, rtt_ms);
+
+		GatewayOptions opts = {
+			cert, key, GATEWAY_ADDR, GATEWAY_PORT, SESSION_KEY,
+			BENCH_USER, BENCH_PASSWORD, BENCH_OTC, BENCH_RESOURCE,
+			PPP_CLIENT_IP, PPP_SERVER_IP, PPP_LAN, PPP_SERVER_IP, INTRANET_DOMAIN, rtt_ms
+		};
+		gateway_run (&opts);
+		_exit (EXIT_FAILURE);
+	}
+
+	close (ready[1]);
+	close (go[0]);
+	gboolean ok = read (ready[0], &c, 1) == 1
+	              && run_cmd ("ip link add f5bench type veth peer name f5gw netns %d", pid)
+	              && run_cmd ("ip addr add %s/24 dev f5bench", BENCH_ADDR)
+	              && run_cmd ("ip link set f5bench up")
+	              && write (go[1], &c, 1) == 1;
+	close (ready[0]);
+	close (go[1]);
+	if (!ok) {
+		kill (pid, SIGTERM);
+		waitpid (pid, NULL, 0);
+		return -1;
+	}
+	return pid;
+}
+
+static gboolean
+wait_for_gateway (void)
+{
+	struct sockaddr_in addr = { 0 };
+
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons (GATEWAY_PORT);
+	inet_pton (AF_INET, GATEWAY_ADDR, &addr.sin_addr);
+	for (int attempt = 0; attempt < 100; ++attempt) {
+		int fd = socket (AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		int ret = connect (fd, (struct sockaddr *) &addr, sizeof (addr));
+		close (fd);
+		if (ret == 0)
+			return TRUE;
+		g_usleep (50000);
+	}
+	fprintf (stderr, "the gateway did not come up\n");
+	return FALSE;
+}
+
+int
+main (int argc, char **argv)
+{
+	Bench b = { 0 };
+	const char *profile_spec = F5VPN_SOCKET_PROFILE_DEFAULT;
+	GError *err = NULL;
+
+	b.bulk_mib = 1024;
+	b.rounds = 10000;
+	b.message_size = 64;
+	b.mtu = F5VPN_MTU_AUTO;
+	b.soak_warmup = 20;
+	b.max_rss_growth_kib = 2048;
+	b.max_heap_growth_kib = 256;
+	b.status = EXIT_FAILURE;
+
+	GOptionEntry options[] = {
+		{ "bulk", 'b', 0, G_OPTION_ARG_INT, &b.bulk_mib, "MiB to send through the tunnel for the throughput measurement", NULL },
+		{ "rounds", 'r', 0, G_OPTION_ARG_INT, &b.rounds, "Echo round trips for the latency measurement", NULL },
+		{ "message-size", 'm', 0, G_OPTION_ARG_INT, &b.message_size, "Bytes per echo round trip", NULL },
+		{ "under-load", 'l', 0, G_OPTION_ARG_NONE, &b.under_load, "Measure the latency while a bulk transfer keeps the tunnel busy", NULL },
+		{ "socket-profile", 0, 0, G_OPTION_ARG_STRING, &profile_spec, "Tuning of the tunnel's TCP connection, as for f5vpn-cli", NULL },
+		{ "mtu", 0, 0, G_OPTION_ARG_INT, &b.mtu, "MTU of the ppp interface, as for f5vpn-cli", NULL },
+		{ "clamp-mss", 0, 0, G_OPTION_ARG_NONE, &b.clamp_mss, "Clamp the MSS of TCP connections forwarded into the tunnel", NULL },
+		{ "setup", 's', 0, G_OPTION_ARG_INT, &b.setup_runs, "Instead of the tunnel, time logging in and bringing up the tunnel N times", "N" },
+		{ "soak", 0, 0, G_OPTION_ARG_INT, &b.soak_cycles, "Repeat the --setup cycle N times and fail if the benchmark process grows", "N" },
+		{ "soak-warmup", 0, 0, G_OPTION_ARG_INT, &b.soak_warmup, "Cycles to run before taking the baseline", "N" },
+		{ "max-rss-growth", 0, 0, G_OPTION_ARG_INT, &b.max_rss_growth_kib, "Resident set growth tolerated by --soak", "KIB" },
+		{ "max-heap-growth", 0, 0, G_OPTION_ARG_INT, &b.max_heap_growth_kib, "Heap growth tolerated by --soak", "KIB" },
+		{ "max-fd-growth", 0, 0, G_OPTION_ARG_INT, &b.max_fd_growth, "Growth in open file descriptors tolerated by --soak", "N" },
+		{ "tunnels", 0, 0, G_OPTION_ARG_INT, &b.scale_tunnels, "Instead of the throughput and latency, hold N tunnels open at once and report their memory and CPU cost", "N" },
+		{ "herd", 0, 0, G_OPTION_ARG_INT, &b.herd_clients, "Instead of the tunnel, drop N sessions at once and time their reconnects without and with jitter", "N" },
+		{ "dns", 0, 0, G_OPTION_ARG_INT, &b.dns_rounds, "Instead of the throughput and latency, time N rounds of DNS lookups with and without split DNS", "N" },
+		{ "rtt", 0, 0, G_OPTION_ARG_INT, &b.rtt_ms, "Milliseconds the gateway waits before each response and handshake", "MS" },
+		{ NULL }
+	};
+
+	GOptionContext *opt_ctx = g_option_context_new (NULL);
+	g_option_context_add_main_entries (opt_ctx, options, NULL);
+	g_option_context_set_summary (opt_ctx, "Measures the throughput, CPU cost and latency of an F5 VPN tunnel to a local stand-in gateway,\n"
+	                                       "or with --setup, how long logging in and bringing up the tunnel take.\n"
+	                                       "With --soak, repeats that cycle and fails if the process leaks memory or file descriptors.\n"
+	                                       "With --tunnels, what each of N tunnels held by one process costs in memory and CPU time.\n"
+	                                       "With --herd, how N clients losing their tunnels at once come back to the gateway.\n"
+	                                       "With --dns, how long looking up internet and intranet names through systemd-resolved takes with and without split DNS.\n"
+	                                       "Needs root, as it creates network namespaces and runs pppd.");
+	if (!g_option_context_parse (opt_ctx, &argc, &argv, &err)) {
+		fprintf (stderr, "%s\n", err->message);
+		g_error_free (err);
+		g_option_context_free (opt_ctx);
+		return EXIT_FAILURE;
+	}
+	g_option_context_free (opt_ctx);
+
+	if (b.bulk_mib < 1 || b.rounds < 1 || b.message_size < 1 || b.message_size > BULK_CHUNK)
+		return fprintf (stderr, "invalid bulk size, rounds or message size\n"), EXIT_FAILURE;
+	if (b.setup_runs < 0 || b.rtt_ms < 0 || b.dns_rounds < 0 || b.herd_clients < 0 || b.scale_tunnels < 0)
+		return fprintf (stderr, "invalid number of setup runs, dns rounds, herd clients, tunnels or rtt\n"), EXIT_FAILURE;
+	if (b.soak_cycles < 0 || b.soak_warmup < 0 || (b.soak_cycles && b.soak_warmup >= b.soak_cycles))
+		return fprintf (stderr, "invalid number of soak or warmup cycles\n"), EXIT_FAILURE;
+	if (b.soak_cycles)
+		b.setup_runs = b.soak_cycles;
+	if (!f5vpn_socket_profile_parse (profile_spec, &b.profile, &err))
+		return fprintf (stderr, "%s\n", err->message), g_error_free (err), EXIT_FAILURE;
+	if (geteuid () != 0)
+		return fprintf (stderr, "must be run as root\n"), EXIT_FAILURE;
+
+	gchar *dir = g_dir_make_tmp ("f5vpn-bench-XXXXXX", &err);
+	if (!dir)
+		return fprintf (stderr, "%s\n", err->message), g_error_free (err), EXIT_FAILURE;
+	gchar *cert = g_build_filename (dir, "cert.pem", NULL);
+	gchar *key = g_build_filename (dir, "key.pem", NULL);
+
+	if (!run_cmd ("openssl req -x509 -newkey ec -pkeyopt ec_paramgen_curve:prime256v1 -nodes -days 1 "
+	              "-subj /CN=f5vpn-bench -addext subjectAltName=IP:%s -keyout %s -out %s 2>/dev/null",
+	              GATEWAY_ADDR, key, cert)
+	    || !isolate (cert) || (b.gateway_pid = spawn_gateway (cert, key, b.rtt_ms)) == -1 || !wait_for_gateway ())
+		goto out;
+	if (b.dns_rounds && (b.resolver_pid = fork ()) == 0)
+		run_resolver (LOCAL_RESOLVER, LOCAL_ANSWER, 0);
+
+	b.loop = g_main_loop_new (NULL, FALSE);
+	if (b.scale_tunnels) {
+		start_scale (&b);
+	} else if (b.herd_clients) {
+		b.herd_attempt_us = g_array_new (FALSE, FALSE, sizeof (gint64));
+		b.herd_done_us = g_new0 (gint64, b.herd_clients);
+		start_herd_round (&b);
+	} else if (b.setup_runs) {
+		for (int i = 0; i < SETUP_PHASE_COUNT; ++i)
+			b.setup_us[i] = g_new0 (gint64, b.setup_runs);
+		start_setup_run (&b);
+	} else {
+		b.connection = f5vpn_connect (NULL, GATEWAY_ADDR, SESSION_KEY, BENCH_RESOURCE, on_connection_status, &b);
+		f5vpn_connection_set_socket_profile (b.connection, &b.profile);
+		f5vpn_connection_set_mtu (b.connection, b.mtu, b.clamp_mss);
+	}
+	g_main_loop_run (b.loop);
+	g_main_loop_unref (b.loop);
+
+out:
+	if (b.getsid)
+		f5vpn_getsid_free (b.getsid);
+	if (b.auth)
+		f5vpn_auth_session_free (b.auth);
+	for (int i = 0; i < SETUP_PHASE_COUNT; ++i)
+		g_free (b.setup_us[i]);
+	g_free (b.resource);
+	if (b.herd_attempt_us)
+		g_array_free (b.herd_attempt_us, TRUE);
+	g_free (b.herd_done_us);
+	g_free (b.scale);
+	if (b.load_pid > 0) {
+		kill (b.load_pid, SIGTERM);
+		waitpid (b.load_pid, NULL, 0);
+	}
+	if (b.resolver_pid > 0) {
+		kill (b.resolver_pid, SIGTERM);
+		waitpid (b.resolver_pid, NULL, 0);
+	}
+	if (b.gateway_pid > 0) {
+		kill (-b.gateway_pid, SIGTERM);
+		waitpid (b.gateway_pid, NULL, 0);
+	}
+	unlink (cert);
+	unlink (key);
+	rmdir (dir);
+	g_free (cert);
+	g_free (key);
+	g_free (dir);
+	return b.status;
+}
@@ -0,0 +1,384 @@
+/*
+ * NetworkManager-f5vpn
+ * Plugin for NetworkManager to access F5 Firepass SSL VPNs
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+#include "f5vpn_parse.h"
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Allocations are counted by interposing the allocator: the definitions
+ * below take precedence over libc's for libxml2 and glib as well. */
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t nmemb, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+
+static guint64 nr_allocs;
+static guint64 alloc_bytes;
+
+void *
+malloc (size_t size)
+{
+	nr_allocs++;
+	alloc_bytes += size;
+	return __libc_malloc (size);
+}
+
+void *
+calloc (size_t nmemb, size_t size)
+{
+	nr_allocs++;
+	alloc_bytes += nmemb * size;
+	return __libc_calloc (nmemb, size);
+}
+
+void *
+realloc (void *ptr, size_t size)
+{
+	nr_allocs++;
+	alloc_bytes += size;
+	return __libc_realloc (ptr, size);
+}
+
+typedef enum
+{
+	INPUT_LOGIN_PAGE,
+	INPUT_RESOURCE_LIST,
+	INPUT_RESOURCE_INFO,
+	INPUT_CONNECT_PARAMS,
+	INPUT_LANS,
+	INPUT_NAMESERVERS,
+	INPUT_DOMAINS,
+	INPUT_HEADERS,
+	INPUT_KIND_COUNT
+} InputKind;
+
+/* File name prefixes of captured inputs in a corpus directory */
+static const char *const kind_prefixes[INPUT_KIND_COUNT] = {
+	"login", "resource-list", "resource-info", "connect", "lans", "nameservers", "domains", "headers"
+};
+
+typedef struct
+{
+	gchar *name;
+	InputKind kind;
+	GString *data;
+} Input;
+
+static gint64
+mono_ns (void)
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (gint64) ts.tv_sec * G_GINT64_CONSTANT (1000000000) + ts.tv_nsec;
+}
+
+/* Parses the input once and frees the result, as the library would */
+static void
+parse (const Input *in)
+{
+	switch (in->kind) {
+	case INPUT_LOGIN_PAGE:
+		f5vpn_parse_free_login_fields (f5vpn_parse_login_page (in->data->str));
+		break;
+	case INPUT_RESOURCE_LIST: {
+		gchar *detail_uri, **queries;
+		f5vpn_parse_resource_list (in->data->str, in->data->len, &detail_uri, &queries);
+		g_free (detail_uri);
+		g_strfreev (queries);
+		break;
+	}
+	case INPUT_RESOURCE_INFO: {
+		vpn_tunnel tunnel;
+		f5vpn_parse_resource_info (in->data->str, in->data->len, &tunnel);
+		free (tunnel.id);
+		free (tunnel.label);
+		free (tunnel.description);
+		break;
+	}
+	case INPUT_CONNECT_PARAMS: {
+		gchar *ur_Z, *host, *port, *dns, *lan, *dns_suffix, *dns_split;
+		f5vpn_parse_connect_params (in->data->str, in->data->len, &ur_Z, &host, &port, &dns, &lan, &dns_suffix, &dns_split);
+		g_free (ur_Z);
+		g_free (host);
+		g_free (port);
+		g_free (dns);
+		g_free (lan);
+		g_free (dns_suffix);
+		g_free (dns_split);
+		break;
+	}
+	case INPUT_LANS:
+		g_slist_free_full (f5vpn_parse_lans (in->data->str), free);
+		break;
+	case INPUT_NAMESERVERS:
+		g_slist_free_full (f5vpn_parse_nameservers (in->data->str), free);
+		break;
+	case INPUT_DOMAINS:
+		g_slist_free_full (f5vpn_parse_domains (in->data->str), g_free);
+		break;
+	case INPUT_HEADERS:
+		/* Line by line, as curl hands them to the header callback */
+		for (const char *line = in->data->str; *line;) {
+			const char *end = strchr (line, '\n');
+			size_t len = end ? (size_t) (end - line + 1) : strlen (line);
+			free (f5vpn_parse_sid_header (line, len));
+			line += len;
+		}
+		break;
+	default:
+		g_assert_not_reached ();
+	}
+}
+
+static void
+run (const Input *in, gint64 min_ns)
+{
+	guint64 iterations = 0;
+
+	/* Warms up the caches, and libxml2's one-time initialisation */
+	parse (in);
+
+	guint64 allocs_start = nr_allocs, bytes_start = alloc_bytes;
+	gint64 start = mono_ns (), elapsed;
+	do {
+		parse (in);
+		iterations++;
+		elapsed = mono_ns () - start;
+	} while (elapsed < min_ns);
+
+	double ns = (double) elapsed / iterations;
+	printf ("%-26s %10zu %8" G_GUINT64_FORMAT " %14.0f %9.2f %11.1f %13.0f\n",
+	        in->name, in->data->len, iterations, ns, ns / MAX (in->data->len, 1),
+	        (double) (nr_allocs - allocs_start) / iterations, (double) (alloc_bytes - bytes_start) / iterations);
+}
+
+static void
+append_lans (GString *s, int nr)
+{
+	for (int i = 0; i < nr; ++i)
+		g_string_append_printf (s, "%s10.%d.%d.0/255.255.255.0", i ? " " : "", (i >> 8) & 0xff, i & 0xff);
+}
+
+/* A logon page as served by APM, with pad_bytes of inline branding (styles,
+ * scripts and an embedded logo) around the form, as customised portals have */
+static GString *
+make_login_page (gsize pad_bytes)
+{
+	GString *s = g_string_new ("<!DOCTYPE html PUBLIC \"-//W3C//DTD HTML 4.01 Transitional//EN\">\n"
+	                           "<html><head><meta http-equiv=\"Content-Type\" content=\"text/html; charset=utf-8\">"
+	                           "<title>Corporate VPN</title>\n<style type=\"text/css\">\n");
+	for (int i = 0; s->len < pad_bytes / 3; ++i)
+		g_string_append_printf (s, ".brand-%d { font-family: Arial, sans-serif; color: #%06x; margin: %dpx; background: url(/public/images/b%d.png); }\n",
+		                        i, (i * 2654435761u) & 0xffffff, i % 17, i % 5);
+	g_string_append (s, "</style>\n<script type=\"text/javascript\">\n");
+	for (int i = 0; s->len < pad_bytes * 2 / 3; ++i)
+		g_string_append_printf (s, "function check_%d(f) { if (f.elements[%d] && f.elements[%d].value.length > %d) { return true; } return false; }\n",
+		                        i, i % 4, i % 4, i % 64);
+	g_string_append (s, "</script></head>\n<body class=\"logon_page\" onload=\"OnLoad()\">\n"
+	                    "<table id=\"page_header\"><tr><td id=\"header_leftcell\"><img src=\"data:image/png;base64,");
+	while (s->len < pad_bytes)
+		g_string_append (s, "iVBORw0KGgoAAAANSUhEUgAAAAEAAAABCAYAAAAfFcSJAAAADUlEQVR42mNkYPhfDwAChwGA60e6kgAAAABJRU5ErkJggg");
+	g_string_append (s, "\"></td></tr></table>\n"
+	                    "<table id=\"main_table\" class=\"logon_page\"><tr><td id=\"main_table_info_cell\">\n"
+	                    "<form id=\"auth_form\" name=\"e1\" method=\"post\" action=\"/my.policy\" autocomplete=\"off\">\n"
+	                    "<table id=\"credentials_table\">\n"
+	                    "<tr><td colspan=\"2\" id=\"credentials_table_header\">Secure Logon <br> for F5 Networks</td></tr>\n"
+	                    "<tr><td colspan=\"2\" id=\"credentials_table_postheader\" class=\"credentials_table_unified_cell\"></td></tr>\n"
+	                    "<tr><td class=\"credentials_table_label_cell\"><label for=\"input_1\" id=\"label_input_1\">Username</label></td>"
+	                    "<td class=\"credentials_table_field_cell\"><input type=\"text\" name=\"username\" class=\"credentials_input_text\" value=\"\" id=\"input_1\" autocomplete=\"off\" autocapitalize=\"off\"></td></tr>\n"
+	                    "<tr><td class=\"credentials_table_label_cell\"><label for=\"input_2\" id=\"label_input_2\">Password</label></td>"
+	                    "<td class=\"credentials_table_field_cell\"><input type=\"password\" name=\"password\" class=\"credentials_input_password\" value=\"\" id=\"input_2\" autocomplete=\"off\"></td></tr>\n"
+	                    "<tr id=\"submit_row\"><td class=\"credentials_table_unified_cell\"><input type=\"submit\" class=\"credentials_input_submit\" value=\"Logon\"></td></tr>\n"
+	                    "</table><input type=\"hidden\" name=\"vhost\" value=\"standard\"></form>\n"
+	                    "</td></tr></table>\n<table id=\"page_footer\"><tr><td>This product is licensed from F5 Networks.</td></tr></table>\n"
+	                    "</body></html>\n");
+	return s;
+}
+
+static GString *
+make_resource_list (int nr_tunnels)
+{
+	GString *s = g_string_new ("<?xml version=\"1.0\" encoding=\"utf-8\" ?>"
+	                           "<res type=\"resource_list\" xmlns:dyn=\"http://www.f5.com/xml/dynamic\">"
+	                           "<opts><opt type=\"rq\" uri=\"/vdesk/resource_list.xml\" />"
+	                           "<opt type=\"available_rq\" uri=\"/vdesk/resource_info_v2.xml\" /></opts><lists>"
+	                           "<list type=\"app_tunnel\"></list><list type=\"network_access\">");
+	for (int i = 0; i < nr_tunnels; ++i)
+		g_string_append_printf (s, "<entry param=\"resourcename\">/Common/na_res_%04d</entry>", i);
+	g_string_append (s, "</list><list type=\"portal_access\"></list></lists></res>");
+	return s;
+}
+
+static GString *
+make_connect_params (int nr_lans)
+{
+	GString *s = g_string_new ("<?xml version=\"1.0\" encoding=\"utf-8\" ?><favorite type=\"VPN\" id=\"/Common/na_res\"><object>"
+	                           "<ur_Z>a1b2c3d4e5f6a7b8c9d0e1f2</ur_Z><Session_Timeout>3600</Session_Timeout>"
+	                           "<IPV4_0>1</IPV4_0><IPV6_0>0</IPV6_0><tunnel_host0>vpn.example.com</tunnel_host0>"
+	                           "<tunnel_port0>443</tunnel_port0><tunnel_protocol0>https</tunnel_protocol0>"
+	                           "<idle_session_timeout>900</idle_session_timeout><DNS0>10.0.0.53 10.0.1.53</DNS0>"
+	                           "<DNS_SUFFIX0>corp.example.com</DNS_SUFFIX0><DNS_SPLIT0>*.example.com corp.example.net</DNS_SPLIT0><LAN0>");
+	append_lans (s, nr_lans);
+	g_string_append (s, "</LAN0><LAN6_0></LAN6_0><compression>deflate</compression><UseDefaultGateway0>0</UseDefaultGateway0>"
+	                    "<client_traffic_classifier>1</client_traffic_classifier></object></favorite>");
+	return s;
+}
+
+static void
+add_input (GPtrArray *inputs, const char *name, InputKind kind, GString *data)
+{
+	Input *in = g_new (Input, 1);
+	in->name = g_strdup (name);
+	in->kind = kind;
+	in->data = data;
+	g_ptr_array_add (inputs, in);
+}
+
+static void
+add_generated_inputs (GPtrArray *inputs)
+{
+	add_input (inputs, "login-plain", INPUT_LOGIN_PAGE, make_login_page (0));
+	add_input (inputs, "login-branded-256k", INPUT_LOGIN_PAGE, make_login_page (256 * 1024));
+	add_input (inputs, "login-branded-4m", INPUT_LOGIN_PAGE, make_login_page (4 * 1024 * 1024));
+	add_input (inputs, "resource-list-1", INPUT_RESOURCE_LIST, make_resource_list (1));
+	add_input (inputs, "resource-list-500", INPUT_RESOURCE_LIST, make_resource_list (500));
+	add_input (inputs, "resource-list-5000", INPUT_RESOURCE_LIST, make_resource_list (5000));
+	add_input (inputs, "resource-info", INPUT_RESOURCE_INFO,
+	           g_string_new ("<?xml version=\"1.0\" encoding=\"utf-8\" ?><resources><item>"
+	                         "<id>/Common/na_res</id><caption>Corporate network</caption>"
+	                         "<description>Full access to the corporate network</description>"
+	                         "<autolaunch>1</autolaunch><icon>/vdesk/icons/na.png</icon></item></resources>"));
+	add_input (inputs, "connect-3", INPUT_CONNECT_PARAMS, make_connect_params (3));
+	add_input (inputs, "connect-1k", INPUT_CONNECT_PARAMS, make_connect_params (1000));
+	add_input (inputs, "connect-100k", INPUT_CONNECT_PARAMS, make_connect_params (100000));
+
+	static const int lan_counts[] = { 3, 1000, 10000, 100000 };
+	for (gsize i = 0; i < G_N_ELEMENTS (lan_counts); ++i) {
+		GString *s = g_string_new ("");
+		append_lans (s, lan_counts[i]);
+		gchar *name = g_strdup_printf ("lans-%d", lan_counts[i]);
+		add_input (inputs, name, INPUT_LANS, s);
+		g_free (name);
+	}
+	add_input (inputs, "nameservers-4", INPUT_NAMESERVERS, g_string_new ("10.0.0.53 10.0.1.53 192.168.1.1 bogus"));
+	add_input (inputs, "domains-4", INPUT_DOMAINS, g_string_new ("*.example.com, corp.example.net .Lab.Example.ORG *"));
+	add_input (inputs, "headers-getsid", INPUT_HEADERS,
+	           g_string_new ("HTTP/1.1 200 OK\r\n"
+	                         "Date: Mon, 18 Oct 2026 09:00:00 GMT\r\n"
+	                         "Server: BigIP\r\n"
+	                         "Cache-Control: no-cache, must-revalidate\r\n"
+	                         "Pragma: no-cache\r\n"
+	                         "Strict-Transport-Security: max-age=16070400\r\n"
+	                         "X-Frame-Options: DENY\r\n"
+	                         "X-ACCESS-Session-ID: 5f2c8a1e9b7d4c3a6e0f1d2b8a9c7e6f\r\n"
+	                         "Content-Length: 0\r\n"
+	                         "Connection: close\r\n"
+	                         "\r\n"));
+}
+
+/* Adds the files of a corpus directory, whose names start with the prefix of
+ * the parser they are meant for */
+static gboolean
+add_corpus_inputs (GPtrArray *inputs, const char *dir_name, GError **err)
+{
+	const char *file;
+	GDir *dir = g_dir_open (dir_name, 0, err);
+	if (!dir)
+		return FALSE;
+
+	while ((file = g_dir_read_name (dir))) {
+		int kind;
+		gchar *contents;
+		gsize len;
+
+		for (kind = 0; kind < INPUT_KIND_COUNT && !g_str_has_prefix (file, kind_prefixes[kind]); ++kind)
+			;
+		if (kind == INPUT_KIND_COUNT) {
+			fprintf (stderr, "skipping %s: unknown input kind\n", file);
+			continue;
+		}
+
+		gchar *path = g_build_filename (dir_name, file, NULL);
+		if (g_file_get_contents (path, &contents, &len, err)) {
+			GString *data = g_string_new_len (contents, len);
+			g_free (contents);
+			add_input (inputs, file, kind, data);
+		}
+		g_free (path);
+		if (*err) {
+			g_dir_close (dir);
+			return FALSE;
+		}
+	}
+	g_dir_close (dir);
+	return TRUE;
+}
+
+int
+main (int argc, char **argv)
+{
+	gchar *corpus = NULL, *filter = NULL;
+	gint min_ms = 200;
+	gboolean no_generated = FALSE;
+	GError *err = NULL;
+
+	GOptionEntry options[] = {
+		{ "corpus", 'c', 0, G_OPTION_ARG_FILENAME, &corpus, "Directory of captured inputs, named login*, resource-list*, resource-info*, connect*, lans*, nameservers*, domains* or headers*", "DIR" },
+		{ "no-generated", 0, 0, G_OPTION_ARG_NONE, &no_generated, "Only parse the inputs of the corpus directory", NULL },
+		{ "filter", 'f', 0, G_OPTION_ARG_STRING, &filter, "Only parse inputs whose name contains this", "TEXT" },
+		{ "min-time", 't', 0, G_OPTION_ARG_INT, &min_ms, "Milliseconds to spend parsing each input", "MS" },
+		{ NULL }
+	};
+
+	GOptionContext *opt_ctx = g_option_context_new (NULL);
+	g_option_context_add_main_entries (opt_ctx, options, NULL);
+	g_option_context_set_summary (opt_ctx, "Measures the time and allocations the parsers for logon pages, resource XML, connection parameters, LAN lists and headers need per input.");
+	if (!g_option_context_parse (opt_ctx, &argc, &argv, &err)) {
+		fprintf (stderr, "%s\n", err->message);
+		g_error_free (err);
+		g_option_context_free (opt_ctx);
+		return EXIT_FAILURE;
+	}
+	g_option_context_free (opt_ctx);
+
+	GPtrArray *inputs = g_ptr_array_new ();
+	if (!no_generated)
+		add_generated_inputs (inputs);
+	if (corpus && !add_corpus_inputs (inputs, corpus, &err)) {
+		fprintf (stderr, "%s\n", err->message);
+		g_error_free (err);
+		return EXIT_FAILURE;
+	}
+
+	printf ("%-26s %10s %8s %14s %9s %11s %13s\n", "input", "bytes", "runs", "ns/parse", "ns/byte", "allocs", "alloc bytes");
+	for (guint i = 0; i < inputs->len; ++i) {
+		Input *in = g_ptr_array_index (inputs, i);
+		if (!filter || strstr (in->name, filter))
+			run (in, (gint64) min_ms * 1000000);
+		g_string_free (in->data, TRUE);
+		g_free (in->name);
+		g_free (in);
+	}
+	g_ptr_array_free (inputs, TRUE);
+	g_free (corpus);
+	g_free (filter);
+	return EXIT_SUCCESS;
+}
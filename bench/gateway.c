@@ -0,0 +1,449 @@
+/*
+ * NetworkManager-f5vpn
+ * Plugin for NetworkManager to access F5 Firepass SSL VPNs
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+#include "gateway.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <glib.h>
+#include <netinet/in.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <poll.h>
+#include <pty.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static int
+write_all (int fd, const char *buf, size_t len)
+{
+	while (len) {
+		ssize_t n = write (fd, buf, len);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int
+ssl_write_all (SSL *ssl, const char *buf, size_t len)
+{
+	while (len) {
+		int n = SSL_write (ssl, buf, len);
+		if (n <= 0)
+			return -1;
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+typedef struct
+{
+	SSL *ssl;
+	int sock;
+	const GatewayOptions *opts;
+	/* Received bytes not consumed by a request yet */
+	char buf[16384];
+	size_t len;
+} Conn;
+
+/* Reads the next request, returning its header and body as strings. Clients
+ * send nothing beyond a request before they get the answer to it. */
+static gboolean
+read_request (Conn *c, gchar **head, gchar **body)
+{
+	char *end;
+	size_t content_length = 0;
+
+	for (;;) {
+		c->buf[c->len] = '\0';
+		if ((end = strstr (c->buf, "\r\n\r\n")))
+			break;
+		if (c->len == sizeof (c->buf) - 1)
+			return FALSE;
+		int n = SSL_read (c->ssl, c->buf + c->len, sizeof (c->buf) - 1 - c->len);
+		if (n <= 0)
+			return FALSE;
+		c->len += n;
+	}
+
+	size_t head_len = end + 4 - c->buf;
+	*head = g_strndup (c->buf, head_len);
+	const char *cl = strcasestr (*head, "\r\nContent-Length:");
+	if (cl)
+		content_length = strtoul (cl + strlen ("\r\nContent-Length:"), NULL, 10);
+	if (head_len + content_length > sizeof (c->buf) - 1) {
+		g_free (*head);
+		return FALSE;
+	}
+
+	while (c->len < head_len + content_length) {
+		int n = SSL_read (c->ssl, c->buf + c->len, sizeof (c->buf) - 1 - c->len);
+		if (n <= 0) {
+			g_free (*head);
+			return FALSE;
+		}
+		c->len += n;
+	}
+	*body = g_strndup (c->buf + head_len, content_length);
+
+	c->len -= head_len + content_length;
+	memmove (c->buf, c->buf + head_len + content_length, c->len);
+	return TRUE;
+}
+
+static gboolean
+respond (Conn *c, const char *status, const char *headers, const char *body)
+{
+	gchar *resp = g_strdup_printf ("HTTP/1.1 %s\r\n%sContent-Length: %zu\r\n\r\n%s", status, headers, strlen (body), body);
+
+	if (c->opts->rtt_ms)
+		g_usleep (c->opts->rtt_ms * 1000);
+	int ret = ssl_write_all (c->ssl, resp, strlen (resp));
+	g_free (resp);
+	return ret == 0;
+}
+
+static gboolean
+is_request (const char *head, const char *method, const char *path)
+{
+	size_t method_len = strlen (method), path_len = strlen (path);
+	return !strncmp (head, method, method_len) && head[method_len] == ' ' && !strncmp (head + method_len + 1, path, path_len) && strchr (" ?", head[method_len + 1 + path_len]);
+}
+
+/* Returns the value of a header, or of a query parameter if name ends with
+ * '=', as a newly allocated string */
+static gchar *
+get_param (const char *head, const char *name)
+{
+	const char *p = strstr (head, name);
+	if (!p)
+		return NULL;
+	p += strlen (name);
+	return g_strndup (p, strcspn (p, "&; \r\n"));
+}
+
+static gboolean
+session_valid (const Conn *c, const char *head)
+{
+	gchar *session = get_param (head, "MRHSession=");
+	gboolean valid = session && !strcmp (session, c->opts->session_key);
+	g_free (session);
+	return valid;
+}
+
+/* Whether the urlencoded form contains name=value */
+static gboolean
+form_has (const char *form, const char *name, const char *value)
+{
+	gchar *field = g_strdup_printf ("%s=%s", name, value);
+	gchar **fields = g_strsplit (form, "&", -1);
+	gboolean found = g_strv_contains ((const gchar *const *) fields, field);
+	g_strfreev (fields);
+	g_free (field);
+	return found;
+}
+
+static gboolean
+answer_logon_page (Conn *c, const char *status, const char *error)
+{
+	gchar *headers = g_strdup_printf ("Content-Type: text/html; charset=utf-8\r\n"
+	                                  "Set-Cookie: MRHSession=%s; path=/; secure\r\n",
+	                                  c->opts->session_key);
+	gchar *page = g_strdup_printf ("<html><head><title>Logon</title></head><body class=\"logon_page\">"
+	                               "<form id=\"auth_form\" name=\"e1\" method=\"post\" action=\"/my.policy\">"
+	                               "<table id=\"credentials_table\">"
+	                               "<tr><td class=\"credentials_table_postheader\">%s</td></tr>"
+	                               "<tr><td><label for=\"input_1\">Username</label></td>"
+	                               "<td><input type=\"text\" name=\"username\" id=\"input_1\" value=\"\"></td></tr>"
+	                               "<tr><td><label for=\"input_2\">Password</label></td>"
+	                               "<td><input type=\"password\" name=\"password\" id=\"input_2\" value=\"\"></td></tr>"
+	                               "<tr><td><input type=\"hidden\" name=\"vhost\" value=\"standard\">"
+	                               "<input type=\"submit\" value=\"Logon\"></td></tr>"
+	                               "</table></form></body></html>",
+	                               error);
+	gboolean ret = respond (c, status, headers, page);
+	g_free (page);
+	g_free (headers);
+	return ret;
+}
+
+static gboolean
+answer_policy (Conn *c, const char *body)
+{
+	/* Both the EPI skip and a successful login lead on to the webtop */
+	if (strstr (body, "no-inspection-host=1") || (form_has (body, "username", c->opts->username) && form_has (body, "password", c->opts->password)))
+		return respond (c, "302 Found", "Location: /vdesk/webtop.eui\r\n", "");
+	return answer_logon_page (c, "200 OK", "The username or password is not correct.");
+}
+
+static gboolean
+answer_resource_list (Conn *c)
+{
+	gchar *xml = g_strdup_printf ("<?xml version=\"1.0\" encoding=\"utf-8\"?>"
+	                              "<res type=\"resource_list\">"
+	                              "<opts><opt type=\"available_rq\" uri=\"/vdesk/resource_info_v2.xml\"/></opts>"
+	                              "<lists><list type=\"network_access\"><entry param=\"resourcename\">%s</entry></list></lists>"
+	                              "</res>",
+	                              c->opts->resource);
+	gboolean ret = respond (c, "200 OK", "Content-Type: text/xml\r\n", xml);
+	g_free (xml);
+	return ret;
+}
+
+static gboolean
+answer_resource_info (Conn *c)
+{
+	gchar *xml = g_strdup_printf ("<?xml version=\"1.0\" encoding=\"utf-8\"?>"
+	                              "<resources><item>"
+	                              "<id>%s</id><caption>Stand-in</caption><description>Stand-in network access</description>"
+	                              "<autolaunch>0</autolaunch>"
+	                              "</item></resources>",
+	                              c->opts->resource);
+	gboolean ret = respond (c, "200 OK", "Content-Type: text/xml\r\n", xml);
+	g_free (xml);
+	return ret;
+}
+
+static gboolean
+answer_sessid_for_token (Conn *c, const char *head)
+{
+	gchar *otc = get_param (head, "\r\nX-ACCESS-Session-Token: ");
+	gboolean valid = otc && !strcmp (otc, c->opts->otc);
+	g_free (otc);
+	if (!valid)
+		return respond (c, "403 Forbidden", "", "");
+
+	gchar *headers = g_strdup_printf ("X-ACCESS-Session-ID: %s\r\n", c->opts->session_key);
+	gboolean ret = respond (c, "200 OK", headers, "");
+	g_free (headers);
+	return ret;
+}
+
+static gboolean
+answer_connect_params (Conn *c)
+{
+	const GatewayOptions *opts = c->opts;
+	gchar *xml = g_strdup_printf ("<?xml version=\"1.0\" encoding=\"utf-8\"?>"
+	                              "<favorite type=\"VPN\" id=\"standin\"><object>"
+	                              "<ur_Z>standin</ur_Z>"
+	                              "<tunnel_host0>%s</tunnel_host0>"
+	                              "<tunnel_port0>%d</tunnel_port0>"
+	                              "<DNS0>%s</DNS0>"
+	                              "<LAN0>%s</LAN0>"
+	                              "<DNS_SPLIT0>%s</DNS_SPLIT0>"
+	                              "</object></favorite>",
+	                              opts->listen_addr, opts->port, opts->dns, opts->lan, opts->dns_split);
+	gboolean ret = respond (c, "200 OK", "Content-Type: text/xml\r\n", xml);
+	g_free (xml);
+	return ret;
+}
+
+static pid_t
+launch_pppd (const GatewayOptions *opts, int *pty_fd)
+{
+	int pty_master, pty_slave;
+
+	if (openpty (&pty_master, &pty_slave, NULL, NULL, NULL) == -1)
+		return -1;
+
+	pid_t pid = fork ();
+	if (pid == 0) {
+		gchar *ip_spec = g_strdup_printf ("%s:%s", opts->server_ip, opts->client_ip);
+		close (pty_master);
+		dup2 (pty_slave, STDIN_FILENO);
+		close (pty_slave);
+		execlp ("pppd", "pppd", "local", "nodetach", "noauth", "nocrtscts", "noccp", ip_spec, NULL);
+		exit (EXIT_FAILURE);
+	}
+	close (pty_slave);
+	*pty_fd = pty_master;
+	return pid;
+}
+
+/* Shuttles PPP frames between the TLS connection and pppd until either side
+ * goes away */
+static void
+relay (SSL *ssl, int sock, int pty)
+{
+	char buf[16384];
+	struct pollfd fds[2] = { { sock, POLLIN, 0 }, { pty, POLLIN, 0 } };
+
+	for (;;) {
+		fds[0].revents = fds[1].revents = 0;
+		/* Records already decrypted by OpenSSL do not show up in poll */
+		if (!SSL_pending (ssl) && poll (fds, 2, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (SSL_pending (ssl) || fds[0].revents) {
+			int n = SSL_read (ssl, buf, sizeof (buf));
+			if (n <= 0)
+				break;
+			if (write_all (pty, buf, n) == -1)
+				break;
+		}
+		if (fds[1].revents) {
+			ssize_t n = read (pty, buf, sizeof (buf));
+			if (n <= 0 || ssl_write_all (ssl, buf, n) == -1)
+				break;
+		}
+	}
+}
+
+static void
+open_tunnel (Conn *c)
+{
+	int pty;
+	gchar *resp = g_strdup_printf ("HTTP/1.0 200 OK\r\n"
+	                               "Content-length: 0\r\n"
+	                               "X-VPN-client-IP: %s\r\n"
+	                               "X-VPN-server-IP: %s\r\n\r\n",
+	                               c->opts->client_ip, c->opts->server_ip);
+	if (c->opts->rtt_ms)
+		g_usleep (c->opts->rtt_ms * 1000);
+	int ret = ssl_write_all (c->ssl, resp, strlen (resp));
+	g_free (resp);
+	if (ret == -1)
+		return;
+
+	pid_t pppd = launch_pppd (c->opts, &pty);
+	if (pppd == -1) {
+		fprintf (stderr, "gateway: could not launch pppd: %s\n", strerror (errno));
+		return;
+	}
+	relay (c->ssl, c->sock, pty);
+	kill (pppd, SIGTERM);
+	waitpid (pppd, NULL, 0);
+	close (pty);
+}
+
+/* Answers a request, returning FALSE once the connection is done with */
+static gboolean
+handle_request (Conn *c, const char *head, const char *body)
+{
+	if (is_request (head, "GET", "/myvpn")) {
+		open_tunnel (c);
+		return FALSE;
+	}
+	if (is_request (head, "GET", "/"))
+		return respond (c, "302 Found", "Location: /my.policy\r\n", "");
+	if (is_request (head, "GET", "/my.policy"))
+		return answer_logon_page (c, "200 OK", "");
+	if (is_request (head, "POST", "/my.policy"))
+		return answer_policy (c, body);
+	if (is_request (head, "GET", "/vdesk/get_sessid_for_token.php3"))
+		return answer_sessid_for_token (c, head);
+
+	/* Everything else needs the session */
+	if (!session_valid (c, head))
+		return respond (c, "302 Found", "Location: /my.policy\r\n", "");
+	if (is_request (head, "GET", "/vdesk/resource_list.xml"))
+		return answer_resource_list (c);
+	if (is_request (head, "GET", "/vdesk/resource_info_v2.xml"))
+		return answer_resource_info (c);
+	if (is_request (head, "GET", "/vdesk/vpn/connect.php3"))
+		return answer_connect_params (c);
+	return respond (c, "404 Not Found", "", "");
+}
+
+static void
+serve (SSL_CTX *ctx, int sock, const GatewayOptions *opts)
+{
+	Conn c = { 0 };
+	gchar *head, *body;
+
+	c.ssl = SSL_new (ctx);
+	c.sock = sock;
+	c.opts = opts;
+	SSL_set_fd (c.ssl, sock);
+
+	if (opts->rtt_ms)
+		g_usleep (opts->rtt_ms * 1000);
+	if (SSL_accept (c.ssl) != 1) {
+		ERR_print_errors_fp (stderr);
+	} else {
+		/* Connections are kept alive, as clients reuse them */
+		gboolean keep = TRUE;
+		while (keep && read_request (&c, &head, &body)) {
+			keep = handle_request (&c, head, body);
+			g_free (head);
+			g_free (body);
+		}
+		SSL_shutdown (c.ssl);
+	}
+	SSL_free (c.ssl);
+	close (sock);
+}
+
+int
+gateway_run (const GatewayOptions *opts)
+{
+	struct sockaddr_in addr = { 0 };
+	int one = 1;
+
+	SSL_CTX *ctx = SSL_CTX_new (TLS_server_method ());
+	if (SSL_CTX_use_certificate_chain_file (ctx, opts->cert_file) != 1 || SSL_CTX_use_PrivateKey_file (ctx, opts->key_file, SSL_FILETYPE_PEM) != 1) {
+		ERR_print_errors_fp (stderr);
+		SSL_CTX_free (ctx);
+		return -1;
+	}
+
+	int listener = socket (AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	setsockopt (listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons (opts->port);
+	inet_pton (AF_INET, opts->listen_addr, &addr.sin_addr);
+	if (bind (listener, (struct sockaddr *) &addr, sizeof (addr)) == -1 || listen (listener, 16) == -1) {
+		fprintf (stderr, "gateway: could not listen on %s:%d: %s\n", opts->listen_addr, opts->port, strerror (errno));
+		close (listener);
+		SSL_CTX_free (ctx);
+		return -1;
+	}
+
+	/* Connection processes reap their pppd themselves */
+	signal (SIGCHLD, SIG_IGN);
+	for (;;) {
+		int sock = accept4 (listener, NULL, NULL, SOCK_CLOEXEC);
+		if (sock == -1) {
+			if (errno == EINTR)
+				continue;
+			fprintf (stderr, "gateway: accept failed: %s\n", strerror (errno));
+			continue;
+		}
+		if (fork () == 0) {
+			signal (SIGCHLD, SIG_DFL);
+			close (listener);
+			serve (ctx, sock, opts);
+			_exit (EXIT_SUCCESS);
+		}
+		close (sock);
+	}
+}
@@ -0,0 +1,64 @@
+/*
+ * NetworkManager-f5vpn
+ * Plugin for NetworkManager to access F5 Firepass SSL VPNs
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+#ifndef F5VPN_BENCH_GATEWAY_H
+#define F5VPN_BENCH_GATEWAY_H
+
+/* A stand-in for an F5 gateway, just enough of one for F5VpnAuthSession,
+ * F5VpnGetSid and F5VpnConnection: it serves the logon page, the login and
+ * EPI skip POSTs, the resource list and tunnel details, the One-Time-Code
+ * exchange and connect.php3, and answers GET /myvpn with the X-VPN headers,
+ * after which it runs pppd on the other end of the tunnel.
+ *
+ * There is a single session, which logging in and exchanging the
+ * One-Time-Code both yield. */
+typedef struct
+{
+	const char *cert_file; /* PEM certificate and key for the TLS listener */
+	const char *key_file;
+	const char *listen_addr;
+	int port;
+	/* Session key handed out and expected in the MRHSession cookie; any
+	 * other one gets the redirect to the logon page a real gateway sends */
+	const char *session_key;
+	/* Credentials accepted by the logon form, and the One-Time-Code accepted
+	 * by get_sessid_for_token.php3 */
+	const char *username;
+	const char *password;
+	const char *otc;
+	/* The single network access resource offered */
+	const char *resource;
+	/* PPP addresses of both ends, announced in the X-VPN headers */
+	const char *client_ip;
+	const char *server_ip;
+	/* LAN0 and DNS0 of the tunnel parameters */
+	const char *lan;
+	const char *dns;
+	/* DNS_SPLIT0, the domains resolved through the DNS0 nameservers */
+	const char *dns_split;
+	/* Delay before each response, and before each TLS handshake, standing
+	 * in for the round trip to a distant gateway */
+	int rtt_ms;
+} GatewayOptions;
+
+/* Serves each connection in a process of its own until killed. Only returns,
+ * with -1, if the listener could not be set up. */
+int gateway_run (const GatewayOptions *opts);
+
+#endif // F5VPN_BENCH_GATEWAY_H
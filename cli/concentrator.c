@@ -0,0 +1,498 @@
+/*
+ * NetworkManager-f5vpn
+ * Plugin for NetworkManager to access F5 Firepass SSL VPNs
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <signal.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <glib.h>
+#include <glib-unix.h>
+#include <curl/curl.h>
+
+#include "concentrator.h"
+
+typedef struct {
+	GMainContext *context;
+	GMainLoop *loop;
+	GThread *thread;
+	F5VpnLagMonitor *lag_monitor;
+} Worker;
+
+typedef struct _Concentrator Concentrator;
+
+typedef struct {
+	Concentrator *conc;
+	Worker *worker;
+	gchar *name;
+	gchar *host;
+	gchar *session_key;
+	gchar *vpn_z_id;
+	gchar *stats_file;
+	/* Only ever touched from the worker's thread */
+	F5VpnConnection *connection;
+	gboolean up;
+	GSList *routes; /* keys this tunnel owns in conc->routes */
+} Tunnel;
+
+/* A LAN claimed by one of the tunnels */
+typedef struct {
+	LanAddr lan;
+	const gchar *owner; /* name of the tunnel routing it */
+} Route;
+
+typedef struct {
+	guint64 rss_kib;
+	guint64 cpu_ms;
+	guint64 fds;  /* open in this process */
+	guint64 ptys; /* of those, pty masters */
+} Usage;
+
+struct _Concentrator {
+	const ConcentratorOptions *opts;
+	GMainLoop *main_loop;
+	Worker *workers;
+	gint nr_workers;
+	Tunnel *tunnels;
+	gint nr_tunnels;
+	gint live; /* tunnels which have not gone down yet */
+	gint up;
+	/* Serialises output from the workers and guards routes */
+	GMutex lock;
+	GHashTable *routes; /* "addr/mask" -> Route */
+	Usage baseline;
+};
+
+/* Adds the CPU time and resident set size of the process described by a
+ * /proc/<pid>/stat file to usage, if its parent is ppid (or ppid is 0) */
+static void add_proc_usage(const char *path, pid_t ppid, Usage *usage)
+{
+	gchar *stat = NULL;
+	if(!g_file_get_contents(path, &stat, NULL, NULL))
+		return;
+
+	/* The command name may contain anything, so parse from its end */
+	const char *p = strrchr(stat, ')');
+	int parent;
+	unsigned long utime, stime;
+	long rss;
+	if(p && sscanf(p + 2, "%*c %d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu %*d %*d %*d %*d %*d %*d %*u %*u %ld",
+	               &parent, &utime, &stime, &rss) == 4 && (!ppid || parent == ppid)) {
+		usage->cpu_ms += (utime + stime) * 1000 / sysconf(_SC_CLK_TCK);
+		usage->rss_kib += rss * (sysconf(_SC_PAGESIZE) / 1024);
+	}
+	g_free(stat);
+}
+
+/* Counts the descriptors open in this process, among them the pty masters
+ * leading to the pppd processes */
+static void add_fd_usage(Usage *usage)
+{
+	DIR *dir = opendir("/proc/self/fd");
+	if(!dir)
+		return;
+	struct dirent *de;
+	while((de = readdir(dir))) {
+		if(de->d_name[0] == '.' || atoi(de->d_name) == dirfd(dir))
+			continue;
+		usage->fds++;
+		gchar *path = g_strdup_printf("/proc/self/fd/%s", de->d_name);
+		gchar *target = g_file_read_link(path, NULL);
+		if(target && g_str_has_suffix(target, "/ptmx"))
+			usage->ptys++;
+		g_free(target);
+		g_free(path);
+	}
+	closedir(dir);
+}
+
+/* Samples this process together with its direct children, the pppd and
+ * openssl processes of the tunnels. Pages shared between processes are
+ * counted once per process, descriptors only in this process. */
+static void sample_usage(Usage *usage)
+{
+	pid_t self = getpid();
+
+	memset(usage, 0, sizeof(*usage));
+	add_proc_usage("/proc/self/stat", 0, usage);
+	add_fd_usage(usage);
+
+	DIR *dir = opendir("/proc");
+	if(!dir)
+		return;
+	struct dirent *de;
+	while((de = readdir(dir))) {
+		if(de->d_name[0] < '1' || de->d_name[0] > '9')
+			continue;
+		gchar *path = g_strdup_printf("/proc/%s/stat", de->d_name);
+		add_proc_usage(path, self, usage);
+		g_free(path);
+	}
+	closedir(dir);
+}
+
+static gboolean on_report_usage(gpointer userdata)
+{
+	Concentrator *conc = (Concentrator*) userdata;
+	Usage now;
+	gint up = g_atomic_int_get(&conc->up);
+
+	sample_usage(&now);
+	g_mutex_lock(&conc->lock);
+	fprintf(stderr, "%d tunnels up: rss %" G_GUINT64_FORMAT " KiB, cpu %" G_GUINT64_FORMAT " ms, fds %" G_GUINT64_FORMAT " (ptys %" G_GUINT64_FORMAT ")",
+	        up, now.rss_kib, now.cpu_ms, now.fds, now.ptys);
+	if(up > 0) {
+		fprintf(stderr, ", per tunnel: rss %" G_GINT64_FORMAT " KiB, cpu %" G_GINT64_FORMAT " ms, fds %.1f",
+		        ((gint64) now.rss_kib - (gint64) conc->baseline.rss_kib) / up,
+		        ((gint64) now.cpu_ms - (gint64) conc->baseline.cpu_ms) / up,
+		        ((gint64) now.fds - (gint64) conc->baseline.fds) / (double) up);
+	}
+	fprintf(stderr, "\n");
+	g_mutex_unlock(&conc->lock);
+	return G_SOURCE_CONTINUE;
+}
+
+/* Must be called with conc->lock held */
+static void release_routes(Tunnel *t)
+{
+	for(GSList *p = t->routes; p; p = p->next)
+		g_hash_table_remove(t->conc->routes, p->data);
+	g_slist_free(t->routes);
+	t->routes = NULL;
+}
+
+/* Whether the two prefixes have addresses in common, i.e. one contains the
+ * other */
+static gboolean lans_overlap(const LanAddr *a, const LanAddr *b)
+{
+	guint mask = MIN(MIN(a->mask, b->mask), 32);
+	guint32 bits = mask ? htonl(G_MAXUINT32 << (32 - mask)) : 0;
+	return ((a->addr.s_addr ^ b->addr.s_addr) & bits) == 0;
+}
+
+/* Must be called with conc->lock held. Prints the routes of other tunnels
+ * that lan overlaps, as the longer prefix takes the addresses they have in
+ * common from the shorter one. */
+static void print_overlaps(Tunnel *t, const char *key, const LanAddr *lan)
+{
+	GHashTableIter iter;
+	gpointer other_key, value;
+
+	g_hash_table_iter_init(&iter, t->conc->routes);
+	while(g_hash_table_iter_next(&iter, &other_key, &value)) {
+		const Route *other = (const Route*) value;
+		if(other->owner == t->name || !lans_overlap(lan, &other->lan))
+			continue;
+		printf("[%s] # %s overlaps %s routed through %s, which %s\n", t->name, key, (const char*) other_key, other->owner,
+		       lan->mask > other->lan.mask ? "loses the addresses in both to this tunnel" : "keeps the addresses in both");
+	}
+}
+
+/* Must be called with conc->lock held. Routes already claimed by another
+ * tunnel are left to that one, and overlapping ones are reported, rather
+ * than silently shadowing it. */
+static void print_routes(Tunnel *t, const NetworkSettings *settings)
+{
+	char str_peer[INET_ADDRSTRLEN] = "";
+	inet_ntop(AF_INET, &settings->remote_ip, str_peer, INET_ADDRSTRLEN);
+	for(GSList *p = settings->lans; p; p = p->next) {
+		const LanAddr *lan = (const LanAddr*) p->data;
+		char str_route[INET_ADDRSTRLEN] = "";
+		inet_ntop(AF_INET, &lan->addr, str_route, INET_ADDRSTRLEN);
+
+		gchar *key = g_strdup_printf("%s/%d", str_route, lan->mask);
+		const Route *claimed = g_hash_table_lookup(t->conc->routes, key);
+		if(claimed) {
+			printf("[%s] # %s is already routed through %s\n", t->name, key, claimed->owner);
+			g_free(key);
+			continue;
+		}
+		print_overlaps(t, key, lan);
+		Route *route = g_new(Route, 1);
+		route->lan = *lan;
+		route->owner = t->name;
+		g_hash_table_insert(t->conc->routes, key, route);
+		t->routes = g_slist_prepend(t->routes, key);
+		printf("[%s] ip route add %s via %s dev %s\n", t->name, key, str_peer, settings->device);
+	}
+	for(GSList *p = settings->nameservers; p; p = p->next) {
+		char str_dns[INET_ADDRSTRLEN] = "";
+		inet_ntop(AF_INET, p->data, str_dns, INET_ADDRSTRLEN);
+		printf("[%s] resolvconf %s\n", t->name, str_dns);
+	}
+	gchar *resolvectl = resolvectl_domain_command(settings);
+	if(resolvectl)
+		printf("[%s] %s\n", t->name, resolvectl);
+	g_free(resolvectl);
+	fflush(stdout);
+}
+
+gchar *resolvectl_domain_command(const NetworkSettings *settings)
+{
+	if(!settings->split_domains)
+		return NULL;
+
+	GString *command = g_string_new("resolvectl domain ");
+	g_string_append(command, settings->device);
+	for(GSList *p = settings->split_domains; p; p = p->next) {
+		const char *domain = (const char*) p->data;
+		g_string_append_printf(command, " ~%s", g_strcmp0(domain, "*") ? domain : ".");
+	}
+	return g_string_free(command, FALSE);
+}
+
+static void on_tunnel_status(F5VpnConnection *connection, const NetworkSettings *settings, void *userdata, GError *err)
+{
+	Tunnel *t = (Tunnel*) userdata;
+	Concentrator *conc = t->conc;
+
+	if(settings && !err) {
+		g_mutex_lock(&conc->lock);
+		/* Reported again if IPCP overrode early settings */
+		if(t->up)
+			release_routes(t);
+		printf("[%s] connection up!\n", t->name);
+		print_routes(t, settings);
+		g_mutex_unlock(&conc->lock);
+		if(!t->up) {
+			t->up = TRUE;
+			g_atomic_int_inc(&conc->up);
+		}
+		return;
+	}
+
+	g_mutex_lock(&conc->lock);
+	if(err)
+		fprintf(stderr, "[%s] error: %s\n", t->name, err->message);
+	else
+		fprintf(stderr, "[%s] connection closed\n", t->name);
+	release_routes(t);
+	g_mutex_unlock(&conc->lock);
+
+	if(err)
+		g_error_free(err);
+	f5vpn_connection_free(connection);
+	t->connection = NULL;
+	if(t->up) {
+		t->up = FALSE;
+		g_atomic_int_add(&conc->up, -1);
+	}
+	if(g_atomic_int_dec_and_test(&conc->live))
+		g_main_loop_quit(conc->main_loop);
+}
+
+static gboolean tunnel_start(gpointer userdata)
+{
+	Tunnel *t = (Tunnel*) userdata;
+	const ConcentratorOptions *opts = t->conc->opts;
+
+	t->connection = f5vpn_connect(t->worker->context, t->host, t->session_key, t->vpn_z_id, on_tunnel_status, t);
+	f5vpn_connection_set_keepalive(t->connection, opts->keepalive_interval, opts->keepalive_failures);
+	f5vpn_connection_set_mtu(t->connection, opts->mtu, opts->clamp_mss);
+	f5vpn_connection_set_socket_profile(t->connection, &opts->socket_profile);
+	f5vpn_connection_set_early_settings(t->connection, opts->early_settings);
+	if(t->stats_file) {
+		GError *err = NULL;
+		if(!f5vpn_connection_publish_stats(t->connection, t->stats_file, &err)) {
+			g_mutex_lock(&t->conc->lock);
+			fprintf(stderr, "[%s] warning: %s\n", t->name, err->message);
+			g_mutex_unlock(&t->conc->lock);
+			g_error_free(err);
+		}
+	}
+	return G_SOURCE_REMOVE;
+}
+
+static gboolean tunnel_stop(gpointer userdata)
+{
+	Tunnel *t = (Tunnel*) userdata;
+	if(t->connection)
+		f5vpn_disconnect(t->connection);
+	return G_SOURCE_REMOVE;
+}
+
+static gboolean tunnel_dump_latency(gpointer userdata)
+{
+	Tunnel *t = (Tunnel*) userdata;
+	if(t->connection) {
+		gchar *dump = f5vpn_connection_dump_latency(t->connection);
+		g_mutex_lock(&t->conc->lock);
+		fprintf(stderr, "[%s]\n%s", t->name, dump);
+		g_mutex_unlock(&t->conc->lock);
+		g_free(dump);
+	}
+	return G_SOURCE_REMOVE;
+}
+
+/* Runs fn for every tunnel on the thread owning it */
+static void invoke_on_tunnels(Concentrator *conc, GSourceFunc fn)
+{
+	for(gint i = 0; i < conc->nr_tunnels; ++i)
+		g_main_context_invoke(conc->tunnels[i].worker->context, fn, &conc->tunnels[i]);
+}
+
+static gboolean on_interrupt(gpointer userdata)
+{
+	Concentrator *conc = (Concentrator*) userdata;
+	/* Every tunnel reports going down, the last one quits */
+	invoke_on_tunnels(conc, tunnel_stop);
+	return G_SOURCE_CONTINUE;
+}
+
+static gboolean on_dump_latency(gpointer userdata)
+{
+	invoke_on_tunnels((Concentrator*) userdata, tunnel_dump_latency);
+	return G_SOURCE_CONTINUE;
+}
+
+static gpointer worker_run(gpointer userdata)
+{
+	Worker *worker = (Worker*) userdata;
+	g_main_context_push_thread_default(worker->context);
+	g_main_loop_run(worker->loop);
+	g_main_context_pop_thread_default(worker->context);
+	return NULL;
+}
+
+static gboolean load_tunnels(Concentrator *conc, const char *path, GError **err)
+{
+	GKeyFile *kf = g_key_file_new();
+	gsize nr_groups = 0;
+
+	if(!g_key_file_load_from_file(kf, path, G_KEY_FILE_NONE, err)) {
+		g_key_file_free(kf);
+		return FALSE;
+	}
+
+	gchar **groups = g_key_file_get_groups(kf, &nr_groups);
+	conc->tunnels = calloc(nr_groups, sizeof(Tunnel));
+	for(gsize i = 0; i < nr_groups; ++i) {
+		Tunnel *t = &conc->tunnels[conc->nr_tunnels++];
+		t->conc = conc;
+		t->name = g_strdup(groups[i]);
+		t->host = g_key_file_get_string(kf, groups[i], "host", NULL);
+		t->session_key = g_key_file_get_string(kf, groups[i], "session-key", NULL);
+		t->vpn_z_id = g_key_file_get_string(kf, groups[i], "vpn-z-id", NULL);
+		t->stats_file = g_key_file_get_string(kf, groups[i], "stats-file", NULL);
+		if(!t->host || !t->session_key || !t->vpn_z_id) {
+			g_set_error(err, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND, "%s: tunnel %s needs host, session-key and vpn-z-id", path, t->name);
+			break;
+		}
+	}
+	g_strfreev(groups);
+	g_key_file_free(kf);
+	return !err || !*err;
+}
+
+static void free_tunnels(Concentrator *conc)
+{
+	for(gint i = 0; i < conc->nr_tunnels; ++i) {
+		Tunnel *t = &conc->tunnels[i];
+		g_free(t->name);
+		g_free(t->host);
+		g_free(t->session_key);
+		g_free(t->vpn_z_id);
+		g_free(t->stats_file);
+		g_slist_free(t->routes);
+	}
+	free(conc->tunnels);
+}
+
+int concentrator_run(const char *tunnels_file, const ConcentratorOptions *opts)
+{
+	Concentrator conc = {0};
+	GError *err = NULL;
+
+	conc.opts = opts;
+	if(!load_tunnels(&conc, tunnels_file, &err)) {
+		fprintf(stderr, "%s\n", err->message);
+		g_error_free(err);
+		free_tunnels(&conc);
+		return EXIT_FAILURE;
+	}
+	if(conc.nr_tunnels == 0) {
+		fprintf(stderr, "%s: no tunnels listed\n", tunnels_file);
+		free_tunnels(&conc);
+		return EXIT_FAILURE;
+	}
+
+	/* Neither may happen lazily once there are several threads */
+	curl_global_init(CURL_GLOBAL_DEFAULT);
+	f5vpn_connect_share_http_state();
+
+	g_mutex_init(&conc.lock);
+	conc.routes = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	conc.main_loop = g_main_loop_new(NULL, FALSE);
+	conc.live = conc.nr_tunnels;
+	sample_usage(&conc.baseline);
+
+	guint signal_ids[] = {
+		/* kill -USR1 dumps forwarding latency histograms */
+		g_unix_signal_add(SIGUSR1, on_dump_latency, &conc),
+		g_unix_signal_add(SIGINT, on_interrupt, &conc),
+		g_unix_signal_add(SIGTERM, on_interrupt, &conc),
+		opts->usage_interval > 0 ? g_timeout_add_seconds(opts->usage_interval, on_report_usage, &conc) : 0,
+	};
+
+	conc.nr_workers = opts->workers > 0 ? opts->workers : (gint) g_get_num_processors();
+	conc.nr_workers = MIN(conc.nr_workers, conc.nr_tunnels);
+	conc.workers = calloc(conc.nr_workers, sizeof(Worker));
+	for(gint i = 0; i < conc.nr_workers; ++i) {
+		Worker *worker = &conc.workers[i];
+		worker->context = g_main_context_new();
+		worker->loop = g_main_loop_new(worker->context, FALSE);
+		if(opts->dispatch_lag > 0)
+			worker->lag_monitor = f5vpn_lag_monitor_start(worker->context, F5VPN_LAG_MONITOR_DEFAULT_INTERVAL_MS, opts->dispatch_lag);
+		worker->thread = g_thread_new("f5vpn-worker", worker_run, worker);
+	}
+
+	for(gint i = 0; i < conc.nr_tunnels; ++i)
+		conc.tunnels[i].worker = &conc.workers[i % conc.nr_workers];
+	invoke_on_tunnels(&conc, tunnel_start);
+
+	g_main_loop_run(conc.main_loop);
+
+	for(gint i = 0; i < conc.nr_workers; ++i) {
+		Worker *worker = &conc.workers[i];
+		g_main_loop_quit(worker->loop);
+		g_thread_join(worker->thread);
+		if(worker->lag_monitor) {
+			gchar *dump = f5vpn_lag_monitor_dump(worker->lag_monitor);
+			fprintf(stderr, "[worker %d]\n%s", i, dump);
+			g_free(dump);
+			f5vpn_lag_monitor_free(worker->lag_monitor);
+		}
+		g_main_loop_unref(worker->loop);
+		g_main_context_unref(worker->context);
+	}
+	free(conc.workers);
+
+	if(opts->usage_interval > 0)
+		on_report_usage(&conc);
+	for(gsize i = 0; i < G_N_ELEMENTS(signal_ids); ++i) {
+		if(signal_ids[i])
+			g_source_remove(signal_ids[i]);
+	}
+	g_main_loop_unref(conc.main_loop);
+	g_hash_table_destroy(conc.routes);
+	g_mutex_clear(&conc.lock);
+	free_tunnels(&conc);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,65 @@
+/*
+ * NetworkManager-f5vpn
+ * Plugin for NetworkManager to access F5 Firepass SSL VPNs
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+#ifndef F5VPN_CLI_CONCENTRATOR_H
+#define F5VPN_CLI_CONCENTRATOR_H
+
+#include <glib.h>
+
+#include "f5vpn_connect.h"
+#include "f5vpn_lagmon.h"
+
+typedef struct {
+	gint keepalive_interval;
+	gint keepalive_failures;
+	gint mtu;
+	gboolean clamp_mss;
+	F5VpnSocketProfile socket_profile;
+	gboolean early_settings;
+	/* Threads running the tunnels' main loops, 0 for one per core */
+	gint workers;
+	/* Seconds between resource usage reports, 0 to disable them */
+	gint usage_interval;
+	/* Stall threshold of the workers' dispatch lag monitors, 0 to disable them */
+	gint dispatch_lag;
+} ConcentratorOptions;
+
+/*
+ * Holds all tunnels listed in tunnels_file in this process, spread over a
+ * pool of worker threads each running a main loop of its own. The file is a
+ * key file with one group per tunnel, named after it:
+ *
+ *   [site-a]
+ *   host=vpn.site-a.example.com
+ *   session-key=...
+ *   vpn-z-id=/Common/site-a_na_res
+ *   stats-file=/run/f5vpn/site-a.stats   (optional)
+ *
+ * Returns once every tunnel has gone down, or after SIGINT or SIGTERM, with
+ * the process exit status.
+ */
+int concentrator_run(const char *tunnels_file, const ConcentratorOptions *opts);
+
+/*
+ * Returns the resolvectl command routing the split DNS domains of settings
+ * to its interface, or NULL if there are none. resolvectl replaces the
+ * interface's domains, so they all go in the one command.
+ */
+gchar *resolvectl_domain_command(const NetworkSettings *settings);
+
+#endif // F5VPN_CLI_CONCENTRATOR_H
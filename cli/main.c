@@ -18,6 +18,8 @@
  */
 #include <stdio.h>
 #include <glib.h>
+#include <glib-unix.h>
+#include <signal.h>
 #include <termios.h>
 #include <arpa/inet.h>
 #include <unistd.h>
@@ -25,12 +27,39 @@
 #include "f5vpn_auth.h"
 #include "f5vpn_getsid.h"
 #include "f5vpn_connect.h"
+#include "f5vpn_lagmon.h"
+#include "f5vpn_probe.h"
+#include "concentrator.h"
+
+/* Gateways which do not complete the TLS handshake within this time are ignored */
+#define GATEWAY_PROBE_TIMEOUT_MS 3000
 
 typedef struct {
 	GMainLoop* main_loop;
 	const char* hostname;
+	gboolean do_auth;
+	gboolean do_getsid;
 	gboolean do_connect;
+	gchar* session_key;
+	gchar* otc;
 	const char* vpn_z_id;
+	const char* stats_file;
+	const char* tunnels_file;
+	gint workers;
+	gint usage_interval;
+	gint dispatch_lag;
+	F5VpnLagMonitor *lag_monitor;
+	F5VpnConnection *connection;
+	gint keepalive_interval;
+	gint keepalive_failures;
+	gint mtu;
+	gboolean clamp_mss;
+	const char* socket_profile_spec;
+	F5VpnSocketProfile socket_profile;
+	gboolean early_settings;
+	F5VpnAuthSession *auth;
+	F5VpnGetSid *getsid;
+	F5VpnProbe *probe;
 } F5VpnCli;
 
 static void handle_connection_status(F5VpnConnection *connection, const NetworkSettings *settings, void *userdata, GError *err)
@@ -38,11 +67,15 @@ static void handle_connection_status(F5VpnConnection *connection, const NetworkS
 	F5VpnCli *cli = (F5VpnCli*) userdata;
 	if(err) {
 		fprintf(stderr, "error: %s\n", err->message);
+		if(err->code == F5VPN_CONNECT_ERROR_PEER_DEAD && f5vpn_connection_get_rtt(connection) >= 0) {
+			fprintf(stderr, "last smoothed rtt: %" G_GINT64_FORMAT "us\n", f5vpn_connection_get_rtt(connection));
+		}
 		if(err->code == F5VPN_CONNECT_ERROR_BAD_HTTP_CODE) {
 			fprintf(stderr, "session key should be invalidated\n");
 		}
 		g_error_free(err);
 		f5vpn_connection_free(connection);
+		cli->connection = NULL;
 		g_main_loop_quit(cli->main_loop);
 		return;
 	}
@@ -51,6 +84,7 @@ static void handle_connection_status(F5VpnConnection *connection, const NetworkS
 		/* connection gone down */
 		fprintf(stderr, "connection closed\n");
 		f5vpn_connection_free(connection);
+		cli->connection = NULL;
 		g_main_loop_quit(cli->main_loop);
 		return;
 	}
@@ -69,15 +103,71 @@ static void handle_connection_status(F5VpnConnection *connection, const NetworkS
 		inet_ntop(AF_INET, p->data, str_dns, INET_ADDRSTRLEN);
 		printf("resolvconf %s\n", str_dns);
 	}
+	gchar *resolvectl = resolvectl_domain_command(settings);
+	if(resolvectl)
+		printf("%s\n", resolvectl);
+	g_free(resolvectl);
 }
 
-static void on_login_done(F5VpnAuthSession* session, const char* session_key, const vpn_tunnel* const* vpn_ids, void *userdata, GError* err)
+static void start_connect(F5VpnCli *cli, const char *session_key, const char *vpn_z_id)
+{
+	cli->connection = f5vpn_connect(g_main_loop_get_context(cli->main_loop), cli->hostname, session_key, vpn_z_id, handle_connection_status, cli);
+	f5vpn_connection_set_keepalive(cli->connection, cli->keepalive_interval, cli->keepalive_failures);
+	f5vpn_connection_set_mtu(cli->connection, cli->mtu, cli->clamp_mss);
+	f5vpn_connection_set_socket_profile(cli->connection, &cli->socket_profile);
+	f5vpn_connection_set_early_settings(cli->connection, cli->early_settings);
+	if(cli->stats_file) {
+		GError *err = NULL;
+		if(!f5vpn_connection_publish_stats(cli->connection, cli->stats_file, &err)) {
+			fprintf(stderr, "warning: %s\n", err->message);
+			g_error_free(err);
+		}
+	}
+}
+
+static gboolean on_dump_latency(gpointer userdata)
+{
+	F5VpnCli *cli = (F5VpnCli*) userdata;
+	if(cli->connection) {
+		gchar *dump = f5vpn_connection_dump_latency(cli->connection);
+		fprintf(stderr, "%s", dump);
+		g_free(dump);
+	}
+	if(cli->lag_monitor) {
+		gchar *dump = f5vpn_lag_monitor_dump(cli->lag_monitor);
+		fprintf(stderr, "%s", dump);
+		g_free(dump);
+	}
+	return G_SOURCE_CONTINUE;
+}
+
+static gboolean on_interrupt(gpointer userdata)
 {
-	(void) session;
+	F5VpnCli *cli = (F5VpnCli*) userdata;
 
+	/* Abort whatever is in progress and let its callback quit */
+	if(cli->connection)
+		f5vpn_disconnect(cli->connection);
+	else if(cli->getsid)
+		f5vpn_getsid_cancel(cli->getsid);
+	else if(cli->auth)
+		f5vpn_auth_session_cancel(cli->auth);
+	else
+		g_main_loop_quit(cli->main_loop);
+	return G_SOURCE_CONTINUE;
+}
+
+static void on_login_done(F5VpnAuthSession* session, const char* session_key, const vpn_tunnel* const* vpn_ids, void *userdata, GError* err)
+{
 	F5VpnCli *cli = (F5VpnCli*) userdata;
 	static char buffer[4] = "";
 	int chosen_tunnel = 0;
+	F5VpnHttpCounters counters;
+
+	f5vpn_auth_session_get_http_counters(session, &counters);
+	if(counters.retries || counters.hedges) {
+		fprintf(stderr, "login took %u requests: %u retries, %u hedges (%u won)\n", counters.requests, counters.retries, counters.hedges, counters.hedges_won);
+	}
 
 	if(err) {
 		fprintf(stderr, "error: %s\n", err->message);
@@ -110,7 +200,7 @@ static void on_login_done(F5VpnAuthSession* session, const char* session_key, co
 		chosen_tunnel = atoi(buffer);
 	} while(chosen_tunnel < 1 || chosen_tunnel >= n);
 
-	f5vpn_connect(g_main_loop_get_context(cli->main_loop), cli->hostname, session_key, vpn_ids[chosen_tunnel - 1]->id, handle_connection_status, cli);
+	start_connect(cli, session_key, vpn_ids[chosen_tunnel - 1]->id);
 }
 
 static char* user_get_text(void)
@@ -182,30 +272,71 @@ static void on_otc_retrieved(F5VpnGetSid *getsid, const char *session_key, void
 	printf("session key: %s\n", session_key);
 
 	if(cli->do_connect) {
-		f5vpn_connect(g_main_loop_get_context(cli->main_loop), cli->hostname, session_key, cli->vpn_z_id, handle_connection_status, cli);
+		start_connect(cli, session_key, cli->vpn_z_id);
 	} else {
 		g_main_loop_quit(cli->main_loop);
 	}
 
 }
 
+static void begin(F5VpnCli *cli)
+{
+	if (cli->do_auth) {
+		cli->auth = f5vpn_auth_session_new(g_main_loop_get_context(cli->main_loop), cli->hostname);
+		f5vpn_auth_session_begin(cli->auth, on_credentials_needed, cli);
+	} else if (cli->do_getsid) {
+		cli->getsid = f5vpn_getsid_begin(g_main_loop_get_context(cli->main_loop), cli->hostname, cli->otc, on_otc_retrieved, cli);
+	} else if(cli->do_connect) {
+		start_connect(cli, cli->session_key, cli->vpn_z_id);
+	}
+}
+
+static void on_gateways_probed(F5VpnProbe *probe, const F5VpnProbeResult* const* results, void *userdata)
+{
+	(void) probe;
+
+	F5VpnCli *cli = (F5VpnCli*) userdata;
+
+	for(const F5VpnProbeResult* const* r = results; *r; ++r) {
+		if((*r)->err)
+			fprintf(stderr, "gateway %s: %s\n", (*r)->host, (*r)->err->message);
+		else
+			fprintf(stderr, "gateway %s: tcp %" G_GINT64_FORMAT "us tls %" G_GINT64_FORMAT "us\n", (*r)->host, (*r)->connect_us, (*r)->tls_us);
+	}
+
+	/* Fall back to the first listed gateway if none is healthy, so that the real error gets reported */
+	cli->hostname = results[0]->host;
+	printf("using gateway %s\n", cli->hostname);
+	begin(cli);
+}
+
 int main(int argc, char** argv)
 {
 	F5VpnCli cli = {0};
-	gboolean do_auth = FALSE, do_getsid = FALSE;
-	gchar *session_key = NULL, *otc = NULL;
+	cli.keepalive_interval = F5VPN_KEEPALIVE_DEFAULT_INTERVAL;
+	cli.keepalive_failures = F5VPN_KEEPALIVE_DEFAULT_FAILURES;
+	cli.mtu = F5VPN_MTU_AUTO;
 	GOptionContext *opt_ctx = NULL;
-	F5VpnAuthSession *auth = NULL;
-	F5VpnGetSid *getsid = NULL;
 	
 	GOptionEntry options[] = {
-	    { "auth", 'a', 0, G_OPTION_ARG_NONE, &do_auth, "Authenticate to obtain a session key", NULL },
-	    { "getsid", 'g', 0, G_OPTION_ARG_NONE, &do_getsid, "Exchange a One-Time-Code for a session key", NULL },
+	    { "auth", 'a', 0, G_OPTION_ARG_NONE, &cli.do_auth, "Authenticate to obtain a session key", NULL },
+	    { "getsid", 'g', 0, G_OPTION_ARG_NONE, &cli.do_getsid, "Exchange a One-Time-Code for a session key", NULL },
 	    { "connect", 'c', 0, G_OPTION_ARG_NONE, &cli.do_connect, "Connect to remote VPN", NULL },
-	    { "session", 's', 0, G_OPTION_ARG_STRING, &session_key, "Provide a session key", NULL },
-	    { "otc", 'o', 0, G_OPTION_ARG_STRING, &otc, "Provide a One-Time-Code", NULL },
-	    { "host", 'h', 0, G_OPTION_ARG_STRING, &cli.hostname, "F5 SSL VPN host", NULL },
+	    { "session", 's', 0, G_OPTION_ARG_STRING, &cli.session_key, "Provide a session key", NULL },
+	    { "otc", 'o', 0, G_OPTION_ARG_STRING, &cli.otc, "Provide a One-Time-Code", NULL },
+	    { "host", 'h', 0, G_OPTION_ARG_STRING, &cli.hostname, "F5 SSL VPN host, or comma-separated list of hosts to choose the fastest from", NULL },
 	    { "vpn-z-id", 'z', 0, G_OPTION_ARG_STRING, &cli.vpn_z_id, "VPN id to use", NULL },
+	    { "keepalive-interval", 0, 0, G_OPTION_ARG_INT, &cli.keepalive_interval, "Seconds between LCP echo requests (0 to disable)", NULL },
+	    { "keepalive-failures", 0, 0, G_OPTION_ARG_INT, &cli.keepalive_failures, "Unanswered LCP echo requests before the gateway is considered dead", NULL },
+	    { "mtu", 0, 0, G_OPTION_ARG_INT, &cli.mtu, "MTU of the ppp interface (0 to derive it from the path MTU, -1 for the pppd default)", NULL },
+	    { "clamp-mss", 0, 0, G_OPTION_ARG_NONE, &cli.clamp_mss, "Clamp the MSS of TCP connections forwarded into the tunnel", NULL },
+	    { "socket-profile", 0, 0, G_OPTION_ARG_STRING, &cli.socket_profile_spec, "Tuning of the tunnel's TCP connection: interactive, throughput or kernel (default), optionally followed by ,option=value overrides", NULL },
+	    { "early-settings", 0, 0, G_OPTION_ARG_NONE, &cli.early_settings, "Report the tunnel's settings once the ppp interface exists, with the addresses announced by the gateway, instead of after IPCP", NULL },
+	    { "stats-file", 0, 0, G_OPTION_ARG_FILENAME, &cli.stats_file, "Publish connection statistics to a shared file", NULL },
+	    { "tunnels", 't', 0, G_OPTION_ARG_FILENAME, &cli.tunnels_file, "Hold all tunnels listed in a key file at once", NULL },
+	    { "workers", 'w', 0, G_OPTION_ARG_INT, &cli.workers, "Threads to spread the tunnels over (0 for one per core)", NULL },
+	    { "usage-interval", 0, 0, G_OPTION_ARG_INT, &cli.usage_interval, "Seconds between reports of memory, CPU and descriptor use per tunnel (0 to disable)", NULL },
+	    { "dispatch-lag", 0, 0, G_OPTION_ARG_INT, &cli.dispatch_lag, "Debugging: monitor how late the main loop dispatches, logging stalls of this many milliseconds (0 to disable)", NULL },
 	    { NULL }
 	};
 	
@@ -216,50 +347,90 @@ int main(int argc, char** argv)
 	g_option_context_set_summary (opt_ctx, "Connect to F5 SSL VPNs.");
 	g_option_context_parse (opt_ctx, &argc, &argv, NULL);
 	g_option_context_free (opt_ctx);
+
+	if (cli.keepalive_interval < 0 || cli.keepalive_interval > F5VPN_KEEPALIVE_MAX_INTERVAL
+	    || cli.keepalive_failures < 1 || cli.keepalive_failures > F5VPN_KEEPALIVE_MAX_FAILURES)
+		return fprintf(stderr, "--keepalive-interval must be between 0 and %d and --keepalive-failures between 1 and %d\n",
+		               F5VPN_KEEPALIVE_MAX_INTERVAL, F5VPN_KEEPALIVE_MAX_FAILURES), EXIT_FAILURE;
+
+	if (cli.tunnels_file) {
+		if (cli.do_auth || cli.do_getsid || cli.do_connect || cli.hostname || cli.session_key || cli.otc || cli.vpn_z_id || cli.stats_file)
+			return fprintf(stderr, "--tunnels conflicts with options selecting a single tunnel\n"), EXIT_FAILURE;
+
+		ConcentratorOptions opts = {
+			cli.keepalive_interval, cli.keepalive_failures, cli.mtu, cli.clamp_mss, { 0 }, cli.early_settings, cli.workers, cli.usage_interval, cli.dispatch_lag
+		};
+		GError *profile_err = NULL;
+		if (!f5vpn_socket_profile_parse(cli.socket_profile_spec ? cli.socket_profile_spec : F5VPN_SOCKET_PROFILE_DEFAULT, &opts.socket_profile, &profile_err))
+			return fprintf(stderr, "%s\n", profile_err->message), g_error_free(profile_err), EXIT_FAILURE;
+		return concentrator_run(cli.tunnels_file, &opts);
+	}
 	
 	if (!cli.hostname)
 		return fprintf(stderr, "hostname must be provided\n"), EXIT_FAILURE;
 	
-	if (do_auth && do_getsid)
+	if (cli.do_auth && cli.do_getsid)
 		return fprintf(stderr, "--auth conflicts with --getsid\n"), EXIT_FAILURE;
 
-	if (do_getsid && !otc)
+	if (cli.do_getsid && !cli.otc)
 		return fprintf(stderr, "otc must be provided when exchanging otc for session key\n"), EXIT_FAILURE;
 
-	if (do_getsid && session_key)
+	if (cli.do_getsid && cli.session_key)
 		return fprintf(stderr, "session key should not be provided when exchanging otc for session key\n"), EXIT_FAILURE;
 
-	if (do_getsid && !cli.do_connect && cli.vpn_z_id)
+	if (cli.do_getsid && !cli.do_connect && cli.vpn_z_id)
 		return fprintf(stderr, "not connecting: vpn_z_id should not be provided\n"), EXIT_FAILURE;
 
-	if (do_auth && (session_key || otc || cli.vpn_z_id))
+	if (cli.do_auth && (cli.session_key || cli.otc || cli.vpn_z_id))
 		return fprintf(stderr, "neither session_key, otc nor vpn_z_id should be provided when authenticating\n"), EXIT_FAILURE;
 	
-	if (cli.do_connect && !do_auth && (!cli.vpn_z_id || (!session_key && !do_getsid)))
+	if (cli.do_connect && !cli.do_auth && (!cli.vpn_z_id || (!cli.session_key && !cli.do_getsid)))
 		return fprintf(stderr, "not authenticating: session key (or otc) and Z-id must be provided\n"), EXIT_FAILURE;
 
-	if (!do_auth && !do_getsid && !cli.do_connect)
+	if (!cli.do_auth && !cli.do_getsid && !cli.do_connect)
 		return fprintf(stderr, "one or more of --auth, --getsid or --connect must be used\n"), EXIT_FAILURE;
 
-	cli.main_loop = g_main_loop_new(NULL, FALSE);
+	GError *profile_err = NULL;
+	if (!f5vpn_socket_profile_parse(cli.socket_profile_spec ? cli.socket_profile_spec : F5VPN_SOCKET_PROFILE_DEFAULT, &cli.socket_profile, &profile_err))
+		return fprintf(stderr, "%s\n", profile_err->message), g_error_free(profile_err), EXIT_FAILURE;
 
-	if (do_auth) {
-		auth = f5vpn_auth_session_new(g_main_loop_get_context(cli.main_loop), cli.hostname);
-		f5vpn_auth_session_begin(auth, on_credentials_needed, &cli);
-	} else if (do_getsid) {
-		getsid = f5vpn_getsid_begin(g_main_loop_get_context(cli.main_loop), cli.hostname, otc, on_otc_retrieved, &cli);
-	} else if(cli.do_connect) {
-		f5vpn_connect(g_main_loop_get_context(cli.main_loop), cli.hostname, session_key, cli.vpn_z_id, handle_connection_status, &cli);
+	cli.main_loop = g_main_loop_new(NULL, FALSE);
+	/* kill -USR1 dumps forwarding latency histograms */
+	g_unix_signal_add(SIGUSR1, on_dump_latency, &cli);
+	g_unix_signal_add(SIGINT, on_interrupt, &cli);
+	g_unix_signal_add(SIGTERM, on_interrupt, &cli);
+	if (cli.dispatch_lag > 0)
+		cli.lag_monitor = f5vpn_lag_monitor_start(NULL, F5VPN_LAG_MONITOR_DEFAULT_INTERVAL_MS, cli.dispatch_lag);
+
+	/* A single host is used from the split list, so it is freed after the loop */
+	gchar **gateways = f5vpn_probe_split_hosts(cli.hostname);
+	if (!gateways[0])
+		return fprintf(stderr, "hostname must be provided\n"), g_strfreev(gateways), EXIT_FAILURE;
+	if (g_strv_length(gateways) > 1) {
+		cli.probe = f5vpn_probe_begin(g_main_loop_get_context(cli.main_loop), (const char* const*) gateways, FALSE, GATEWAY_PROBE_TIMEOUT_MS, on_gateways_probed, &cli);
+	} else {
+		cli.hostname = gateways[0];
+		begin(&cli);
 	}
 
 	g_main_loop_run(cli.main_loop);
+	g_strfreev(gateways);
+
+	if (cli.auth) {
+		f5vpn_auth_session_free(cli.auth);
+	}
+
+	if (cli.getsid) {
+		f5vpn_getsid_free(cli.getsid);
+	}
 
-	if (auth) {
-		f5vpn_auth_session_free(auth);
+	if (cli.probe) {
+		f5vpn_probe_free(cli.probe);
 	}
 
-	if (getsid) {
-		f5vpn_getsid_free(getsid);
+	if (cli.lag_monitor) {
+		on_dump_latency(&cli);
+		f5vpn_lag_monitor_free(cli.lag_monitor);
 	}
 
 	g_main_loop_unref(cli.main_loop);
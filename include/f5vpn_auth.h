@@ -20,11 +20,32 @@
 #ifndef F5VPN_AUTH_H
 #define F5VPN_AUTH_H
 
+#include "f5vpn_http.h"
 #include <glib.h>
 
 struct _F5VpnAuthSession;
 typedef struct _F5VpnAuthSession F5VpnAuthSession;
 
+enum
+{
+	F5VPN_AUTH_ERROR_TIMED_OUT = 10001,
+	F5VPN_AUTH_ERROR_CANCELLED
+};
+
+/**
+ * Phases of the authentication flow which have their own deadline, see
+ * f5vpn_auth_session_set_deadline
+ */
+typedef enum
+{
+	F5VPN_AUTH_PHASE_PORTAL, /* f5vpn_auth_session_begin until the login form is parsed */
+	F5VPN_AUTH_PHASE_LOGIN,  /* posting the credentials until the tunnel list is complete */
+	F5VPN_AUTH_PHASE_COUNT
+} F5VpnAuthPhase;
+
+#define F5VPN_AUTH_DEFAULT_PORTAL_DEADLINE_MS 15000
+#define F5VPN_AUTH_DEFAULT_LOGIN_DEADLINE_MS  30000
+
 typedef enum
 {
 	FORM_FIELD_TEXT,
@@ -111,7 +132,31 @@ void f5vpn_auth_session_begin (F5VpnAuthSession *session, F5VpnRequestCredential
 void f5vpn_auth_session_post_credentials (F5VpnAuthSession *session, F5VpnLoginDoneCallback callback, void *userdata);
 
 /**
- * Destroys a F5VpnAuthSession structure and frees all associated memory
+ * Limits how long a phase may take, counting from its start; 0 disables the
+ * deadline. Once it passes, the requests in flight are aborted and the
+ * callback of the phase fails with F5VPN_AUTH_ERROR_TIMED_OUT. May also be
+ * called while the phase is in progress.
+ */
+void f5vpn_auth_session_set_deadline (F5VpnAuthSession *session, F5VpnAuthPhase phase, guint timeout_ms);
+
+/**
+ * Retrieves the session's HTTP statistics so far. The idempotent requests of
+ * the flow are retried after transport failures, and hedged: if the gateway
+ * is slow to respond, a duplicate request is sent and the first response
+ * taken.
+ */
+void f5vpn_auth_session_get_http_counters (F5VpnAuthSession *session, F5VpnHttpCounters *counters);
+
+/**
+ * Aborts the requests in flight. The pending callback, if any, is invoked
+ * from the main loop with F5VPN_AUTH_ERROR_CANCELLED. Cancelling while the
+ * session waits for f5vpn_auth_session_post_credentials just ends it.
+ */
+void f5vpn_auth_session_cancel (F5VpnAuthSession *session);
+
+/**
+ * Destroys a F5VpnAuthSession structure and frees all associated memory.
+ * Requests still in flight are aborted without invoking any callback.
  */
 void f5vpn_auth_session_free (F5VpnAuthSession *session);
 
@@ -0,0 +1,53 @@
+/*
+ * NetworkManager-f5vpn
+ * Plugin for NetworkManager to access F5 Firepass SSL VPNs
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+#ifndef F5VPN_BACKOFF_H
+#define F5VPN_BACKOFF_H
+
+#include <glib.h>
+
+/**
+ * Reconnect delays with randomised exponential backoff. The n-th delay is
+ * drawn uniformly from [0, min(max_ms, base_ms * 2^n)] ("full jitter"), so
+ * that clients which lost their tunnels together, e.g. to a gateway restart,
+ * spread their reconnects out instead of returning in waves.
+ */
+typedef struct
+{
+	guint base_ms;
+	guint max_ms;
+	guint attempt;
+} F5VpnBackoff;
+
+void f5vpn_backoff_init (F5VpnBackoff *backoff, guint base_ms, guint max_ms);
+
+/**
+ * Returns the delay before the next attempt in milliseconds. A server hint
+ * such as an HTTP Retry-After (0 if there is none) is honoured as the
+ * minimum; the jittered backoff is added on top of it, since every client
+ * gets the same hint.
+ */
+guint f5vpn_backoff_next (F5VpnBackoff *backoff, guint hint_ms);
+
+/**
+ * Starts over with the shortest delays, after a successful attempt
+ */
+void f5vpn_backoff_reset (F5VpnBackoff *backoff);
+
+#endif // F5VPN_BACKOFF_H
@@ -20,6 +20,7 @@
 #ifndef F5VPN_CONNECT_H
 #define F5VPN_CONNECT_H
 
+#include "f5vpn_stats.h"
 #include <glib.h>
 #include <stdint.h>
 #include <netinet/in.h>
@@ -30,9 +31,50 @@ typedef struct _F5VpnConnection F5VpnConnection;
 enum
 {
 	F5VPN_CONNECT_ERROR_BAD_HTTP_CODE = 10001,
-	F5VPN_CONNECT_ERROR_PARSE_FAILED
+	F5VPN_CONNECT_ERROR_PARSE_FAILED,
+	F5VPN_CONNECT_ERROR_STATS_FILE,
+	F5VPN_CONNECT_ERROR_PEER_DEAD,
+	F5VPN_CONNECT_ERROR_BAD_SOCKET_PROFILE,
+	F5VPN_CONNECT_ERROR_TIMED_OUT,
+	F5VPN_CONNECT_ERROR_CANCELLED,
+	F5VPN_CONNECT_ERROR_UNAVAILABLE,
+	F5VPN_CONNECT_ERROR_SPAWN_FAILED,
+	F5VPN_CONNECT_ERROR_TUNNEL_SOCKET
 };
 
+/* Default deadlines of the connection phases in milliseconds, see
+ * f5vpn_connection_set_deadline */
+#define F5VPN_CONNECT_PARAMS_DEFAULT_DEADLINE_MS 15000
+#define F5VPN_TUNNEL_OPEN_DEFAULT_DEADLINE_MS    15000
+#define F5VPN_PPP_UP_DEFAULT_DEADLINE_MS         30000
+
+/* Default LCP echo keepalive: the link is declared dead after this many
+ * unanswered echo requests sent this many seconds apart */
+#define F5VPN_KEEPALIVE_DEFAULT_INTERVAL 5
+#define F5VPN_KEEPALIVE_DEFAULT_FAILURES 3
+#define F5VPN_KEEPALIVE_MAX_INTERVAL     3600
+#define F5VPN_KEEPALIVE_MAX_FAILURES     100
+
+/* Special values for f5vpn_connection_set_mtu */
+#define F5VPN_MTU_AUTO          0
+#define F5VPN_MTU_PPPD_DEFAULT -1
+
+/* Options applied to the TCP connection carrying the tunnel. -1 leaves the
+ * kernel's default in place. */
+typedef struct
+{
+	gint nodelay;        /* TCP_NODELAY, 0 or 1 */
+	gint notsent_lowat;  /* TCP_NOTSENT_LOWAT, bytes */
+	gint sndbuf;         /* SO_SNDBUF, bytes */
+	gint rcvbuf;         /* SO_RCVBUF, bytes */
+	gint keepalive_idle; /* seconds before TCP keepalive probes, 0 to disable */
+	gint busy_poll;      /* SO_BUSY_POLL, microseconds */
+} F5VpnSocketProfile;
+
+/* The socket profile used unless another one is set, which leaves the socket
+ * as the kernel set it up; the other presets are opt-in per connection */
+#define F5VPN_SOCKET_PROFILE_DEFAULT "kernel"
+
 typedef struct
 {
 	struct in_addr addr;
@@ -45,15 +87,188 @@ typedef struct
 	uint32_t remote_ip;
 	GSList *lans; // data is of type LanAddr*
 	GSList *nameservers; // data is of type struct in_addr*
+	GSList *search_domains; // data is of type gchar*
+	/* Domains whose names should be resolved through the nameservers, while
+	 * other names keep using the local ones; "*" stands for all names. Empty
+	 * unless the gateway is configured for split DNS. */
+	GSList *split_domains; // data is of type gchar*
 	char device[16];
 } NetworkSettings;
 
 typedef void (*F5VpnConnectCallback) (F5VpnConnection *connection, const NetworkSettings *settings, void *userdata, GError *err);
 
+struct _F5VpnConnectParams;
+typedef struct _F5VpnConnectParams F5VpnConnectParams;
+
+typedef void (*F5VpnConnectParamsCallback) (F5VpnConnectParams *params, void *userdata, GError *err);
+
+/**
+ * Fetches the tunnel parameters of resource vpn_z_id from the gateway's
+ * connect.php3, which at the same time validates the session key: an expired
+ * or otherwise invalid session fails with F5VPN_CONNECT_ERROR_BAD_HTTP_CODE,
+ * while a gateway which is overloaded or restarting (HTTP 502, 503 or 504)
+ * fails with F5VPN_CONNECT_ERROR_UNAVAILABLE.
+ * On success the params can be passed to f5vpn_connect_with_params, so that
+ * a session validated beforehand does not cost a second request.
+ *
+ * The error passed to the callback belongs to the library user. The returned
+ * pointer should be freed with f5vpn_connect_params_free, but not before the
+ * callback has been invoked.
+ */
+F5VpnConnectParams *f5vpn_connect_params_begin (GMainContext *main_context, const char *hostname, const char *session_key, const char *vpn_z_id, F5VpnConnectParamsCallback callback, void *userdata);
+
+/**
+ * Limits how long fetching the parameters may take, counting from
+ * f5vpn_connect_params_begin; 0 disables the deadline. The default is
+ * F5VPN_CONNECT_PARAMS_DEFAULT_DEADLINE_MS. Once it passes, the request is
+ * aborted and the callback fails with F5VPN_CONNECT_ERROR_TIMED_OUT.
+ */
+void f5vpn_connect_params_set_deadline (F5VpnConnectParams *params, guint timeout_ms);
+
+/**
+ * Aborts the request. Unless it has been reported already, the callback is
+ * invoked from the main loop with F5VPN_CONNECT_ERROR_CANCELLED.
+ */
+void f5vpn_connect_params_cancel (F5VpnConnectParams *params);
+
+/**
+ * Returns how long the gateway asked clients to wait before trying again,
+ * through a Retry-After header, in milliseconds; 0 if it did not.
+ */
+guint f5vpn_connect_params_get_retry_after (F5VpnConnectParams *params);
+
+/**
+ * Destroys a F5VpnConnectParams structure. A request still in flight is
+ * aborted without invoking the callback.
+ */
+void f5vpn_connect_params_free (F5VpnConnectParams *params);
+
+/**
+ * Fetches the tunnel parameters as f5vpn_connect_params_begin does, then
+ * establishes the tunnel. All sources of the connection, including the
+ * forwarding between pppd and the gateway, are attached to main_context.
+ */
 F5VpnConnection *f5vpn_connect (GMainContext *main_context, const char *hostname, const char *session_key, const char *vpn_z_id, F5VpnConnectCallback callback, void *userdata);
 
+/**
+ * Establishes the tunnel using previously fetched parameters, with its sources
+ * attached to the GMainContext the params were fetched on. The params are
+ * not referenced after this returns.
+ */
+F5VpnConnection *f5vpn_connect_with_params (const F5VpnConnectParams *params, const char *session_key, F5VpnConnectCallback callback, void *userdata);
+
+/**
+ * Moves the connection's statistics (see f5vpn_stats.h) into a shared file
+ * at path, which external monitors can mmap and sample without IPC. Should be
+ * called directly after f5vpn_connect. Anything the file held before is
+ * overwritten. The file is left in place after the connection is freed.
+ */
+gboolean f5vpn_connection_publish_stats (F5VpnConnection *connection, const char *path, GError **err);
+
+/**
+ * Sets the reconnect counter of the connection's statistics, i.e. how many
+ * times the caller has re-established the tunnel this connection replaces.
+ * Must be called before f5vpn_connection_publish_stats.
+ */
+void f5vpn_connection_set_reconnects (F5VpnConnection *connection, guint reconnects);
+
+/**
+ * Configures the LCP echo keepalive used to detect a dead gateway. Must be
+ * called before the tunnel is established, i.e. directly after f5vpn_connect.
+ * When failures consecutive echo requests sent interval seconds apart go
+ * unanswered, the connection is torn down and the callback is invoked with a
+ * F5VPN_CONNECT_ERROR_PEER_DEAD error. An interval of 0 disables keepalives.
+ */
+void f5vpn_connection_set_keepalive (F5VpnConnection *connection, guint interval, guint failures);
+
+/**
+ * Sets the MTU and MRU of the ppp interface. With F5VPN_MTU_AUTO (the
+ * default) it is derived from the kernel's path MTU on the tunnel's TCP
+ * connection, less the framing, TLS, TCP and IP overhead, so that a
+ * full-sized packet inside the tunnel travels in a single TCP segment; if
+ * that connection cannot be accessed, pppd's default is used.
+ * F5VPN_MTU_PPPD_DEFAULT leaves pppd's default in place. If clamp_mss is
+ * set, an iptables rule clamps the MSS of forwarded TCP connections into
+ * the tunnel while it is up; it is added and removed in the background.
+ * Must be called directly after f5vpn_connect.
+ */
+void f5vpn_connection_set_mtu (F5VpnConnection *connection, gint mtu, gboolean clamp_mss);
+
+/**
+ * Reports the network settings through the callback as soon as pppd has
+ * created the ppp interface, using the addresses announced in the gateway's
+ * /myvpn response, instead of waiting for LCP and IPCP to complete. Routes and
+ * DNS can then be set up while PPP is still negotiating; packets sent into
+ * the interface before that are lost. Should IPCP settle on other addresses,
+ * the callback is invoked again with those. Has no effect if the gateway did
+ * not announce the client address. Must be called directly after
+ * f5vpn_connect.
+ */
+void f5vpn_connection_set_early_settings (F5VpnConnection *connection, gboolean enable);
+
+/**
+ * Parses a socket profile specification into profile. The specification is
+ * the name of a preset, optionally followed by comma-separated overrides:
+ *
+ *   interactive  no-delay, 16 KiB not-sent low watermark, 30s TCP keepalive
+ *   throughput   Nagle enabled, 4 MiB buffers, 30s TCP keepalive
+ *   kernel       kernel defaults throughout
+ *
+ * e.g. "interactive,busy-poll=50,sndbuf=262144". The override keys are
+ * nodelay, notsent-lowat, sndbuf, rcvbuf, keepalive and busy-poll.
+ */
+gboolean f5vpn_socket_profile_parse (const char *spec, F5VpnSocketProfile *profile, GError **err);
+
+/**
+ * Sets the options applied to the tunnel's TCP connection once it is
+ * established. Must be called directly after f5vpn_connect. Since the TLS
+ * handshake has completed by then, rcvbuf does not affect the negotiated
+ * window scale.
+ */
+void f5vpn_connection_set_socket_profile (F5VpnConnection *connection, const F5VpnSocketProfile *profile);
+
+/**
+ * Returns the smoothed round trip time to the gateway in microseconds, as
+ * measured by the keepalive, or -1 if no measurement is available yet.
+ */
+gint64 f5vpn_connection_get_rtt (F5VpnConnection *connection);
+
+/**
+ * Returns the connection's live statistics. The segment is only written from
+ * the thread running the connection's main context, so no locking is needed
+ * when reading it from there.
+ */
+const F5VpnStatsSegment *f5vpn_connection_get_stats (F5VpnConnection *connection);
+
+/**
+ * Formats the per-direction forwarding latency histograms, with percentiles,
+ * as a human-readable string which should be freed with g_free.
+ */
+gchar *f5vpn_connection_dump_latency (F5VpnConnection *connection);
+
+/**
+ * Limits how long a phase of establishing the tunnel may take, counting from
+ * its start; 0 disables the deadline. Once it passes, the connection is torn
+ * down and the callback is invoked with F5VPN_CONNECT_ERROR_TIMED_OUT. The
+ * defaults are F5VPN_*_DEFAULT_DEADLINE_MS. Should be called directly after
+ * f5vpn_connect.
+ */
+void f5vpn_connection_set_deadline (F5VpnConnection *connection, F5VpnStatsPhase phase, guint timeout_ms);
+
+/**
+ * Tears the connection down, at any stage of establishing it. The callback is
+ * then invoked as for a tunnel which went down, without an error.
+ */
 void f5vpn_disconnect (F5VpnConnection *connection);
 
 void f5vpn_connection_free (F5VpnConnection *connection);
 
+/**
+ * Lets the connect.php3 requests of all connections begun afterwards share
+ * their DNS cache and TLS sessions, which pays off when a process holds many
+ * tunnels, possibly on several threads. Must be called before starting
+ * threads.
+ */
+void f5vpn_connect_share_http_state (void);
+
 #endif // F5VPN_CONNECT_H
@@ -25,6 +25,14 @@
 struct _F5VpnGetSid;
 typedef struct _F5VpnGetSid F5VpnGetSid;
 
+enum
+{
+	F5VPN_GETSID_ERROR_TIMED_OUT = 10001,
+	F5VPN_GETSID_ERROR_CANCELLED
+};
+
+#define F5VPN_GETSID_DEFAULT_DEADLINE_MS 15000
+
 /**
  * Callback function to be passed to f5vpn_getsid_begin.
  * The consumer of this callback should first check whether there were errors
@@ -44,7 +52,21 @@ typedef void (*F5VpnGetSidResultCallback) (F5VpnGetSid *getsid, const char *sid,
 F5VpnGetSid *f5vpn_getsid_begin (GMainContext *glib_context, const char *host, const char *otc, F5VpnGetSidResultCallback callback, void *userdata);
 
 /**
- * Destroys a F5VpnGetSid structure and frees all associated memory
+ * Limits how long the request may take, counting from f5vpn_getsid_begin;
+ * 0 disables the deadline. Once it passes, the request is aborted and the
+ * callback fails with F5VPN_GETSID_ERROR_TIMED_OUT.
+ */
+void f5vpn_getsid_set_deadline (F5VpnGetSid *getsid, guint timeout_ms);
+
+/**
+ * Aborts the request. Unless it has been reported already, the callback is
+ * invoked from the main loop with F5VPN_GETSID_ERROR_CANCELLED.
+ */
+void f5vpn_getsid_cancel (F5VpnGetSid *getsid);
+
+/**
+ * Destroys a F5VpnGetSid structure and frees all associated memory. A request
+ * still in flight is aborted without invoking the callback.
  */
 void f5vpn_getsid_free (F5VpnGetSid *getsid);
 
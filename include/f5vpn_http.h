@@ -0,0 +1,35 @@
+/*
+ * NetworkManager-f5vpn
+ * Plugin for NetworkManager to access F5 Firepass SSL VPNs
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+#ifndef F5VPN_HTTP_H
+#define F5VPN_HTTP_H
+
+#include <glib.h>
+
+/* Counts the HTTP requests of the library's sessions, and how many of them
+ * needed retries or hedged duplicates */
+typedef struct
+{
+	guint requests;
+	guint retries;
+	guint hedges;     /* duplicates sent */
+	guint hedges_won; /* requests answered by a duplicate */
+} F5VpnHttpCounters;
+
+#endif // F5VPN_HTTP_H
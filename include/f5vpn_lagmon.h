@@ -0,0 +1,61 @@
+/*
+ * NetworkManager-f5vpn
+ * Plugin for NetworkManager to access F5 Firepass SSL VPNs
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+#ifndef F5VPN_LAGMON_H
+#define F5VPN_LAGMON_H
+
+#include <glib.h>
+
+struct _F5VpnLagMonitor;
+typedef struct _F5VpnLagMonitor F5VpnLagMonitor;
+
+#define F5VPN_LAG_MONITOR_DEFAULT_INTERVAL_MS 10
+
+/**
+ * Watchdog for a GMainContext, meant for debugging. A source which asks to
+ * be dispatched every interval_ms records how late it actually is into a
+ * histogram; its lateness is what every other timer and fd source of the
+ * context suffers too.
+ *
+ * Dispatches later than stall_ms are logged. While such a stall is still in
+ * progress, a watchdog thread interrupts the thread running the context with
+ * SIGPROF, whose handler writes that thread's stack to stderr. The stack
+ * names the callback responsible if the executable exports its symbols
+ * (-rdynamic); offsets into static functions can be resolved with
+ * addr2line. Sleeps and polls the signal interrupts return
+ * early, which is harmless for retrying callers but may change what a
+ * stalled callback does next.
+ *
+ * The returned pointer should be freed with f5vpn_lag_monitor_free.
+ */
+F5VpnLagMonitor *f5vpn_lag_monitor_start (GMainContext *main_context, guint interval_ms, guint stall_ms);
+
+/**
+ * Describes the lateness histogram and the number of stalls so far, as a
+ * string to be freed with g_free. May only be called from the thread running
+ * the context, or once it has stopped.
+ */
+gchar *f5vpn_lag_monitor_dump (F5VpnLagMonitor *monitor);
+
+/**
+ * Stops the watchdog and frees the monitor
+ */
+void f5vpn_lag_monitor_free (F5VpnLagMonitor *monitor);
+
+#endif // F5VPN_LAGMON_H
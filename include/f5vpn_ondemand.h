@@ -0,0 +1,97 @@
+/*
+ * NetworkManager-f5vpn
+ * Plugin for NetworkManager to access F5 Firepass SSL VPNs
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+#ifndef F5VPN_ONDEMAND_H
+#define F5VPN_ONDEMAND_H
+
+#include <glib.h>
+#include <stdint.h>
+
+struct _F5VpnOnDemand;
+typedef struct _F5VpnOnDemand F5VpnOnDemand;
+
+enum
+{
+	F5VPN_ONDEMAND_ERROR_TUN = 10001
+};
+
+/* Packets held back while the tunnel is coming up; later ones are dropped */
+#define F5VPN_ONDEMAND_QUEUE_PACKETS 64
+#define F5VPN_ONDEMAND_QUEUE_BYTES   (256 * 1024)
+
+/**
+ * Callback function to be passed to f5vpn_ondemand_new. Invoked once per
+ * f5vpn_ondemand_park, for the first packet routed into the placeholder.
+ */
+typedef void (*F5VpnOnDemandCallback) (F5VpnOnDemand *ondemand, void *userdata);
+
+/**
+ * Creates a TUN interface to stand in for a tunnel which is brought up only
+ * when there is traffic for it. While the tunnel is parked, the tunnel's
+ * routes are meant to point at the placeholder: packets routed into it are
+ * queued and the first one invokes the callback, which should bring the
+ * tunnel up and then call f5vpn_ondemand_flush. Requires CAP_NET_ADMIN, and
+ * CAP_NET_RAW for the flush.
+ *
+ * The returned pointer should be freed with f5vpn_ondemand_free, which also
+ * removes the interface.
+ */
+F5VpnOnDemand *f5vpn_ondemand_new (GMainContext *main_context, F5VpnOnDemandCallback callback, void *userdata, GError **err);
+
+/**
+ * Returns the name of the placeholder interface
+ */
+const char *f5vpn_ondemand_get_device (F5VpnOnDemand *ondemand);
+
+/**
+ * Records that the tunnel has been taken down for being idle and that its
+ * routes now point at the placeholder, and arms the callback.
+ */
+void f5vpn_ondemand_park (F5VpnOnDemand *ondemand);
+
+/**
+ * To be called once the tunnel is up again on ifname with local address
+ * local_ip (in network byte order). Sends the queued packets through
+ * ifname, except for those whose source address is not local_ip because the
+ * gateway assigned a different one this time: their connections were lost
+ * anyway. Also records the time since the first queued packet as the
+ * first-packet latency. Returns FALSE without doing anything unless parked.
+ */
+gboolean f5vpn_ondemand_flush (F5VpnOnDemand *ondemand, const char *ifname, uint32_t local_ip);
+
+/**
+ * Returns the first-packet latency of the last on-demand bring-up in
+ * microseconds, or -1 if there was none yet.
+ */
+gint64 f5vpn_ondemand_get_last_latency (F5VpnOnDemand *ondemand);
+
+/**
+ * Describes the idle teardowns, the time spent parked, the first-packet
+ * latencies and the fate of the queued packets, as a string to be freed
+ * with g_free.
+ */
+gchar *f5vpn_ondemand_dump (F5VpnOnDemand *ondemand);
+
+/**
+ * Drops any queued packets, removes the placeholder interface and frees the
+ * structure
+ */
+void f5vpn_ondemand_free (F5VpnOnDemand *ondemand);
+
+#endif // F5VPN_ONDEMAND_H
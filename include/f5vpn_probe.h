@@ -0,0 +1,70 @@
+/*
+ * NetworkManager-f5vpn
+ * Plugin for NetworkManager to access F5 Firepass SSL VPNs
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+#ifndef F5VPN_PROBE_H
+#define F5VPN_PROBE_H
+
+#include <glib.h>
+
+struct _F5VpnProbe;
+typedef struct _F5VpnProbe F5VpnProbe;
+
+/**
+ * Outcome of probing a single gateway. Times are in microseconds from the
+ * start of the probe; http_us is -1 unless an HTTP round trip was requested.
+ */
+typedef struct
+{
+	char *host;
+	gint64 connect_us; /* TCP handshake complete */
+	gint64 tls_us;     /* TLS handshake complete */
+	gint64 http_us;    /* first byte of the HTTP response */
+	GError *err;       /* NULL if the gateway is healthy */
+} F5VpnProbeResult;
+
+/**
+ * Callback function to be passed to f5vpn_probe_begin. The NULL-terminated
+ * results are ordered with the fastest healthy gateway first and unhealthy
+ * gateways last. They remain valid until f5vpn_probe_free is called.
+ */
+typedef void (*F5VpnProbeResultCallback) (F5VpnProbe *probe, const F5VpnProbeResult *const *results, void *userdata);
+
+/**
+ * Splits a gateway list as stored in the "hostname" data item (host names
+ * separated by commas, semicolons or whitespace) into a NULL-terminated
+ * array, which should be freed with g_strfreev.
+ */
+gchar **f5vpn_probe_split_hosts (const char *list);
+
+/**
+ * Concurrently measures the TCP and TLS handshake times to each of the given
+ * hosts and, if http_rtt is set, the time until the portal responds to an
+ * HTTP request, which is then used for ranking instead of the handshake time.
+ * Probes are given up after timeout_ms.
+ *
+ * The returned pointer should be freed with f5vpn_probe_free.
+ */
+F5VpnProbe *f5vpn_probe_begin (GMainContext *glib_context, const char *const *hosts, gboolean http_rtt, long timeout_ms, F5VpnProbeResultCallback callback, void *userdata);
+
+/**
+ * Destroys a F5VpnProbe structure and frees all associated memory
+ */
+void f5vpn_probe_free (F5VpnProbe *probe);
+
+#endif // F5VPN_PROBE_H
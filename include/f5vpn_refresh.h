@@ -0,0 +1,65 @@
+/*
+ * NetworkManager-f5vpn
+ * Plugin for NetworkManager to access F5 Firepass SSL VPNs
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+#ifndef F5VPN_REFRESH_H
+#define F5VPN_REFRESH_H
+
+#include <glib.h>
+
+struct _F5VpnRefresh;
+typedef struct _F5VpnRefresh F5VpnRefresh;
+
+enum
+{
+	F5VPN_REFRESH_ERROR_SESSION_LOST = 1
+};
+
+/**
+ * Callback function to be passed to f5vpn_refresh_begin. It is invoked with
+ * err set to NULL after each refresh the gateway accepted, and a last time
+ * with an error once the gateway has stopped accepting the session, at which
+ * point refreshing stops.
+ */
+typedef void (*F5VpnRefreshCallback) (F5VpnRefresh *refresh, void *userdata, GError *err);
+
+/**
+ * Keeps an MRHSession alive on the gateway by requesting the portal's resource
+ * list, a small authenticated XML document, roughly every interval seconds.
+ * The schedule is jittered by up to a quarter of the interval so that many
+ * clients do not refresh in lockstep. Only a gateway rejecting the session,
+ * by redirecting to the logon page or with HTTP 401 or 403, ends refreshing.
+ * Network errors and other responses, such as a 503 while the gateway
+ * restarts, are retried with jittered exponential backoff.
+ *
+ * The returned pointer should be freed with f5vpn_refresh_free.
+ */
+F5VpnRefresh *f5vpn_refresh_begin (GMainContext *glib_context, const char *host, const char *session_key, guint interval, F5VpnRefreshCallback callback, void *userdata);
+
+/**
+ * Returns the number of refreshes the gateway has accepted so far
+ */
+guint f5vpn_refresh_get_count (F5VpnRefresh *refresh);
+
+/**
+ * Stops refreshing and frees all associated memory. May be called at any
+ * time, including from the callback.
+ */
+void f5vpn_refresh_free (F5VpnRefresh *refresh);
+
+#endif // F5VPN_REFRESH_H
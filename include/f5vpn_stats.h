@@ -0,0 +1,168 @@
+/*
+ * NetworkManager-f5vpn
+ * Plugin for NetworkManager to access F5 Firepass SSL VPNs
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+#ifndef F5VPN_STATS_H
+#define F5VPN_STATS_H
+
+#include <stdint.h>
+#include <string.h>
+
+/* Layout of the statistics segment which an F5VpnConnection can publish to a
+ * file (see f5vpn_connection_publish_stats). External monitors may mmap the
+ * file read-only and sample it with f5vpn_stats_snapshot without any IPC.
+ *
+ * New fields are only ever appended, and the size member grows accordingly.
+ * The version member changes only if existing fields are moved or redefined,
+ * so readers should check magic and version, and use size to find out which
+ * of the appended fields are present. */
+
+#define F5VPN_STATS_MAGIC   0x53563546u /* "F5VS" */
+#define F5VPN_STATS_VERSION 1
+
+typedef enum
+{
+	F5VPN_STATS_STATE_CONNECTING,
+	F5VPN_STATS_STATE_UP,
+	F5VPN_STATS_STATE_DOWN
+} F5VpnStatsState;
+
+typedef enum
+{
+	F5VPN_STATS_PHASE_CONNECT_PARAMS, /* connect.php3 request */
+	F5VPN_STATS_PHASE_TUNNEL_OPEN,    /* TLS handshake and GET /myvpn */
+	F5VPN_STATS_PHASE_PPP_UP,         /* tunnel handed to pppd until ip-up */
+	F5VPN_STATS_PHASE_COUNT
+} F5VpnStatsPhase;
+
+typedef enum
+{
+	F5VPN_STATS_DIR_RX, /* gateway to pppd */
+	F5VPN_STATS_DIR_TX, /* pppd to gateway */
+	F5VPN_STATS_DIR_COUNT
+} F5VpnStatsDirection;
+
+typedef struct
+{
+	uint64_t bytes;
+	uint64_t chunks; /* number of reads/splices, not PPP frames */
+	uint64_t stalls; /* times the output side was not ready for writing */
+} F5VpnStatsCounters;
+
+/* PPP-level link statistics, as last reported by the pppd plugin */
+typedef struct
+{
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	uint64_t packets_in;
+	uint64_t packets_out;
+	uint64_t errors_in;
+	uint64_t errors_out;
+	int32_t lcp_echo_rtt_us; /* -1 if not measured yet */
+	uint32_t idle_in_s;
+	uint32_t idle_out_s;
+	uint32_t reserved;
+} F5VpnStatsLink;
+
+/* Latency histograms use log-linear buckets in the style of HdrHistogram:
+ * values below 2^F5VPN_STATS_LATENCY_SUB_BITS nanoseconds get a bucket each,
+ * above that every power of two is split into 2^F5VPN_STATS_LATENCY_SUB_BITS
+ * linear sub-buckets, giving a relative error below 12.5%. Values beyond the
+ * last bucket (about 17s) are counted in the last bucket. */
+#define F5VPN_STATS_LATENCY_SUB_BITS 3
+#define F5VPN_STATS_LATENCY_BUCKETS  256
+
+typedef struct
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;
+	uint32_t seq; /* odd while the writer is updating the segment */
+
+	uint32_t state; /* F5VpnStatsState */
+	uint32_t reconnects;
+	int64_t phase_us[F5VPN_STATS_PHASE_COUNT];
+	F5VpnStatsCounters dir[F5VPN_STATS_DIR_COUNT];
+
+	/* Time from a chunk becoming readable until it was completely written to
+	 * the other side, in nanoseconds */
+	uint64_t latency[F5VPN_STATS_DIR_COUNT][F5VPN_STATS_LATENCY_BUCKETS];
+
+	F5VpnStatsLink link;
+
+	/* Smoothed LCP echo round trip time and its mean deviation, as in
+	 * RFC 6298; -1 until the first echo reply */
+	int64_t srtt_us;
+	int64_t rttvar_us;
+} F5VpnStatsSegment;
+
+static inline unsigned int
+f5vpn_stats_latency_bucket (uint64_t ns)
+{
+	const unsigned int sub = 1u << F5VPN_STATS_LATENCY_SUB_BITS;
+	if (ns < sub)
+		return (unsigned int) ns;
+	unsigned int msb = 63 - __builtin_clzll (ns);
+	unsigned int idx = (msb - F5VPN_STATS_LATENCY_SUB_BITS + 1) * sub + ((ns >> (msb - F5VPN_STATS_LATENCY_SUB_BITS)) & (sub - 1));
+	return idx < F5VPN_STATS_LATENCY_BUCKETS ? idx : F5VPN_STATS_LATENCY_BUCKETS - 1;
+}
+
+/* Lowest value, in nanoseconds, which falls into the given bucket */
+static inline uint64_t
+f5vpn_stats_latency_bucket_floor (unsigned int idx)
+{
+	const unsigned int sub = 1u << F5VPN_STATS_LATENCY_SUB_BITS;
+	if (idx < sub)
+		return idx;
+	unsigned int msb = idx / sub + F5VPN_STATS_LATENCY_SUB_BITS - 1;
+	return ((uint64_t) (sub | (idx % sub))) << (msb - F5VPN_STATS_LATENCY_SUB_BITS);
+}
+
+/* There is only ever a single writer (the thread running the connection's
+ * main loop), so the sequence counter needs no atomic read-modify-write; the
+ * fences merely keep the compiler and CPU from reordering the data stores
+ * around the counter updates. */
+static inline void
+f5vpn_stats_write_begin (F5VpnStatsSegment *seg)
+{
+	__atomic_store_n (&seg->seq, seg->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence (__ATOMIC_RELEASE);
+}
+
+static inline void
+f5vpn_stats_write_end (F5VpnStatsSegment *seg)
+{
+	__atomic_store_n (&seg->seq, seg->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Copies a consistent view of seg into out, retrying while the writer is
+ * active. len is the number of bytes to copy, normally sizeof (*out) but
+ * smaller when reading a segment written by an older version. */
+static inline void
+f5vpn_stats_snapshot (const F5VpnStatsSegment *seg, F5VpnStatsSegment *out, size_t len)
+{
+	uint32_t seq;
+	do {
+		while ((seq = __atomic_load_n (&seg->seq, __ATOMIC_ACQUIRE)) & 1)
+			;
+		memcpy (out, seg, len);
+		__atomic_thread_fence (__ATOMIC_ACQUIRE);
+	} while (__atomic_load_n (&seg->seq, __ATOMIC_RELAXED) != seq);
+}
+
+#endif // F5VPN_STATS_H
@@ -21,6 +21,29 @@
 #define PPPD_PLUGIN_MESSAGE_H
 
 #include <arpa/inet.h>
+#include <stdint.h>
+
+/* Every message on the plugin pipe starts with this header, followed by
+ * length bytes of payload whose layout depends on type. Each message is
+ * written with a single write() smaller than PIPE_BUF, so it arrives whole.
+ * Readers should skip messages of unknown type or version. */
+#define PPPD_PLUGIN_MESSAGE_VERSION 1
+
+typedef enum
+{
+	PPPD_PLUGIN_MSG_IP_UP = 1,   /* PppdPluginNotification */
+	PPPD_PLUGIN_MSG_LINK_STATS,  /* PppdPluginLinkStats */
+	PPPD_PLUGIN_MSG_ECHO_RTT,    /* PppdPluginEchoRtt */
+	PPPD_PLUGIN_MSG_CONFIG,      /* PppdPluginConfig, sent to the plugin */
+	PPPD_PLUGIN_MSG_LINK_ESTABLISHED, /* PppdPluginNotification */
+} PppdPluginMessageType;
+
+typedef struct
+{
+	uint16_t version;
+	uint16_t type;
+	uint32_t length;
+} PppdPluginMessageHeader;
 
 typedef struct
 {
@@ -29,4 +52,40 @@ typedef struct
 	char ifname[16];
 } PppdPluginNotification;
 
+/* PPPD_PLUGIN_MSG_LINK_ESTABLISHED is sent as soon as the ppp interface
+ * exists, before LCP and IPCP have run. Its addresses are the ones pppd is
+ * going to ask for, zero where it leaves the choice to the peer. */
+
+/* Sent periodically while the link is up. Counters are those of the ppp
+ * interface since it was created. */
+typedef struct
+{
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	uint64_t packets_in;
+	uint64_t packets_out;
+	uint64_t errors_in;
+	uint64_t errors_out;
+	int32_t lcp_echo_rtt_us; /* most recent LCP echo round trip, or -1 */
+	uint32_t idle_in_s;      /* seconds since a data packet was received */
+	uint32_t idle_out_s;     /* seconds since a data packet was sent */
+} PppdPluginLinkStats;
+
+/* Sent for every LCP echo reply matching the last echo request */
+typedef struct
+{
+	int32_t rtt_us;
+} PppdPluginEchoRtt;
+
+/* Sent once, on the socket named by F5_VPN_PPPD_CONFIG_FD, to a pppd started
+ * ahead of the tunnel. The plugin waits for it in plugin_init, before pppd
+ * touches the pty, and applies it as the "local:remote", mtu and mru
+ * options would. Zero addresses are left to IPCP, a zero mtu to pppd. */
+typedef struct
+{
+	struct in_addr local_addr;
+	struct in_addr remote_addr;
+	uint32_t mtu;
+} PppdPluginConfig;
+
 #endif // PPPD_PLUGIN_MESSAGE_H
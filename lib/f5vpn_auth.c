@@ -18,20 +18,35 @@
  * USA.
  */
 #include "f5vpn_auth.h"
+#include "f5vpn_parse.h"
 #include "glib_curl.h"
-
-#include <libxml/HTMLparser.h>
-#include <libxml/xpath.h>
+#include "glib_request.h"
 
 G_DEFINE_QUARK (f5vpn - auth - error - quark, f5vpn_auth_error)
 #define F5VPN_AUTH_ERROR f5vpn_auth_error_quark ()
 
+static const char *const phase_desc[F5VPN_AUTH_PHASE_COUNT] = {
+	"retrieving the logon page",
+	"logging in",
+};
+
 #ifdef WITH_DEBUG
 #define debug(...) fprintf (stderr, __VA_ARGS__)
 #else
 #define debug(...)
 #endif
 
+/* The GETs of the flow which carry the session cookie are idempotent, so
+ * they are retried after transport failures and hedged against a slow
+ * gateway node. The first, cookie-less request to the portal is not: every
+ * copy of it makes the gateway allocate another session. Neither are the
+ * POSTs changing the session's state. Both are sent exactly once. */
+static const GlibCurlPolicy get_policy = {
+	.max_retries = 2,
+	.backoff_ms = 250,
+	.hedge_after_ms = 1000,
+};
+
 #define USER_AGENT "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/76.0.3809.100 Safari/537.36"
 
 typedef enum
@@ -65,6 +80,12 @@ struct _F5VpnAuthSession
 	gpointer done_userdata;
 
 	F5VpnAuthSessionState state;
+
+	/* Deadline of the current phase, F5VPN_AUTH_PHASE_COUNT if none */
+	F5VpnAuthPhase phase;
+	gint64 phase_start;
+	guint deadline_ms[F5VPN_AUTH_PHASE_COUNT];
+	GlibRequest req;
 };
 
 typedef struct
@@ -74,6 +95,55 @@ typedef struct
 	F5VpnAuthSession *auth_session;
 } TunnelDetailCtx;
 
+static gboolean
+on_phase_deadline (gpointer user)
+{
+	F5VpnAuthSession *session = (F5VpnAuthSession *) user;
+	GError *err = g_error_new (F5VPN_AUTH_ERROR, F5VPN_AUTH_ERROR_TIMED_OUT, "Timed out after %u ms %s",
+	                           session->deadline_ms[session->phase], phase_desc[session->phase]);
+
+	/* The callbacks of the aborted requests report the error */
+	glib_curl_abort (session->glc, err);
+	g_error_free (err);
+	return G_SOURCE_REMOVE;
+}
+
+/* (Re)arms the deadline of the current phase, counting from its start */
+static void
+arm_deadline (F5VpnAuthSession *session)
+{
+	if (session->phase == F5VPN_AUTH_PHASE_COUNT)
+		glib_request_disarm (&session->req);
+	else
+		glib_request_arm (&session->req, session->phase_start, session->deadline_ms[session->phase]);
+}
+
+static void
+begin_phase (F5VpnAuthSession *session, F5VpnAuthPhase phase)
+{
+	session->phase = phase;
+	session->phase_start = g_get_monotonic_time ();
+	arm_deadline (session);
+}
+
+/* Invokes the user callback from the main loop rather than from the curl
+ * callback, so that the user may free the session right away */
+static void
+schedule_report (F5VpnAuthSession *session, GSourceFunc report)
+{
+	session->phase = F5VPN_AUTH_PHASE_COUNT;
+	glib_request_report (&session->req, report);
+}
+
+/* A result which was already on its way when the session got cancelled is
+ * replaced by the cancellation */
+static void
+check_cancelled (F5VpnAuthSession *session)
+{
+	if (session->req.cancelled && !session->err)
+		session->err = g_error_new (F5VPN_AUTH_ERROR, F5VPN_AUTH_ERROR_CANCELLED, "Authentication cancelled");
+}
+
 static void
 tunnel_detail_ctx_destroy (TunnelDetailCtx *ctx)
 {
@@ -88,6 +158,7 @@ report_login_state (gpointer user)
 	F5VpnAuthSession *session = (F5VpnAuthSession *) user;
 
 	debug ("report_login_state\n");
+	check_cancelled (session);
 	(session->done_callback) (session, session->session_key, (const vpn_tunnel *const *) session->tunnels, session->done_userdata, session->err);
 	session->err = NULL;
 
@@ -106,7 +177,7 @@ handle_tunnel_detail_error (F5VpnAuthSession *session, GError *err)
 
 	if (session->tunnel_details_nr_pending == 0) {
 		/* no more pending requests, propagate the error */
-		g_timeout_add (0, report_login_state, session);
+		schedule_report (session, report_login_state);
 	}
 }
 
@@ -115,12 +186,10 @@ on_tunnel_detail_response (CURL *curl, void *user, GError *err)
 {
 	TunnelDetailCtx *ctx = (TunnelDetailCtx *) user;
 	F5VpnAuthSession *session = ctx->auth_session;
+	/* May be a hedged duplicate of the handle we sent */
+	ctx->curl = curl;
 	long response_code = 0;
-	xmlDoc *doc;
-	xmlXPathContext *xpathCtx;
-	xmlXPathObject *xpathObj;
-	gchar *res_id = NULL, *res_caption = NULL, *res_description = NULL;
-	gboolean res_autolaunch = FALSE;
+	vpn_tunnel *detail;
 
 	session->tunnel_details_nr_pending--;
 	/* since we may have multiple requests, wait for all of them before reporting any error */
@@ -143,55 +212,27 @@ on_tunnel_detail_response (CURL *curl, void *user, GError *err)
 		return;
 	}
 
-	doc = xmlParseMemory (ctx->http_response->str, ctx->http_response->len);
-	if (doc == NULL) {
+	detail = calloc (1, sizeof (vpn_tunnel));
+	if (!f5vpn_parse_resource_info (ctx->http_response->str, ctx->http_response->len, detail)) {
 		err = g_error_new (F5VPN_AUTH_ERROR, 0, "Could not parse server response XML: %s", ctx->http_response->str);
+		free (detail);
 		tunnel_detail_ctx_destroy (ctx);
 		handle_tunnel_detail_error (session, err);
 		return;
 	}
 
-	xpathCtx = xmlXPathNewContext (doc);
-	xpathObj = xmlXPathEvalExpression ((const xmlChar *) "string(/resources/item/id)", xpathCtx);
-	if (xpathObj && xpathObj->stringval)
-		res_id = strdup ((const char *) xpathObj->stringval);
-	xmlXPathFreeObject (xpathObj);
-
-	xpathObj = xmlXPathEvalExpression ((const xmlChar *) "string(/resources/item/caption)", xpathCtx);
-	if (xpathObj && xpathObj->stringval)
-		res_caption = strdup ((const char *) xpathObj->stringval);
-	xmlXPathFreeObject (xpathObj);
-
-	xpathObj = xmlXPathEvalExpression ((const xmlChar *) "string(/resources/item/description)", xpathCtx);
-	if (xpathObj && xpathObj->stringval)
-		res_description = strdup ((const char *) xpathObj->stringval);
-	xmlXPathFreeObject (xpathObj);
-
-	xpathObj = xmlXPathEvalExpression ((const xmlChar *) "string(/resources/item/autolaunch)", xpathCtx);
-	if (xpathObj && xpathObj->stringval)
-		res_autolaunch = *xpathObj->stringval == '1';
-	xmlXPathFreeObject (xpathObj);
-
-	xmlXPathFreeContext (xpathCtx);
-	xmlFreeDoc (doc);
-
-	if (!(res_id && res_caption && res_description)) {
+	if (!(detail->id && detail->label && detail->description)) {
 		err = g_error_new (F5VPN_AUTH_ERROR, 0, "Expected field missing in tunnel detail XML: %s", ctx->http_response->str);
-		free (res_id);
-		free (res_caption);
-		free (res_description);
+		free (detail->id);
+		free (detail->label);
+		free (detail->description);
+		free (detail);
 		tunnel_detail_ctx_destroy (ctx);
 		handle_tunnel_detail_error (session, err);
 		return;
 	}
 
 	tunnel_detail_ctx_destroy (ctx);
-
-	vpn_tunnel *detail = calloc (1, sizeof (vpn_tunnel));
-	detail->id = res_id;
-	detail->label = res_caption;
-	detail->description = res_description;
-	detail->autolaunch = res_autolaunch;
 	session->tunnels_tmp = g_slist_append (session->tunnels_tmp, detail);
 
 	/* henceforth simpler error handling, we won't be here simultaneously */
@@ -202,7 +243,7 @@ on_tunnel_detail_response (CURL *curl, void *user, GError *err)
 	int i = 0;
 	session->tunnels = calloc (g_slist_length (session->tunnels_tmp) + 1, sizeof (vpn_tunnel *));
 	for (GSList *p = session->tunnels_tmp; p; p = p->next)
-		session->tunnels[i] = p->data;
+		session->tunnels[i++] = p->data;
 	g_slist_free (session->tunnels_tmp);
 	session->tunnels_tmp = NULL;
 
@@ -225,7 +266,7 @@ on_tunnel_detail_response (CURL *curl, void *user, GError *err)
 
 	/* invoke user callback */
 	session->state = F5VPN_AUTH_SESSION_STATE_DONE;
-	g_timeout_add (0, report_login_state, session);
+	schedule_report (session, report_login_state);
 }
 
 static CURL *
@@ -247,16 +288,15 @@ on_resource_list_retrieved (CURL *curl, void *user, GError *err)
 {
 	F5VpnAuthSession *session = (F5VpnAuthSession *) user;
 	long response_code;
-	xmlDoc *doc;
-	xmlXPathContext *xpathCtx;
-	xmlXPathObject *xpathObj;
-	gchar *detail_uri = NULL;
+	gchar *detail_uri, **queries;
 
+	/* May be a hedged duplicate of the handle we sent */
+	session->curl = curl;
 	g_assert_true (session->state == F5VPN_AUTH_SESSION_STATE_PERFORMING_LOGIN);
 
 	if (err) {
 		session->err = err;
-		g_timeout_add (0, report_login_state, session);
+		schedule_report (session, report_login_state);
 		return;
 	}
 
@@ -265,90 +305,62 @@ on_resource_list_retrieved (CURL *curl, void *user, GError *err)
 		char *url;
 		curl_easy_getinfo (curl, CURLINFO_EFFECTIVE_URL, &url);
 		session->err = g_error_new (F5VPN_AUTH_ERROR, 0, "Unexpected HTTP response code %lu received from %s", response_code, url);
-		g_timeout_add (0, report_login_state, session);
+		schedule_report (session, report_login_state);
 		return;
 	}
 
 	debug ("%.*s\n", (int) session->http_response_body->len, session->http_response_body->str);
 
-	doc = xmlParseMemory (session->http_response_body->str, session->http_response_body->len);
-	if (doc == NULL) {
+	if (!f5vpn_parse_resource_list (session->http_response_body->str, session->http_response_body->len, &detail_uri, &queries)) {
 		session->err = g_error_new (F5VPN_AUTH_ERROR, 0, "Could not parse server response XML: %s", session->http_response_body->str);
-		g_timeout_add (0, report_login_state, session);
+		schedule_report (session, report_login_state);
 		return;
 	}
 
-	xpathCtx = xmlXPathNewContext (doc);
-
-	xpathObj = xmlXPathEvalExpression ((const xmlChar *) "string(/res[@type='resource_list']/opts/opt[@type='available_rq']/@uri)", xpathCtx);
-	if (xpathObj && xpathObj->stringval)
-		detail_uri = strdup ((const char *) xpathObj->stringval);
-	xmlXPathFreeObject (xpathObj);
-
 	if (!detail_uri) {
-		xmlXPathFreeContext (xpathCtx);
-		xmlFreeDoc (doc);
+		g_strfreev (queries);
 		session->err = g_error_new (F5VPN_AUTH_ERROR, 0, "Could not retrieve detail URI from server response XML: %s", session->http_response_body->str);
-		g_timeout_add (0, report_login_state, session);
-		return;
-	}
-
-	xpathObj = xmlXPathEvalExpression ((const xmlChar *) "/res[@type='resource_list']/lists/list[@type='network_access']/entry", xpathCtx);
-
-	if (!xpathObj || !xpathObj->nodesetval) {
-		free (detail_uri);
-		xmlXPathFreeObject (xpathObj);
-		xmlXPathFreeContext (xpathCtx);
-		xmlFreeDoc (doc);
-		session->err = g_error_new (F5VPN_AUTH_ERROR, 0, "Could not retrieve vpn entry from server response XML: %s", session->http_response_body->str);
-		g_timeout_add (0, report_login_state, session);
+		schedule_report (session, report_login_state);
 		return;
 	}
 
 	session->tunnel_details_nr_pending = 0;
-	for (int i = 0; i < xpathObj->nodesetval->nodeNr; ++i) {
-		xmlNode *node = xpathObj->nodesetval->nodeTab[i];
-		for (xmlAttr *a = node->properties; a; a = a->next) {
-			if (strcmp ((const char *) a->name, "param") == 0) {
-				TunnelDetailCtx *ctx = calloc (1, sizeof (TunnelDetailCtx));
+	for (gchar **q = queries; *q; ++q) {
+		TunnelDetailCtx *ctx = calloc (1, sizeof (TunnelDetailCtx));
 
-				ctx->auth_session = session;
-				ctx->http_response = g_string_new ("");
-				ctx->curl = f5vpn_curl_new ();
+		ctx->auth_session = session;
+		ctx->http_response = g_string_new ("");
+		ctx->curl = f5vpn_curl_new ();
 
-				curl_easy_setopt (ctx->curl, CURLOPT_WRITEDATA, ctx->http_response);
+		curl_easy_setopt (ctx->curl, CURLOPT_WRITEDATA, ctx->http_response);
+		/* Multiplex onto the portal connection if the gateway speaks HTTP/2,
+		 * rather than opening one connection per tunnel */
+		curl_easy_setopt (ctx->curl, CURLOPT_PIPEWAIT, 1L);
 #ifdef WITH_DEBUG
-				curl_easy_setopt (ctx->curl, CURLOPT_VERBOSE, 1L);
+		curl_easy_setopt (ctx->curl, CURLOPT_VERBOSE, 1L);
 #endif
 
-				char *uri = g_strdup_printf ("https://%s%s?%s=%s", session->host, detail_uri, a->children->content, node->children->content);
-				debug ("request tunnel info at [%s]\n", uri);
-				curl_easy_setopt (ctx->curl, CURLOPT_URL, uri);
-				free (uri);
+		char *uri = g_strdup_printf ("https://%s%s?%s", session->host, detail_uri, *q);
+		debug ("request tunnel info at [%s]\n", uri);
+		curl_easy_setopt (ctx->curl, CURLOPT_URL, uri);
+		free (uri);
 
-				/* Copy cookies to the new handle */
-				struct curl_slist *cookies;
-				curl_easy_getinfo (curl, CURLINFO_COOKIELIST, &cookies);
-				for (struct curl_slist *p = cookies; p; p = p->next)
-					curl_easy_setopt (ctx->curl, CURLOPT_COOKIELIST, p->data);
-				curl_slist_free_all (cookies);
+		/* Copy cookies to the new handle */
+		struct curl_slist *cookies;
+		curl_easy_getinfo (curl, CURLINFO_COOKIELIST, &cookies);
+		for (struct curl_slist *p = cookies; p; p = p->next)
+			curl_easy_setopt (ctx->curl, CURLOPT_COOKIELIST, p->data);
+		curl_slist_free_all (cookies);
 
-				session->tunnel_details_nr_pending++;
-				glib_curl_send (session->glc, ctx->curl, on_tunnel_detail_response, ctx);
-
-				break;
-			}
-		}
+		session->tunnel_details_nr_pending++;
+		glib_curl_send_with_policy (session->glc, ctx->curl, ctx->http_response, &get_policy, on_tunnel_detail_response, ctx);
 	}
-	xmlXPathFreeObject (xpathObj);
-
-	xmlXPathFreeContext (xpathCtx);
-	xmlFreeDoc (doc);
-	free (detail_uri);
+	g_strfreev (queries);
+	g_free (detail_uri);
 
 	if (session->tunnel_details_nr_pending == 0) {
 		session->err = g_error_new (F5VPN_AUTH_ERROR, 0, "No valid tunnel descriptions found in server XML: %s", session->http_response_body->str);
-		g_timeout_add (0, report_login_state, session);
+		schedule_report (session, report_login_state);
 	}
 }
 
@@ -364,7 +376,7 @@ on_epi_skip_response (CURL *curl, void *user, GError *err)
 
 	if (err) {
 		session->err = err;
-		g_timeout_add (0, report_login_state, session);
+		schedule_report (session, report_login_state);
 		return;
 	}
 
@@ -372,7 +384,7 @@ on_epi_skip_response (CURL *curl, void *user, GError *err)
 	if (response_code != 302) {
 		curl_easy_getinfo (curl, CURLINFO_EFFECTIVE_URL, &url);
 		session->err = g_error_new (F5VPN_AUTH_ERROR, 0, "Unexpected HTTP response code %lu received from %s", response_code, url);
-		g_timeout_add (0, report_login_state, session);
+		schedule_report (session, report_login_state);
 		return;
 	}
 
@@ -383,7 +395,7 @@ on_epi_skip_response (CURL *curl, void *user, GError *err)
 	curl_easy_setopt (session->curl, CURLOPT_URL, url);
 	g_free (url);
 
-	glib_curl_send (session->glc, session->curl, on_resource_list_retrieved, session);
+	glib_curl_send_with_policy (session->glc, session->curl, session->http_response_body, &get_policy, on_resource_list_retrieved, session);
 }
 
 static void
@@ -398,7 +410,7 @@ on_login_result (CURL *curl, void *user, GError *err)
 
 	if (err) {
 		session->err = err;
-		g_timeout_add (0, report_login_state, session);
+		schedule_report (session, report_login_state);
 		return;
 	}
 
@@ -407,7 +419,7 @@ on_login_result (CURL *curl, void *user, GError *err)
 	if (!(response_code == 302 || response_code == 200)) {
 		curl_easy_getinfo (curl, CURLINFO_EFFECTIVE_URL, &url);
 		session->err = g_error_new (F5VPN_AUTH_ERROR, 0, "Unexpected HTTP response code %lu received from %s", response_code, url);
-		g_timeout_add (0, report_login_state, session);
+		schedule_report (session, report_login_state);
 		return;
 	}
 
@@ -422,7 +434,7 @@ on_login_result (CURL *curl, void *user, GError *err)
 		} else {
 			session->err = g_error_new (F5VPN_AUTH_ERROR, 0, "Unexpected recurrence of logon page");
 		}
-		g_timeout_add (0, report_login_state, session);
+		schedule_report (session, report_login_state);
 		return;
 	}
 
@@ -479,92 +491,15 @@ f5vpn_auth_session_post_credentials (F5VpnAuthSession *session, F5VpnLoginDoneCa
 	free (postdata);
 
 	session->state = F5VPN_AUTH_SESSION_STATE_PERFORMING_LOGIN;
+	begin_phase (session, F5VPN_AUTH_PHASE_LOGIN);
 	glib_curl_send (session->glc, session->curl, on_login_result, session);
 }
 
-#define MAX_LOGIN_FIELDS 5
-typedef struct
-{
-	gboolean in_form;
-	gboolean in_label;
-	form_field *fields[MAX_LOGIN_FIELDS];
-	int field_idx;
-	int label_idx;
-	char *last_label;
-} html_parse_ctx;
-
-static void
-parse_login_page_cb_start_element (html_parse_ctx *ctx, const xmlChar *name, const xmlChar **atts)
-{
-	if (ctx->in_form) {
-		if (strcmp ((const char *) name, "label") == 0) {
-			g_assert_false (ctx->in_label);
-			ctx->in_label = TRUE;
-		} else if (strcmp ((const char *) name, "input") == 0) {
-			ctx->fields[ctx->field_idx] = calloc (sizeof (form_field), 1);
-			for (const xmlChar **p = atts; p && *p; p++) {
-				if (strcmp ((const char *) *p, "name") == 0 && p[1]) {
-					ctx->fields[ctx->field_idx]->name = strdup ((const char *) p[1]);
-					p++;
-				} else if (strcmp ((const char *) *p, "type") == 0 && p[1]) {
-					ctx->fields[ctx->field_idx]->type =
-					    (strcmp ((const char *) p[1], "text") == 0)
-					        ? FORM_FIELD_TEXT
-					    : (strcmp ((const char *) p[1], "password") == 0)
-					        ? FORM_FIELD_PASSWORD
-					    : (strcmp ((const char *) p[1], "hidden") == 0) ? FORM_FIELD_HIDDEN
-					                                                    : FORM_FIELD_OTHER;
-					p++;
-				} else if (strcmp ((const char *) *p, "value") == 0 && p[1]) {
-					ctx->fields[ctx->field_idx]->value = strdup ((const char *) p[1]);
-					p++;
-				}
-			}
-			if (ctx->last_label) {
-				ctx->fields[ctx->field_idx]->label = ctx->last_label;
-				ctx->last_label = NULL;
-			} else if (ctx->fields[ctx->field_idx]->name) {
-				ctx->fields[ctx->field_idx]->label =
-				    strdup (ctx->fields[ctx->field_idx]->name);
-			}
-		}
-	} else if (strcmp ((const char *) name, "form") == 0) {
-		for (const xmlChar **p = atts; p && *p; p++) {
-			if (strcmp ((const char *) p[0], "id") == 0 && p[1] && strcmp ((const char *) p[1], "auth_form") == 0) {
-				ctx->in_form = TRUE;
-				break;
-			}
-		}
-	}
-}
-
-static void
-parse_login_page_cb_characters (html_parse_ctx *ctx, const xmlChar *ch, int len)
-{
-	if (ctx->in_label)
-		ctx->last_label = strndup ((const char *) ch, len);
-}
-
-static void
-parse_login_page_cb_end_element (html_parse_ctx *ctx, const xmlChar *name)
-{
-	if (!ctx->in_form)
-		return;
-
-	if (strcmp ((const char *) name, "form") == 0) {
-		ctx->in_form = FALSE;
-	} else if (strcmp ((const char *) name, "label") == 0) {
-		g_assert_true (ctx->in_label);
-		ctx->in_label = FALSE;
-	} else if (strcmp ((const char *) name, "input") == 0) {
-		ctx->field_idx++;
-	}
-}
-
 static gboolean
 report_auth_state (gpointer user)
 {
 	F5VpnAuthSession *session = (F5VpnAuthSession *) user;
+	check_cancelled (session);
 	(session->credentials_callback) (session, session->login_fields, session->credentials_userdata, session->err);
 	session->err = NULL;
 	return G_SOURCE_REMOVE;
@@ -577,11 +512,13 @@ on_auth_portal_reached (CURL *curl, void *user, GError *err)
 	long response_code;
 
 	session = (F5VpnAuthSession *) user;
+	/* May be a hedged duplicate of the handle we sent */
+	session->curl = curl;
 	g_assert_true (session->state == F5VPN_AUTH_SESSION_STATE_RETRIEVE_GATEWAY);
 
 	if (err) {
 		session->err = err;
-		g_timeout_add (0, report_auth_state, session);
+		schedule_report (session, report_auth_state);
 		return;
 	}
 
@@ -591,29 +528,14 @@ on_auth_portal_reached (CURL *curl, void *user, GError *err)
 		session->state = F5VPN_AUTH_SESSION_STATE_DONE;
 		curl_easy_getinfo (curl, CURLINFO_EFFECTIVE_URL, &url);
 		session->err = g_error_new (F5VPN_AUTH_ERROR, 0, "Unexpected HTTP response code %lu received from %s", response_code, url);
-		g_timeout_add (0, report_auth_state, session);
+		schedule_report (session, report_auth_state);
 		return;
 	}
 
-	html_parse_ctx ctx = {
-		.in_form = FALSE,
-		.field_idx = 0,
-		.label_idx = 0,
-		.last_label = NULL,
-	};
-	static xmlSAXHandler sax_parse_handlers = {
-		.startElement = (startElementSAXFunc) parse_login_page_cb_start_element,
-		.characters = (charactersSAXFunc) parse_login_page_cb_characters,
-		.endElement = (endElementSAXFunc) parse_login_page_cb_end_element,
-	};
-	htmlSAXParseDoc ((const xmlChar *) session->http_response_body->str, "utf-8", &sax_parse_handlers, &ctx);
-
-	session->login_fields = calloc (sizeof (form_field *), ctx.field_idx + 1);
-	for (int i = 0; i < ctx.field_idx; ++i)
-		session->login_fields[i] = ctx.fields[i];
+	session->login_fields = f5vpn_parse_login_page (session->http_response_body->str);
 
 	session->state = F5VPN_AUTH_SESSION_STATE_WAITING_FOR_CREDENTIALS;
-	g_timeout_add (0, report_auth_state, session);
+	schedule_report (session, report_auth_state);
 }
 
 void
@@ -633,7 +555,8 @@ f5vpn_auth_session_begin (F5VpnAuthSession *session, F5VpnRequestCredentialsCall
 	g_free (url);
 
 	session->state = F5VPN_AUTH_SESSION_STATE_RETRIEVE_GATEWAY;
-	glib_curl_send (session->glc, session->curl, on_auth_portal_reached, session);
+	begin_phase (session, F5VPN_AUTH_PHASE_PORTAL);
+	glib_curl_send_with_policy (session->glc, session->curl, session->http_response_body, NULL, on_auth_portal_reached, session);
 }
 
 F5VpnAuthSession *
@@ -651,6 +574,10 @@ f5vpn_auth_session_new (GMainContext *glib_context, const char *host)
 	session->tunnels_tmp = NULL;
 	session->tunnel_details_nr_pending = 0;
 	session->session_key = NULL;
+	session->phase = F5VPN_AUTH_PHASE_COUNT;
+	session->deadline_ms[F5VPN_AUTH_PHASE_PORTAL] = F5VPN_AUTH_DEFAULT_PORTAL_DEADLINE_MS;
+	session->deadline_ms[F5VPN_AUTH_PHASE_LOGIN] = F5VPN_AUTH_DEFAULT_LOGIN_DEADLINE_MS;
+	glib_request_init (&session->req, glib_context, on_phase_deadline, session);
 
 	session->curl = f5vpn_curl_new ();
 	curl_easy_setopt (session->curl, CURLOPT_WRITEDATA, session->http_response_body);
@@ -658,22 +585,49 @@ f5vpn_auth_session_new (GMainContext *glib_context, const char *host)
 	return session;
 }
 
+void
+f5vpn_auth_session_set_deadline (F5VpnAuthSession *session, F5VpnAuthPhase phase, guint timeout_ms)
+{
+	session->deadline_ms[phase] = timeout_ms;
+	if (session->phase == phase)
+		arm_deadline (session);
+}
+
+void
+f5vpn_auth_session_get_http_counters (F5VpnAuthSession *session, F5VpnHttpCounters *counters)
+{
+	*counters = *glib_curl_get_counters (session->glc);
+}
+
+void
+f5vpn_auth_session_cancel (F5VpnAuthSession *session)
+{
+	GError *err = g_error_new (F5VPN_AUTH_ERROR, F5VPN_AUTH_ERROR_CANCELLED, "Authentication cancelled");
+
+	session->phase = F5VPN_AUTH_PHASE_COUNT;
+	glib_request_cancel (&session->req);
+	/* Nobody is waiting for a callback in between the two steps */
+	if (session->state == F5VPN_AUTH_SESSION_STATE_WAITING_FOR_CREDENTIALS)
+		session->state = F5VPN_AUTH_SESSION_STATE_DONE;
+	glib_curl_abort (session->glc, err);
+	g_error_free (err);
+}
+
 void
 f5vpn_auth_session_free (F5VpnAuthSession *session)
 {
+	/* Requests still in flight would otherwise call back into freed memory */
+	f5vpn_auth_session_cancel (session);
+	glib_request_clear (&session->req);
+	if (session->err)
+		g_error_free (session->err);
+
 	free (session->host);
 	curl_easy_cleanup (session->curl);
 	glib_curl_free (session->glc);
 	g_string_free (session->http_response_body, TRUE);
-	if (session->login_fields) {
-		for (form_field **p = session->login_fields; *p; ++p) {
-			free ((*p)->label);
-			free ((*p)->name);
-			free ((*p)->value);
-			free (*p);
-		}
-		free (session->login_fields);
-	}
+	if (session->login_fields)
+		f5vpn_parse_free_login_fields (session->login_fields);
 	g_slist_free_full (session->tunnels_tmp, free);
 	if (session->tunnels) {
 		for (vpn_tunnel **t = session->tunnels; *t; ++t) {
@@ -0,0 +1,50 @@
+/*
+ * NetworkManager-f5vpn
+ * Plugin for NetworkManager to access F5 Firepass SSL VPNs
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+#include "f5vpn_backoff.h"
+
+void
+f5vpn_backoff_init (F5VpnBackoff *backoff, guint base_ms, guint max_ms)
+{
+	backoff->base_ms = base_ms;
+	backoff->max_ms = max_ms;
+	backoff->attempt = 0;
+}
+
+guint
+f5vpn_backoff_next (F5VpnBackoff *backoff, guint hint_ms)
+{
+	guint64 ceiling = backoff->base_ms;
+
+	/* Stop doubling once the ceiling is reached, which also avoids overflow */
+	for (guint i = 0; i < backoff->attempt && ceiling < backoff->max_ms; ++i)
+		ceiling *= 2;
+	if (ceiling > backoff->max_ms)
+		ceiling = backoff->max_ms;
+	backoff->attempt++;
+
+	guint64 delay = (guint64) hint_ms + g_random_int_range (0, (gint32) MIN (ceiling, G_MAXINT32 - 1) + 1);
+	return (guint) MIN (delay, G_MAXUINT);
+}
+
+void
+f5vpn_backoff_reset (F5VpnBackoff *backoff)
+{
+	backoff->attempt = 0;
+}
@@ -18,16 +18,26 @@
  * USA.
  */
 #include "f5vpn_connect.h"
+#include "f5vpn_parse.h"
+#include "f5vpn_spawn.h"
+#include "f5vpn_stats.h"
+#include "glib_context.h"
 #include "glib_curl.h"
+#include "glib_request.h"
 #include "pppd-plugin-message.h"
 #include <arpa/inet.h>
 #include <curl/curl.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <glib-unix.h>
-#include <libxml/xpath.h>
-#include <pty.h>
+#include <dirent.h>
+#include <netinet/tcp.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <time.h>
 #include <unistd.h>
 
 G_DEFINE_QUARK (f5vpn - connect - error - quark, f5vpn_connect_error)
@@ -43,27 +53,359 @@ G_DEFINE_QUARK (f5vpn - connect - error - quark, f5vpn_connect_error)
 #define STR(x)           _STR (x)
 #define PPPD_PLUGIN_PATH STR (PPPD_PLUGIN)
 
+/* pppd's exit status when the peer stopped answering LCP echo requests */
+#define PPPD_EXIT_PEER_DEAD 15
+
+/* Descriptor numbers of the plugin, configuration and log pipes in pppd */
+#define PPPD_PLUGIN_CHILD_FD 3
+#define PPPD_CONFIG_CHILD_FD 4
+#define PPPD_LOG_CHILD_FD    5
+
+/* Context for one direction of the data path, or for the pppd log */
+typedef struct
+{
+	F5VpnConnection *vpn;
+	int out_fd;
+	int dir; /* F5VpnStatsDirection, or -1 if not accounted */
+	/* The source reading the input, or waiting for out_fd to drain; 0 once
+	 * forwarding has stopped */
+	guint source_id;
+	/* While waiting for out_fd, the input and when it became readable */
+	int wait_from_fd;
+	gint64 wait_start_ns;
+} ForwardCtx;
+
+/* An iptables run adding or removing the MSS clamping rule. It runs
+ * asynchronously, as waiting for the xtables lock would stall the main loop;
+ * a removal requested while the rule is still being added is started once
+ * that has finished, so that the two cannot overtake each other. */
+typedef struct
+{
+	GMainContext *main_context;
+	/* The connection waiting for the rule to be added, NULL once it let go */
+	F5VpnConnection *vpn;
+	gchar *ifname;
+	gboolean enable;
+	gboolean undo;
+} MssClamp;
+
 struct _F5VpnConnection
 {
-	GlibCurl *glc;
+	GMainContext *main_context;
+	/* Only set if the connection fetched its parameters itself */
+	F5VpnConnectParams *params;
 	F5VpnConnectCallback callback;
 	void *userdata;
 	GError *err;
-	GString *resp;
 	gchar *session_key;
+	/* The ends of openssl's stdout and stdin, or -1 */
+	int ssl_read_fd;
 	int ssl_write_fd;
+	/* Waits for the response to the /myvpn request, 0 once it arrived */
+	guint ssl_established_id;
+	/* The part of the response read so far, which may arrive in pieces */
+	char header[128];
+	int header_len;
 	int ppd_fd;
 	GSList *parsed_lans;
 	GSList *parsed_nameservers;
+	GSList *parsed_search_domains;
+	GSList *parsed_split_domains;
 	pid_t ppd_pid;
 	pid_t openssl_pid;
+	/* pppd is started while the tunnel is being opened and waits in its
+	 * plugin for the settings, which are sent on this socket; -1 once sent */
+	int ppd_config_fd;
+	/* pppd's plugin messages and, in debug builds, its log; -1 once closed */
+	int plugin_fd;
+	guint plugin_id;
+	int log_fd;
+	guint prelaunch_id;
+	/* The connect.php3 request has not reported back yet */
+	gboolean params_pending;
+	/* Being torn down on purpose, so that children exiting is expected */
+	gboolean stopping;
+	/* Duplicate of openssl's socket to the gateway, or -1 */
+	int tunnel_fd;
+	F5VpnSocketProfile socket_profile;
+	ForwardCtx fwd[F5VPN_STATS_DIR_COUNT];
+	ForwardCtx fwd_log;
+	guint keepalive_interval;
+	guint keepalive_failures;
+	gint mtu;
+	gboolean clamp_mss;
+	gchar *clamped_ifname;
+	/* The iptables run adding the rule, while it has not finished */
+	MssClamp *clamp_pending;
+	/* See f5vpn_connection_set_early_settings */
+	gboolean early_settings;
+	/* Settings last passed to the callback; device is empty until then */
+	NetworkSettings reported;
+	gchar *tunnel_host;
+	gchar *tunnel_port;
+	/* Points at stats_local until published to a file */
+	F5VpnStatsSegment *stats;
+	F5VpnStatsSegment stats_local;
+	gint64 phase_start;
+	/* Phase being established, F5VPN_STATS_PHASE_COUNT once up or down */
+	F5VpnStatsPhase phase;
+	guint deadline_ms[F5VPN_STATS_PHASE_COUNT];
+	guint deadline_id;
+};
+
+static const char *const phase_desc[F5VPN_STATS_PHASE_COUNT] = {
+	"fetching the connection parameters",
+	"opening the tunnel",
+	"waiting for the PPP link",
 };
 
+static void
+stats_set_state (F5VpnConnection *vpn, F5VpnStatsState state)
+{
+	f5vpn_stats_write_begin (vpn->stats);
+	vpn->stats->state = state;
+	f5vpn_stats_write_end (vpn->stats);
+}
+
+/* Records the time since the previous phase ended */
+static void
+stats_end_phase (F5VpnConnection *vpn, F5VpnStatsPhase phase)
+{
+	gint64 now = g_get_monotonic_time ();
+	f5vpn_stats_write_begin (vpn->stats);
+	vpn->stats->phase_us[phase] = now - vpn->phase_start;
+	f5vpn_stats_write_end (vpn->stats);
+	vpn->phase_start = now;
+}
+
+static void
+disarm_deadline (F5VpnConnection *vpn)
+{
+	if (vpn->deadline_id)
+		context_source_remove (vpn->main_context, vpn->deadline_id);
+	vpn->deadline_id = 0;
+}
+
+static void
+kill_children (F5VpnConnection *vpn)
+{
+	if (vpn->ppd_pid)
+		kill (vpn->ppd_pid, SIGTERM);
+	if (vpn->openssl_pid)
+		kill (vpn->openssl_pid, SIGTERM);
+}
+
+static gboolean callback_to_user (gpointer user);
+
+/* Stops everything still running on behalf of the connection. Each of the
+ * children and the connect.php3 request references it, so the last of them
+ * to go reports vpn->err. */
+static void
+stop_connection (F5VpnConnection *vpn)
+{
+	vpn->stopping = TRUE;
+	if (vpn->prelaunch_id) {
+		context_source_remove (vpn->main_context, vpn->prelaunch_id);
+		vpn->prelaunch_id = 0;
+	}
+	if (vpn->params_pending)
+		f5vpn_connect_params_cancel (vpn->params);
+	kill_children (vpn);
+}
+
+/* Like stop_connection, for failures which may leave nothing running whose
+ * end would report the error */
+static void
+fail_connection (F5VpnConnection *vpn)
+{
+	stop_connection (vpn);
+	if (!vpn->params_pending && !vpn->ppd_pid && !vpn->openssl_pid)
+		context_timeout_add (vpn->main_context, 0, callback_to_user, vpn);
+}
+
+static gboolean
+on_phase_deadline (gpointer user)
+{
+	F5VpnConnection *vpn = (F5VpnConnection *) user;
+	vpn->deadline_id = 0;
+	if (!vpn->err)
+		vpn->err = g_error_new (F5VPN_CONNECT_ERROR, F5VPN_CONNECT_ERROR_TIMED_OUT, "Timed out after %u ms %s",
+		                        vpn->deadline_ms[vpn->phase], phase_desc[vpn->phase]);
+	/* The exit handlers report the error */
+	stop_connection (vpn);
+	return G_SOURCE_REMOVE;
+}
+
+/* (Re)arms the deadline of the current phase, counting from its start. The
+ * connect.php3 request enforces its own deadline. */
+static void
+arm_deadline (F5VpnConnection *vpn)
+{
+	disarm_deadline (vpn);
+	if (vpn->phase == F5VPN_STATS_PHASE_COUNT || vpn->phase == F5VPN_STATS_PHASE_CONNECT_PARAMS || vpn->deadline_ms[vpn->phase] == 0)
+		return;
+
+	gint64 left = vpn->deadline_ms[vpn->phase] - (g_get_monotonic_time () - vpn->phase_start) / 1000;
+	vpn->deadline_id = context_timeout_add (vpn->main_context, MAX (left, 0), on_phase_deadline, vpn);
+}
+
+/* Finishes a phase and starts the deadline of the next one */
+static void
+end_phase (F5VpnConnection *vpn, F5VpnStatsPhase phase)
+{
+	stats_end_phase (vpn, phase);
+	vpn->phase = phase + 1;
+	arm_deadline (vpn);
+}
+
+/* Nanosecond timestamps for the data path; g_get_monotonic_time is too coarse */
+static inline gint64
+now_ns (void)
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (gint64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Accounts for a chunk which became readable at start_ns and has just been written out */
+static inline void
+stats_account (ForwardCtx *fwd, long nbytes, gint64 start_ns)
+{
+	if (fwd->dir < 0)
+		return;
+	F5VpnStatsSegment *stats = fwd->vpn->stats;
+	unsigned int bucket = f5vpn_stats_latency_bucket (now_ns () - start_ns);
+	f5vpn_stats_write_begin (stats);
+	stats->dir[fwd->dir].bytes += nbytes;
+	stats->dir[fwd->dir].chunks++;
+	stats->latency[fwd->dir][bucket]++;
+	f5vpn_stats_write_end (stats);
+}
+
+static inline void
+stats_stall (ForwardCtx *fwd)
+{
+	if (fwd->dir < 0)
+		return;
+	F5VpnStatsSegment *stats = fwd->vpn->stats;
+	f5vpn_stats_write_begin (stats);
+	stats->dir[fwd->dir].stalls++;
+	f5vpn_stats_write_end (stats);
+}
+
+static MssClamp *set_mss_clamp (GMainContext *context, const char *ifname, gboolean enable);
+
+static void
+on_mss_clamp_exited (GPid pid, gint status, gpointer user)
+{
+	(void) pid;
+
+	MssClamp *clamp = (MssClamp *) user;
+
+	if (!WIFEXITED (status) || WEXITSTATUS (status) != 0)
+		fprintf (stderr, "iptables failed to %s MSS clamping on %s\n", clamp->enable ? "enable" : "disable", clamp->ifname);
+	if (clamp->vpn)
+		clamp->vpn->clamp_pending = NULL;
+	if (clamp->undo)
+		set_mss_clamp (clamp->main_context, clamp->ifname, FALSE);
+
+	g_main_context_unref (clamp->main_context);
+	g_free (clamp->ifname);
+	free (clamp);
+}
+
+/* Adds or removes a rule clamping the MSS of forwarded TCP connections
+ * into the tunnel to what fits its MTU. Returns the pending run, or NULL if
+ * iptables could not be started. */
+static MssClamp *
+set_mss_clamp (GMainContext *context, const char *ifname, gboolean enable)
+{
+	const char *argv[] = { "/usr/sbin/iptables", "-w", "-t", "mangle", enable ? "-A" : "-D", "FORWARD",
+		                   "-o", ifname, "-p", "tcp", "--tcp-flags", "SYN,RST", "SYN",
+		                   "-j", "TCPMSS", "--clamp-mss-to-pmtu", NULL };
+
+	pid_t pid = f5vpn_spawn (argv, NULL, NULL, 0, FALSE);
+	if (pid == -1) {
+		fprintf (stderr, "could not run iptables: %s\n", g_strerror (errno));
+		return NULL;
+	}
+
+	MssClamp *clamp = malloc (sizeof (MssClamp));
+	clamp->main_context = g_main_context_ref (context ? context : g_main_context_default ());
+	clamp->vpn = NULL;
+	clamp->ifname = g_strdup (ifname);
+	clamp->enable = enable;
+	clamp->undo = FALSE;
+	f5vpn_spawn_watch_add (context, pid, on_mss_clamp_exited, clamp);
+	return clamp;
+}
+
+/* Removes the connection's clamping rule, if it added one */
+static void
+clear_mss_clamp (F5VpnConnection *vpn)
+{
+	if (!vpn->clamped_ifname)
+		return;
+
+	if (vpn->clamp_pending) {
+		vpn->clamp_pending->vpn = NULL;
+		vpn->clamp_pending->undo = TRUE;
+		vpn->clamp_pending = NULL;
+	} else {
+		set_mss_clamp (vpn->main_context, vpn->clamped_ifname, FALSE);
+	}
+	g_free (vpn->clamped_ifname);
+	vpn->clamped_ifname = NULL;
+}
+
+/* Removes the sources forwarding data for the connection, which point into
+ * it, whether they are reading or waiting for their output to drain */
+static void
+stop_forwarding (F5VpnConnection *vpn)
+{
+	ForwardCtx *all[] = { &vpn->fwd[F5VPN_STATS_DIR_TX], &vpn->fwd[F5VPN_STATS_DIR_RX], &vpn->fwd_log };
+
+	for (guint i = 0; i < G_N_ELEMENTS (all); ++i) {
+		if (all[i]->source_id)
+			context_source_remove (vpn->main_context, all[i]->source_id);
+		all[i]->source_id = 0;
+	}
+}
+
+/* Removes the remaining sources watching the children and closes every
+ * descriptor leading to them, so that none outlives the connection */
+static void
+close_child_fds (F5VpnConnection *vpn)
+{
+	int *fds[] = { &vpn->ppd_fd, &vpn->ppd_config_fd, &vpn->plugin_fd, &vpn->log_fd, &vpn->ssl_read_fd, &vpn->ssl_write_fd, &vpn->tunnel_fd };
+
+	if (vpn->ssl_established_id)
+		context_source_remove (vpn->main_context, vpn->ssl_established_id);
+	vpn->ssl_established_id = 0;
+	if (vpn->plugin_id)
+		context_source_remove (vpn->main_context, vpn->plugin_id);
+	vpn->plugin_id = 0;
+
+	for (guint i = 0; i < G_N_ELEMENTS (fds); ++i) {
+		if (*fds[i] != -1)
+			close (*fds[i]);
+		*fds[i] = -1;
+	}
+}
+
 void
 tunnel_exited (F5VpnConnection *vpn)
 {
-	/* TODO: if due to an error condition, report via GError */
-	(*vpn->callback) (vpn, NULL, vpn->userdata, NULL);
+	vpn->phase = F5VPN_STATS_PHASE_COUNT;
+	disarm_deadline (vpn);
+	stop_forwarding (vpn);
+	close_child_fds (vpn);
+	stats_set_state (vpn, F5VPN_STATS_STATE_DOWN);
+	clear_mss_clamp (vpn);
+	/* TODO: report other error conditions via GError too */
+	GError *err = vpn->err;
+	vpn->err = NULL;
+	(*vpn->callback) (vpn, NULL, vpn->userdata, err);
 }
 
 void
@@ -72,32 +414,143 @@ tunnel_up (F5VpnConnection *vpn, const NetworkSettings *settings)
 	(*vpn->callback) (vpn, settings, vpn->userdata, NULL);
 }
 
-static gboolean
-handle_plugin_msg (gint fd, GIOCondition condition, gpointer user)
+static void
+report_settings (F5VpnConnection *vpn, const PppdPluginNotification *msg)
 {
-	(void) condition;
+	NetworkSettings *settings = &vpn->reported;
+	settings->local_ip = msg->local_addr.s_addr;
+	settings->remote_ip = msg->remote_addr.s_addr;
+	settings->lans = vpn->parsed_lans;
+	settings->nameservers = vpn->parsed_nameservers;
+	settings->search_domains = vpn->parsed_search_domains;
+	settings->split_domains = vpn->parsed_split_domains;
+	strcpy (settings->device, msg->ifname);
+
+	tunnel_up (vpn, settings);
+}
+
+/* The interface exists, but LCP and IPCP have yet to run. The addresses pppd
+ * asks for are those from the /myvpn response, which IPCP normally confirms,
+ * so with early settings enabled they are reported right away and the user
+ * can configure routes and DNS in parallel with the negotiation */
+static void
+handle_link_established (F5VpnConnection *vpn, PppdPluginNotification *msg)
+{
+	msg->ifname[sizeof (msg->ifname) - 1] = '\0';
 
-	PppdPluginNotification msg;
-	long n = read (fd, &msg, sizeof (PppdPluginNotification));
-	g_assert_true (n == sizeof (PppdPluginNotification));
-	msg.ifname[sizeof (msg.ifname) - 1] = '\0';
+	debug ("plugin notified: link established on %s\n", msg->ifname);
+
+	if (!vpn->early_settings || vpn->reported.device[0] || !msg->local_addr.s_addr || !msg->remote_addr.s_addr)
+		return;
+	report_settings (vpn, msg);
+}
+
+static void
+handle_ip_up (F5VpnConnection *vpn, PppdPluginNotification *msg)
+{
+	msg->ifname[sizeof (msg->ifname) - 1] = '\0';
 
 	char local_addr[INET_ADDRSTRLEN], remote_addr[INET_ADDRSTRLEN];
-	inet_ntop (AF_INET, &msg.local_addr, local_addr, INET_ADDRSTRLEN);
-	inet_ntop (AF_INET, &msg.remote_addr, remote_addr, INET_ADDRSTRLEN);
+	inet_ntop (AF_INET, &msg->local_addr, local_addr, INET_ADDRSTRLEN);
+	inet_ntop (AF_INET, &msg->remote_addr, remote_addr, INET_ADDRSTRLEN);
+
+	debug ("plugin notified: local %s remote %s ifname %s\n", local_addr, remote_addr, msg->ifname);
+
+	end_phase (vpn, F5VPN_STATS_PHASE_PPP_UP);
+	stats_set_state (vpn, F5VPN_STATS_STATE_UP);
+
+	if (vpn->clamp_mss && !vpn->clamped_ifname) {
+		vpn->clamp_pending = set_mss_clamp (vpn->main_context, msg->ifname, TRUE);
+		if (vpn->clamp_pending)
+			vpn->clamp_pending->vpn = vpn;
+		vpn->clamped_ifname = g_strdup (msg->ifname);
+	}
 
-	debug ("plugin notified: local %s remote %s ifname %s\n", local_addr, remote_addr, msg.ifname);
+	/* Only report again if IPCP settled on something other than the early
+	 * settings */
+	if (vpn->reported.device[0] && vpn->reported.local_ip == msg->local_addr.s_addr
+	    && vpn->reported.remote_ip == msg->remote_addr.s_addr && !strcmp (vpn->reported.device, msg->ifname)) {
+		debug ("IPCP confirmed the early settings\n");
+		return;
+	}
+	report_settings (vpn, msg);
+}
+
+static void
+handle_link_stats (F5VpnConnection *vpn, const PppdPluginLinkStats *msg)
+{
+	debug ("link stats: in %" G_GUINT64_FORMAT "/%" G_GUINT64_FORMAT " out %" G_GUINT64_FORMAT "/%" G_GUINT64_FORMAT " rtt %dus\n",
+	       msg->bytes_in, msg->packets_in, msg->bytes_out, msg->packets_out, msg->lcp_echo_rtt_us);
+
+	f5vpn_stats_write_begin (vpn->stats);
+	vpn->stats->link.bytes_in = msg->bytes_in;
+	vpn->stats->link.bytes_out = msg->bytes_out;
+	vpn->stats->link.packets_in = msg->packets_in;
+	vpn->stats->link.packets_out = msg->packets_out;
+	vpn->stats->link.errors_in = msg->errors_in;
+	vpn->stats->link.errors_out = msg->errors_out;
+	vpn->stats->link.lcp_echo_rtt_us = msg->lcp_echo_rtt_us;
+	vpn->stats->link.idle_in_s = msg->idle_in_s;
+	vpn->stats->link.idle_out_s = msg->idle_out_s;
+	f5vpn_stats_write_end (vpn->stats);
+}
+
+/* Updates the smoothed RTT estimate following RFC 6298 */
+static void
+handle_echo_rtt (F5VpnConnection *vpn, const PppdPluginEchoRtt *msg)
+{
+	gint64 rtt = msg->rtt_us;
+
+	f5vpn_stats_write_begin (vpn->stats);
+	if (vpn->stats->srtt_us < 0) {
+		vpn->stats->srtt_us = rtt;
+		vpn->stats->rttvar_us = rtt / 2;
+	} else {
+		vpn->stats->rttvar_us = (3 * vpn->stats->rttvar_us + ABS (vpn->stats->srtt_us - rtt)) / 4;
+		vpn->stats->srtt_us = (7 * vpn->stats->srtt_us + rtt) / 8;
+	}
+	f5vpn_stats_write_end (vpn->stats);
+}
+
+static gboolean
+handle_plugin_msg (gint fd, GIOCondition condition, gpointer user)
+{
+	(void) condition;
 
 	F5VpnConnection *vpn = (F5VpnConnection *) user;
+	PppdPluginMessageHeader hdr;
+	union
+	{
+		PppdPluginNotification notification;
+		PppdPluginLinkStats link_stats;
+		PppdPluginEchoRtt echo_rtt;
+		char raw[256];
+	} payload;
+
+	/* Messages are written atomically, so a short read means pppd has gone */
+	long n = read (fd, &hdr, sizeof (hdr));
+	if (n != sizeof (hdr) || hdr.length > sizeof (payload) || read (fd, &payload, hdr.length) != hdr.length) {
+		close (fd);
+		vpn->plugin_fd = -1;
+		vpn->plugin_id = 0;
+		return G_SOURCE_REMOVE;
+	}
 
-	NetworkSettings settings;
-	settings.local_ip = msg.local_addr.s_addr;
-	settings.remote_ip = msg.remote_addr.s_addr;
-	settings.lans = vpn->parsed_lans;
-	settings.nameservers = vpn->parsed_nameservers;
-	strcpy (settings.device, msg.ifname);
+	if (hdr.version != PPPD_PLUGIN_MESSAGE_VERSION) {
+		debug ("ignoring plugin message with version %d\n", hdr.version);
+		return G_SOURCE_CONTINUE;
+	}
 
-	tunnel_up (vpn, &settings);
+	if (hdr.type == PPPD_PLUGIN_MSG_IP_UP && hdr.length == sizeof (PppdPluginNotification))
+		handle_ip_up (vpn, &payload.notification);
+	else if (hdr.type == PPPD_PLUGIN_MSG_LINK_ESTABLISHED && hdr.length == sizeof (PppdPluginNotification))
+		handle_link_established (vpn, &payload.notification);
+	else if (hdr.type == PPPD_PLUGIN_MSG_LINK_STATS && hdr.length == sizeof (PppdPluginLinkStats))
+		handle_link_stats (vpn, &payload.link_stats);
+	else if (hdr.type == PPPD_PLUGIN_MSG_ECHO_RTT && hdr.length == sizeof (PppdPluginEchoRtt))
+		handle_echo_rtt (vpn, &payload.echo_rtt);
+	else
+		debug ("ignoring plugin message of type %d length %u\n", hdr.type, hdr.length);
 
 	return G_SOURCE_CONTINUE;
 }
@@ -105,33 +558,42 @@ handle_plugin_msg (gint fd, GIOCondition condition, gpointer user)
 static gboolean
 fallback_read_write_fds (gint fd, GIOCondition condition, gpointer user)
 {
-	if (condition & G_IO_HUP)
-		return debug ("hup on %d\n", fd), G_SOURCE_REMOVE;
+	ForwardCtx *fwd = (ForwardCtx *) user;
+	if (condition & G_IO_HUP) {
+		debug ("hup on %d\n", fd);
+		fwd->source_id = 0;
+		return G_SOURCE_REMOVE;
+	}
 
-	int out_fd = (intptr_t) user;
+	gint64 start_ns = now_ns ();
 	char buf[4096];
 
 	long buflen = read (fd, buf, 4096);
 	if (buflen < 0) {
 		debug ("fallback_read_write_fds read failed: %s\n", strerror (errno));
+		fwd->source_id = 0;
 		return G_SOURCE_REMOVE;
 	}
+	long total = buflen;
 
 	long nwrote = 0;
 	char *bufp = buf;
 	while (nwrote < buflen) {
-		nwrote = write (out_fd, bufp, buflen);
+		nwrote = write (fwd->out_fd, bufp, buflen);
 		if (nwrote < 0) {
 			if (errno == EAGAIN) {
+				stats_stall (fwd);
 				sched_yield ();
 				continue;
 			}
-			fprintf (stderr, "fallback_read_write_fds: write() on %d returned %ld: %s\n", out_fd, nwrote, strerror (errno));
+			fprintf (stderr, "fallback_read_write_fds: write() on %d returned %ld: %s\n", fwd->out_fd, nwrote, strerror (errno));
+			fwd->source_id = 0;
 			return G_SOURCE_REMOVE;
 		}
 		buflen -= nwrote;
 		bufp += nwrote;
 	}
+	stats_account (fwd, total, start_ns);
 
 	return G_SOURCE_CONTINUE;
 }
@@ -139,19 +601,22 @@ fallback_read_write_fds (gint fd, GIOCondition condition, gpointer user)
 static gboolean
 splice_fds (gint fd, GIOCondition condition, gpointer user);
 
+/* Called once the output side of a pending splice has drained */
 static gboolean
 splice_write_ready (gint fd, GIOCondition condition, gpointer user)
 {
 	(void) condition;
 
-	int from_fd = (intptr_t) user;
-	long n = splice (from_fd, NULL, fd, NULL, 4096, SPLICE_F_NONBLOCK | SPLICE_F_MOVE);
+	ForwardCtx *fwd = (ForwardCtx *) user;
+	long n = splice (fwd->wait_from_fd, NULL, fd, NULL, 4096, SPLICE_F_NONBLOCK | SPLICE_F_MOVE);
 	if (n < 0) {
 		fprintf (stderr, "splice_write_ready: splice() returned %ld: %s\n", n, strerror (errno));
+	} else {
+		stats_account (fwd, n, fwd->wait_start_ns);
 	}
 
 	// Add the read handler back
-	g_unix_fd_add (from_fd, G_IO_IN, splice_fds, (gpointer) (intptr_t) fd);
+	fwd->source_id = context_unix_fd_add (fwd->vpn->main_context, fwd->wait_from_fd, G_IO_IN, splice_fds, fwd);
 
 	return G_SOURCE_REMOVE;
 }
@@ -159,24 +624,33 @@ splice_write_ready (gint fd, GIOCondition condition, gpointer user)
 static gboolean
 splice_fds (gint fd, GIOCondition condition, gpointer user)
 {
-	if (condition & G_IO_HUP)
-		return debug ("hup on %d\n", fd), G_SOURCE_REMOVE;
+	ForwardCtx *fwd = (ForwardCtx *) user;
+	if (condition & G_IO_HUP) {
+		debug ("hup on %d\n", fd);
+		fwd->source_id = 0;
+		return G_SOURCE_REMOVE;
+	}
 
-	int out_fd = (intptr_t) user;
-	long n = splice (fd, NULL, out_fd, NULL, 4096, SPLICE_F_NONBLOCK | SPLICE_F_MOVE);
+	gint64 start_ns = now_ns ();
+	long n = splice (fd, NULL, fwd->out_fd, NULL, 4096, SPLICE_F_NONBLOCK | SPLICE_F_MOVE);
 	if (n < 0) {
 		if (errno == EINVAL) {
 			// Some kernels do not support splice() between a pipe and a tty
-			debug ("splice from %d to %d returned EINVAL, replacing handler with fallback using read/write\n", fd, out_fd);
-			g_unix_fd_add (fd, G_IO_IN, fallback_read_write_fds, (gpointer) (intptr_t) out_fd);
+			debug ("splice from %d to %d returned EINVAL, replacing handler with fallback using read/write\n", fd, fwd->out_fd);
+			fwd->source_id = context_unix_fd_add (fwd->vpn->main_context, fd, G_IO_IN, fallback_read_write_fds, fwd);
 		} else if (errno == EAGAIN) {
 			// Wait until the other side is ready to write
-			g_unix_fd_add (out_fd, G_IO_OUT, splice_write_ready, (gpointer) (intptr_t) fd);
+			fwd->wait_from_fd = fd;
+			fwd->wait_start_ns = start_ns;
+			stats_stall (fwd);
+			fwd->source_id = context_unix_fd_add (fwd->vpn->main_context, fwd->out_fd, G_IO_OUT, splice_write_ready, fwd);
 		} else {
 			fprintf (stderr, "splice_fds: splice() returned %ld: %s\n", n, strerror (errno));
+			fwd->source_id = 0;
 		}
 		return G_SOURCE_REMOVE;
 	}
+	stats_account (fwd, n, start_ns);
 
 	return G_SOURCE_CONTINUE;
 }
@@ -187,74 +661,305 @@ setnonblocking (int fd)
 	fcntl (fd, F_SETFL, fcntl (fd, F_GETFL, 0) | O_NONBLOCK);
 }
 
-/* Forks and execs pppd. PPP is full-duplex, but instead of using stdin/stdout
+/* Asks the kernel for its path MTU estimate towards the peer of the tunnel's
+ * connected TCP socket by reading IP_MTU. This reflects both the route MTU
+ * and any cached PMTU discovery results. Returns 0 if unknown. */
+static int
+query_path_mtu (int fd, int *family)
+{
+	struct sockaddr_storage peer;
+	socklen_t peer_len = sizeof (peer);
+	int mtu = 0;
+	socklen_t len = sizeof (mtu);
+
+	if (fd == -1 || getpeername (fd, (struct sockaddr *) &peer, &peer_len) == -1)
+		return 0;
+	*family = peer.ss_family;
+	if (getsockopt (fd, peer.ss_family == AF_INET6 ? IPPROTO_IPV6 : IPPROTO_IP, peer.ss_family == AF_INET6 ? IPV6_MTU : IP_MTU, &mtu, &len) == -1)
+		return 0;
+	return mtu;
+}
+
+/* Bytes added to each PPP frame on its way to the gateway, assuming a frame
+ * is written as one TLS record in one TCP segment: the F5 frame header and
+ * PPP header, the TLS record header, explicit nonce and AEAD tag, and TCP
+ * with timestamps. The IP header is added depending on the address family. */
+#define TUNNEL_OVERHEAD (4 + 4 + 5 + 8 + 16 + 32)
+#define TUNNEL_MIN_MTU  576
+
+static guint
+tunnel_mtu (F5VpnConnection *vpn)
+{
+	int family = AF_INET;
+
+	if (vpn->mtu > 0)
+		return vpn->mtu;
+	if (vpn->mtu < 0)
+		return 0;
+
+	/* Without access to the tunnel socket, pppd's default is used */
+	int path_mtu = query_path_mtu (vpn->tunnel_fd, &family);
+	if (path_mtu <= 0)
+		return 0;
+
+	int mtu = path_mtu - TUNNEL_OVERHEAD - (family == AF_INET6 ? 40 : 20);
+	debug ("path mtu to %s is %d, using ppp mtu %d\n", vpn->tunnel_host, path_mtu, mtu);
+	return MAX (mtu, TUNNEL_MIN_MTU);
+}
+
+/* openssl s_client makes the TCP connection to the gateway itself, so to
+ * tune it a duplicate of its socket is taken with pidfd_getfd (Linux 5.6).
+ * The socket is recognised as the child's TCP socket connected to port.
+ * Returns -1 and sets err if there is none or it cannot be taken. */
+static int
+acquire_tunnel_socket (pid_t pid, const char *port, GError **err)
+{
+#if defined(SYS_pidfd_open) && defined(SYS_pidfd_getfd)
+	char path[32];
+	struct dirent *de;
+	int fd = -1;
+	int getfd_errno = 0;
+
+	int pidfd = syscall (SYS_pidfd_open, pid, 0);
+	if (pidfd == -1) {
+		g_set_error (err, F5VPN_CONNECT_ERROR, F5VPN_CONNECT_ERROR_TUNNEL_SOCKET, "pidfd_open: %s", strerror (errno));
+		return -1;
+	}
+
+	snprintf (path, sizeof (path), "/proc/%d/fd", pid);
+	DIR *dir = opendir (path);
+	if (!dir) {
+		g_set_error (err, F5VPN_CONNECT_ERROR, F5VPN_CONNECT_ERROR_TUNNEL_SOCKET, "could not list %s: %s", path, strerror (errno));
+		close (pidfd);
+		return -1;
+	}
+	while (fd == -1 && (de = readdir (dir))) {
+		char link[64];
+		char fd_path[300];
+		struct sockaddr_storage peer;
+		socklen_t len = sizeof (peer);
+		int type;
+		socklen_t type_len = sizeof (type);
+
+		snprintf (fd_path, sizeof (fd_path), "%s/%s", path, de->d_name);
+		ssize_t n = readlink (fd_path, link, sizeof (link) - 1);
+		if (n <= 0)
+			continue;
+		link[n] = '\0';
+		if (strncmp (link, "socket:", 7))
+			continue;
+
+		fd = syscall (SYS_pidfd_getfd, pidfd, atoi (de->d_name), 0);
+		if (fd == -1) {
+			getfd_errno = errno;
+			continue;
+		}
+		if (getsockopt (fd, SOL_SOCKET, SO_TYPE, &type, &type_len) == -1 || type != SOCK_STREAM
+		    || getpeername (fd, (struct sockaddr *) &peer, &len) == -1
+		    || (peer.ss_family == AF_INET && ntohs (((struct sockaddr_in *) &peer)->sin_port) != atoi (port))
+		    || (peer.ss_family == AF_INET6 && ntohs (((struct sockaddr_in6 *) &peer)->sin6_port) != atoi (port))
+		    || (peer.ss_family != AF_INET && peer.ss_family != AF_INET6)) {
+			close (fd);
+			fd = -1;
+		}
+	}
+	closedir (dir);
+	close (pidfd);
+	if (fd == -1 && getfd_errno)
+		g_set_error (err, F5VPN_CONNECT_ERROR, F5VPN_CONNECT_ERROR_TUNNEL_SOCKET, "pidfd_getfd: %s", strerror (getfd_errno));
+	else if (fd == -1)
+		g_set_error (err, F5VPN_CONNECT_ERROR, F5VPN_CONNECT_ERROR_TUNNEL_SOCKET, "openssl has no TCP socket connected to port %s", port);
+	return fd;
+#else
+	(void) pid;
+	(void) port;
+	g_set_error (err, F5VPN_CONNECT_ERROR, F5VPN_CONNECT_ERROR_TUNNEL_SOCKET, "pidfd_getfd is not supported on this system");
+	return -1;
+#endif
+}
+
+static void
+apply_socket_profile (int fd, const F5VpnSocketProfile *profile)
+{
+	const struct
+	{
+		int level, name, value;
+		const char *desc;
+	} opts[] = {
+		{ IPPROTO_TCP, TCP_NODELAY, profile->nodelay, "TCP_NODELAY" },
+		{ IPPROTO_TCP, TCP_NOTSENT_LOWAT, profile->notsent_lowat, "TCP_NOTSENT_LOWAT" },
+		{ SOL_SOCKET, SO_SNDBUF, profile->sndbuf, "SO_SNDBUF" },
+		{ SOL_SOCKET, SO_RCVBUF, profile->rcvbuf, "SO_RCVBUF" },
+		{ SOL_SOCKET, SO_KEEPALIVE, profile->keepalive_idle < 0 ? -1 : profile->keepalive_idle > 0, "SO_KEEPALIVE" },
+		{ IPPROTO_TCP, TCP_KEEPIDLE, profile->keepalive_idle > 0 ? profile->keepalive_idle : -1, "TCP_KEEPIDLE" },
+#ifdef SO_BUSY_POLL
+		{ SOL_SOCKET, SO_BUSY_POLL, profile->busy_poll, "SO_BUSY_POLL" },
+#endif
+	};
+
+	for (size_t i = 0; i < G_N_ELEMENTS (opts); ++i) {
+		if (opts[i].value < 0)
+			continue;
+		if (setsockopt (fd, opts[i].level, opts[i].name, &opts[i].value, sizeof (opts[i].value)) == -1)
+			fprintf (stderr, "could not set %s on the tunnel socket: %s\n", opts[i].desc, strerror (errno));
+		else
+			debug ("tunnel socket %s = %d\n", opts[i].desc, opts[i].value);
+	}
+}
+
+/* Spawns pppd. PPP is full-duplex, but instead of using stdin/stdout
  * pipes, it uses a pty. This is for irrelevant/legacy reasons such has modem
  * hardware flow control. The upshot is that this function returns a
  * bidirectional file descriptor, data_fd. It also returns two regular pipes for
  * polling, plugin_fd and log_fd, which allow receiving messages from the ppp
- * plugin and reading pppd log messages respectively */
+ * plugin and reading pppd log messages respectively.
+ *
+ * pppd is started before the tunnel is open and its plugin waits for the
+ * tunnel's addresses and MTU (a PppdPluginConfig message) on config_fd, so
+ * that exec'ing pppd, loading the plugin and allocating the pty overlap with
+ * the connect.php3 request and the TLS handshake. Returns -1 with errno set
+ * if pppd could not be started */
 static int
-launch_pppd (const char *pppd_ip_spec, int *data_fd, int *plugin_fd, int *log_fd)
+launch_pppd (guint echo_interval, guint echo_failures, int *data_fd, int *plugin_fd, int *config_fd, int *log_fd)
 {
 #ifndef WITH_DEBUG
 	(void) log_fd;
 #endif
 
-	int ret, pty_master, pty_slave, pipe_plugin[2];
-	char fd_as_str[3];
+	int pid, err, pty_master, pty_slave, pipe_plugin[2], sock_config[2];
+	char interval_str[12], failures_str[12];
+	const char *argv[32];
+	int argc = 0;
+	const char *env[] = {
+		"F5_VPN_PPPD_PLUGIN_FD=" STR (PPPD_PLUGIN_CHILD_FD),
+		"F5_VPN_PPPD_CONFIG_FD=" STR (PPPD_CONFIG_CHILD_FD),
+		NULL
+	};
+	F5VpnSpawnFd fds[4];
+	int nr_fds = 0;
+
+	/* An LCP echo failure count of 0 makes pppd send echoes without ever
+	 * giving up, which still gives us RTT measurements */
+	sprintf (interval_str, "%u", echo_interval);
+	sprintf (failures_str, "%u", echo_interval ? echo_failures : 0);
+
+	if (pipe2 (pipe_plugin, O_CLOEXEC) == -1)
+		return -1;
 
-	if (pipe (pipe_plugin) == -1)
+	/* A socket rather than a pipe, so that sending to a pppd which has gone
+	 * fails instead of raising SIGPIPE */
+	if (socketpair (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sock_config) == -1) {
+		err = errno;
+		close (pipe_plugin[0]);
+		close (pipe_plugin[1]);
+		errno = err;
 		return -1;
+	}
 
-	openpty (&pty_master, &pty_slave, NULL, NULL, NULL);
+	if (!f5vpn_spawn_open_pty (&pty_master, &pty_slave)) {
+		err = errno;
+		close (pipe_plugin[0]);
+		close (pipe_plugin[1]);
+		close (sock_config[0]);
+		close (sock_config[1]);
+		errno = err;
+		return -1;
+	}
 
 #ifdef WITH_DEBUG
 	int pipe_log[2];
-	if (pipe (pipe_log) == -1)
-		return -1;
+	if (pipe2 (pipe_log, O_CLOEXEC) == -1)
+		pipe_log[0] = pipe_log[1] = -1;
 #endif
 
-	ret = fork ();
-	if (ret == -1) {
-		fprintf (stderr, "fork failed: %s\n", strerror (errno));
-		return -1;
-	} else if (ret == 0) {
-		/* child process: fork pppd */
-		close (pipe_plugin[0]);
-		sprintf (fd_as_str, "%d", pipe_plugin[1]);
-
-		setenv ("F5_VPN_PPPD_PLUGIN_FD", fd_as_str, 1);
-		close (pty_master);
-		dup2 (pty_slave, STDIN_FILENO);
-		close (pty_slave);
+	fds[nr_fds++] = (F5VpnSpawnFd){ pty_slave, STDIN_FILENO };
+	fds[nr_fds++] = (F5VpnSpawnFd){ pipe_plugin[1], PPPD_PLUGIN_CHILD_FD };
+	fds[nr_fds++] = (F5VpnSpawnFd){ sock_config[1], PPPD_CONFIG_CHILD_FD };
+
+	argv[argc++] = "/usr/bin/pppd";
+	argv[argc++] = "local";
+	argv[argc++] = "nodetach";
+	argv[argc++] = "noauth";
+	argv[argc++] = "nocrtscts";
+	argv[argc++] = "nodefaultroute";
+	argv[argc++] = "noremoteip";
+	argv[argc++] = "noproxyarp";
+	argv[argc++] = "lcp-echo-interval";
+	argv[argc++] = interval_str;
+	argv[argc++] = "lcp-echo-failure";
+	argv[argc++] = failures_str;
+	argv[argc++] = "plugin";
+	argv[argc++] = PPPD_PLUGIN_PATH;
+#ifdef WITH_DEBUG
+	if (pipe_log[1] != -1) {
+		fds[nr_fds++] = (F5VpnSpawnFd){ pipe_log[1], PPPD_LOG_CHILD_FD };
+		argv[argc++] = "logfd";
+		argv[argc++] = STR (PPPD_LOG_CHILD_FD);
+	}
+	argv[argc++] = "debug";
+#endif
+	argv[argc] = NULL;
 
-		close (STDOUT_FILENO);
-		close (STDERR_FILENO);
+	/* stdout and stderr are closed, as before pppd logs through logfd */
+	pid = f5vpn_spawn (argv, env, fds, nr_fds, FALSE);
+	err = errno;
 
+	/* The child has its copies of these */
+	close (pty_slave);
+	close (pipe_plugin[1]);
+	close (sock_config[1]);
 #ifdef WITH_DEBUG
-		close (pipe_log[0]);
-		sprintf (fd_as_str, "%d", pipe_log[1]);
+	if (pipe_log[1] != -1)
+		close (pipe_log[1]);
 #endif
-		execl ("/usr/bin/pppd", "/usr/bin/pppd", "local", "nodetach", "noauth",
-		       "nocrtscts", "nodefaultroute", "noremoteip", "noproxyarp", "plugin",
-		       PPPD_PLUGIN_PATH, pppd_ip_spec,
+
+	if (pid == -1) {
+		close (pty_master);
+		close (pipe_plugin[0]);
+		close (sock_config[0]);
 #ifdef WITH_DEBUG
-		       "logfd", fd_as_str, "debug",
+		if (pipe_log[0] != -1)
+			close (pipe_log[0]);
 #endif
-		       NULL);
-		exit (EXIT_FAILURE);
-	} else {
-		/* parent process: clean up fds and pass them back up */
-		close (pty_slave);
-		setnonblocking (pty_master);
-		*data_fd = pty_master;
-		*plugin_fd = pipe_plugin[0];
+		errno = err;
+		return -1;
+	}
+
+	setnonblocking (pty_master);
+	*data_fd = pty_master;
+	*plugin_fd = pipe_plugin[0];
+	*config_fd = sock_config[0];
 #ifdef WITH_DEBUG
-		close (pipe_log[1]);
-		*log_fd = pipe_log[0];
+	*log_fd = pipe_log[0];
 #endif
-		return ret;
-	}
+	return pid;
+}
+
+/* Hands the tunnel's settings to the pppd waiting for them in its plugin */
+static gboolean
+send_pppd_config (F5VpnConnection *vpn, const PppdPluginConfig *config)
+{
+	struct
+	{
+		PppdPluginMessageHeader hdr;
+		PppdPluginConfig config;
+	} msg = { { PPPD_PLUGIN_MESSAGE_VERSION, PPPD_PLUGIN_MSG_CONFIG, sizeof (PppdPluginConfig) }, *config };
+
+	ssize_t n = send (vpn->ppd_config_fd, &msg, sizeof (msg), MSG_NOSIGNAL);
+	close (vpn->ppd_config_fd);
+	vpn->ppd_config_fd = -1;
+	return n == sizeof (msg);
+}
+
+/* Called as each child is reaped. Once nothing is left running for the
+ * connection, its end is reported. */
+static void
+child_gone (F5VpnConnection *vpn)
+{
+	if (vpn->ppd_pid || vpn->openssl_pid || vpn->params_pending)
+		stop_connection (vpn);
+	else
+		tunnel_exited (vpn);
 }
 
 static void
@@ -263,15 +968,23 @@ pppd_exited (GPid pid, gint status, gpointer user_data)
 	F5VpnConnection *vpn = (F5VpnConnection *) user_data;
 	if (WIFEXITED (status)) {
 		debug ("pppd exited with status %d\n", WEXITSTATUS (status));
+		if (WEXITSTATUS (status) == PPPD_EXIT_PEER_DEAD && !vpn->err)
+			vpn->err = g_error_new (F5VPN_CONNECT_ERROR, F5VPN_CONNECT_ERROR_PEER_DEAD, "No reply to %u LCP echo requests, gateway presumed dead", vpn->keepalive_failures);
 	} else {
 		debug ("pppd unexpectedly stopped\n");
 	}
 	g_assert (vpn->ppd_pid == pid);
 	vpn->ppd_pid = 0;
-	if (vpn->openssl_pid)
-		kill (vpn->openssl_pid, SIGTERM);
-	else
-		tunnel_exited (vpn);
+	/* Still waiting for its settings, so the pty was never used either */
+	if (vpn->ppd_config_fd != -1) {
+		if (!vpn->stopping && !vpn->err)
+			vpn->err = g_error_new (F5VPN_CONNECT_ERROR, F5VPN_CONNECT_ERROR_SPAWN_FAILED, "pppd exited before the tunnel was open");
+		close (vpn->ppd_config_fd);
+		vpn->ppd_config_fd = -1;
+		close (vpn->ppd_fd);
+		vpn->ppd_fd = -1;
+	}
+	child_gone (vpn);
 }
 
 static void
@@ -285,10 +998,12 @@ openssl_exited (GPid pid, gint status, gpointer user_data)
 	}
 	g_assert (vpn->openssl_pid == pid);
 	vpn->openssl_pid = 0;
-	if (vpn->ppd_pid)
-		kill (vpn->ppd_pid, SIGTERM);
-	else
-		tunnel_exited (vpn);
+	/* Our duplicate would otherwise keep the connection open */
+	if (vpn->tunnel_fd != -1) {
+		close (vpn->tunnel_fd);
+		vpn->tunnel_fd = -1;
+	}
+	child_gone (vpn);
 }
 
 static gboolean
@@ -304,320 +1019,722 @@ on_ssl_established (gint fd, GIOCondition condition, gpointer user)
 	//   X-VPN-client-IP: 192.168.1.6
 	//   X-VPN-server-IP: 1.1.1.1
 
-	char buffer[128];
-	int n = 0;
+	char *buffer = vpn->header;
+	int n = vpn->header_len;
 	/* Look for the \r\n\r\n signifying the end of the HTTP header. This is a very
    * inefficent loop, but reading bigger chunks risks going over the header and
-   * into the PPP data; doing something smarter isn't worth the effort */
-	do
-		if (read (fd, buffer + n, 1) == 1)
-			n++;
-	while (errno == 0 && (n < 4 || memcmp (buffer + n - 4, "\r\n\r\n", 4)));
+   * into the PPP data; doing something smarter isn't worth the effort. The fd
+   * is non-blocking, so the header may take several calls to arrive. */
+	while (n < (int) sizeof (vpn->header) - 1 && (n < 4 || memcmp (buffer + n - 4, "\r\n\r\n", 4))) {
+		ssize_t r = read (fd, buffer + n, 1);
+		if (r == 1) {
+			vpn->header_len = ++n;
+		} else if (r == -1 && errno == EINTR) {
+			continue;
+		} else if (r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return G_SOURCE_CONTINUE;
+		} else {
+			/* openssl has gone, its exit handler reports that */
+			vpn->ssl_established_id = 0;
+			return FALSE;
+		}
+	}
 	buffer[n] = '\0';
+	vpn->ssl_established_id = 0;
 	// debug("received %d bytes [%s]\n", n, buffer);
 	// debug("last 4 bytes [%x %x %x %x]\n", buffer[n-4], buffer[n-3],
 	// buffer[n-2], buffer[n-1]);
 
-	/* TODO: no way to return error from this func */
+	/* Anything but a 200 means the gateway refused the tunnel, e.g. because
+	 * the session expired after connect.php3. As elsewhere, the error is
+	 * reported by the exit handlers once the children are gone. */
+	if (n < 12 || strncmp (buffer, "HTTP/1.", 7) || strncmp (buffer + 8, " 200", 4)) {
+		if (!vpn->err)
+			vpn->err = g_error_new (F5VPN_CONNECT_ERROR, F5VPN_CONNECT_ERROR_BAD_HTTP_CODE, "Gateway refused the tunnel: %.*s",
+			                        (int) strcspn (buffer, "\r\n"), buffer);
+		stop_connection (vpn);
+		return FALSE;
+	}
 
-	char ip_spec[32];
-	char *server_ip;
 	// Try to extract the client and server IP from the HTTP response header. If
 	// it fails, use dummy defaults and hope that IPCP will sort it out for us.
-	server_ip = ip_spec + sprintf (ip_spec, "0.0.0.0:");
+	PppdPluginConfig config = { { 0 }, { 0 }, 0 };
+	inet_aton ("1.1.1.1", &config.remote_addr);
 	if ((p = strstr (buffer, "X-VPN-client-IP: "))) {
 		p += strlen ("X-VPN-client-IP: ");
 		if ((e = memchr (p, '\r', 16))) {
 			*e = '\0';
-			server_ip = ip_spec + sprintf (ip_spec, "%s:", p);
+			inet_aton (p, &config.local_addr);
 		}
 	}
-	sprintf (server_ip, "1.1.1.1");
 	if ((p = strstr (buffer, "X-VPN-server-IP: "))) {
 		p += strlen ("X-VPN-server-IP: ");
 		if ((e = memchr (p, '\r', 16))) {
 			*e = '\0';
-			sprintf (server_ip, "%s", p);
+			inet_aton (p, &config.remote_addr);
 		}
 	}
 
-	debug ("PPP IP spec: [%s]\n", ip_spec);
+	end_phase (vpn, F5VPN_STATS_PHASE_TUNNEL_OPEN);
 
-	// Pass execution off to pppd
-	int ppd_fd;
-	int ppd_log;
-	int plugin_fd;
-	int pppd_pid = launch_pppd (ip_spec, &ppd_fd, &plugin_fd, &ppd_log);
-	g_child_watch_add (pppd_pid, pppd_exited, vpn);
-	vpn->ppd_pid = pppd_pid;
-	vpn->ppd_fd = ppd_fd;
-	g_unix_fd_add (plugin_fd, G_IO_IN, handle_plugin_msg, vpn);
-#ifdef WITH_DEBUG
-	g_unix_fd_add (ppd_log, G_IO_IN, splice_fds, (gpointer) STDERR_FILENO);
-#endif
-	g_unix_fd_add (ppd_fd, G_IO_IN, splice_fds, (gpointer) (intptr_t) vpn->ssl_write_fd);
-	g_unix_fd_add (fd, G_IO_IN, splice_fds, (gpointer) (intptr_t) vpn->ppd_fd);
+	GError *socket_err = NULL;
+	vpn->tunnel_fd = acquire_tunnel_socket (vpn->openssl_pid, vpn->tunnel_port, &socket_err);
+	if (vpn->tunnel_fd != -1) {
+		apply_socket_profile (vpn->tunnel_fd, &vpn->socket_profile);
+	} else {
+		fprintf (stderr, "could not access the tunnel socket, leaving it untuned: %s\n", socket_err->message);
+		g_error_free (socket_err);
+	}
+
+	// Pass execution off to the pppd waiting for it
+	config.mtu = tunnel_mtu (vpn);
+	debug ("PPP local %s mtu %u\n", inet_ntoa (config.local_addr), config.mtu);
+	if (!vpn->ppd_pid || vpn->ppd_config_fd == -1 || !send_pppd_config (vpn, &config)) {
+		if (!vpn->err)
+			vpn->err = g_error_new (F5VPN_CONNECT_ERROR, F5VPN_CONNECT_ERROR_SPAWN_FAILED, "pppd is not running");
+		/* The exit handlers report the error */
+		stop_connection (vpn);
+		return FALSE;
+	}
+
+	vpn->fwd[F5VPN_STATS_DIR_TX] = (ForwardCtx){ vpn, vpn->ssl_write_fd, F5VPN_STATS_DIR_TX, 0, -1, 0 };
+	vpn->fwd[F5VPN_STATS_DIR_RX] = (ForwardCtx){ vpn, vpn->ppd_fd, F5VPN_STATS_DIR_RX, 0, -1, 0 };
+	vpn->fwd[F5VPN_STATS_DIR_TX].source_id = context_unix_fd_add (vpn->main_context, vpn->ppd_fd, G_IO_IN, splice_fds, &vpn->fwd[F5VPN_STATS_DIR_TX]);
+	vpn->fwd[F5VPN_STATS_DIR_RX].source_id = context_unix_fd_add (vpn->main_context, fd, G_IO_IN, splice_fds, &vpn->fwd[F5VPN_STATS_DIR_RX]);
 
 	// Finished with this handler
 	return FALSE;
 }
 
+/* Spawns openssl s_client connected to endpoint, returning the read end of
+ * its stdout in fds[0] and the write end of its stdin in fds[1]. Returns -1
+ * with errno set if openssl could not be started */
 static int
 launch_ssl_client (const char *endpoint, int fds[2])
 {
-	int ret, to_child[2], from_child[2];
+	int pid, err, to_child[2], from_child[2];
+	const char *argv[] = { "/usr/bin/openssl", "s_client", "-quiet", "-verify_quiet", "-verify_return_error", "-connect", endpoint, NULL };
 
-	if (pipe (to_child) == -1)
+	if (pipe2 (to_child, O_CLOEXEC) == -1)
 		return -1;
 
-	if (pipe (from_child) == -1)
+	if (pipe2 (from_child, O_CLOEXEC) == -1) {
+		err = errno;
+		close (to_child[0]);
+		close (to_child[1]);
+		errno = err;
 		return -1;
+	}
 
-	ret = fork ();
-	if (ret == -1)
-		return -1;
+	/* stderr is passed through for openssl's diagnostics */
+	F5VpnSpawnFd child_fds[] = { { to_child[0], STDIN_FILENO }, { from_child[1], STDOUT_FILENO } };
+	pid = f5vpn_spawn (argv, NULL, child_fds, G_N_ELEMENTS (child_fds), TRUE);
+	err = errno;
 
-	if (ret == 0) {
+	close (to_child[0]);
+	close (from_child[1]);
+	if (pid == -1) {
 		close (to_child[1]);
 		close (from_child[0]);
-		dup2 (to_child[0], STDIN_FILENO);
-		close (to_child[0]);
-		dup2 (from_child[1], STDOUT_FILENO);
-		close (from_child[1]);
-		execl ("/usr/bin/openssl", "/usr/bin/openssl", "s_client", "-quiet",
-		       "-verify_quiet", "-verify_return_error", "-connect", endpoint, NULL);
-		exit (EXIT_FAILURE);
-	} else {
-		close (to_child[0]);
-		close (from_child[1]);
-		fds[0] = from_child[0];
-		fds[1] = to_child[1];
-		setnonblocking (fds[0]);
-		setnonblocking (fds[1]);
+		errno = err;
+		return -1;
 	}
-	return ret;
+
+	fds[0] = from_child[0];
+	fds[1] = to_child[1];
+	setnonblocking (fds[0]);
+	setnonblocking (fds[1]);
+	return pid;
 }
 
 static gboolean
-parse_network_settings (F5VpnConnection *vpn, char *lan_segment, char *nameservers)
-{
-	char *addr, *subnet, *savep;
-	struct in_addr bin_addr, bin_subnet;
-	for (;;) {
-		addr = strtok_r (lan_segment, " ", &savep);
-		if (!addr)
-			break;
-		lan_segment = NULL;
-		subnet = strchr (addr, '/');
-		if (!subnet)
-			break;
-		*subnet++ = '\0';
-		if (inet_pton (AF_INET, addr, &bin_addr) != 1 || inet_pton (AF_INET, subnet, &bin_subnet) != 1)
-			continue;
-		LanAddr *la = malloc (sizeof (LanAddr));
-		la->addr = bin_addr;
-		la->mask = (32 - (uint8_t) __builtin_ctz (ntohl (bin_subnet.s_addr)));
-		vpn->parsed_lans = g_slist_append (vpn->parsed_lans, la);
+prelaunch_pppd (gpointer user)
+{
+	F5VpnConnection *vpn = (F5VpnConnection *) user;
+	vpn->prelaunch_id = 0;
+	int pid = launch_pppd (vpn->keepalive_interval, vpn->keepalive_failures, &vpn->ppd_fd, &vpn->plugin_fd, &vpn->ppd_config_fd, &vpn->log_fd);
+	if (pid == -1) {
+		if (!vpn->err)
+			vpn->err = g_error_new (F5VPN_CONNECT_ERROR, F5VPN_CONNECT_ERROR_SPAWN_FAILED, "Could not start pppd: %s", strerror (errno));
+		fail_connection (vpn);
+		return G_SOURCE_REMOVE;
 	}
+	f5vpn_spawn_watch_add (vpn->main_context, pid, pppd_exited, vpn);
+	vpn->ppd_pid = pid;
+	vpn->plugin_id = context_unix_fd_add (vpn->main_context, vpn->plugin_fd, G_IO_IN, handle_plugin_msg, vpn);
+#ifdef WITH_DEBUG
+	if (vpn->log_fd != -1) {
+		vpn->fwd_log = (ForwardCtx){ vpn, STDERR_FILENO, -1, 0, -1, 0 };
+		vpn->fwd_log.source_id = context_unix_fd_add (vpn->main_context, vpn->log_fd, G_IO_IN, splice_fds, &vpn->fwd_log);
+	}
+#endif
+	return G_SOURCE_REMOVE;
+}
 
-	for (;;) {
-		addr = strtok_r (nameservers, " ", &savep);
-		if (!addr)
-			break;
-		nameservers = NULL;
-
-		if (inet_pton (AF_INET, addr, &bin_addr) != 1)
-			continue;
+static gboolean
+callback_to_user (gpointer user)
+{
+	F5VpnConnection *vpn = (F5VpnConnection *) user;
+	vpn->phase = F5VPN_STATS_PHASE_COUNT;
+	disarm_deadline (vpn);
+	/* The error now belongs to the library user */
+	GError *err = vpn->err;
+	vpn->err = NULL;
+	(vpn->callback) (vpn, NULL, vpn->userdata, err);
+	return G_SOURCE_REMOVE;
+}
 
-		struct in_addr *ns = malloc (sizeof (struct in_addr));
-		*ns = bin_addr;
+struct _F5VpnConnectParams
+{
+	GlibCurl *glc;
+	GString *resp;
+	F5VpnConnectParamsCallback callback;
+	void *userdata;
+	gint64 start_us;
+	gint64 fetch_us;
+	gchar *ur_Z;
+	gchar *tunnel_host;
+	gchar *tunnel_port;
+	gchar *DNS;
+	gchar *LAN;
+	gchar *DNS_suffix;
+	gchar *DNS_split;
+	GError *err;
+	GMainContext *main_context;
+	guint deadline_ms;
+	GlibRequest req;
+	guint retry_after_ms;
+};
 
-		vpn->parsed_nameservers = g_slist_append (vpn->parsed_nameservers, ns);
-	}
+static gboolean
+on_params_deadline (gpointer user)
+{
+	F5VpnConnectParams *params = (F5VpnConnectParams *) user;
+	GError *err = g_error_new (F5VPN_CONNECT_ERROR, F5VPN_CONNECT_ERROR_TIMED_OUT, "Timed out after %u ms %s",
+	                           params->deadline_ms, phase_desc[F5VPN_STATS_PHASE_CONNECT_PARAMS]);
 
-	return TRUE;
+	glib_curl_abort (params->glc, err);
+	g_error_free (err);
+	return G_SOURCE_REMOVE;
 }
 
+/* Called from the main loop rather than from the curl callback, so that the
+ * user may free the params right away */
 static gboolean
-callback_to_user (gpointer user)
+report_connect_params (gpointer user)
 {
-	F5VpnConnection *vpn = (F5VpnConnection *) user;
-	(vpn->callback) (vpn, NULL, vpn->userdata, vpn->err);
+	F5VpnConnectParams *params = (F5VpnConnectParams *) user;
+	/* A result which was already on its way is replaced by the cancellation */
+	if (params->req.cancelled && !params->err)
+		params->err = g_error_new (F5VPN_CONNECT_ERROR, F5VPN_CONNECT_ERROR_CANCELLED, "Connection parameter request cancelled");
+	/* The error now belongs to the library user */
+	GError *err = params->err;
+	params->err = NULL;
+	(params->callback) (params, params->userdata, err);
 	return G_SOURCE_REMOVE;
 }
 
 static void
 handle_connection_parameters (CURL *curl, void *user, GError *err)
 {
-	F5VpnConnection *vpn = (F5VpnConnection *) user;
+	F5VpnConnectParams *params = (F5VpnConnectParams *) user;
 	long response_code = 0;
 
-	xmlDoc *doc;
-	xmlXPathContext *xpathCtx;
-	xmlXPathObject *xpathObj;
-
-	gchar *ur_Z = NULL, *tunnel_host0 = NULL, *tunnel_port0 = NULL, *DNS0 = NULL,
-	      *LAN0 = NULL;
+	params->fetch_us = g_get_monotonic_time () - params->start_us;
 
 	if (err) {
 		curl_easy_cleanup (curl);
-		vpn->err = err;
-		g_timeout_add (0, callback_to_user, vpn);
+		params->err = err;
+		glib_request_report (&params->req, report_connect_params);
 		return;
 	}
 
 	curl_easy_getinfo (curl, CURLINFO_RESPONSE_CODE, &response_code);
+	if (response_code == 502 || response_code == 503 || response_code == 504) {
+		/* Not a verdict on the session: the gateway is overloaded or restarting */
+		curl_off_t retry_after = 0;
+		curl_easy_getinfo (curl, CURLINFO_RETRY_AFTER, &retry_after);
+		params->retry_after_ms = (guint) CLAMP (retry_after, 0, G_MAXUINT / 1000) * 1000;
+		params->err = g_error_new (F5VPN_CONNECT_ERROR, F5VPN_CONNECT_ERROR_UNAVAILABLE,
+		                           "Gateway unavailable (HTTP response code %lu), retry after %us",
+		                           response_code, params->retry_after_ms / 1000);
+		curl_easy_cleanup (curl);
+		glib_request_report (&params->req, report_connect_params);
+		return;
+	}
 	if (response_code != 200) {
 		char *url;
 		curl_easy_getinfo (curl, CURLINFO_EFFECTIVE_URL, &url);
-		vpn->err =
-		    g_error_new (F5VPN_CONNECT_ERROR, F5VPN_CONNECT_ERROR_BAD_HTTP_CODE,
-		                 "Unexpected HTTP response code %lu received from %s",
-		                 response_code, url);
+		params->err = g_error_new (F5VPN_CONNECT_ERROR, F5VPN_CONNECT_ERROR_BAD_HTTP_CODE,
+		                           "Unexpected HTTP response code %lu received from %s",
+		                           response_code, url);
 		curl_easy_cleanup (curl);
-		g_timeout_add (0, callback_to_user, vpn);
+		glib_request_report (&params->req, report_connect_params);
 		return;
 	}
 
 	curl_easy_cleanup (curl);
 
-	// debug("xml resp: %s\n", vpn->resp->str);
+	// debug("xml resp: %s\n", params->resp->str);
 
-	doc = xmlParseMemory (vpn->resp->str, vpn->resp->len);
-	if (doc == NULL) {
-		err = g_error_new (F5VPN_CONNECT_ERROR, F5VPN_CONNECT_ERROR_PARSE_FAILED, "Could not parse server response XML: %s", vpn->resp->str);
-		(vpn->callback) (vpn, NULL, vpn->userdata, err);
+	if (!f5vpn_parse_connect_params (params->resp->str, params->resp->len, &params->ur_Z, &params->tunnel_host, &params->tunnel_port, &params->DNS, &params->LAN, &params->DNS_suffix, &params->DNS_split)) {
+		params->err = g_error_new (F5VPN_CONNECT_ERROR, F5VPN_CONNECT_ERROR_PARSE_FAILED, "Could not parse server response XML: %s", params->resp->str);
+		glib_request_report (&params->req, report_connect_params);
 		return;
 	}
 
-	xpathCtx = xmlXPathNewContext (doc);
+	debug ("ur_Z[%s] tunnel_host0[%s] tunnel_port0[%s] DNS0[%s] LAN0[%s] DNS_SUFFIX0[%s] DNS_SPLIT0[%s]\n", params->ur_Z, params->tunnel_host, params->tunnel_port, params->DNS, params->LAN, params->DNS_suffix, params->DNS_split);
 
-	xpathObj = xmlXPathEvalExpression ((const xmlChar *) "string(/favorite/object/ur_Z)", xpathCtx);
-	if (xpathObj && xpathObj->stringval)
-		ur_Z = g_strdup ((const gchar *) xpathObj->stringval);
-	xmlXPathFreeObject (xpathObj);
+	if (!(params->ur_Z && params->tunnel_host && params->tunnel_port && params->DNS && params->LAN)) {
+		params->err = g_error_new (F5VPN_CONNECT_ERROR, F5VPN_CONNECT_ERROR_PARSE_FAILED, "Missing expected params in server response XML: %s", params->resp->str);
+		glib_request_report (&params->req, report_connect_params);
+		return;
+	}
 
-	xpathObj = xmlXPathEvalExpression ((const xmlChar *) "string(/favorite/object/tunnel_host0)", xpathCtx);
-	if (xpathObj && xpathObj->stringval)
-		tunnel_host0 = g_strdup ((const gchar *) xpathObj->stringval);
-	xmlXPathFreeObject (xpathObj);
+	/* The raw response is no longer needed once parsed */
+	g_string_truncate (params->resp, 0);
+	glib_request_report (&params->req, report_connect_params);
+}
 
-	xpathObj = xmlXPathEvalExpression ((const xmlChar *) "string(/favorite/object/tunnel_port0)", xpathCtx);
-	if (xpathObj && xpathObj->stringval)
-		tunnel_port0 = g_strdup ((const gchar *) xpathObj->stringval);
-	xmlXPathFreeObject (xpathObj);
+F5VpnConnectParams *
+f5vpn_connect_params_begin (GMainContext *main_context, const char *hostname, const char *session_key, const char *vpn_z_id, F5VpnConnectParamsCallback callback, void *userdata)
+{
+	F5VpnConnectParams *params = calloc (1, sizeof (F5VpnConnectParams));
 
-	xpathObj = xmlXPathEvalExpression ((const xmlChar *) "string(/favorite/object/DNS0)", xpathCtx);
-	if (xpathObj && xpathObj->stringval)
-		DNS0 = g_strdup ((const gchar *) xpathObj->stringval);
-	xmlXPathFreeObject (xpathObj);
+	params->glc = glib_curl_new (main_context);
+	params->resp = g_string_new ("");
+	params->callback = callback;
+	params->userdata = userdata;
+	params->start_us = g_get_monotonic_time ();
+	params->main_context = main_context;
+	params->deadline_ms = F5VPN_CONNECT_PARAMS_DEFAULT_DEADLINE_MS;
+	glib_request_init (&params->req, main_context, on_params_deadline, params);
 
-	xpathObj = xmlXPathEvalExpression ((const xmlChar *) "string(/favorite/object/LAN0)", xpathCtx);
-	if (xpathObj && xpathObj->stringval)
-		LAN0 = g_strdup ((const gchar *) xpathObj->stringval);
-	xmlXPathFreeObject (xpathObj);
+	gchar *url = g_strdup_printf ("https://%s/vdesk/vpn/connect.php3?resourcename=%s&outform=xml&client_version=1.1", hostname, vpn_z_id);
+	gchar *cookie = g_strdup_printf ("MRHSession=%s;", session_key);
 
-	debug ("ur_Z[%s] tunnel_host0[%s] tunnel_port0[%s] DNS0[%s] LAN0[%s]\n", ur_Z, tunnel_host0, tunnel_port0, DNS0, LAN0);
+	CURL *curl = curl_easy_init ();
+	curl_easy_setopt (curl, CURLOPT_WRITEFUNCTION, curl_write_to_gstring);
+	curl_easy_setopt (curl, CURLOPT_WRITEDATA, params->resp);
 
-	xmlXPathFreeContext (xpathCtx);
-	xmlFreeDoc (doc);
+	curl_easy_setopt (curl, CURLOPT_COOKIE, cookie);
+	curl_easy_setopt (curl, CURLOPT_URL, url);
 
-	if (!(ur_Z && tunnel_host0 && tunnel_port0 && DNS0 && LAN0)) {
-		g_free (ur_Z);
-		g_free (tunnel_host0);
-		g_free (tunnel_port0);
-		g_free (DNS0);
-		g_free (LAN0);
-		vpn->err = g_error_new (F5VPN_CONNECT_ERROR, F5VPN_CONNECT_ERROR_PARSE_FAILED, "Missing expected params in server response XML: %s", vpn->resp->str);
-		g_timeout_add (0, callback_to_user, vpn);
-		return;
-	}
+	// necessary?
+	curl_easy_setopt (curl, CURLOPT_USERAGENT, "Mozilla/5.0 (Linux) F5Launcher/1.0");
+	glib_curl_use_shared_state (curl);
+
+	g_free (url);
+	g_free (cookie);
+	glib_curl_send (params->glc, curl, handle_connection_parameters, params);
+	glib_request_arm (&params->req, params->start_us, params->deadline_ms);
+
+	return params;
+}
+
+void
+f5vpn_connect_params_set_deadline (F5VpnConnectParams *params, guint timeout_ms)
+{
+	params->deadline_ms = timeout_ms;
+	if (params->req.deadline)
+		glib_request_arm (&params->req, params->start_us, timeout_ms);
+}
+
+void
+f5vpn_connect_params_cancel (F5VpnConnectParams *params)
+{
+	GError *err = g_error_new (F5VPN_CONNECT_ERROR, F5VPN_CONNECT_ERROR_CANCELLED, "Connection parameter request cancelled");
+
+	glib_request_cancel (&params->req);
+	glib_curl_abort (params->glc, err);
+	g_error_free (err);
+}
+
+guint
+f5vpn_connect_params_get_retry_after (F5VpnConnectParams *params)
+{
+	return params->retry_after_ms;
+}
+
+void
+f5vpn_connect_params_free (F5VpnConnectParams *params)
+{
+	/* A request still in flight would otherwise call back into freed memory */
+	f5vpn_connect_params_cancel (params);
+	glib_request_clear (&params->req);
+	if (params->err)
+		g_error_free (params->err);
+	g_free (params->ur_Z);
+	g_free (params->tunnel_host);
+	g_free (params->tunnel_port);
+	g_free (params->DNS);
+	g_free (params->LAN);
+	g_free (params->DNS_suffix);
+	g_free (params->DNS_split);
+	g_string_free (params->resp, TRUE);
+	glib_curl_free (params->glc);
+	free (params);
+}
+
+/* Opens the TLS connection to the tunnel endpoint and requests the tunnel */
+static void
+start_tunnel (F5VpnConnection *vpn, const F5VpnConnectParams *params)
+{
+	vpn->tunnel_host = g_strdup (params->tunnel_host);
+	vpn->tunnel_port = g_strdup (params->tunnel_port);
 
 	gchar *ssl_endpoint =
-	    g_strdup_printf ("%s:%d", tunnel_host0, atoi (tunnel_port0));
+	    g_strdup_printf ("%s:%d", vpn->tunnel_host, atoi (vpn->tunnel_port));
 	/* Totally bizarre, but the session string has to be terminated with a newline!? */
 	gchar *vpn_http_get = g_strdup_printf (
 	    "GET /myvpn?sess=%s\n&hdlc_framing=no&ipv4=yes&ipv6=yes&Z=%s HTTP/1.0\r\n"
 	    "User-Agent: Mozilla/5.0 (compatible; MSIE 10.0; Windows NT 6.1; Trident/6.0; F5 Networks Client)\r\n"
 	    "Host: %s\r\n\r\n",
-	    vpn->session_key, ur_Z, tunnel_host0);
-	free (tunnel_host0);
-	free (tunnel_port0);
-	free (ur_Z);
-
-	if (!parse_network_settings (vpn, LAN0, DNS0)) {
-		free (LAN0);
-		free (DNS0);
-		vpn->err = g_error_new (F5VPN_CONNECT_ERROR, F5VPN_CONNECT_ERROR_PARSE_FAILED, "Failed to parse LAN0[%s] or DNS0[%s]", LAN0, DNS0);
-		g_timeout_add (0, callback_to_user, vpn);
-		return;
-	}
+	    vpn->session_key, params->ur_Z, vpn->tunnel_host);
 
-	free (LAN0);
-	free (DNS0);
+	/* Malformed entries are skipped rather than failing the connection */
+	vpn->parsed_lans = g_slist_concat (vpn->parsed_lans, f5vpn_parse_lans (params->LAN));
+	vpn->parsed_nameservers = g_slist_concat (vpn->parsed_nameservers, f5vpn_parse_nameservers (params->DNS));
+	vpn->parsed_search_domains = g_slist_concat (vpn->parsed_search_domains, f5vpn_parse_domains (params->DNS_suffix));
+	vpn->parsed_split_domains = g_slist_concat (vpn->parsed_split_domains, f5vpn_parse_domains (params->DNS_split));
 
 	int ssl_client_fds[2];
 	int openssl_pid = launch_ssl_client (ssl_endpoint, ssl_client_fds);
 	g_free (ssl_endpoint);
-	g_child_watch_add (openssl_pid, openssl_exited, vpn);
+	if (openssl_pid == -1) {
+		g_free (vpn_http_get);
+		vpn->err = g_error_new (F5VPN_CONNECT_ERROR, F5VPN_CONNECT_ERROR_SPAWN_FAILED, "Could not start openssl: %s", strerror (errno));
+		fail_connection (vpn);
+		return;
+	}
+	f5vpn_spawn_watch_add (vpn->main_context, openssl_pid, openssl_exited, vpn);
 	vpn->openssl_pid = openssl_pid;
+	vpn->ssl_read_fd = ssl_client_fds[0];
+	vpn->ssl_write_fd = ssl_client_fds[1];
 
 	debug ("request [%s]\n", vpn_http_get);
 
 	if (write (ssl_client_fds[1], vpn_http_get, strlen (vpn_http_get)) == -1) {
 		g_free (vpn_http_get);
 		vpn->err = g_error_new (F5VPN_CONNECT_ERROR, F5VPN_CONNECT_ERROR_PARSE_FAILED, "Failed to write initial HTTP request: %s", strerror (errno));
-		g_timeout_add (0, callback_to_user, vpn);
+		fail_connection (vpn);
 		return;
 	}
 
 	g_free (vpn_http_get);
-	vpn->ssl_write_fd = ssl_client_fds[1];
-	g_unix_fd_add (ssl_client_fds[0], G_IO_IN, on_ssl_established, vpn);
+	vpn->ssl_established_id = context_unix_fd_add (vpn->main_context, vpn->ssl_read_fd, G_IO_IN, on_ssl_established, vpn);
 }
 
-F5VpnConnection *
-f5vpn_connect (GMainContext *main_context, const char *hostname, const char *session_key, const char *vpn_z_id, F5VpnConnectCallback callback, void *userdata)
+static void
+on_connection_parameters (F5VpnConnectParams *params, void *user, GError *err)
+{
+	F5VpnConnection *vpn = (F5VpnConnection *) user;
+
+	vpn->params_pending = FALSE;
+	if (err) {
+		/* Cancelled by f5vpn_disconnect, which reports a plain close, or
+		 * after a failure which has set its own error */
+		if (err->code == F5VPN_CONNECT_ERROR_CANCELLED)
+			g_clear_error (&err);
+		if (!vpn->err)
+			vpn->err = err;
+		else if (err)
+			g_error_free (err);
+		/* Once pppd has exited, its exit handler reports the error */
+		stop_connection (vpn);
+		if (!vpn->ppd_pid)
+			callback_to_user (vpn);
+		return;
+	}
+
+	end_phase (vpn, F5VPN_STATS_PHASE_CONNECT_PARAMS);
+	start_tunnel (vpn, params);
+}
+
+static F5VpnConnection *
+connection_new (GMainContext *main_context, const char *session_key, F5VpnConnectCallback callback, void *userdata)
 {
 	F5VpnConnection *vpn = calloc (1, sizeof (F5VpnConnection));
 
-	vpn->glc = glib_curl_new (main_context);
-	vpn->resp = g_string_new ("");
+	vpn->main_context = main_context;
 	vpn->callback = callback;
 	vpn->userdata = userdata;
 	vpn->session_key = strdup (session_key);
 	vpn->parsed_lans = NULL;
 	vpn->parsed_nameservers = NULL;
-	vpn->ppd_fd = 0;
+	vpn->parsed_search_domains = NULL;
+	vpn->parsed_split_domains = NULL;
+	vpn->ssl_read_fd = -1;
+	vpn->ssl_write_fd = -1;
+	vpn->ppd_fd = -1;
+	vpn->ppd_config_fd = -1;
+	vpn->plugin_fd = -1;
+	vpn->log_fd = -1;
 	vpn->openssl_pid = 0;
+	vpn->tunnel_fd = -1;
+	f5vpn_socket_profile_parse (F5VPN_SOCKET_PROFILE_DEFAULT, &vpn->socket_profile, NULL);
+	vpn->stats = &vpn->stats_local;
+	vpn->stats->magic = F5VPN_STATS_MAGIC;
+	vpn->stats->version = F5VPN_STATS_VERSION;
+	vpn->stats->size = sizeof (F5VpnStatsSegment);
+	vpn->stats->state = F5VPN_STATS_STATE_CONNECTING;
+	vpn->stats->link.lcp_echo_rtt_us = -1;
+	vpn->stats->srtt_us = -1;
+	vpn->stats->rttvar_us = -1;
+	vpn->keepalive_interval = F5VPN_KEEPALIVE_DEFAULT_INTERVAL;
+	vpn->keepalive_failures = F5VPN_KEEPALIVE_DEFAULT_FAILURES;
+	vpn->mtu = F5VPN_MTU_AUTO;
+	vpn->clamp_mss = FALSE;
+	vpn->phase_start = g_get_monotonic_time ();
+	vpn->phase = F5VPN_STATS_PHASE_CONNECT_PARAMS;
+	vpn->deadline_ms[F5VPN_STATS_PHASE_CONNECT_PARAMS] = F5VPN_CONNECT_PARAMS_DEFAULT_DEADLINE_MS;
+	vpn->deadline_ms[F5VPN_STATS_PHASE_TUNNEL_OPEN] = F5VPN_TUNNEL_OPEN_DEFAULT_DEADLINE_MS;
+	vpn->deadline_ms[F5VPN_STATS_PHASE_PPP_UP] = F5VPN_PPP_UP_DEFAULT_DEADLINE_MS;
+	/* Deferred to the main loop, as the keepalive settings it needs are only
+	 * set after f5vpn_connect returns */
+	vpn->prelaunch_id = context_timeout_add (main_context, 0, prelaunch_pppd, vpn);
+	return vpn;
+}
 
-	gchar *url = g_strdup_printf ("https://%s/vdesk/vpn/connect.php3?resourcename=%s&outform=xml&client_version=1.1", hostname, vpn_z_id);
-	gchar *cookie = g_strdup_printf ("MRHSession=%s;", session_key);
+F5VpnConnection *
+f5vpn_connect (GMainContext *main_context, const char *hostname, const char *session_key, const char *vpn_z_id, F5VpnConnectCallback callback, void *userdata)
+{
+	F5VpnConnection *vpn = connection_new (main_context, session_key, callback, userdata);
+	vpn->params = f5vpn_connect_params_begin (main_context, hostname, session_key, vpn_z_id, on_connection_parameters, vpn);
+	vpn->params_pending = TRUE;
+	return vpn;
+}
 
-	CURL *curl = curl_easy_init ();
-	curl_easy_setopt (curl, CURLOPT_WRITEFUNCTION, curl_write_to_gstring);
-	curl_easy_setopt (curl, CURLOPT_WRITEDATA, vpn->resp);
+F5VpnConnection *
+f5vpn_connect_with_params (const F5VpnConnectParams *params, const char *session_key, F5VpnConnectCallback callback, void *userdata)
+{
+	F5VpnConnection *vpn = connection_new (params->main_context, session_key, callback, userdata);
+	vpn->stats->phase_us[F5VPN_STATS_PHASE_CONNECT_PARAMS] = params->fetch_us;
+	vpn->phase = F5VPN_STATS_PHASE_TUNNEL_OPEN;
+	arm_deadline (vpn);
+	start_tunnel (vpn, params);
+	return vpn;
+}
 
-	curl_easy_setopt (curl, CURLOPT_COOKIE, cookie);
-	curl_easy_setopt (curl, CURLOPT_URL, url);
+void
+f5vpn_connect_share_http_state (void)
+{
+	glib_curl_share_state ();
+}
 
-	// necessary?
-	curl_easy_setopt (curl, CURLOPT_USERAGENT, "Mozilla/5.0 (Linux) F5Launcher/1.0");
+gboolean
+f5vpn_connection_publish_stats (F5VpnConnection *connection, const char *path, GError **err)
+{
+	F5VpnStatsSegment *seg;
+	g_return_val_if_fail (connection->stats == &connection->stats_local, FALSE);
 
-	g_free (url);
-	g_free (cookie);
-	glib_curl_send (vpn->glc, curl, handle_connection_parameters, vpn);
+	int fd = open (path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd == -1) {
+		g_set_error (err, F5VPN_CONNECT_ERROR, F5VPN_CONNECT_ERROR_STATS_FILE, "Could not open %s: %s", path, strerror (errno));
+		return FALSE;
+	}
 
-	return vpn;
+	if (ftruncate (fd, sizeof (F5VpnStatsSegment)) == -1) {
+		g_set_error (err, F5VPN_CONNECT_ERROR, F5VPN_CONNECT_ERROR_STATS_FILE, "Could not resize %s: %s", path, strerror (errno));
+		close (fd);
+		return FALSE;
+	}
+
+	seg = mmap (NULL, sizeof (F5VpnStatsSegment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close (fd);
+	if (seg == MAP_FAILED) {
+		g_set_error (err, F5VPN_CONNECT_ERROR, F5VPN_CONNECT_ERROR_STATS_FILE, "Could not map %s: %s", path, strerror (errno));
+		return FALSE;
+	}
+
+	/* Keep the sequence counter moving forward so that readers which were
+	 * sampling the old segment notice the change */
+	uint32_t seq = seg->seq | 1;
+	__atomic_store_n (&seg->seq, seq, __ATOMIC_RELAXED);
+	__atomic_thread_fence (__ATOMIC_RELEASE);
+	size_t hdr = offsetof (F5VpnStatsSegment, state);
+	memcpy ((char *) seg + hdr, (char *) &connection->stats_local + hdr, sizeof (F5VpnStatsSegment) - hdr);
+	seg->magic = F5VPN_STATS_MAGIC;
+	seg->version = F5VPN_STATS_VERSION;
+	seg->size = sizeof (F5VpnStatsSegment);
+	__atomic_store_n (&seg->seq, seq + 1, __ATOMIC_RELEASE);
+
+	connection->stats = seg;
+	return TRUE;
+}
+
+void
+f5vpn_connection_set_reconnects (F5VpnConnection *connection, guint reconnects)
+{
+	g_return_if_fail (connection->stats == &connection->stats_local);
+	connection->stats_local.reconnects = reconnects;
+}
+
+void
+f5vpn_connection_set_keepalive (F5VpnConnection *connection, guint interval, guint failures)
+{
+	g_return_if_fail (connection->ppd_pid == 0);
+	connection->keepalive_interval = interval;
+	connection->keepalive_failures = failures;
+}
+
+void
+f5vpn_connection_set_mtu (F5VpnConnection *connection, gint mtu, gboolean clamp_mss)
+{
+	g_return_if_fail (connection->ppd_pid == 0);
+	connection->mtu = mtu;
+	connection->clamp_mss = clamp_mss;
+}
+
+void
+f5vpn_connection_set_early_settings (F5VpnConnection *connection, gboolean enable)
+{
+	g_return_if_fail (connection->ppd_pid == 0);
+	connection->early_settings = enable;
+}
+
+gboolean
+f5vpn_socket_profile_parse (const char *spec, F5VpnSocketProfile *profile, GError **err)
+{
+	static const struct
+	{
+		const char *name;
+		F5VpnSocketProfile profile;
+	} presets[] = {
+		{ "interactive", { 1, 16384, -1, -1, 30, -1 } },
+		{ "throughput", { 0, -1, 4 << 20, 4 << 20, 30, -1 } },
+		{ "kernel", { -1, -1, -1, -1, -1, -1 } },
+	};
+	gchar **items = g_strsplit (spec, ",", -1);
+	gboolean found = FALSE;
+
+	for (size_t i = 0; i < G_N_ELEMENTS (presets); ++i) {
+		if (items[0] && !strcmp (items[0], presets[i].name)) {
+			*profile = presets[i].profile;
+			found = TRUE;
+		}
+	}
+	if (!found) {
+		g_set_error (err, F5VPN_CONNECT_ERROR, F5VPN_CONNECT_ERROR_BAD_SOCKET_PROFILE, "Unknown socket profile '%s'", items[0] ? items[0] : "");
+		g_strfreev (items);
+		return FALSE;
+	}
+
+	for (gchar **item = items + 1; *item; ++item) {
+		char *value = strchr (*item, '=');
+		char *end;
+		gint *field = NULL;
+
+		if (value) {
+			*value++ = '\0';
+			if (!strcmp (*item, "nodelay"))
+				field = &profile->nodelay;
+			else if (!strcmp (*item, "notsent-lowat"))
+				field = &profile->notsent_lowat;
+			else if (!strcmp (*item, "sndbuf"))
+				field = &profile->sndbuf;
+			else if (!strcmp (*item, "rcvbuf"))
+				field = &profile->rcvbuf;
+			else if (!strcmp (*item, "keepalive"))
+				field = &profile->keepalive_idle;
+			else if (!strcmp (*item, "busy-poll"))
+				field = &profile->busy_poll;
+		}
+		if (!field) {
+			g_set_error (err, F5VPN_CONNECT_ERROR, F5VPN_CONNECT_ERROR_BAD_SOCKET_PROFILE, "Unknown socket profile option '%s'", *item);
+			g_strfreev (items);
+			return FALSE;
+		}
+		long n = strtol (value, &end, 10);
+		if (*value == '\0' || *end != '\0' || n < -1 || n > G_MAXINT) {
+			g_set_error (err, F5VPN_CONNECT_ERROR, F5VPN_CONNECT_ERROR_BAD_SOCKET_PROFILE, "Invalid value '%s' for socket profile option '%s'", value, *item);
+			g_strfreev (items);
+			return FALSE;
+		}
+		*field = n;
+	}
+
+	g_strfreev (items);
+	return TRUE;
+}
+
+void
+f5vpn_connection_set_socket_profile (F5VpnConnection *connection, const F5VpnSocketProfile *profile)
+{
+	g_return_if_fail (connection->ppd_pid == 0);
+	connection->socket_profile = *profile;
+}
+
+gint64
+f5vpn_connection_get_rtt (F5VpnConnection *connection)
+{
+	return connection->stats->srtt_us;
+}
+
+const F5VpnStatsSegment *
+f5vpn_connection_get_stats (F5VpnConnection *connection)
+{
+	return connection->stats;
+}
+
+static void
+dump_latency_histogram (GString *out, const char *name, const uint64_t *buckets)
+{
+	static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+	uint64_t total = 0, seen = 0;
+	unsigned int q = 0, max = 0;
+
+	for (unsigned int i = 0; i < F5VPN_STATS_LATENCY_BUCKETS; ++i) {
+		total += buckets[i];
+		if (buckets[i])
+			max = i;
+	}
+
+	g_string_append_printf (out, "%s: %" G_GUINT64_FORMAT " chunks", name, total);
+	if (total == 0) {
+		g_string_append (out, "\n");
+		return;
+	}
+
+	/* Report the upper end of the bucket in which each quantile falls */
+	for (unsigned int i = 0; i < F5VPN_STATS_LATENCY_BUCKETS && q < G_N_ELEMENTS (quantiles); ++i) {
+		seen += buckets[i];
+		while (q < G_N_ELEMENTS (quantiles) && seen >= quantiles[q] * total) {
+			g_string_append_printf (out, ", p%g <%" G_GUINT64_FORMAT "ns", quantiles[q] * 100, f5vpn_stats_latency_bucket_floor (i + 1));
+			q++;
+		}
+	}
+	g_string_append_printf (out, ", max <%" G_GUINT64_FORMAT "ns\n", f5vpn_stats_latency_bucket_floor (max + 1));
+
+	for (unsigned int i = 0; i <= max; ++i) {
+		if (buckets[i])
+			g_string_append_printf (out, "  [%" G_GUINT64_FORMAT ", %" G_GUINT64_FORMAT ")ns %" G_GUINT64_FORMAT "\n", f5vpn_stats_latency_bucket_floor (i), f5vpn_stats_latency_bucket_floor (i + 1), buckets[i]);
+	}
+}
+
+gchar *
+f5vpn_connection_dump_latency (F5VpnConnection *connection)
+{
+	GString *out = g_string_new ("");
+	dump_latency_histogram (out, "gateway to pppd", connection->stats->latency[F5VPN_STATS_DIR_RX]);
+	dump_latency_histogram (out, "pppd to gateway", connection->stats->latency[F5VPN_STATS_DIR_TX]);
+	return g_string_free (out, FALSE);
+}
+
+void
+f5vpn_connection_set_deadline (F5VpnConnection *connection, F5VpnStatsPhase phase, guint timeout_ms)
+{
+	connection->deadline_ms[phase] = timeout_ms;
+	if (phase == F5VPN_STATS_PHASE_CONNECT_PARAMS && connection->params)
+		f5vpn_connect_params_set_deadline (connection->params, timeout_ms);
+	else if (connection->phase == phase)
+		arm_deadline (connection);
 }
 
 void
 f5vpn_disconnect (F5VpnConnection *connection)
 {
-	if (connection->ppd_pid)
-		kill (connection->ppd_pid, SIGTERM);
-	if (connection->openssl_pid)
-		kill (connection->openssl_pid, SIGTERM);
+	stop_connection (connection);
 }
 
 void
@@ -626,13 +1743,26 @@ f5vpn_connection_free (F5VpnConnection *connection)
 	/* f5vpn_connection_free should really only be called after the child processes are reaped */
 	g_warn_if_fail (connection->ppd_pid == 0);
 	g_warn_if_fail (connection->openssl_pid == 0);
+	disarm_deadline (connection);
+	stop_forwarding (connection);
+	close_child_fds (connection);
+	clear_mss_clamp (connection);
+	if (connection->prelaunch_id)
+		context_source_remove (connection->main_context, connection->prelaunch_id);
+
+	if (connection->stats != &connection->stats_local)
+		munmap (connection->stats, sizeof (F5VpnStatsSegment));
 
 	g_slist_free_full (connection->parsed_lans, free);
 	g_slist_free_full (connection->parsed_nameservers, free);
+	g_slist_free_full (connection->parsed_search_domains, g_free);
+	g_slist_free_full (connection->parsed_split_domains, g_free);
 
 	/* Do NOT free connection->err, it belongs to the library user */
+	g_free (connection->tunnel_host);
+	g_free (connection->tunnel_port);
 	g_free (connection->session_key);
-	g_string_free (connection->resp, TRUE);
-	glib_curl_free (connection->glc);
+	if (connection->params)
+		f5vpn_connect_params_free (connection->params);
 	free (connection);
 }
@@ -18,7 +18,9 @@
  * USA.
  */
 #include "f5vpn_getsid.h"
+#include "f5vpn_parse.h"
 #include "glib_curl.h"
+#include "glib_request.h"
 
 G_DEFINE_QUARK (f5vpn - getsid - error - quark, f5vpn_getsid_error)
 #define F5VPN_GETSID_ERROR f5vpn_getsid_error_quark ()
@@ -37,12 +39,30 @@ struct _F5VpnGetSid
 	struct curl_slist *headers;
 	gchar *sid;
 	GError *err;
+	GMainContext *glib_context;
+	gint64 start_us;
+	guint deadline_ms;
+	GlibRequest req;
 };
 
+static gboolean
+on_deadline (gpointer user)
+{
+	F5VpnGetSid *getsid = (F5VpnGetSid *) user;
+	GError *err = g_error_new (F5VPN_GETSID_ERROR, F5VPN_GETSID_ERROR_TIMED_OUT, "Timed out after %u ms exchanging the One-Time-Code", getsid->deadline_ms);
+
+	glib_curl_abort (getsid->glc, err);
+	g_error_free (err);
+	return G_SOURCE_REMOVE;
+}
+
 static gboolean
 report_getsid_state (gpointer user)
 {
 	F5VpnGetSid *getsid = (F5VpnGetSid *) user;
+	/* A result which was already on its way is replaced by the cancellation */
+	if (getsid->req.cancelled && !getsid->err)
+		getsid->err = g_error_new (F5VPN_GETSID_ERROR, F5VPN_GETSID_ERROR_CANCELLED, "Session ID request cancelled");
 	(getsid->callback) (getsid, getsid->sid, getsid->userdata, getsid->err);
 	getsid->err = NULL;
 	return G_SOURCE_REMOVE;
@@ -56,9 +76,8 @@ on_get_sessid_response (CURL *curl, void *user, GError *err)
 
 	if (err) {
 		getsid->err = err;
-		getsid->callback (getsid, NULL, getsid->userdata, err);
 		curl_easy_cleanup (curl);
-		g_timeout_add (0, report_getsid_state, getsid);
+		glib_request_report (&getsid->req, report_getsid_state);
 		return;
 	}
 
@@ -66,7 +85,7 @@ on_get_sessid_response (CURL *curl, void *user, GError *err)
 	if (response_code != 200) {
 		getsid->err = g_error_new (F5VPN_GETSID_ERROR, 0, "Unexpected HTTP response code %lu received", response_code);
 		curl_easy_cleanup (curl);
-		g_timeout_add (0, report_getsid_state, getsid);
+		glib_request_report (&getsid->req, report_getsid_state);
 		return;
 	}
 
@@ -74,24 +93,21 @@ on_get_sessid_response (CURL *curl, void *user, GError *err)
 
 	if (getsid->sid == NULL) {
 		getsid->err = g_error_new (F5VPN_GETSID_ERROR, 0, "%s", "Failed to parse X-ACCESS-Session-ID header from response");
-		g_timeout_add (0, report_getsid_state, getsid);
+		glib_request_report (&getsid->req, report_getsid_state);
 		return;
 	}
 
 	// all good
-	g_timeout_add (0, report_getsid_state, getsid);
+	glib_request_report (&getsid->req, report_getsid_state);
 }
 
 static size_t
 header_callback (char *buffer, size_t size, size_t nitems, void *user)
 {
 	F5VpnGetSid *getsid = (F5VpnGetSid *) user;
-	const char expected[] = "X-ACCESS-Session-ID: ";
-	size_t elen = strlen (expected);
 
-	if (getsid->sid == NULL && nitems - strlen ("\r\n") > elen && strncmp (expected, buffer, elen) == 0) {
-		getsid->sid = strndup (&buffer[elen], nitems - strlen ("\r\n") - elen);
-	}
+	if (getsid->sid == NULL)
+		getsid->sid = f5vpn_parse_sid_header (buffer, nitems);
 
 	return nitems * size;
 }
@@ -106,6 +122,10 @@ f5vpn_getsid_begin (GMainContext *glib_context, const char *host, const char *ot
 	getsid->headers = NULL;
 	getsid->sid = NULL;
 	getsid->err = NULL;
+	getsid->glib_context = glib_context;
+	getsid->start_us = g_get_monotonic_time ();
+	getsid->deadline_ms = F5VPN_GETSID_DEFAULT_DEADLINE_MS;
+	glib_request_init (&getsid->req, glib_context, on_deadline, getsid);
 
 	CURL *curl = curl_easy_init ();
 	curl_easy_setopt (curl, CURLOPT_SSL_VERIFYPEER, 1L);
@@ -128,13 +148,37 @@ f5vpn_getsid_begin (GMainContext *glib_context, const char *host, const char *ot
 	curl_easy_setopt (curl, CURLOPT_USERAGENT, "Mozilla/5.0 (Linux) F5Launcher/1.0");
 
 	glib_curl_send (getsid->glc, curl, on_get_sessid_response, getsid);
+	glib_request_arm (&getsid->req, getsid->start_us, getsid->deadline_ms);
 
 	return getsid;
 }
 
+void
+f5vpn_getsid_set_deadline (F5VpnGetSid *getsid, guint timeout_ms)
+{
+	getsid->deadline_ms = timeout_ms;
+	if (getsid->req.deadline)
+		glib_request_arm (&getsid->req, getsid->start_us, timeout_ms);
+}
+
+void
+f5vpn_getsid_cancel (F5VpnGetSid *getsid)
+{
+	GError *err = g_error_new (F5VPN_GETSID_ERROR, F5VPN_GETSID_ERROR_CANCELLED, "Session ID request cancelled");
+
+	glib_request_cancel (&getsid->req);
+	glib_curl_abort (getsid->glc, err);
+	g_error_free (err);
+}
+
 void
 f5vpn_getsid_free (F5VpnGetSid *getsid)
 {
+	/* Requests still in flight would otherwise call back into freed memory */
+	f5vpn_getsid_cancel (getsid);
+	glib_request_clear (&getsid->req);
+	if (getsid->err)
+		g_error_free (getsid->err);
 	free (getsid->sid);
 	curl_slist_free_all (getsid->headers);
 	glib_curl_free (getsid->glc);
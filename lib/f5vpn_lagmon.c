@@ -0,0 +1,212 @@
+/*
+ * NetworkManager-f5vpn
+ * Plugin for NetworkManager to access F5 Firepass SSL VPNs
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+#include "f5vpn_lagmon.h"
+#include "f5vpn_stats.h"
+#include <errno.h>
+#include <execinfo.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+
+#define STALL_SIGNAL SIGPROF
+
+typedef struct
+{
+	GSource source;
+	F5VpnLagMonitor *monitor;
+} TickSource;
+
+struct _F5VpnLagMonitor
+{
+	TickSource *tick;
+	guint interval_ms;
+	guint stall_ms;
+
+	/* Dispatch lateness in nanoseconds, using the buckets of the connection
+	 * statistics */
+	uint64_t lag[F5VPN_STATS_LATENCY_BUCKETS];
+	uint64_t stalls;
+	gint64 started_us;
+
+	/* Shared with the watchdog thread; heartbeat_us is 0 until the context
+	 * dispatched the tick once and loop_thread is known */
+	pthread_t loop_thread;
+	gint64 heartbeat_us;
+	GThread *watchdog;
+	GMutex lock;
+	GCond cond;
+	gboolean stop;
+};
+
+/* Only async-signal-safe calls, the first backtrace () having been made in
+ * f5vpn_lag_monitor_start already */
+static void
+on_stall_signal (int sig)
+{
+	static const char msg[] = "main loop stalled in:\n";
+	void *frames[32];
+	int saved_errno = errno;
+
+	(void) sig;
+	if (write (STDERR_FILENO, msg, sizeof (msg) - 1) == -1)
+		return;
+	int n = backtrace (frames, G_N_ELEMENTS (frames));
+	/* The first frame is this handler */
+	backtrace_symbols_fd (frames + 1, n - 1, STDERR_FILENO);
+	errno = saved_errno;
+}
+
+static gboolean
+tick_dispatch (GSource *source, GSourceFunc callback, gpointer user_data)
+{
+	(void) callback;
+	(void) user_data;
+
+	F5VpnLagMonitor *monitor = ((TickSource *) source)->monitor;
+	gint64 now = g_get_monotonic_time ();
+	gint64 lag_us = MAX (now - g_source_get_ready_time (source), 0);
+
+	monitor->lag[f5vpn_stats_latency_bucket (lag_us * 1000)]++;
+	if (lag_us >= (gint64) monitor->stall_ms * 1000) {
+		monitor->stalls++;
+		g_message ("main loop dispatched %" G_GINT64_FORMAT " ms late", lag_us / 1000);
+	}
+
+	if (!__atomic_load_n (&monitor->heartbeat_us, __ATOMIC_RELAXED))
+		monitor->loop_thread = pthread_self ();
+	__atomic_store_n (&monitor->heartbeat_us, now, __ATOMIC_RELEASE);
+
+	g_source_set_ready_time (source, now + monitor->interval_ms * 1000);
+	return G_SOURCE_CONTINUE;
+}
+
+static GSourceFuncs tick_funcs = {
+	.dispatch = tick_dispatch,
+};
+
+static gpointer
+watchdog_run (gpointer user)
+{
+	F5VpnLagMonitor *monitor = (F5VpnLagMonitor *) user;
+	gint64 reported = 0;
+
+	g_mutex_lock (&monitor->lock);
+	while (!monitor->stop) {
+		g_cond_wait_until (&monitor->cond, &monitor->lock, g_get_monotonic_time () + monitor->stall_ms * 1000 / 2);
+		if (monitor->stop)
+			break;
+
+		/* Each stall is reported once, while it is still going on */
+		gint64 beat = __atomic_load_n (&monitor->heartbeat_us, __ATOMIC_ACQUIRE);
+		gint64 overdue_us = g_get_monotonic_time () - beat - monitor->interval_ms * 1000;
+		if (beat && beat != reported && overdue_us >= (gint64) monitor->stall_ms * 1000) {
+			reported = beat;
+			pthread_kill (monitor->loop_thread, STALL_SIGNAL);
+		}
+	}
+	g_mutex_unlock (&monitor->lock);
+	return NULL;
+}
+
+F5VpnLagMonitor *
+f5vpn_lag_monitor_start (GMainContext *main_context, guint interval_ms, guint stall_ms)
+{
+	static gsize handler_installed = 0;
+	F5VpnLagMonitor *monitor = calloc (1, sizeof (F5VpnLagMonitor));
+
+	if (g_once_init_enter (&handler_installed)) {
+		void *frame;
+		struct sigaction sa = { 0 };
+
+		/* Loads the unwinder now rather than in the signal handler */
+		backtrace (&frame, 1);
+		sa.sa_handler = on_stall_signal;
+		sa.sa_flags = SA_RESTART;
+		sigemptyset (&sa.sa_mask);
+		sigaction (STALL_SIGNAL, &sa, NULL);
+		g_once_init_leave (&handler_installed, 1);
+	}
+
+	monitor->interval_ms = MAX (interval_ms, 1);
+	monitor->stall_ms = MAX (stall_ms, 1);
+	monitor->started_us = g_get_monotonic_time ();
+	g_mutex_init (&monitor->lock);
+	g_cond_init (&monitor->cond);
+
+	monitor->tick = (TickSource *) g_source_new (&tick_funcs, sizeof (TickSource));
+	monitor->tick->monitor = monitor;
+	g_source_set_name ((GSource *) monitor->tick, "f5vpn-lag-monitor");
+	/* Ahead of everything else, so that its own lateness is the loop's */
+	g_source_set_priority ((GSource *) monitor->tick, G_PRIORITY_HIGH);
+	g_source_set_ready_time ((GSource *) monitor->tick, g_get_monotonic_time () + monitor->interval_ms * 1000);
+	g_source_attach ((GSource *) monitor->tick, main_context);
+
+	monitor->watchdog = g_thread_new ("f5vpn-lag-watchdog", watchdog_run, monitor);
+	return monitor;
+}
+
+gchar *
+f5vpn_lag_monitor_dump (F5VpnLagMonitor *monitor)
+{
+	static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+	GString *out = g_string_new ("");
+	uint64_t total = 0, seen = 0;
+	unsigned int q = 0, max = 0;
+
+	for (unsigned int i = 0; i < F5VPN_STATS_LATENCY_BUCKETS; ++i) {
+		total += monitor->lag[i];
+		if (monitor->lag[i])
+			max = i;
+	}
+
+	g_string_append_printf (out, "dispatch lag: %" G_GUINT64_FORMAT " ticks of %ums over %" G_GINT64_FORMAT "s, %" G_GUINT64_FORMAT " stalls of %ums or more",
+	                        total, monitor->interval_ms, (g_get_monotonic_time () - monitor->started_us) / G_USEC_PER_SEC, monitor->stalls, monitor->stall_ms);
+	if (total == 0) {
+		g_string_append (out, "\n");
+		return g_string_free (out, FALSE);
+	}
+
+	/* Report the upper end of the bucket in which each quantile falls */
+	for (unsigned int i = 0; i < F5VPN_STATS_LATENCY_BUCKETS && q < G_N_ELEMENTS (quantiles); ++i) {
+		seen += monitor->lag[i];
+		while (q < G_N_ELEMENTS (quantiles) && seen >= quantiles[q] * total) {
+			g_string_append_printf (out, ", p%g <%" G_GUINT64_FORMAT "us", quantiles[q] * 100, f5vpn_stats_latency_bucket_floor (i + 1) / 1000);
+			q++;
+		}
+	}
+	g_string_append_printf (out, ", max <%" G_GUINT64_FORMAT "us\n", f5vpn_stats_latency_bucket_floor (max + 1) / 1000);
+	return g_string_free (out, FALSE);
+}
+
+void
+f5vpn_lag_monitor_free (F5VpnLagMonitor *monitor)
+{
+	g_mutex_lock (&monitor->lock);
+	monitor->stop = TRUE;
+	g_cond_signal (&monitor->cond);
+	g_mutex_unlock (&monitor->lock);
+	g_thread_join (monitor->watchdog);
+
+	g_source_destroy ((GSource *) monitor->tick);
+	g_source_unref ((GSource *) monitor->tick);
+	g_mutex_clear (&monitor->lock);
+	g_cond_clear (&monitor->cond);
+	free (monitor);
+}
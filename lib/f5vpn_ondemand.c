@@ -0,0 +1,267 @@
+/*
+ * NetworkManager-f5vpn
+ * Plugin for NetworkManager to access F5 Firepass SSL VPNs
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+#include "f5vpn_ondemand.h"
+#include "glib_context.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/if_tun.h>
+#include <net/ethernet.h>
+#include <net/if.h>
+#include <netinet/ip.h>
+#include <netpacket/packet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+G_DEFINE_QUARK (f5vpn - ondemand - error - quark, f5vpn_ondemand_error)
+#define F5VPN_ONDEMAND_ERROR f5vpn_ondemand_error_quark ()
+
+#ifdef WITH_DEBUG
+#define debug(...) fprintf (stderr, __VA_ARGS__)
+#else
+#define debug(...)
+#endif
+
+#define TUN_NAME_TEMPLATE "f5vpn%d"
+
+struct _F5VpnOnDemand
+{
+	GMainContext *main_context;
+	F5VpnOnDemandCallback callback;
+	void *userdata;
+	int tun_fd;
+	char device[IFNAMSIZ];
+	guint watch_id;
+
+	/* GBytes holding whole IPv4 packets */
+	GQueue queue;
+	gsize queued_bytes;
+	gboolean parked;
+	gboolean triggered;
+	gint64 parked_at;
+	gint64 first_packet_at;
+
+	guint idle_teardowns;
+	gint64 parked_us;
+	guint bringups;
+	gint64 latency_last_us;
+	gint64 latency_max_us;
+	gint64 latency_sum_us;
+	guint64 packets_queued;
+	guint64 packets_sent;
+	guint64 packets_dropped;
+
+	unsigned char buf[65535];
+};
+
+static void
+drop_queue (F5VpnOnDemand *ondemand)
+{
+	GBytes *packet;
+	while ((packet = g_queue_pop_head (&ondemand->queue))) {
+		ondemand->packets_dropped++;
+		g_bytes_unref (packet);
+	}
+	ondemand->queued_bytes = 0;
+}
+
+static gboolean
+on_tun_readable (gint fd, GIOCondition condition, gpointer user)
+{
+	(void) condition;
+
+	F5VpnOnDemand *ondemand = (F5VpnOnDemand *) user;
+	gboolean trigger = FALSE;
+	ssize_t n;
+
+	while ((n = read (fd, ondemand->buf, sizeof (ondemand->buf))) > 0) {
+		/* Only IPv4 is routed here; whatever arrives while the tunnel is up
+		 * was sent before its routes moved over */
+		if (!ondemand->parked || (ondemand->buf[0] >> 4) != 4
+		    || g_queue_get_length (&ondemand->queue) >= F5VPN_ONDEMAND_QUEUE_PACKETS
+		    || ondemand->queued_bytes + n > F5VPN_ONDEMAND_QUEUE_BYTES) {
+			ondemand->packets_dropped++;
+			continue;
+		}
+
+		g_queue_push_tail (&ondemand->queue, g_bytes_new (ondemand->buf, n));
+		ondemand->queued_bytes += n;
+		ondemand->packets_queued++;
+		if (!ondemand->triggered) {
+			ondemand->triggered = TRUE;
+			ondemand->first_packet_at = g_get_monotonic_time ();
+			trigger = TRUE;
+		}
+	}
+
+	/* Last, as the callback may free the structure */
+	if (trigger) {
+		debug ("on-demand: traffic on %s, bringing the tunnel up\n", ondemand->device);
+		(ondemand->callback) (ondemand, ondemand->userdata);
+	}
+	return G_SOURCE_CONTINUE;
+}
+
+F5VpnOnDemand *
+f5vpn_ondemand_new (GMainContext *main_context, F5VpnOnDemandCallback callback, void *userdata, GError **err)
+{
+	struct ifreq ifr;
+	int fd;
+
+	fd = open ("/dev/net/tun", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (fd == -1) {
+		g_set_error (err, F5VPN_ONDEMAND_ERROR, F5VPN_ONDEMAND_ERROR_TUN, "Could not open /dev/net/tun: %s", strerror (errno));
+		return NULL;
+	}
+
+	memset (&ifr, 0, sizeof (ifr));
+	ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
+	strcpy (ifr.ifr_name, TUN_NAME_TEMPLATE);
+	if (ioctl (fd, TUNSETIFF, &ifr) == -1) {
+		g_set_error (err, F5VPN_ONDEMAND_ERROR, F5VPN_ONDEMAND_ERROR_TUN, "Could not create a TUN interface: %s", strerror (errno));
+		close (fd);
+		return NULL;
+	}
+
+	F5VpnOnDemand *ondemand = calloc (1, sizeof (F5VpnOnDemand));
+	ondemand->main_context = main_context;
+	ondemand->callback = callback;
+	ondemand->userdata = userdata;
+	ondemand->tun_fd = fd;
+	memcpy (ondemand->device, ifr.ifr_name, IFNAMSIZ);
+	ondemand->device[IFNAMSIZ - 1] = '\0';
+	ondemand->latency_last_us = -1;
+	g_queue_init (&ondemand->queue);
+	ondemand->watch_id = context_unix_fd_add (main_context, fd, G_IO_IN, on_tun_readable, ondemand);
+
+	debug ("on-demand: placeholder interface %s\n", ondemand->device);
+	return ondemand;
+}
+
+const char *
+f5vpn_ondemand_get_device (F5VpnOnDemand *ondemand)
+{
+	return ondemand->device;
+}
+
+void
+f5vpn_ondemand_park (F5VpnOnDemand *ondemand)
+{
+	g_return_if_fail (!ondemand->parked);
+
+	ondemand->parked = TRUE;
+	ondemand->triggered = FALSE;
+	ondemand->parked_at = g_get_monotonic_time ();
+	ondemand->idle_teardowns++;
+}
+
+/* Sends the packet out of the interface directly, as the routing table may
+ * not point at it yet */
+static void
+send_packet (F5VpnOnDemand *ondemand, int sock, const struct sockaddr_ll *addr, GBytes *packet, uint32_t local_ip)
+{
+	gsize len;
+	const struct iphdr *ip = g_bytes_get_data (packet, &len);
+
+	if (sock == -1 || len < sizeof (struct iphdr) || ip->saddr != local_ip
+	    || sendto (sock, ip, len, 0, (const struct sockaddr *) addr, sizeof (*addr)) != (ssize_t) len)
+		ondemand->packets_dropped++;
+	else
+		ondemand->packets_sent++;
+}
+
+gboolean
+f5vpn_ondemand_flush (F5VpnOnDemand *ondemand, const char *ifname, uint32_t local_ip)
+{
+	struct sockaddr_ll addr;
+	GBytes *packet;
+	int sock;
+
+	if (!ondemand->parked)
+		return FALSE;
+
+	gint64 now = g_get_monotonic_time ();
+	ondemand->parked = FALSE;
+	ondemand->parked_us += now - ondemand->parked_at;
+	if (ondemand->triggered) {
+		gint64 latency = now - ondemand->first_packet_at;
+		ondemand->bringups++;
+		ondemand->latency_last_us = latency;
+		ondemand->latency_sum_us += latency;
+		ondemand->latency_max_us = MAX (ondemand->latency_max_us, latency);
+	}
+
+	memset (&addr, 0, sizeof (addr));
+	addr.sll_family = AF_PACKET;
+	addr.sll_protocol = htons (ETH_P_IP);
+	addr.sll_ifindex = if_nametoindex (ifname);
+	sock = addr.sll_ifindex ? socket (AF_PACKET, SOCK_DGRAM | SOCK_CLOEXEC, 0) : -1;
+	if (sock == -1) {
+		debug ("on-demand: cannot send the queued packets through %s: %s\n", ifname, strerror (errno));
+	}
+
+	while ((packet = g_queue_pop_head (&ondemand->queue))) {
+		send_packet (ondemand, sock, &addr, packet, local_ip);
+		g_bytes_unref (packet);
+	}
+	ondemand->queued_bytes = 0;
+
+	if (sock != -1)
+		close (sock);
+	return TRUE;
+}
+
+gint64
+f5vpn_ondemand_get_last_latency (F5VpnOnDemand *ondemand)
+{
+	return ondemand->latency_last_us;
+}
+
+gchar *
+f5vpn_ondemand_dump (F5VpnOnDemand *ondemand)
+{
+	GString *out = g_string_new ("");
+	gint64 parked_us = ondemand->parked_us;
+
+	if (ondemand->parked)
+		parked_us += g_get_monotonic_time () - ondemand->parked_at;
+
+	g_string_append_printf (out, "on-demand: %s, %u idle teardowns, parked for %" G_GINT64_FORMAT "s in total\n",
+	                        ondemand->parked ? "parked" : "tunnel up", ondemand->idle_teardowns, parked_us / G_USEC_PER_SEC);
+	g_string_append_printf (out, "on-demand: %u bring-ups", ondemand->bringups);
+	if (ondemand->bringups)
+		g_string_append_printf (out, ", first-packet latency last %" G_GINT64_FORMAT "ms mean %" G_GINT64_FORMAT "ms max %" G_GINT64_FORMAT "ms",
+		                        ondemand->latency_last_us / 1000, ondemand->latency_sum_us / ondemand->bringups / 1000, ondemand->latency_max_us / 1000);
+	g_string_append_printf (out, "\non-demand: %" G_GUINT64_FORMAT " packets queued, %" G_GUINT64_FORMAT " sent, %" G_GUINT64_FORMAT " dropped\n",
+	                        ondemand->packets_queued, ondemand->packets_sent, ondemand->packets_dropped);
+	return g_string_free (out, FALSE);
+}
+
+void
+f5vpn_ondemand_free (F5VpnOnDemand *ondemand)
+{
+	context_source_remove (ondemand->main_context, ondemand->watch_id);
+	drop_queue (ondemand);
+	close (ondemand->tun_fd);
+	free (ondemand);
+}
@@ -0,0 +1,332 @@
+/*
+ * NetworkManager-f5vpn
+ * Plugin for NetworkManager to access F5 Firepass SSL VPNs
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+#include "f5vpn_parse.h"
+#include <arpa/inet.h>
+#include <libxml/HTMLparser.h>
+#include <libxml/xpath.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_LOGIN_FIELDS 5
+typedef struct
+{
+	gboolean in_form;
+	gboolean in_label;
+	form_field *fields[MAX_LOGIN_FIELDS];
+	int field_idx;
+	int label_idx;
+	char *last_label;
+} html_parse_ctx;
+
+static void
+parse_login_page_cb_start_element (html_parse_ctx *ctx, const xmlChar *name, const xmlChar **atts)
+{
+	if (ctx->in_form) {
+		if (strcmp ((const char *) name, "label") == 0) {
+			g_assert_false (ctx->in_label);
+			ctx->in_label = TRUE;
+		} else if (strcmp ((const char *) name, "input") == 0) {
+			ctx->fields[ctx->field_idx] = calloc (sizeof (form_field), 1);
+			for (const xmlChar **p = atts; p && *p; p++) {
+				if (strcmp ((const char *) *p, "name") == 0 && p[1]) {
+					ctx->fields[ctx->field_idx]->name = strdup ((const char *) p[1]);
+					p++;
+				} else if (strcmp ((const char *) *p, "type") == 0 && p[1]) {
+					ctx->fields[ctx->field_idx]->type =
+					    (strcmp ((const char *) p[1], "text") == 0)
+					        ? FORM_FIELD_TEXT
+					    : (strcmp ((const char *) p[1], "password") == 0)
+					        ? FORM_FIELD_PASSWORD
+					    : (strcmp ((const char *) p[1], "hidden") == 0) ? FORM_FIELD_HIDDEN
+					                                                    : FORM_FIELD_OTHER;
+					p++;
+				} else if (strcmp ((const char *) *p, "value") == 0 && p[1]) {
+					ctx->fields[ctx->field_idx]->value = strdup ((const char *) p[1]);
+					p++;
+				}
+			}
+			if (ctx->last_label) {
+				ctx->fields[ctx->field_idx]->label = ctx->last_label;
+				ctx->last_label = NULL;
+			} else if (ctx->fields[ctx->field_idx]->name) {
+				ctx->fields[ctx->field_idx]->label =
+				    strdup (ctx->fields[ctx->field_idx]->name);
+			}
+		}
+	} else if (strcmp ((const char *) name, "form") == 0) {
+		for (const xmlChar **p = atts; p && *p; p++) {
+			if (strcmp ((const char *) p[0], "id") == 0 && p[1] && strcmp ((const char *) p[1], "auth_form") == 0) {
+				ctx->in_form = TRUE;
+				break;
+			}
+		}
+	}
+}
+
+static void
+parse_login_page_cb_characters (html_parse_ctx *ctx, const xmlChar *ch, int len)
+{
+	if (ctx->in_label)
+		ctx->last_label = strndup ((const char *) ch, len);
+}
+
+static void
+parse_login_page_cb_end_element (html_parse_ctx *ctx, const xmlChar *name)
+{
+	if (!ctx->in_form)
+		return;
+
+	if (strcmp ((const char *) name, "form") == 0) {
+		ctx->in_form = FALSE;
+	} else if (strcmp ((const char *) name, "label") == 0) {
+		g_assert_true (ctx->in_label);
+		ctx->in_label = FALSE;
+	} else if (strcmp ((const char *) name, "input") == 0) {
+		ctx->field_idx++;
+	}
+}
+
+form_field **
+f5vpn_parse_login_page (const char *html)
+{
+	html_parse_ctx ctx = {
+		.in_form = FALSE,
+		.field_idx = 0,
+		.label_idx = 0,
+		.last_label = NULL,
+	};
+	static xmlSAXHandler sax_parse_handlers = {
+		.startElement = (startElementSAXFunc) parse_login_page_cb_start_element,
+		.characters = (charactersSAXFunc) parse_login_page_cb_characters,
+		.endElement = (endElementSAXFunc) parse_login_page_cb_end_element,
+	};
+	htmlSAXParseDoc ((const xmlChar *) html, "utf-8", &sax_parse_handlers, &ctx);
+
+	form_field **fields = calloc (sizeof (form_field *), ctx.field_idx + 1);
+	for (int i = 0; i < ctx.field_idx; ++i)
+		fields[i] = ctx.fields[i];
+	return fields;
+}
+
+void
+f5vpn_parse_free_login_fields (form_field **fields)
+{
+	for (form_field **p = fields; *p; ++p) {
+		free ((*p)->label);
+		free ((*p)->name);
+		free ((*p)->value);
+		free (*p);
+	}
+	free (fields);
+}
+
+static gchar *
+xpath_string (xmlXPathContext *xpathCtx, const char *expr)
+{
+	gchar *ret = NULL;
+	xmlXPathObject *xpathObj = xmlXPathEvalExpression ((const xmlChar *) expr, xpathCtx);
+	if (xpathObj && xpathObj->stringval)
+		ret = g_strdup ((const gchar *) xpathObj->stringval);
+	xmlXPathFreeObject (xpathObj);
+	return ret;
+}
+
+gboolean
+f5vpn_parse_resource_list (const char *xml, size_t len, gchar **detail_uri, gchar ***queries)
+{
+	GPtrArray *found = g_ptr_array_new ();
+
+	*detail_uri = NULL;
+	xmlDoc *doc = xmlParseMemory (xml, len);
+	if (doc == NULL) {
+		*queries = NULL;
+		g_ptr_array_free (found, TRUE);
+		return FALSE;
+	}
+
+	xmlXPathContext *xpathCtx = xmlXPathNewContext (doc);
+	*detail_uri = xpath_string (xpathCtx, "string(/res[@type='resource_list']/opts/opt[@type='available_rq']/@uri)");
+	/* An empty string is as good as none */
+	if (*detail_uri && !**detail_uri) {
+		g_free (*detail_uri);
+		*detail_uri = NULL;
+	}
+
+	xmlXPathObject *xpathObj = xmlXPathEvalExpression ((const xmlChar *) "/res[@type='resource_list']/lists/list[@type='network_access']/entry", xpathCtx);
+	if (xpathObj && xpathObj->nodesetval) {
+		for (int i = 0; i < xpathObj->nodesetval->nodeNr; ++i) {
+			xmlNode *node = xpathObj->nodesetval->nodeTab[i];
+			for (xmlAttr *a = node->properties; a; a = a->next) {
+				if (strcmp ((const char *) a->name, "param") == 0 && a->children && node->children) {
+					g_ptr_array_add (found, g_strdup_printf ("%s=%s", a->children->content, node->children->content));
+					break;
+				}
+			}
+		}
+	}
+	xmlXPathFreeObject (xpathObj);
+	xmlXPathFreeContext (xpathCtx);
+	xmlFreeDoc (doc);
+
+	g_ptr_array_add (found, NULL);
+	*queries = (gchar **) g_ptr_array_free (found, FALSE);
+	return TRUE;
+}
+
+gboolean
+f5vpn_parse_resource_info (const char *xml, size_t len, vpn_tunnel *tunnel)
+{
+	xmlXPathObject *xpathObj;
+
+	memset (tunnel, 0, sizeof (*tunnel));
+	xmlDoc *doc = xmlParseMemory (xml, len);
+	if (doc == NULL)
+		return FALSE;
+
+	xmlXPathContext *xpathCtx = xmlXPathNewContext (doc);
+	xpathObj = xmlXPathEvalExpression ((const xmlChar *) "string(/resources/item/id)", xpathCtx);
+	if (xpathObj && xpathObj->stringval)
+		tunnel->id = strdup ((const char *) xpathObj->stringval);
+	xmlXPathFreeObject (xpathObj);
+
+	xpathObj = xmlXPathEvalExpression ((const xmlChar *) "string(/resources/item/caption)", xpathCtx);
+	if (xpathObj && xpathObj->stringval)
+		tunnel->label = strdup ((const char *) xpathObj->stringval);
+	xmlXPathFreeObject (xpathObj);
+
+	xpathObj = xmlXPathEvalExpression ((const xmlChar *) "string(/resources/item/description)", xpathCtx);
+	if (xpathObj && xpathObj->stringval)
+		tunnel->description = strdup ((const char *) xpathObj->stringval);
+	xmlXPathFreeObject (xpathObj);
+
+	xpathObj = xmlXPathEvalExpression ((const xmlChar *) "string(/resources/item/autolaunch)", xpathCtx);
+	if (xpathObj && xpathObj->stringval)
+		tunnel->autolaunch = *xpathObj->stringval == '1';
+	xmlXPathFreeObject (xpathObj);
+
+	xmlXPathFreeContext (xpathCtx);
+	xmlFreeDoc (doc);
+	return TRUE;
+}
+
+gboolean
+f5vpn_parse_connect_params (const char *xml, size_t len, gchar **ur_Z, gchar **tunnel_host, gchar **tunnel_port, gchar **dns, gchar **lan, gchar **dns_suffix, gchar **dns_split)
+{
+	*ur_Z = *tunnel_host = *tunnel_port = *dns = *lan = *dns_suffix = *dns_split = NULL;
+	xmlDoc *doc = xmlParseMemory (xml, len);
+	if (doc == NULL)
+		return FALSE;
+
+	xmlXPathContext *xpathCtx = xmlXPathNewContext (doc);
+	*ur_Z = xpath_string (xpathCtx, "string(/favorite/object/ur_Z)");
+	*tunnel_host = xpath_string (xpathCtx, "string(/favorite/object/tunnel_host0)");
+	*tunnel_port = xpath_string (xpathCtx, "string(/favorite/object/tunnel_port0)");
+	*dns = xpath_string (xpathCtx, "string(/favorite/object/DNS0)");
+	*lan = xpath_string (xpathCtx, "string(/favorite/object/LAN0)");
+	*dns_suffix = xpath_string (xpathCtx, "string(/favorite/object/DNS_SUFFIX0)");
+	*dns_split = xpath_string (xpathCtx, "string(/favorite/object/DNS_SPLIT0)");
+	xmlXPathFreeContext (xpathCtx);
+	xmlFreeDoc (doc);
+	return TRUE;
+}
+
+GSList *
+f5vpn_parse_lans (const char *lans)
+{
+	char *addr, *subnet, *savep;
+	struct in_addr bin_addr, bin_subnet;
+	GSList *parsed = NULL;
+	gchar *copy = g_strdup (lans), *lan_segment = copy;
+
+	for (;;) {
+		addr = strtok_r (lan_segment, " ", &savep);
+		if (!addr)
+			break;
+		lan_segment = NULL;
+		subnet = strchr (addr, '/');
+		if (!subnet)
+			break;
+		*subnet++ = '\0';
+		if (inet_pton (AF_INET, addr, &bin_addr) != 1 || inet_pton (AF_INET, subnet, &bin_subnet) != 1)
+			continue;
+		LanAddr *la = malloc (sizeof (LanAddr));
+		la->addr = bin_addr;
+		la->mask = (32 - (uint8_t) __builtin_ctz (ntohl (bin_subnet.s_addr)));
+		parsed = g_slist_prepend (parsed, la);
+	}
+	g_free (copy);
+	return g_slist_reverse (parsed);
+}
+
+GSList *
+f5vpn_parse_nameservers (const char *nameservers)
+{
+	char *addr, *savep;
+	struct in_addr bin_addr;
+	GSList *parsed = NULL;
+	gchar *copy = g_strdup (nameservers), *list = copy;
+
+	for (;;) {
+		addr = strtok_r (list, " ", &savep);
+		if (!addr)
+			break;
+		list = NULL;
+
+		if (inet_pton (AF_INET, addr, &bin_addr) != 1)
+			continue;
+
+		struct in_addr *ns = malloc (sizeof (struct in_addr));
+		*ns = bin_addr;
+
+		parsed = g_slist_prepend (parsed, ns);
+	}
+	g_free (copy);
+	return g_slist_reverse (parsed);
+}
+
+GSList *
+f5vpn_parse_domains (const char *domains)
+{
+	GSList *parsed = NULL;
+	gchar **tokens = g_strsplit_set (domains ? domains : "", ", \t\r\n", -1);
+
+	for (gchar **t = tokens; *t; ++t) {
+		const char *domain = *t;
+		if (g_str_has_prefix (domain, "*."))
+			domain += 2;
+		while (*domain == '.')
+			domain++;
+		if (*domain)
+			parsed = g_slist_prepend (parsed, g_ascii_strdown (domain, -1));
+	}
+	g_strfreev (tokens);
+	return g_slist_reverse (parsed);
+}
+
+char *
+f5vpn_parse_sid_header (const char *line, size_t len)
+{
+	const char expected[] = "X-ACCESS-Session-ID: ";
+	size_t elen = strlen (expected);
+
+	if (len - strlen ("\r\n") > elen && strncmp (expected, line, elen) == 0)
+		return strndup (&line[elen], len - strlen ("\r\n") - elen);
+	return NULL;
+}
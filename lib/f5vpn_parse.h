@@ -0,0 +1,71 @@
+/*
+ * NetworkManager-f5vpn
+ * Plugin for NetworkManager to access F5 Firepass SSL VPNs
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+#ifndef F5VPN_PARSE_H
+#define F5VPN_PARSE_H
+
+#include "f5vpn_auth.h"
+#include "f5vpn_connect.h"
+#include <glib.h>
+
+/* Parsers for what the gateway sends during login and connection setup.
+ * They are kept apart from the network code so that they can be benchmarked
+ * on canned input. */
+
+/* Extracts the fields of the logon form (form id="auth_form") from an HTML
+ * page. The NULL-terminated array should be freed with
+ * f5vpn_parse_free_login_fields. */
+form_field **f5vpn_parse_login_page (const char *html);
+
+void f5vpn_parse_free_login_fields (form_field **fields);
+
+/* Parses the resource list, returning the URI of the resource detail request
+ * in *detail_uri (NULL if missing) and the query strings of that request
+ * ("param=value"), one per network access resource, in *queries as a
+ * NULL-terminated array. Returns FALSE if the XML is malformed. */
+gboolean f5vpn_parse_resource_list (const char *xml, size_t len, gchar **detail_uri, gchar ***queries);
+
+/* Parses the details of a network access resource into tunnel; members which
+ * are missing are left NULL. Returns FALSE if the XML is malformed. */
+gboolean f5vpn_parse_resource_info (const char *xml, size_t len, vpn_tunnel *tunnel);
+
+/* Parses the response of connect.php3; members which are missing are left
+ * NULL. dns_suffix receives the DNS suffixes (DNS_SUFFIX0) and dns_split the
+ * domains to be resolved through the tunnel's nameservers (DNS_SPLIT0).
+ * Returns FALSE if the XML is malformed. */
+gboolean f5vpn_parse_connect_params (const char *xml, size_t len, gchar **ur_Z, gchar **tunnel_host, gchar **tunnel_port, gchar **dns, gchar **lan, gchar **dns_suffix, gchar **dns_split);
+
+/* Parses a space separated list of "address/netmask" pairs into a list of
+ * LanAddr, skipping malformed ones */
+GSList *f5vpn_parse_lans (const char *lans);
+
+/* Parses a space separated list of addresses into a list of struct in_addr,
+ * skipping malformed ones */
+GSList *f5vpn_parse_nameservers (const char *nameservers);
+
+/* Parses a list of domains separated by commas or whitespace into a list of
+ * strings, dropping leading dots and "*." wildcards; a lone "*" stands for all
+ * domains */
+GSList *f5vpn_parse_domains (const char *domains);
+
+/* Returns the session ID if the header line (including its CRLF) is an
+ * X-ACCESS-Session-ID header, otherwise NULL */
+char *f5vpn_parse_sid_header (const char *line, size_t len);
+
+#endif // F5VPN_PARSE_H
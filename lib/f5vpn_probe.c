@@ -0,0 +1,189 @@
+/*
+ * NetworkManager-f5vpn
+ * Plugin for NetworkManager to access F5 Firepass SSL VPNs
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+#include "f5vpn_probe.h"
+#include "glib_context.h"
+#include "glib_curl.h"
+
+G_DEFINE_QUARK (f5vpn - probe - error - quark, f5vpn_probe_error)
+#define F5VPN_PROBE_ERROR f5vpn_probe_error_quark ()
+
+#ifdef WITH_DEBUG
+#define debug(...) fprintf (stderr, __VA_ARGS__)
+#else
+#define debug(...)
+#endif
+
+struct _F5VpnProbe
+{
+	F5VpnProbeResultCallback callback;
+	void *userdata;
+	GMainContext *glib_context;
+	GlibCurl *glc;
+	gboolean http_rtt;
+	int nr_pending;
+	F5VpnProbeResult **results;
+};
+
+typedef struct
+{
+	F5VpnProbe *probe;
+	F5VpnProbeResult *result;
+} ProbeCtx;
+
+static gint64
+probe_rank (const F5VpnProbeResult *result, gboolean http_rtt)
+{
+	if (result->err)
+		return G_MAXINT64;
+	return http_rtt ? result->http_us : result->tls_us;
+}
+
+static gboolean
+report_probe_results (gpointer user)
+{
+	F5VpnProbe *probe = (F5VpnProbe *) user;
+
+	/* Insertion sort, there are only a handful of gateways */
+	for (int i = 1; probe->results[i]; ++i) {
+		F5VpnProbeResult *r = probe->results[i];
+		int j = i;
+		for (; j > 0 && probe_rank (probe->results[j - 1], probe->http_rtt) > probe_rank (r, probe->http_rtt); --j)
+			probe->results[j] = probe->results[j - 1];
+		probe->results[j] = r;
+	}
+
+	(probe->callback) (probe, (const F5VpnProbeResult *const *) probe->results, probe->userdata);
+	return G_SOURCE_REMOVE;
+}
+
+static void
+on_probe_done (CURL *curl, void *user, GError *err)
+{
+	ProbeCtx *ctx = (ProbeCtx *) user;
+	F5VpnProbe *probe = ctx->probe;
+	F5VpnProbeResult *result = ctx->result;
+	curl_off_t connect_us = 0, tls_us = 0, http_us = 0;
+	long response_code = 0;
+
+	free (ctx);
+
+	curl_easy_getinfo (curl, CURLINFO_CONNECT_TIME_T, &connect_us);
+	curl_easy_getinfo (curl, CURLINFO_APPCONNECT_TIME_T, &tls_us);
+	curl_easy_getinfo (curl, CURLINFO_STARTTRANSFER_TIME_T, &http_us);
+	curl_easy_getinfo (curl, CURLINFO_RESPONSE_CODE, &response_code);
+	curl_easy_cleanup (curl);
+
+	result->connect_us = connect_us;
+	result->tls_us = tls_us;
+	result->http_us = probe->http_rtt ? http_us : -1;
+
+	if (err)
+		result->err = err;
+	else if (probe->http_rtt && (response_code < 200 || response_code >= 400))
+		result->err = g_error_new (F5VPN_PROBE_ERROR, 0, "Unexpected HTTP response code %lu", response_code);
+
+	debug ("probe %s: connect %" G_GINT64_FORMAT "us tls %" G_GINT64_FORMAT "us http %" G_GINT64_FORMAT "us %s\n",
+	       result->host, result->connect_us, result->tls_us, result->http_us, result->err ? result->err->message : "ok");
+
+	if (--probe->nr_pending == 0)
+		context_timeout_add (probe->glib_context, 0, report_probe_results, probe);
+}
+
+gchar **
+f5vpn_probe_split_hosts (const char *list)
+{
+	gchar **tokens = g_strsplit_set (list ? list : "", ",; \t\n", -1);
+	int n = 0;
+
+	/* Compact away empty tokens produced by repeated separators */
+	for (gchar **t = tokens; *t; ++t) {
+		if (**t)
+			tokens[n++] = *t;
+		else
+			g_free (*t);
+	}
+	tokens[n] = NULL;
+	return tokens;
+}
+
+F5VpnProbe *
+f5vpn_probe_begin (GMainContext *glib_context, const char *const *hosts, gboolean http_rtt, long timeout_ms, F5VpnProbeResultCallback callback, void *userdata)
+{
+	F5VpnProbe *probe = malloc (sizeof (F5VpnProbe));
+	int nr_hosts = 0;
+
+	while (hosts[nr_hosts])
+		nr_hosts++;
+
+	probe->callback = callback;
+	probe->userdata = userdata;
+	probe->glib_context = glib_context;
+	probe->glc = glib_curl_new (glib_context);
+	probe->http_rtt = http_rtt;
+	probe->nr_pending = nr_hosts;
+	probe->results = calloc (nr_hosts + 1, sizeof (F5VpnProbeResult *));
+
+	if (nr_hosts == 0) {
+		context_timeout_add (probe->glib_context, 0, report_probe_results, probe);
+		return probe;
+	}
+
+	for (int i = 0; i < nr_hosts; ++i) {
+		F5VpnProbeResult *result = calloc (1, sizeof (F5VpnProbeResult));
+		result->host = strdup (hosts[i]);
+		probe->results[i] = result;
+
+		ProbeCtx *ctx = malloc (sizeof (ProbeCtx));
+		ctx->probe = probe;
+		ctx->result = result;
+
+		CURL *curl = curl_easy_init ();
+		curl_easy_setopt (curl, CURLOPT_SSL_VERIFYPEER, 1L);
+		curl_easy_setopt (curl, CURLOPT_TIMEOUT_MS, timeout_ms);
+		if (http_rtt) {
+			/* The body of the logon page is irrelevant */
+			curl_easy_setopt (curl, CURLOPT_NOBODY, 1L);
+		} else {
+			curl_easy_setopt (curl, CURLOPT_CONNECT_ONLY, 1L);
+		}
+
+		gchar *url = g_strdup_printf ("https://%s/", hosts[i]);
+		curl_easy_setopt (curl, CURLOPT_URL, url);
+		g_free (url);
+
+		glib_curl_send (probe->glc, curl, on_probe_done, ctx);
+	}
+
+	return probe;
+}
+
+void
+f5vpn_probe_free (F5VpnProbe *probe)
+{
+	for (F5VpnProbeResult **r = probe->results; *r; ++r) {
+		free ((*r)->host);
+		if ((*r)->err)
+			g_error_free ((*r)->err);
+		free (*r);
+	}
+	free (probe->results);
+	glib_curl_free (probe->glc);
+	free (probe);
+}
@@ -0,0 +1,225 @@
+/*
+ * NetworkManager-f5vpn
+ * Plugin for NetworkManager to access F5 Firepass SSL VPNs
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+#include "f5vpn_backoff.h"
+#include "f5vpn_refresh.h"
+#include "glib_context.h"
+#include "glib_curl.h"
+
+G_DEFINE_QUARK (f5vpn - refresh - error - quark, f5vpn_refresh_error)
+#define F5VPN_REFRESH_ERROR f5vpn_refresh_error_quark ()
+
+#ifdef WITH_DEBUG
+#define debug(...) fprintf (stderr, __VA_ARGS__)
+#else
+#define debug(...)
+#endif
+
+/* Retries after transient failures start after about this long and back off
+ * up to the refresh interval */
+#define RETRY_BASE_DELAY_MS 1000
+
+struct _F5VpnRefresh
+{
+	F5VpnRefreshCallback callback;
+	void *userdata;
+	GMainContext *glib_context;
+	GlibCurl *glc;
+	gchar *url;
+	gchar *cookie;
+	guint interval;
+	/* Spaces out retries after failures which say nothing about the session */
+	F5VpnBackoff backoff;
+	GSource *timer;
+	guint count;
+	gboolean in_flight;
+	gboolean freed; /* free once the request in flight completes */
+	GError *err;
+	guint report_id;
+};
+
+static void schedule_refresh (F5VpnRefresh *refresh);
+static void schedule_retry (F5VpnRefresh *refresh);
+
+static void
+refresh_destroy (F5VpnRefresh *refresh)
+{
+	glib_curl_free (refresh->glc);
+	g_free (refresh->url);
+	g_free (refresh->cookie);
+	free (refresh);
+}
+
+/* The GlibCurl can't be freed from within its own callback */
+static gboolean
+refresh_destroy_later (gpointer user)
+{
+	refresh_destroy ((F5VpnRefresh *) user);
+	return G_SOURCE_REMOVE;
+}
+
+static gboolean
+report_refresh (gpointer user)
+{
+	F5VpnRefresh *refresh = (F5VpnRefresh *) user;
+	/* The error, if any, now belongs to the library user */
+	GError *err = refresh->err;
+	refresh->err = NULL;
+	refresh->report_id = 0;
+	(refresh->callback) (refresh, refresh->userdata, err);
+	return G_SOURCE_REMOVE;
+}
+
+static size_t
+discard_body (char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+	(void) ptr;
+	(void) userdata;
+	return size * nmemb;
+}
+
+static void
+on_refresh_response (CURL *curl, void *user, GError *err)
+{
+	F5VpnRefresh *refresh = (F5VpnRefresh *) user;
+	long response_code = 0;
+	char *location = NULL;
+
+	refresh->in_flight = FALSE;
+	curl_easy_getinfo (curl, CURLINFO_RESPONSE_CODE, &response_code);
+	curl_easy_getinfo (curl, CURLINFO_REDIRECT_URL, &location);
+	/* An expired session is redirected to the logon page */
+	gboolean to_logon = response_code / 100 == 3 && location && (strstr (location, "/my.policy") || strstr (location, "/my.logon"));
+	curl_easy_cleanup (curl);
+
+	if (refresh->freed) {
+		if (err)
+			g_error_free (err);
+		context_timeout_add (refresh->glib_context, 0, refresh_destroy_later, refresh);
+		return;
+	}
+
+	if (err) {
+		/* The gateway may just be unreachable for now */
+		debug ("session refresh failed: %s\n", err->message);
+		g_error_free (err);
+		schedule_retry (refresh);
+		return;
+	}
+
+	if (to_logon || response_code == 401 || response_code == 403) {
+		refresh->err = g_error_new (F5VPN_REFRESH_ERROR, F5VPN_REFRESH_ERROR_SESSION_LOST, "Session rejected with HTTP response code %lu after %u refreshes", response_code, refresh->count);
+		refresh->report_id = context_timeout_add (refresh->glib_context, 0, report_refresh, refresh);
+		return;
+	}
+
+	/* Such as a 502 to 504 while the gateway restarts or fails over, which
+	 * says nothing about the session */
+	if (response_code != 200) {
+		debug ("session refresh got HTTP response code %lu\n", response_code);
+		schedule_retry (refresh);
+		return;
+	}
+
+	f5vpn_backoff_reset (&refresh->backoff);
+	refresh->count++;
+	debug ("session refreshed (%u)\n", refresh->count);
+	schedule_refresh (refresh);
+	refresh->report_id = context_timeout_add (refresh->glib_context, 0, report_refresh, refresh);
+}
+
+static gboolean
+on_refresh_due (gpointer user)
+{
+	F5VpnRefresh *refresh = (F5VpnRefresh *) user;
+
+	g_source_unref (refresh->timer);
+	refresh->timer = NULL;
+
+	CURL *curl = curl_easy_init ();
+	curl_easy_setopt (curl, CURLOPT_URL, refresh->url);
+	curl_easy_setopt (curl, CURLOPT_COOKIE, refresh->cookie);
+	/* The body is of no interest, but a HEAD request might not count as
+	 * activity on the session */
+	curl_easy_setopt (curl, CURLOPT_WRITEFUNCTION, discard_body);
+	refresh->in_flight = TRUE;
+	glib_curl_send (refresh->glc, curl, on_refresh_response, refresh);
+
+	return G_SOURCE_REMOVE;
+}
+
+static void
+schedule_refresh (F5VpnRefresh *refresh)
+{
+	guint jitter = refresh->interval / 4;
+	guint delay = refresh->interval - jitter + g_random_int_range (0, 2 * jitter + 1);
+
+	refresh->timer = g_timeout_source_new_seconds (delay);
+	g_source_set_callback (refresh->timer, on_refresh_due, refresh, NULL);
+	g_source_attach (refresh->timer, refresh->glib_context);
+}
+
+static void
+schedule_retry (F5VpnRefresh *refresh)
+{
+	refresh->timer = g_timeout_source_new (f5vpn_backoff_next (&refresh->backoff, 0));
+	g_source_set_callback (refresh->timer, on_refresh_due, refresh, NULL);
+	g_source_attach (refresh->timer, refresh->glib_context);
+}
+
+F5VpnRefresh *
+f5vpn_refresh_begin (GMainContext *glib_context, const char *host, const char *session_key, guint interval, F5VpnRefreshCallback callback, void *userdata)
+{
+	F5VpnRefresh *refresh = calloc (1, sizeof (F5VpnRefresh));
+
+	refresh->callback = callback;
+	refresh->userdata = userdata;
+	refresh->glib_context = glib_context;
+	refresh->glc = glib_curl_new (glib_context);
+	refresh->url = g_strdup_printf ("https://%s/vdesk/resource_list.xml?resourcetype=res", host);
+	refresh->cookie = g_strdup_printf ("MRHSession=%s;", session_key);
+	refresh->interval = MAX (interval, 1);
+	f5vpn_backoff_init (&refresh->backoff, RETRY_BASE_DELAY_MS, refresh->interval * 1000);
+
+	schedule_refresh (refresh);
+	return refresh;
+}
+
+guint
+f5vpn_refresh_get_count (F5VpnRefresh *refresh)
+{
+	return refresh->count;
+}
+
+void
+f5vpn_refresh_free (F5VpnRefresh *refresh)
+{
+	if (refresh->timer) {
+		g_source_destroy (refresh->timer);
+		g_source_unref (refresh->timer);
+	}
+	if (refresh->report_id) {
+		context_source_remove (refresh->glib_context, refresh->report_id);
+		g_clear_error (&refresh->err);
+	}
+	if (refresh->in_flight)
+		refresh->freed = TRUE;
+	else
+		refresh_destroy (refresh);
+}
@@ -0,0 +1,188 @@
+/*
+ * NetworkManager-f5vpn
+ * Plugin for NetworkManager to access F5 Firepass SSL VPNs
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+#include "f5vpn_spawn.h"
+#include "glib_context.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+typedef struct
+{
+	pid_t pid;
+	int pidfd;
+	GChildWatchFunc func;
+	gpointer data;
+} PidfdWatch;
+
+pid_t
+f5vpn_spawn (const char *const *argv, const char *const *env, const F5VpnSpawnFd *fds, int nr_fds, gboolean inherit_stdio)
+{
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	sigset_t signals;
+	int staged[nr_fds > 0 ? nr_fds : 1];
+	int first_free = 3, ret = 0, n;
+	pid_t pid = -1;
+
+	for (int i = 0; i < nr_fds; ++i)
+		first_free = MAX (first_free, fds[i].child_fd + 1);
+
+	/* Moving the descriptors above every target number first means no
+	 * dup2 clobbers a source of a later one, and that each dup2 creates a
+	 * new descriptor, which never has close-on-exec set */
+	for (n = 0; n < nr_fds; ++n) {
+		staged[n] = fcntl (fds[n].parent_fd, F_DUPFD_CLOEXEC, first_free);
+		if (staged[n] == -1) {
+			ret = errno;
+			goto out;
+		}
+	}
+
+	posix_spawn_file_actions_init (&actions);
+	for (int i = 0; i < nr_fds; ++i)
+		posix_spawn_file_actions_adddup2 (&actions, staged[i], fds[i].child_fd);
+	for (int std = 0; std < 3 && !inherit_stdio; ++std) {
+		gboolean listed = FALSE;
+		for (int i = 0; i < nr_fds; ++i)
+			listed |= fds[i].child_fd == std;
+		if (!listed)
+			posix_spawn_file_actions_addclose (&actions, std);
+	}
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 34)
+	/* Also drops whatever libraries in this process opened without
+	 * close-on-exec */
+	posix_spawn_file_actions_addclosefrom_np (&actions, first_free);
+#endif
+
+	/* Neither the signal mask nor ignored signals of the spawning thread are
+	 * meant for the child */
+	posix_spawnattr_init (&attr);
+	sigemptyset (&signals);
+	posix_spawnattr_setsigmask (&attr, &signals);
+	sigfillset (&signals);
+	posix_spawnattr_setsigdefault (&attr, &signals);
+	posix_spawnattr_setflags (&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+	gchar **envp = g_get_environ ();
+	for (const char *const *e = env; e && *e; ++e) {
+		const char *eq = strchr (*e, '=');
+		gchar *name = g_strndup (*e, eq - *e);
+		envp = g_environ_setenv (envp, name, eq + 1, TRUE);
+		g_free (name);
+	}
+
+	ret = posix_spawn (&pid, argv[0], &actions, &attr, (char *const *) argv, envp);
+
+	g_strfreev (envp);
+	posix_spawnattr_destroy (&attr);
+	posix_spawn_file_actions_destroy (&actions);
+out:
+	while (n-- > 0)
+		close (staged[n]);
+	if (ret) {
+		errno = ret;
+		return -1;
+	}
+	return pid;
+}
+
+static gboolean
+on_pidfd_readable (gint fd, GIOCondition condition, gpointer user)
+{
+	(void) fd;
+	(void) condition;
+
+	PidfdWatch *watch = (PidfdWatch *) user;
+	int status = 0;
+
+	/* The pidfd only becomes readable once the child exited, so this does
+	 * not block */
+	while (waitpid (watch->pid, &status, 0) == -1 && errno == EINTR)
+		;
+	(watch->func) (watch->pid, status, watch->data);
+	return G_SOURCE_REMOVE;
+}
+
+static void
+pidfd_watch_free (gpointer user)
+{
+	PidfdWatch *watch = (PidfdWatch *) user;
+	close (watch->pidfd);
+	free (watch);
+}
+
+guint
+f5vpn_spawn_watch_add (GMainContext *context, pid_t pid, GChildWatchFunc func, gpointer data)
+{
+	int pidfd = -1;
+
+#ifdef SYS_pidfd_open
+	/* The pid cannot be reused before it is reaped below, so there is no
+	 * race between spawning and opening the pidfd */
+	pidfd = syscall (SYS_pidfd_open, pid, 0);
+#endif
+	if (pidfd == -1)
+		return context_child_watch_add (context, pid, func, data);
+
+	fcntl (pidfd, F_SETFD, FD_CLOEXEC);
+
+	PidfdWatch *watch = malloc (sizeof (PidfdWatch));
+	watch->pid = pid;
+	watch->pidfd = pidfd;
+	watch->func = func;
+	watch->data = data;
+
+	GSource *source = g_unix_fd_source_new (pidfd, G_IO_IN);
+	g_source_set_callback (source, (GSourceFunc) (void (*) (void)) on_pidfd_readable, watch, pidfd_watch_free);
+	return context_attach (context, source);
+}
+
+gboolean
+f5vpn_spawn_open_pty (int *master, int *slave)
+{
+	char name[64];
+	int err;
+
+	*master = posix_openpt (O_RDWR | O_NOCTTY | O_CLOEXEC);
+	if (*master == -1)
+		return FALSE;
+	if (grantpt (*master) == -1 || unlockpt (*master) == -1)
+		goto fail;
+	if ((err = ptsname_r (*master, name, sizeof (name)))) {
+		errno = err;
+		goto fail;
+	}
+	*slave = open (name, O_RDWR | O_NOCTTY | O_CLOEXEC);
+	if (*slave == -1)
+		goto fail;
+	return TRUE;
+
+fail:
+	err = errno;
+	close (*master);
+	errno = err;
+	return FALSE;
+}
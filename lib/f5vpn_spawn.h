@@ -0,0 +1,55 @@
+/*
+ * NetworkManager-f5vpn
+ * Plugin for NetworkManager to access F5 Firepass SSL VPNs
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+#ifndef F5VPN_SPAWN_H
+#define F5VPN_SPAWN_H
+
+#include <glib.h>
+#include <sys/types.h>
+
+/* Helpers for starting and supervising the pppd and openssl children of a
+ * connection. Processes holding many tunnels spawn from several threads at
+ * once, so every descriptor is created close-on-exec and only those listed
+ * explicitly reach a child. */
+
+typedef struct
+{
+	int parent_fd; /* descriptor in this process */
+	int child_fd;  /* number it gets in the child */
+} F5VpnSpawnFd;
+
+/* Starts argv[0] with posix_spawn, which glibc implements with a vfork-style
+ * clone, so its cost does not grow with the size of this process. The child
+ * gets the descriptors in fds, any of 0 to 2 not listed are closed unless
+ * inherit_stdio is set, and nothing else. env holds variables to set on top
+ * of this process' environment ("NAME=value", NULL-terminated, may be NULL).
+ * Returns the pid, or -1 with errno set, including when the exec failed. */
+pid_t f5vpn_spawn (const char *const *argv, const char *const *env, const F5VpnSpawnFd *fds, int nr_fds, gboolean inherit_stdio);
+
+/* Counterpart of g_child_watch_add which waits for the child's pidfd to
+ * become readable instead of relying on SIGCHLD, falling back to a child
+ * watch on kernels without pidfd_open (before 5.3). func is called once with
+ * the reaped status, as for a child watch. */
+guint f5vpn_spawn_watch_add (GMainContext *context, pid_t pid, GChildWatchFunc func, gpointer data);
+
+/* Like openpty, but both sides close-on-exec. Returns FALSE with errno set
+ * on failure. */
+gboolean f5vpn_spawn_open_pty (int *master, int *slave);
+
+#endif // F5VPN_SPAWN_H
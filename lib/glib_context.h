@@ -0,0 +1,71 @@
+/*
+ * NetworkManager-f5vpn
+ * Plugin for NetworkManager to access F5 Firepass SSL VPNs
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+#ifndef GLIB_CONTEXT_H
+#define GLIB_CONTEXT_H
+
+#include <glib-unix.h>
+#include <glib.h>
+
+/* Counterparts of g_timeout_add, g_unix_fd_add, g_child_watch_add and
+ * g_source_remove for sources attached to a given GMainContext rather than
+ * the default one (NULL also selects the default one), so that a session
+ * can be run by a main loop on a thread of its own. */
+
+static inline guint
+context_attach (GMainContext *context, GSource *source)
+{
+	guint id = g_source_attach (source, context);
+	g_source_unref (source);
+	return id;
+}
+
+static inline guint
+context_timeout_add (GMainContext *context, guint interval_ms, GSourceFunc func, gpointer data)
+{
+	GSource *source = g_timeout_source_new (interval_ms);
+	g_source_set_callback (source, func, data, NULL);
+	return context_attach (context, source);
+}
+
+static inline guint
+context_unix_fd_add (GMainContext *context, gint fd, GIOCondition condition, GUnixFDSourceFunc func, gpointer data)
+{
+	GSource *source = g_unix_fd_source_new (fd, condition);
+	g_source_set_callback (source, (GSourceFunc) (void (*) (void)) func, data, NULL);
+	return context_attach (context, source);
+}
+
+static inline guint
+context_child_watch_add (GMainContext *context, GPid pid, GChildWatchFunc func, gpointer data)
+{
+	GSource *source = g_child_watch_source_new (pid);
+	g_source_set_callback (source, (GSourceFunc) (void (*) (void)) func, data, NULL);
+	return context_attach (context, source);
+}
+
+static inline void
+context_source_remove (GMainContext *context, guint id)
+{
+	GSource *source = g_main_context_find_source_by_id (context, id);
+	if (source)
+		g_source_destroy (source);
+}
+
+#endif // GLIB_CONTEXT_H
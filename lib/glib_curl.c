@@ -18,8 +18,9 @@
  * USA.
  */
 #include "glib_curl.h"
-#include <glib-unix.h>
+#include "glib_context.h"
 #include <stdint.h>
+#include <string.h>
 
 G_DEFINE_QUARK (glib - curl - error - quark, glib_curl_error)
 #define GLIB_CURL_ERROR glib_curl_error_quark ()
@@ -29,23 +30,191 @@ struct _GlibCurl
 	CURLM *multi;
 	GMainContext *glib_context;
 	guint timer_id;
+	/* SocketSources of the sockets curl currently wants polled */
+	GSList *sockets;
+	/* Requests which have not been reported yet */
+	GSList *pending;
+	F5VpnHttpCounters counters;
 };
 
 typedef struct
 {
+	GlibCurl *glc;
 	CurlCallback callback;
 	void *userdata;
-} CallbackData;
-
-/* GUnixFDSource doesn't provide a public API to access the tag member,
- * and consequently a polled unix FD can't be modified. "Fix" this by
- * peeking into the ABI. Will have to be fixed if GUnixFDSource changes */
+	GlibCurlPolicy policy;
+	GString *response;
+	/* The attempt which is passed to the callback */
+	CURL *easy;
+	gboolean in_flight; /* as opposed to waiting for a retry */
+	guint attempt;
+	/* Duplicate racing easy, and the body it received */
+	CURL *hedge;
+	GString *hedge_response;
+	gboolean from_hedge;
+	guint timer_id; /* retry or hedge */
+} Request;
+
+/* Per-socket state, assigned to the socket with curl_multi_assign. Keeping
+ * the tag returned by g_source_add_unix_fd allows the polled condition to be
+ * changed in place whenever curl asks for it. */
 typedef struct
 {
 	GSource source;
-	gint fd;
+	GlibCurl *glc;
+	curl_socket_t fd;
 	gpointer tag;
-} GUnixFDSource;
+} SocketSource;
+
+/* Process-wide state shared by the requests passed to glib_curl_use_shared_state
+ * once glib_curl_share_state has been called */
+static CURLSH *shared;
+static GMutex shared_locks[CURL_LOCK_DATA_LAST];
+
+static void
+lock_shared (CURL *handle, curl_lock_data data, curl_lock_access access, void *userptr)
+{
+	(void) handle;
+	(void) access;
+	(void) userptr;
+
+	g_mutex_lock (&shared_locks[data]);
+}
+
+static void
+unlock_shared (CURL *handle, curl_lock_data data, void *userptr)
+{
+	(void) handle;
+	(void) userptr;
+
+	g_mutex_unlock (&shared_locks[data]);
+}
+
+void
+glib_curl_share_state (void)
+{
+	if (shared)
+		return;
+	shared = curl_share_init ();
+	curl_share_setopt (shared, CURLSHOPT_LOCKFUNC, lock_shared);
+	curl_share_setopt (shared, CURLSHOPT_UNLOCKFUNC, unlock_shared);
+	curl_share_setopt (shared, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt (shared, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+}
+
+void
+glib_curl_use_shared_state (CURL *easy)
+{
+	if (shared)
+		curl_easy_setopt (easy, CURLOPT_SHARE, shared);
+}
+
+static gboolean on_hedge_timer (gpointer user);
+
+static void
+start_attempt (Request *req)
+{
+	int still_running;
+
+	if (req->response)
+		g_string_truncate (req->response, 0);
+	curl_multi_add_handle (req->glc->multi, req->easy);
+	req->in_flight = TRUE;
+	if (req->policy.hedge_after_ms)
+		req->timer_id = context_timeout_add (req->glc->glib_context, req->policy.hedge_after_ms, on_hedge_timer, req);
+
+	CURLMcode rc = curl_multi_socket_action (req->glc->multi, CURL_SOCKET_TIMEOUT, 0, &still_running);
+	g_assert (rc >= 0);
+}
+
+static gboolean
+on_retry_timer (gpointer user)
+{
+	Request *req = (Request *) user;
+	req->timer_id = 0;
+	start_attempt (req);
+	return G_SOURCE_REMOVE;
+}
+
+static gboolean
+on_hedge_timer (gpointer user)
+{
+	Request *req = (Request *) user;
+	struct curl_slist *cookies;
+	int still_running;
+
+	req->timer_id = 0;
+	req->hedge = curl_easy_duphandle (req->easy);
+	/* The duplicate starts out with an empty cookie jar */
+	curl_easy_getinfo (req->easy, CURLINFO_COOKIELIST, &cookies);
+	for (struct curl_slist *p = cookies; p; p = p->next)
+		curl_easy_setopt (req->hedge, CURLOPT_COOKIELIST, p->data);
+	curl_slist_free_all (cookies);
+	if (req->response) {
+		req->hedge_response = g_string_new ("");
+		curl_easy_setopt (req->hedge, CURLOPT_WRITEDATA, req->hedge_response);
+	}
+
+	curl_multi_add_handle (req->glc->multi, req->hedge);
+	req->glc->counters.hedges++;
+
+	CURLMcode rc = curl_multi_socket_action (req->glc->multi, CURL_SOCKET_TIMEOUT, 0, &still_running);
+	g_assert (rc >= 0);
+	return G_SOURCE_REMOVE;
+}
+
+static void
+drop_hedge (Request *req)
+{
+	curl_multi_remove_handle (req->glc->multi, req->hedge);
+	curl_easy_cleanup (req->hedge);
+	req->hedge = NULL;
+	if (req->hedge_response)
+		g_string_free (req->hedge_response, TRUE);
+	req->hedge_response = NULL;
+}
+
+/* Replaces the attempt passed to the callback by the hedge, which may still
+ * be in flight */
+static void
+adopt_hedge (Request *req)
+{
+	if (req->in_flight)
+		curl_multi_remove_handle (req->glc->multi, req->easy);
+	curl_easy_cleanup (req->easy);
+	req->easy = req->hedge;
+	req->hedge = NULL;
+	req->in_flight = TRUE;
+	req->from_hedge = TRUE;
+
+	if (req->response) {
+		g_string_truncate (req->response, 0);
+		g_string_append_len (req->response, req->hedge_response->str, req->hedge_response->len);
+		g_string_free (req->hedge_response, TRUE);
+		req->hedge_response = NULL;
+		curl_easy_setopt (req->easy, CURLOPT_WRITEDATA, req->response);
+	}
+}
+
+static void
+finish_request (Request *req, GError *err)
+{
+	GlibCurl *glc = req->glc;
+
+	if (req->timer_id)
+		context_source_remove (req->glc->glib_context, req->timer_id);
+	if (req->hedge)
+		drop_hedge (req);
+	if (req->in_flight)
+		curl_multi_remove_handle (glc->multi, req->easy);
+	glc->pending = g_slist_remove (glc->pending, req);
+	if (!err && req->from_hedge)
+		glc->counters.hedges_won++;
+
+	/* Callback provider must free the curl handle */
+	(*req->callback) (req->easy, req->userdata, err);
+	free (req);
+}
 
 static void
 check_multi (GlibCurl *glc)
@@ -55,39 +224,91 @@ check_multi (GlibCurl *glc)
 	while ((msg = curl_multi_info_read (glc->multi, &msgs_left))) {
 		g_assert_true (msg->msg == CURLMSG_DONE);
 		CURL *hdl = msg->easy_handle;
-		CallbackData *cbd;
-		curl_easy_getinfo (hdl, CURLINFO_PRIVATE, &cbd);
-		curl_multi_remove_handle (glc->multi, hdl);
-		GError *err = NULL;
+		CURLcode result = msg->data.result;
+		Request *req;
+		curl_easy_getinfo (hdl, CURLINFO_PRIVATE, &req);
+
+		if (hdl == req->hedge) {
+			if (result != CURLE_OK && req->in_flight) {
+				/* The original attempt may still succeed */
+				drop_hedge (req);
+				continue;
+			}
+			curl_multi_remove_handle (glc->multi, hdl);
+			adopt_hedge (req);
+		} else {
+			curl_multi_remove_handle (glc->multi, hdl);
+			if (result != CURLE_OK && req->hedge) {
+				/* The hedge may still succeed */
+				req->in_flight = FALSE;
+				adopt_hedge (req);
+				continue;
+			}
+		}
+		req->in_flight = FALSE;
+		if (req->hedge)
+			drop_hedge (req);
+		if (req->timer_id) {
+			context_source_remove (req->glc->glib_context, req->timer_id);
+			req->timer_id = 0;
+		}
 
-		if (msg->data.result != CURLE_OK)
-			g_error_new (GLIB_CURL_ERROR, 0, "curl error: %s", curl_easy_strerror (msg->data.result));
+		if (result != CURLE_OK && req->attempt < req->policy.max_retries) {
+			/* Exponential backoff with jitter, so that clients failing
+			 * together do not retry together */
+			guint delay = req->policy.backoff_ms << req->attempt;
+			delay = delay / 2 + g_random_int_range (0, delay / 2 + 1);
+			req->attempt++;
+			glc->counters.retries++;
+			req->timer_id = context_timeout_add (req->glc->glib_context, delay, on_retry_timer, req);
+			continue;
+		}
 
-		(*cbd->callback) (hdl, cbd->userdata, err);
-		/* Callback provider must free the curl handle */
-		free (cbd);
+		GError *err = NULL;
+		if (result != CURLE_OK)
+			err = g_error_new (GLIB_CURL_ERROR, 0, "curl error: %s", curl_easy_strerror (result));
+		finish_request (req, err);
 	}
 }
 
 static gboolean
-on_socket_event (gint fd, GIOCondition condition, gpointer userdata)
+socket_source_dispatch (GSource *source, GSourceFunc callback, gpointer userdata)
 {
-	GlibCurl *glc = (GlibCurl *) userdata;
+	(void) callback;
+	(void) userdata;
+
+	SocketSource *ss = (SocketSource *) source;
+	GlibCurl *glc = ss->glc;
+	GIOCondition condition = g_source_query_unix_fd (source, ss->tag);
 
 	int ev_bitmask = 0;
 	if (condition & G_IO_IN)
 		ev_bitmask |= CURL_CSELECT_IN;
 	if (condition & G_IO_OUT)
 		ev_bitmask |= CURL_CSELECT_OUT;
+	if (condition & (G_IO_ERR | G_IO_HUP))
+		ev_bitmask |= CURL_CSELECT_ERR;
 
 	int running;
-	CURLMcode rc = curl_multi_socket_action (glc->multi, fd, ev_bitmask, &running);
+	CURLMcode rc = curl_multi_socket_action (glc->multi, ss->fd, ev_bitmask, &running);
 	if (rc != 0)
 		fprintf (stderr, "error %s\n", curl_multi_strerror (rc));
 
 	check_multi (glc);
 
-	return TRUE;
+	return G_SOURCE_CONTINUE;
+}
+
+static GSourceFuncs socket_source_funcs = {
+	.dispatch = socket_source_dispatch,
+};
+
+static void
+socket_source_destroy (SocketSource *ss)
+{
+	ss->glc->sockets = g_slist_remove (ss->glc->sockets, ss);
+	g_source_destroy (&ss->source);
+	g_source_unref (&ss->source);
 }
 
 static int
@@ -95,11 +316,14 @@ on_modify_socket (CURL *e, curl_socket_t s, int what, void *cbp, void *sockp)
 {
 	(void) e;
 
-	intptr_t p = (intptr_t) sockp;
+	SocketSource *ss = (SocketSource *) sockp;
 	GlibCurl *glc = (GlibCurl *) cbp;
 
 	if (what == CURL_POLL_REMOVE) {
-		g_source_remove ((guint) p);
+		if (ss) {
+			curl_multi_assign (glc->multi, s, NULL);
+			socket_source_destroy (ss);
+		}
 	} else {
 		GIOCondition cond = 0;
 		if (what & CURL_POLL_IN)
@@ -107,13 +331,16 @@ on_modify_socket (CURL *e, curl_socket_t s, int what, void *cbp, void *sockp)
 		if (what & CURL_POLL_OUT)
 			cond |= G_IO_OUT;
 
-		if (!p) {
-			p = g_unix_fd_add (s, cond, on_socket_event, glc);
-			curl_multi_assign (glc->multi, s, (void *) p);
+		if (!ss) {
+			ss = (SocketSource *) g_source_new (&socket_source_funcs, sizeof (SocketSource));
+			ss->glc = glc;
+			ss->fd = s;
+			ss->tag = g_source_add_unix_fd (&ss->source, s, cond);
+			g_source_attach (&ss->source, glc->glib_context);
+			glc->sockets = g_slist_prepend (glc->sockets, ss);
+			curl_multi_assign (glc->multi, s, ss);
 		} else {
-			GSource *src = g_main_context_find_source_by_id (glc->glib_context, (guint) p);
-			GUnixFDSource *usrc = (GUnixFDSource *) src;
-			g_source_modify_unix_fd (src, usrc->tag, cond);
+			g_source_modify_unix_fd (&ss->source, ss->tag, cond);
 		}
 	}
 	return 0;
@@ -140,12 +367,12 @@ timer_callback (CURLM *multi, long timeout_ms, void *userp)
 	GlibCurl *glc = (GlibCurl *) userp;
 
 	if (glc->timer_id) {
-		g_source_remove (glc->timer_id);
+		context_source_remove (glc->glib_context, glc->timer_id);
 		glc->timer_id = 0;
 	}
 
 	if (timeout_ms >= 0)
-		glc->timer_id = g_timeout_add (timeout_ms, on_timer_event, glc);
+		glc->timer_id = context_timeout_add (glc->glib_context, timeout_ms, on_timer_event, glc);
 
 	return 0;
 }
@@ -158,20 +385,43 @@ curl_write_to_gstring (char *ptr, size_t size, size_t nmemb, void *userdata)
 }
 
 void
-glib_curl_send (GlibCurl *glc, CURL *easy, CurlCallback callback, void *userdata)
+glib_curl_send_with_policy (GlibCurl *glc, CURL *easy, GString *response, const GlibCurlPolicy *policy, CurlCallback callback, void *userdata)
 {
 	g_assert_nonnull (glc);
 
-	CallbackData *cbd = (CallbackData *) malloc (sizeof (CallbackData));
-	cbd->callback = callback;
-	cbd->userdata = userdata;
+	Request *req = (Request *) calloc (1, sizeof (Request));
+	req->glc = glc;
+	req->callback = callback;
+	req->userdata = userdata;
+	if (policy)
+		req->policy = *policy;
+	req->response = response;
+	req->easy = easy;
+
+	curl_easy_setopt (easy, CURLOPT_PRIVATE, req);
+	glc->pending = g_slist_prepend (glc->pending, req);
+	glc->counters.requests++;
+	start_attempt (req);
+}
 
-	curl_easy_setopt (easy, CURLOPT_PRIVATE, cbd);
-	curl_multi_add_handle (glc->multi, easy);
+void
+glib_curl_send (GlibCurl *glc, CURL *easy, CurlCallback callback, void *userdata)
+{
+	glib_curl_send_with_policy (glc, easy, NULL, NULL, callback, userdata);
+}
 
-	int still_running;
-	CURLMcode rc = curl_multi_socket_action (glc->multi, CURL_SOCKET_TIMEOUT, 0, &still_running);
-	g_assert (rc >= 0);
+void
+glib_curl_abort (GlibCurl *glc, const GError *reason)
+{
+	/* Callbacks may queue further requests, which are aborted as well */
+	while (glc->pending)
+		finish_request (glc->pending->data, g_error_copy (reason));
+}
+
+const F5VpnHttpCounters *
+glib_curl_get_counters (GlibCurl *glc)
+{
+	return &glc->counters;
 }
 
 GlibCurl *
@@ -181,6 +431,10 @@ glib_curl_new (GMainContext *glib_context)
 
 	glc->multi = curl_multi_init ();
 	glc->glib_context = glib_context;
+	glc->timer_id = 0;
+	glc->sockets = NULL;
+	glc->pending = NULL;
+	memset (&glc->counters, 0, sizeof (glc->counters));
 
 	curl_multi_setopt (glc->multi, CURLMOPT_SOCKETFUNCTION, on_modify_socket);
 	curl_multi_setopt (glc->multi, CURLMOPT_SOCKETDATA, glc);
@@ -193,6 +447,25 @@ glib_curl_new (GMainContext *glib_context)
 void
 glib_curl_free (GlibCurl *glc)
 {
+	if (glc->timer_id)
+		context_source_remove (glc->glib_context, glc->timer_id);
+	/* Requests are dropped without a callback, their handles are the
+	 * callback provider's to free */
+	for (GSList *p = glc->pending; p; p = p->next) {
+		Request *req = p->data;
+		if (req->timer_id)
+			context_source_remove (req->glc->glib_context, req->timer_id);
+		if (req->hedge)
+			drop_hedge (req);
+		if (req->in_flight)
+			curl_multi_remove_handle (glc->multi, req->easy);
+		free (req);
+	}
+	g_slist_free (glc->pending);
 	curl_multi_cleanup (glc->multi);
+	/* curl_multi_cleanup normally has curl remove every socket, but sources
+	 * of sockets it kept hold of until then must not outlive glc */
+	while (glc->sockets)
+		socket_source_destroy (glc->sockets->data);
 	free (glc);
 }
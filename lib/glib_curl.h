@@ -20,6 +20,7 @@
 #ifndef GLIB_CURL_H
 #define GLIB_CURL_H
 
+#include "f5vpn_http.h"
 #include <curl/curl.h>
 #include <glib.h>
 
@@ -28,10 +29,49 @@ typedef struct _GlibCurl GlibCurl;
 
 typedef void (*CurlCallback) (CURL *handle, void *userdata, GError *error);
 
+/* Retries a request after transport failures (refused or reset connections,
+ * timeouts) with exponential backoff, and hedges it: if an attempt has not
+ * completed hedge_after_ms after it started, a duplicate is sent and the
+ * first of the two to complete is reported. Only idempotent requests may be
+ * retried or hedged. */
+typedef struct
+{
+	guint max_retries;
+	guint backoff_ms;     /* before the first retry, doubling for each further one */
+	guint hedge_after_ms; /* 0 disables hedging */
+} GlibCurlPolicy;
+
+/* All sockets and timers of the returned GlibCurl are polled through sources
+ * attached to glib_context (NULL for the default context), so it may be
+ * driven by a main loop on another thread. As curl_easy_init initialises
+ * libcurl implicitly, which is not thread-safe, a process doing that must
+ * call curl_global_init before it starts any threads. */
 GlibCurl *glib_curl_new (GMainContext *glib_context);
 
 void glib_curl_send (GlibCurl *glc, CURL *easy, CurlCallback callback, void *userdata);
 
+/* Sends easy according to policy. The handle passed to the callback may then
+ * be a duplicate of easy, which has been cleaned up already. response, if not
+ * NULL, is the GString easy writes to through curl_write_to_gstring; it is
+ * reset for each attempt and ends up holding the body of the reported one. */
+void glib_curl_send_with_policy (GlibCurl *glc, CURL *easy, GString *response, const GlibCurlPolicy *policy, CurlCallback callback, void *userdata);
+
+const F5VpnHttpCounters *glib_curl_get_counters (GlibCurl *glc);
+
+/* Removes all requests in flight from glc and invokes their callbacks right
+ * away, with a copy of reason as the error */
+void glib_curl_abort (GlibCurl *glc, const GError *reason);
+
+/* Sets up a DNS cache and TLS session cache that requests of all GlibCurl
+ * instances, on whichever thread, can share, so that a host contacted once is
+ * resolved and handshaked with cheaply afterwards. Connections themselves
+ * cannot be shared across threads. Must be called before starting threads. */
+void glib_curl_share_state (void);
+
+/* Lets easy use the caches set up by glib_curl_share_state, if it has been
+ * called; does nothing otherwise. Requests not passed here keep their own. */
+void glib_curl_use_shared_state (CURL *easy);
+
 size_t curl_write_to_gstring (char *ptr, size_t size, size_t nmemb, void *userdata);
 
 void glib_curl_free (GlibCurl *glc);
@@ -0,0 +1,125 @@
+/*
+ * NetworkManager-f5vpn
+ * Plugin for NetworkManager to access F5 Firepass SSL VPNs
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+#ifndef GLIB_REQUEST_H
+#define GLIB_REQUEST_H
+
+#include "glib_context.h"
+
+/* Bookkeeping shared by the HTTP exchanges which enforce a deadline and hand
+ * their result to the user from the main loop rather than from the curl
+ * callback, so that the user may free them right away. */
+typedef struct
+{
+	GMainContext *context;
+	GSource *deadline;
+	/* Called once the deadline passed, to abort the requests */
+	GSourceFunc on_deadline;
+	GSourceFunc report;
+	gpointer data;
+	/* The pending call of report, 0 if none */
+	guint report_id;
+	/* Whatever result is reported, the user asked for a cancellation */
+	gboolean cancelled;
+} GlibRequest;
+
+static inline void
+glib_request_init (GlibRequest *req, GMainContext *context, GSourceFunc on_deadline, gpointer data)
+{
+	req->context = context;
+	req->deadline = NULL;
+	req->on_deadline = on_deadline;
+	req->report = NULL;
+	req->data = data;
+	req->report_id = 0;
+	req->cancelled = FALSE;
+}
+
+static inline void
+glib_request_disarm (GlibRequest *req)
+{
+	if (req->deadline) {
+		g_source_destroy (req->deadline);
+		g_source_unref (req->deadline);
+		req->deadline = NULL;
+	}
+}
+
+static inline gboolean
+glib_request_deadline_passed (gpointer user)
+{
+	GlibRequest *req = (GlibRequest *) user;
+
+	g_source_unref (req->deadline);
+	req->deadline = NULL;
+	return (req->on_deadline) (req->data);
+}
+
+/* (Re)arms the deadline to pass timeout_ms after start_us, in the monotonic
+ * clock, or disarms it if timeout_ms is 0 */
+static inline void
+glib_request_arm (GlibRequest *req, gint64 start_us, guint timeout_ms)
+{
+	glib_request_disarm (req);
+	if (timeout_ms == 0)
+		return;
+
+	gint64 left = timeout_ms - (g_get_monotonic_time () - start_us) / 1000;
+	req->deadline = g_timeout_source_new (MAX (left, 0));
+	g_source_set_callback (req->deadline, glib_request_deadline_passed, req, NULL);
+	g_source_attach (req->deadline, req->context);
+}
+
+static inline gboolean
+glib_request_reported (gpointer user)
+{
+	GlibRequest *req = (GlibRequest *) user;
+
+	req->report_id = 0;
+	/* report may free the request, so req is not touched afterwards */
+	return (req->report) (req->data);
+}
+
+/* Disarms the deadline and calls report from the main loop */
+static inline void
+glib_request_report (GlibRequest *req, GSourceFunc report)
+{
+	glib_request_disarm (req);
+	req->report = report;
+	req->report_id = context_timeout_add (req->context, 0, glib_request_reported, req);
+}
+
+static inline void
+glib_request_cancel (GlibRequest *req)
+{
+	req->cancelled = TRUE;
+	glib_request_disarm (req);
+}
+
+/* Drops the deadline and a pending report, before the request is freed */
+static inline void
+glib_request_clear (GlibRequest *req)
+{
+	glib_request_disarm (req);
+	if (req->report_id)
+		context_source_remove (req->context, req->report_id);
+	req->report_id = 0;
+}
+
+#endif // GLIB_REQUEST_H
@@ -110,8 +110,8 @@ create_root_widget (F5VpnEditor *editor, NMSettingVpn *svpn)
 	const char *browser = nm_setting_vpn_get_data_item (svpn, "use-browser-auth");
 
 	GtkWidget *grid = g_object_new (GTK_TYPE_GRID, "column-spacing", 12, "margin", 12, "row-spacing", 6, NULL);
-	GtkWidget *host_label = g_object_new (GTK_TYPE_LABEL, "label", "Hostname", "halign", GTK_ALIGN_END, NULL);
-	GtkWidget *entry_hostname = g_object_new (GTK_TYPE_ENTRY, "text", hostname, "hexpand", TRUE, NULL);
+	GtkWidget *host_label = g_object_new (GTK_TYPE_LABEL, "label", "Gateways", "halign", GTK_ALIGN_END, NULL);
+	GtkWidget *entry_hostname = g_object_new (GTK_TYPE_ENTRY, "text", hostname, "hexpand", TRUE, "tooltip-text", "One or more hostnames separated by commas. When several are given, the fastest to respond is used.", NULL);
 	GtkWidget *browser_label = g_object_new (GTK_TYPE_LABEL, "label", "Use Browser Authentication", "halign", GTK_ALIGN_END, NULL);
 	GtkWidget *browser_switch = g_object_new (GTK_TYPE_SWITCH, "active", browser && strcmp (browser, "true") == 0, "halign", GTK_ALIGN_END, NULL);
 	priv->entry_hostname = entry_hostname;
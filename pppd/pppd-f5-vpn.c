@@ -1,6 +1,7 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <pppd/pppd.h>
@@ -8,12 +9,121 @@
 #include <arpa/inet.h>
 #include <pppd/fsm.h>
 #include <pppd/ipcp.h>
+#include <pppd/lcp.h>
 
 #include "pppd-plugin-message.h"
 
 char pppd_version[] = VERSION;
 
 static int f5_vpn_pipe_fd = -1;
+static int stats_interval = 10;
+
+/* LCP echo round trip measurement, fed by the snoop hooks */
+static int echo_pending_id = -1;
+static struct timespec echo_sent;
+static int32_t echo_rtt_us = -1;
+
+static void
+send_message (uint16_t type, const void *payload, uint32_t length)
+{
+	struct
+	{
+		PppdPluginMessageHeader hdr;
+		union
+		{
+			PppdPluginNotification notification;
+			PppdPluginLinkStats link_stats;
+			PppdPluginEchoRtt echo_rtt;
+		} payload;
+	} msg;
+
+	msg.hdr.version = PPPD_PLUGIN_MESSAGE_VERSION;
+	msg.hdr.type = type;
+	msg.hdr.length = length;
+	memcpy (&msg.payload, payload, length);
+	if (write (f5_vpn_pipe_fd, &msg, sizeof (msg.hdr) + length) == -1)
+		fprintf (stderr, "write error: %s\n", strerror (errno));
+}
+
+/* Returns the LCP code and sets *id if p (starting with the PPP header) is
+ * an LCP packet, otherwise returns -1 */
+static int
+lcp_code (const unsigned char *p, int len, int *id)
+{
+	if (len < PPP_HDRLEN + HEADERLEN)
+		return -1;
+	if (((p[2] << 8) | p[3]) != PPP_LCP)
+		return -1;
+	*id = p[PPP_HDRLEN + 1];
+	return p[PPP_HDRLEN];
+}
+
+static void
+snoop_send (unsigned char *p, int len)
+{
+	int id;
+	if (lcp_code (p, len, &id) == ECHOREQ) {
+		echo_pending_id = id;
+		clock_gettime (CLOCK_MONOTONIC, &echo_sent);
+	}
+}
+
+static void
+snoop_recv (unsigned char *p, int len)
+{
+	int id;
+	if (lcp_code (p, len, &id) == ECHOREP && id == echo_pending_id) {
+		struct timespec now;
+		clock_gettime (CLOCK_MONOTONIC, &now);
+		echo_rtt_us = (now.tv_sec - echo_sent.tv_sec) * 1000000 + (now.tv_nsec - echo_sent.tv_nsec) / 1000;
+		echo_pending_id = -1;
+
+		PppdPluginEchoRtt msg = { echo_rtt_us };
+		send_message (PPPD_PLUGIN_MSG_ECHO_RTT, &msg, sizeof (msg));
+	}
+}
+
+static uint64_t
+read_if_counter (const char *name)
+{
+	char path[64], buf[32];
+	uint64_t value = 0;
+
+	snprintf (path, sizeof (path), "/sys/class/net/%s/statistics/%s", ifname, name);
+	FILE *f = fopen (path, "r");
+	if (!f)
+		return 0;
+	if (fgets (buf, sizeof (buf), f))
+		value = strtoull (buf, NULL, 10);
+	fclose (f);
+	return value;
+}
+
+static void
+send_link_stats (void *arg)
+{
+	(void) arg;
+
+	PppdPluginLinkStats stats;
+	struct ppp_idle idle;
+
+	stats.bytes_in = read_if_counter ("rx_bytes");
+	stats.bytes_out = read_if_counter ("tx_bytes");
+	stats.packets_in = read_if_counter ("rx_packets");
+	stats.packets_out = read_if_counter ("tx_packets");
+	stats.errors_in = read_if_counter ("rx_errors");
+	stats.errors_out = read_if_counter ("tx_errors");
+	stats.lcp_echo_rtt_us = echo_rtt_us;
+	if (get_idle_time (0, &idle)) {
+		stats.idle_in_s = idle.recv_idle;
+		stats.idle_out_s = idle.xmit_idle;
+	} else {
+		stats.idle_in_s = stats.idle_out_s = 0;
+	}
+	send_message (PPPD_PLUGIN_MSG_LINK_STATS, &stats, sizeof (stats));
+
+	timeout (send_link_stats, NULL, stats_interval, 0);
+}
 
 static void
 my_ip_up (void *opaque, int arg)
@@ -26,13 +136,82 @@ my_ip_up (void *opaque, int arg)
 	msg.local_addr.s_addr = opts.ouraddr;
 	msg.remote_addr.s_addr = opts.hisaddr;
 	strncpy (msg.ifname, ifname, sizeof (msg.ifname));
-	if(write (f5_vpn_pipe_fd, &msg, sizeof (msg)) == -1)
-		fprintf(stderr, "write error: %s\n", strerror(errno));
+	send_message (PPPD_PLUGIN_MSG_IP_UP, &msg, sizeof (msg));
+
+	if (stats_interval > 0)
+		timeout (send_link_stats, NULL, stats_interval, 0);
+}
+
+/* Announces the interface as soon as pppd has created it, so that it can be
+ * configured while LCP and IPCP are still negotiating */
+static void
+my_phase_change (void *opaque, int arg)
+{
+	(void) opaque;
+
+	if (arg != PHASE_ESTABLISH || !ifname[0])
+		return;
+
+	PppdPluginNotification msg;
+	msg.local_addr.s_addr = ipcp_wantoptions[0].ouraddr;
+	msg.remote_addr.s_addr = ipcp_wantoptions[0].hisaddr;
+	strncpy (msg.ifname, ifname, sizeof (msg.ifname));
+	send_message (PPPD_PLUGIN_MSG_LINK_ESTABLISHED, &msg, sizeof (msg));
+}
+
+static void
+my_ip_down (void *opaque, int arg)
+{
+	(void) opaque;
+	(void) arg;
+
+	untimeout (send_link_stats, NULL);
+}
+
+/* Waits for the settings of a tunnel which was not open yet when pppd was
+ * started, and applies them */
+static void
+receive_config (int fd)
+{
+	struct
+	{
+		PppdPluginMessageHeader hdr;
+		PppdPluginConfig config;
+	} msg;
+	ssize_t n;
+
+	while ((n = read (fd, &msg, sizeof (msg))) == -1 && errno == EINTR)
+		;
+	close (fd);
+	/* Closed without a message: the connection was given up */
+	if (n != sizeof (msg) || msg.hdr.version != PPPD_PLUGIN_MESSAGE_VERSION || msg.hdr.type != PPPD_PLUGIN_MSG_CONFIG || msg.hdr.length != sizeof (msg.config))
+		exit (EXIT_FAILURE);
+
+	if (msg.config.local_addr.s_addr)
+		ipcp_wantoptions[0].ouraddr = msg.config.local_addr.s_addr;
+	if (msg.config.remote_addr.s_addr)
+		ipcp_wantoptions[0].hisaddr = msg.config.remote_addr.s_addr;
+	if (msg.config.mtu) {
+		lcp_allowoptions[0].mru = msg.config.mtu;
+		lcp_wantoptions[0].mru = msg.config.mtu;
+		lcp_wantoptions[0].neg_mru = 1;
+	}
 }
 
 void
 plugin_init (void)
 {
+	const char *interval, *config_fd;
+
 	f5_vpn_pipe_fd = atoi (getenv ("F5_VPN_PPPD_PLUGIN_FD"));
+	if ((interval = getenv ("F5_VPN_PPPD_STATS_INTERVAL")))
+		stats_interval = atoi (interval);
+	if ((config_fd = getenv ("F5_VPN_PPPD_CONFIG_FD")))
+		receive_config (atoi (config_fd));
+
+	snoop_send_hook = snoop_send;
+	snoop_recv_hook = snoop_recv;
+	add_notifier (&phasechange, my_phase_change, NULL);
 	add_notifier (&ip_up_notifier, my_ip_up, NULL);
+	add_notifier (&ip_down_notifier, my_ip_down, NULL);
 }
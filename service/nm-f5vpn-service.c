@@ -18,11 +18,18 @@
  * USA.
  */
 #include <arpa/inet.h>
-#include <curl/curl.h>
+#include <errno.h>
+#include <glib-unix.h>
 #include <glib.h>
 #include <libnm/NetworkManager.h>
 
+#include "f5vpn_backoff.h"
 #include "f5vpn_connect.h"
+#include "f5vpn_lagmon.h"
+#include "f5vpn_ondemand.h"
+#include "f5vpn_probe.h"
+#include "f5vpn_refresh.h"
+#include "session-cache.h"
 
 #define NM_TYPE_F5VPN_PLUGIN (nm_f5vpn_plugin_get_type ())
 #define NM_F5VPN_PLUGIN(obj) \
@@ -36,10 +43,39 @@
 #define NM_F5VPN_PLUGIN_GET_CLASS(obj) \
 	(G_TYPE_INSTANCE_GET_CLASS ((obj), NM_TYPE_F5VPN_PLUGIN, NMF5VpnPluginClass))
 
+typedef struct _ParamsRequest ParamsRequest;
+
 typedef struct
 {
 	NMVpnServicePlugin parent;
 	F5VpnConnection *f5vpn;
+	/* connect.php3 request started by need_secrets and reused by connect */
+	ParamsRequest *params_req;
+	struct _PluginConnectionHandle *secrets_pending;
+	/* Keeps the last session alive, also after its tunnel went down */
+	F5VpnRefresh *refresh;
+	gchar *refresh_uuid;
+	guint refresh_duration;
+	guint refresh_deadline_id;
+	gboolean quit_requested;
+	/* Re-establishes a tunnel lost to anything but the session expiring */
+	F5VpnBackoff backoff;
+	guint reconnect_attempts;
+	guint reconnects_left;
+	/* Tunnels re-established since NM asked to connect, for the statistics */
+	guint reconnects;
+	guint reconnect_id;
+	struct _PluginConnectionHandle *reconnect_pending;
+	gboolean disconnect_requested;
+	/* Takes the tunnel down while idle, leaving a placeholder interface
+	 * which brings it back up for the first packet */
+	guint idle_timeout;
+	guint idle_check_id;
+	gboolean parking;
+	struct _PluginConnectionHandle *parked;
+	F5VpnOnDemand *ondemand;
+	/* Settings of the last tunnel, which the placeholder takes over */
+	NetworkSettings last_settings;
 } NMF5VpnPlugin;
 
 typedef struct
@@ -47,15 +83,168 @@ typedef struct
 	NMVpnServicePluginClass parent;
 } NMF5VpnPluginClass;
 
-typedef struct
+typedef struct _PluginConnectionHandle
 {
 	NMVpnServicePlugin *plugin;
 	NMConnection *nm_connection;
+	gboolean interactive;
+	gboolean was_up;
 } PluginConnectionHandle;
 
+struct _ParamsRequest
+{
+	gchar *identity;
+	F5VpnConnectParams *params;
+	gboolean done;
+	gint64 done_at;
+	GError *err;
+	PluginConnectionHandle *waiting; /* connect waiting for the result */
+};
+
 G_DEFINE_TYPE (NMF5VpnPlugin, nm_f5vpn_plugin, NM_TYPE_VPN_SERVICE_PLUGIN)
 
+/* Connection statistics are published here for external monitors, one file per connection UUID */
+#define STATS_DIR "/run/NetworkManager-f5vpn"
+
+/* How long to keep a session alive after its tunnel went down, unless the
+ * "session-refresh-duration" data item says otherwise */
+#define REFRESH_DEFAULT_DURATION 3600
+
+/* Tunnel parameters fetched by need_secrets are only reused by a connect
+ * following within this many seconds */
+#define PARAMS_MAX_AGE 60
+
+/* Lost tunnels are re-established this many times in a row, with randomised
+ * delays starting at RECONNECT_BASE_DELAY_MS and growing up to a ceiling in
+ * seconds, unless the "reconnect-attempts" and "reconnect-max-delay" data
+ * items say otherwise */
+#define RECONNECT_DEFAULT_ATTEMPTS  5
+#define RECONNECT_BASE_DELAY_MS     1000
+#define RECONNECT_DEFAULT_MAX_DELAY 60
+
+/* How often an on-demand tunnel is checked for being idle; the pppd plugin
+ * reports the link's idle times every 10s */
+#define IDLE_CHECK_INTERVAL 10
+
 static GMainLoop *main_loop;
+static F5VpnLagMonitor *lag_monitor;
+
+static void
+params_request_free (ParamsRequest *req)
+{
+	g_free (req->identity);
+	g_clear_error (&req->err);
+	f5vpn_connect_params_free (req->params);
+	free (req);
+}
+
+/* Forgets the plugin's current request, aborting it if still in flight */
+static void
+params_request_drop (NMF5VpnPlugin *f5vpn_plugin)
+{
+	ParamsRequest *req = f5vpn_plugin->params_req;
+	f5vpn_plugin->params_req = NULL;
+	g_warn_if_fail (req->waiting == NULL);
+	params_request_free (req);
+}
+
+static void
+stop_refresh (NMF5VpnPlugin *f5vpn_plugin)
+{
+	if (f5vpn_plugin->refresh_deadline_id)
+		g_source_remove (f5vpn_plugin->refresh_deadline_id);
+	f5vpn_plugin->refresh_deadline_id = 0;
+	if (f5vpn_plugin->refresh)
+		f5vpn_refresh_free (f5vpn_plugin->refresh);
+	f5vpn_plugin->refresh = NULL;
+	g_free (f5vpn_plugin->refresh_uuid);
+	f5vpn_plugin->refresh_uuid = NULL;
+
+	/* NM asked us to quit while the session was still being kept alive */
+	if (f5vpn_plugin->quit_requested)
+		g_main_loop_quit (main_loop);
+}
+
+static void
+on_session_refreshed (F5VpnRefresh *refresh, void *userdata, GError *err)
+{
+	NMF5VpnPlugin *f5vpn_plugin = NM_F5VPN_PLUGIN (userdata);
+
+	if (!err) {
+		session_cache_touch (f5vpn_plugin->refresh_uuid);
+		return;
+	}
+
+	g_message ("VPN session lost after %u refreshes: %s", f5vpn_refresh_get_count (refresh), err->message);
+	g_error_free (err);
+	session_cache_invalidate (f5vpn_plugin->refresh_uuid);
+	stop_refresh (f5vpn_plugin);
+}
+
+static gboolean
+on_refresh_deadline (gpointer userdata)
+{
+	NMF5VpnPlugin *f5vpn_plugin = NM_F5VPN_PLUGIN (userdata);
+	g_message ("No longer keeping the VPN session alive after %us without a tunnel", f5vpn_plugin->refresh_duration);
+	f5vpn_plugin->refresh_deadline_id = 0;
+	stop_refresh (f5vpn_plugin);
+	return G_SOURCE_REMOVE;
+}
+
+/* Keeps refreshing for a while once the tunnel is down, so that a reconnect
+ * soon after can still use the cached session */
+static void
+tunnel_down_refresh (NMF5VpnPlugin *f5vpn_plugin)
+{
+	if (f5vpn_plugin->refresh && !f5vpn_plugin->refresh_deadline_id)
+		f5vpn_plugin->refresh_deadline_id = g_timeout_add_seconds (f5vpn_plugin->refresh_duration, on_refresh_deadline, f5vpn_plugin);
+}
+
+/* The "hostname" data item may list several gateways. The auth dialog probes
+ * them and reports the one it authenticated against as a secret, since the
+ * session is only valid there. Returns a newly-allocated string. */
+static gchar *
+get_gateway (NMSettingVpn *s_vpn)
+{
+	const char *chosen = nm_setting_vpn_get_secret (s_vpn, "f5vpn-gateway");
+	if (chosen)
+		return g_strdup (chosen);
+
+	gchar **gateways = f5vpn_probe_split_hosts (nm_setting_vpn_get_data_item (s_vpn, "hostname"));
+	gchar *first = g_strdup (gateways[0]);
+	g_strfreev (gateways);
+	return first;
+}
+
+/* Reads a number between min and max from a data item into value, which is
+ * left alone if the item is missing or invalid */
+static void
+get_uint_item (NMSettingVpn *s_vpn, const char *key, guint min, guint max, guint *value)
+{
+	const char *str = nm_setting_vpn_get_data_item (s_vpn, key);
+	gchar *end = NULL;
+
+	if (!str)
+		return;
+	errno = 0;
+	guint64 parsed = g_ascii_strtoull (str, &end, 10);
+	if (!g_ascii_isdigit (*str) || *end || errno || parsed < min || parsed > max) {
+		g_warning ("Ignoring %s \"%s\": expected a number between %u and %u", key, str, min, max);
+		return;
+	}
+	*value = (guint) parsed;
+}
+
+/* The "mtu" data item is a number, "auto" (the default) or "pppd" */
+static gint
+parse_mtu (const char *mtu)
+{
+	if (!mtu || !g_strcmp0 (mtu, "auto"))
+		return F5VPN_MTU_AUTO;
+	if (!g_strcmp0 (mtu, "pppd"))
+		return F5VPN_MTU_PPPD_DEFAULT;
+	return atoi (mtu);
+}
 
 static GVariant *
 build_dns (const NetworkSettings *settings)
@@ -79,6 +268,39 @@ build_dns (const NetworkSettings *settings)
 	return value;
 }
 
+/* DNS_SUFFIX0 gives search domains. DNS_SPLIT0 lists the domains to be
+ * resolved through the tunnel's nameservers; they are passed as routing-only
+ * "~" domains, so that other names keep using the local nameservers instead
+ * of taking a round trip through the tunnel. A "*" in DNS_SPLIT0, or no
+ * DNS_SPLIT0 at all, has all names resolved through the tunnel as before. */
+static GVariant *
+build_domains (const NetworkSettings *settings)
+{
+	GVariantBuilder builder;
+	GVariant *value;
+	gint size = 0;
+
+	g_variant_builder_init (&builder, G_VARIANT_TYPE ("as"));
+
+	for (GSList *p = settings->search_domains; p; p = p->next, size++) {
+		g_variant_builder_add (&builder, "s", (const char *) p->data);
+	}
+	for (GSList *p = settings->split_domains; p; p = p->next, size++) {
+		const char *domain = (const char *) p->data;
+		gchar *routing = g_strconcat ("~", g_strcmp0 (domain, "*") ? domain : ".", NULL);
+		g_variant_builder_add (&builder, "s", routing);
+		g_free (routing);
+	}
+
+	value = g_variant_builder_end (&builder);
+	if (size == 0) {
+		g_variant_unref (value);
+		return NULL;
+	}
+
+	return value;
+}
+
 static GVariant *
 build_routes (const NetworkSettings *settings)
 {
@@ -133,45 +355,448 @@ notify_network_settings (NMVpnServicePlugin *plugin, const NetworkSettings *sett
 
 	if ((var = build_dns (settings))) {
 		g_variant_builder_add (&vb_ip4, "{sv}", NM_VPN_PLUGIN_IP4_CONFIG_DNS, var);
+		if ((var = build_domains (settings)))
+			g_variant_builder_add (&vb_ip4, "{sv}", NM_VPN_PLUGIN_IP4_CONFIG_DOMAINS, var);
 	}
 	nm_vpn_service_plugin_set_ip4_config (plugin, g_variant_builder_end (&vb_ip4));
 }
 
+static void
+settings_clear (NetworkSettings *settings)
+{
+	g_slist_free_full (settings->lans, g_free);
+	g_slist_free_full (settings->nameservers, g_free);
+	g_slist_free_full (settings->search_domains, g_free);
+	g_slist_free_full (settings->split_domains, g_free);
+	memset (settings, 0, sizeof (*settings));
+}
+
+/* Deep copy, as the lists of a connection's settings go away with it */
+static void
+settings_copy (NetworkSettings *dst, const NetworkSettings *src)
+{
+	settings_clear (dst);
+	*dst = *src;
+	dst->lans = NULL;
+	dst->nameservers = NULL;
+	dst->search_domains = g_slist_copy_deep (src->search_domains, (GCopyFunc) g_strdup, NULL);
+	dst->split_domains = g_slist_copy_deep (src->split_domains, (GCopyFunc) g_strdup, NULL);
+	for (GSList *p = src->lans; p; p = p->next) {
+		LanAddr *lan = g_new (LanAddr, 1);
+		*lan = *(const LanAddr *) p->data;
+		dst->lans = g_slist_prepend (dst->lans, lan);
+	}
+	for (GSList *p = src->nameservers; p; p = p->next) {
+		struct in_addr *ns = g_new (struct in_addr, 1);
+		*ns = *(const struct in_addr *) p->data;
+		dst->nameservers = g_slist_prepend (dst->nameservers, ns);
+	}
+	dst->lans = g_slist_reverse (dst->lans);
+	dst->nameservers = g_slist_reverse (dst->nameservers);
+}
+
+static void
+stop_on_demand (NMF5VpnPlugin *f5vpn_plugin)
+{
+	if (f5vpn_plugin->idle_check_id)
+		g_source_remove (f5vpn_plugin->idle_check_id);
+	f5vpn_plugin->idle_check_id = 0;
+	if (f5vpn_plugin->ondemand) {
+		gchar *dump = f5vpn_ondemand_dump (f5vpn_plugin->ondemand);
+		g_message ("%s", dump);
+		g_free (dump);
+		f5vpn_ondemand_free (f5vpn_plugin->ondemand);
+	}
+	f5vpn_plugin->ondemand = NULL;
+	f5vpn_plugin->parking = FALSE;
+	settings_clear (&f5vpn_plugin->last_settings);
+}
+
+static void connect_with_params (PluginConnectionHandle *pch);
+
+static ParamsRequest *request_params (NMF5VpnPlugin *f5vpn_plugin, NMSettingVpn *s_vpn);
+
+static gboolean
+on_reconnect (gpointer user)
+{
+	PluginConnectionHandle *pch = (PluginConnectionHandle *) user;
+	NMF5VpnPlugin *f5vpn_plugin = NM_F5VPN_PLUGIN (pch->plugin);
+
+	f5vpn_plugin->reconnect_id = 0;
+	f5vpn_plugin->reconnect_pending = NULL;
+	f5vpn_plugin->reconnects++;
+
+	ParamsRequest *req = request_params (f5vpn_plugin, nm_connection_get_setting_vpn (pch->nm_connection));
+	if (req->done)
+		connect_with_params (pch);
+	else
+		req->waiting = pch;
+	return G_SOURCE_REMOVE;
+}
+
+/* Schedules another attempt to bring up pch's tunnel unless the attempts are
+ * used up. hint_ms is the delay the gateway asked for, if any. */
+static gboolean
+schedule_reconnect (PluginConnectionHandle *pch, guint hint_ms)
+{
+	NMF5VpnPlugin *f5vpn_plugin = NM_F5VPN_PLUGIN (pch->plugin);
+
+	if (f5vpn_plugin->reconnects_left == 0)
+		return FALSE;
+	f5vpn_plugin->reconnects_left--;
+
+	guint delay = f5vpn_backoff_next (&f5vpn_plugin->backoff, hint_ms);
+	g_message ("Reconnecting in %u ms, %u attempts left", delay, f5vpn_plugin->reconnects_left);
+	f5vpn_plugin->reconnect_pending = pch;
+	f5vpn_plugin->reconnect_id = g_timeout_add (delay, on_reconnect, pch);
+	return TRUE;
+}
+
+/* Traffic for the parked tunnel */
+static void
+on_demand (F5VpnOnDemand *ondemand, void *userdata)
+{
+	(void) ondemand;
+
+	NMF5VpnPlugin *f5vpn_plugin = NM_F5VPN_PLUGIN (userdata);
+	PluginConnectionHandle *pch = f5vpn_plugin->parked;
+
+	f5vpn_plugin->parked = NULL;
+	g_message ("Traffic for the VPN, bringing the tunnel up");
+	/* A reconnect without the delay */
+	on_reconnect (pch);
+}
+
+/* Parks the tunnel once the pppd plugin reports no data in either direction
+ * for the idle timeout; LCP echoes do not count */
+static gboolean
+on_idle_check (gpointer user)
+{
+	NMF5VpnPlugin *f5vpn_plugin = NM_F5VPN_PLUGIN (user);
+
+	if (!f5vpn_plugin->f5vpn || f5vpn_plugin->parking)
+		return G_SOURCE_CONTINUE;
+
+	const F5VpnStatsSegment *stats = f5vpn_connection_get_stats (f5vpn_plugin->f5vpn);
+	if (stats->state != F5VPN_STATS_STATE_UP || MIN (stats->link.idle_in_s, stats->link.idle_out_s) < f5vpn_plugin->idle_timeout)
+		return G_SOURCE_CONTINUE;
+
+	if (!f5vpn_plugin->ondemand) {
+		GError *err = NULL;
+		f5vpn_plugin->ondemand = f5vpn_ondemand_new (NULL, on_demand, f5vpn_plugin, &err);
+		if (!f5vpn_plugin->ondemand) {
+			g_warning ("Keeping the idle tunnel up: %s", err->message);
+			g_error_free (err);
+			f5vpn_plugin->idle_check_id = 0;
+			return G_SOURCE_REMOVE;
+		}
+	}
+
+	g_message ("Tunnel idle for %us, parking it on %s", f5vpn_plugin->idle_timeout, f5vpn_ondemand_get_device (f5vpn_plugin->ondemand));
+	f5vpn_plugin->parking = TRUE;
+	f5vpn_disconnect (f5vpn_plugin->f5vpn);
+	return G_SOURCE_CONTINUE;
+}
+
+/* Frees the connection which just reported its end. Reconnects and on-demand
+ * bring-ups each start a new one, so that nothing of it, including the
+ * descriptors towards its children, carries over to the next. */
+static void
+drop_connection (NMF5VpnPlugin *f5vpn_plugin, F5VpnConnection *connection)
+{
+	g_warn_if_fail (f5vpn_plugin->f5vpn == connection);
+	f5vpn_connection_free (connection);
+	f5vpn_plugin->f5vpn = NULL;
+}
+
+/* Hands the routes and DNS of the tunnel which just went down to the
+ * placeholder, which keeps the session's local address */
+static void
+park_tunnel (PluginConnectionHandle *pch, F5VpnConnection *connection)
+{
+	NMF5VpnPlugin *f5vpn_plugin = NM_F5VPN_PLUGIN (pch->plugin);
+	NetworkSettings placeholder = f5vpn_plugin->last_settings;
+
+	f5vpn_plugin->parking = FALSE;
+	drop_connection (f5vpn_plugin, connection);
+	f5vpn_plugin->parked = pch;
+
+	g_strlcpy (placeholder.device, f5vpn_ondemand_get_device (f5vpn_plugin->ondemand), sizeof (placeholder.device));
+	notify_network_settings (pch->plugin, &placeholder);
+	f5vpn_ondemand_park (f5vpn_plugin->ondemand);
+}
+
 static void
 on_tunnel_status_change (F5VpnConnection *connection, const NetworkSettings *settings, void *userdata, GError *err)
 {
 	PluginConnectionHandle *pch = (PluginConnectionHandle *) userdata;
+	NMF5VpnPlugin *f5vpn_plugin = NM_F5VPN_PLUGIN (pch->plugin);
+
+	if (!settings && f5vpn_plugin->parking) {
+		g_clear_error (&err);
+		park_tunnel (pch, connection);
+		return;
+	}
+
+	/* A tunnel which was up is re-established in the background, unless the
+	 * user took it down or the session is gone */
+	if (!settings && pch->was_up && !f5vpn_plugin->disconnect_requested
+	    && !(err && err->code == F5VPN_CONNECT_ERROR_BAD_HTTP_CODE)
+	    && schedule_reconnect (pch, 0)) {
+		g_warning ("Tunnel lost: %s", err ? err->message : "closed by the gateway");
+		g_clear_error (&err);
+		drop_connection (f5vpn_plugin, connection);
+		return;
+	}
 
 	if (err) {
 		if (err->code == F5VPN_CONNECT_ERROR_BAD_HTTP_CODE) {
-			/* Don't know how to clear secrets from here. Instead, do a synchronous test in need_secrets, which will be called on reconnect */
+			/* Don't know how to clear secrets from here. Instead, need_secrets validates the session again on reconnect */
 			nm_connection_need_secrets (pch->nm_connection, NULL);
+			session_cache_invalidate (nm_connection_get_uuid (pch->nm_connection));
+			stop_refresh (NM_F5VPN_PLUGIN (pch->plugin));
+		} else {
+			session_cache_touch (nm_connection_get_uuid (pch->nm_connection));
+			tunnel_down_refresh (NM_F5VPN_PLUGIN (pch->plugin));
 		}
+		stop_on_demand (f5vpn_plugin);
 		g_object_unref (pch->nm_connection);
 		nm_vpn_service_plugin_failure (pch->plugin, NM_VPN_PLUGIN_FAILURE_CONNECT_FAILED);
-		f5vpn_connection_free (connection);
-		NM_F5VPN_PLUGIN (pch->plugin)->f5vpn = NULL;
+		drop_connection (f5vpn_plugin, connection);
 		free (pch);
 		return;
 	}
 
 	if (!settings) {
+		session_cache_touch (nm_connection_get_uuid (pch->nm_connection));
+		tunnel_down_refresh (NM_F5VPN_PLUGIN (pch->plugin));
+		stop_on_demand (f5vpn_plugin);
 		g_object_unref (pch->nm_connection);
 		nm_vpn_service_plugin_disconnect (pch->plugin, NULL);
-		f5vpn_connection_free (connection);
-		NM_F5VPN_PLUGIN (pch->plugin)->f5vpn = NULL;
+		drop_connection (f5vpn_plugin, connection);
 		free (pch);
 		return;
 	}
 
+	pch->was_up = TRUE;
+	f5vpn_backoff_reset (&f5vpn_plugin->backoff);
+	f5vpn_plugin->reconnects_left = f5vpn_plugin->reconnect_attempts;
+	/* With early settings this runs again if IPCP assigned other addresses;
+	 * NM applies the new configuration to the active connection */
 	notify_network_settings (pch->plugin, settings);
+
+	if (f5vpn_plugin->idle_timeout) {
+		settings_copy (&f5vpn_plugin->last_settings, settings);
+		if (f5vpn_plugin->ondemand && f5vpn_ondemand_flush (f5vpn_plugin->ondemand, settings->device, settings->local_ip))
+			g_message ("Tunnel up on demand, %" G_GINT64_FORMAT "ms after the first packet", f5vpn_ondemand_get_last_latency (f5vpn_plugin->ondemand) / 1000);
+		if (!f5vpn_plugin->idle_check_id)
+			f5vpn_plugin->idle_check_id = g_timeout_add_seconds (IDLE_CHECK_INTERVAL, on_idle_check, f5vpn_plugin);
+	}
 }
 
-static gboolean
-nm_f5vpn_connect (NMVpnServicePlugin *plugin, NMConnection *connection, GError **error)
+/* Fills in the session cached from an earlier connect if NM did not provide
+ * one, so that reconnects skip the interactive login */
+static void
+apply_cached_session (NMConnection *connection, NMSettingVpn *s_vpn)
 {
-	(void) error;
+	CachedSession cached;
+
+	if (nm_setting_vpn_get_secret (s_vpn, "f5vpn-tunnel-id") && nm_setting_vpn_get_secret (s_vpn, "f5vpn-session-key"))
+		return;
+	if (!session_cache_load (nm_connection_get_uuid (connection), &cached))
+		return;
+
+	/* The session is only valid on the gateway it was created on, which must
+	 * still be one of the connection's gateways */
+	gchar **gateways = f5vpn_probe_split_hosts (nm_setting_vpn_get_data_item (s_vpn, "hostname"));
+	if (g_strv_contains ((const gchar *const *) gateways, cached.gateway)) {
+		nm_setting_vpn_add_secret (s_vpn, "f5vpn-gateway", cached.gateway);
+		nm_setting_vpn_add_secret (s_vpn, "f5vpn-tunnel-id", cached.tunnel_id);
+		nm_setting_vpn_add_secret (s_vpn, "f5vpn-session-key", cached.session_key);
+	}
+	g_strfreev (gateways);
+	cached_session_clear (&cached);
+}
+
+/* Identifies the session a connect.php3 request was made for */
+static gchar *
+session_identity (NMSettingVpn *s_vpn)
+{
+	gchar *gateway = get_gateway (s_vpn);
+	gchar *identity = g_strdup_printf ("%s|%s|%s", gateway,
+	                                   nm_setting_vpn_get_secret (s_vpn, "f5vpn-tunnel-id"),
+	                                   nm_setting_vpn_get_secret (s_vpn, "f5vpn-session-key"));
+	g_free (gateway);
+	return identity;
+}
+
+static void
+on_connect_params (F5VpnConnectParams *params, void *userdata, GError *err);
+
+/* Starts fetching the tunnel parameters unless a request for the same session
+ * is already in flight or done. A previous request still in flight is
+ * aborted. */
+static ParamsRequest *
+request_params (NMF5VpnPlugin *f5vpn_plugin, NMSettingVpn *s_vpn)
+{
+	gchar *identity = session_identity (s_vpn);
+	ParamsRequest *req = f5vpn_plugin->params_req;
+
+	if (req && !strcmp (req->identity, identity)
+	    && !(req->done && g_get_monotonic_time () - req->done_at > PARAMS_MAX_AGE * G_USEC_PER_SEC)) {
+		g_free (identity);
+		return req;
+	}
+
+	if (req)
+		params_request_drop (f5vpn_plugin);
+
+	req = calloc (1, sizeof (ParamsRequest));
+	req->identity = identity;
+	f5vpn_plugin->params_req = req;
+
+	gchar *gateway = get_gateway (s_vpn);
+	req->params = f5vpn_connect_params_begin (g_main_loop_get_context (main_loop),
+	                                          gateway,
+	                                          nm_setting_vpn_get_secret (s_vpn, "f5vpn-session-key"),
+	                                          nm_setting_vpn_get_secret (s_vpn, "f5vpn-tunnel-id"),
+	                                          on_connect_params, req);
+	g_free (gateway);
+	return req;
+}
+
+static void
+configure_connection (NMF5VpnPlugin *f5vpn_plugin, NMConnection *connection, NMSettingVpn *s_vpn)
+{
+	F5VpnConnection *f5vpn = f5vpn_plugin->f5vpn;
 
+	guint keepalive_interval = F5VPN_KEEPALIVE_DEFAULT_INTERVAL;
+	guint keepalive_failures = F5VPN_KEEPALIVE_DEFAULT_FAILURES;
+	get_uint_item (s_vpn, "keepalive-interval", 0, F5VPN_KEEPALIVE_MAX_INTERVAL, &keepalive_interval);
+	get_uint_item (s_vpn, "keepalive-failures", 1, F5VPN_KEEPALIVE_MAX_FAILURES, &keepalive_failures);
+	f5vpn_connection_set_keepalive (f5vpn, keepalive_interval, keepalive_failures);
+
+	const char *mtu = nm_setting_vpn_get_data_item (s_vpn, "mtu");
+	const char *clamp_mss = nm_setting_vpn_get_data_item (s_vpn, "clamp-mss");
+	f5vpn_connection_set_mtu (f5vpn,
+	                          parse_mtu (mtu),
+	                          !g_strcmp0 (clamp_mss, "true"));
+
+	/* An on-demand bring-up sends the queued packets as soon as the settings
+	 * are reported, which would be lost before IPCP is done */
+	const char *early_settings = nm_setting_vpn_get_data_item (s_vpn, "early-settings");
+	const char *idle_timeout = nm_setting_vpn_get_data_item (s_vpn, "on-demand-idle-timeout");
+	f5vpn_connection_set_early_settings (f5vpn, !g_strcmp0 (early_settings, "true") && !(idle_timeout && atoi (idle_timeout) > 0));
+
+	const char *socket_profile = nm_setting_vpn_get_data_item (s_vpn, "socket-profile");
+	if (socket_profile) {
+		F5VpnSocketProfile profile;
+		GError *profile_err = NULL;
+		if (f5vpn_socket_profile_parse (socket_profile, &profile, &profile_err)) {
+			f5vpn_connection_set_socket_profile (f5vpn, &profile);
+		} else {
+			g_warning ("Ignoring socket-profile: %s", profile_err->message);
+			g_error_free (profile_err);
+		}
+	}
+
+	f5vpn_connection_set_reconnects (f5vpn, f5vpn_plugin->reconnects);
+	GError *stats_err = NULL;
+	gchar *stats_path = g_strdup_printf (STATS_DIR "/%s.stats", nm_connection_get_uuid (connection));
+	if (g_mkdir_with_parents (STATS_DIR, 0755) == -1 || !f5vpn_connection_publish_stats (f5vpn, stats_path, &stats_err)) {
+		g_warning ("Not publishing connection statistics to %s: %s", stats_path, stats_err ? stats_err->message : strerror (errno));
+		g_clear_error (&stats_err);
+	}
+	g_free (stats_path);
+}
+
+/* Brings up the tunnel once the connect.php3 request for pch's session is done */
+static void
+connect_with_params (PluginConnectionHandle *pch)
+{
+	NMF5VpnPlugin *f5vpn_plugin = NM_F5VPN_PLUGIN (pch->plugin);
+	ParamsRequest *req = f5vpn_plugin->params_req;
+	NMSettingVpn *s_vpn = nm_connection_get_setting_vpn (pch->nm_connection);
+
+	if (req->err) {
+		gboolean session_invalid = req->err->code == F5VPN_CONNECT_ERROR_BAD_HTTP_CODE;
+		gboolean unavailable = req->err->code == F5VPN_CONNECT_ERROR_UNAVAILABLE;
+		guint retry_after = f5vpn_connect_params_get_retry_after (req->params);
+		g_warning ("Could not fetch tunnel parameters: %s", req->err->message);
+		params_request_drop (f5vpn_plugin);
+		if (session_invalid)
+			session_cache_expire (nm_connection_get_uuid (pch->nm_connection), nm_setting_vpn_get_secret (s_vpn, "f5vpn-session-key"));
+
+		if (session_invalid && pch->interactive) {
+			/* Ask for a new session; new_secrets picks up from here */
+			const char *hints[] = { "f5vpn-session-key", NULL };
+			f5vpn_plugin->secrets_pending = pch;
+			nm_vpn_service_plugin_secrets_required (pch->plugin, "The VPN session has expired", hints);
+			return;
+		}
+
+		/* Reconnects try again whatever went wrong, a first connect only if
+		 * the gateway said it is temporarily unavailable */
+		if (!session_invalid && (pch->was_up || unavailable) && schedule_reconnect (pch, retry_after))
+			return;
+
+		stop_on_demand (f5vpn_plugin);
+		nm_vpn_service_plugin_failure (pch->plugin, session_invalid ? NM_VPN_PLUGIN_FAILURE_LOGIN_FAILED : NM_VPN_PLUGIN_FAILURE_CONNECT_FAILED);
+		g_object_unref (pch->nm_connection);
+		free (pch);
+		return;
+	}
+
+	/* The previous connection, if any, was dropped when it reported its end */
+	g_warn_if_fail (f5vpn_plugin->f5vpn == NULL);
+	f5vpn_plugin->f5vpn =
+	    f5vpn_connect_with_params (req->params,
+	                               nm_setting_vpn_get_secret (s_vpn, "f5vpn-session-key"),
+	                               on_tunnel_status_change, pch);
+	params_request_drop (f5vpn_plugin);
+
+	gchar *gateway = get_gateway (s_vpn);
+	session_cache_store (nm_connection_get_uuid (pch->nm_connection), gateway,
+	                     nm_setting_vpn_get_secret (s_vpn, "f5vpn-tunnel-id"),
+	                     nm_setting_vpn_get_secret (s_vpn, "f5vpn-session-key"));
+
+	/* Optionally keep the session from idling out on the gateway */
+	const char *refresh_interval = nm_setting_vpn_get_data_item (s_vpn, "session-refresh-interval");
+	const char *refresh_duration = nm_setting_vpn_get_data_item (s_vpn, "session-refresh-duration");
+	stop_refresh (f5vpn_plugin);
+	if (refresh_interval && atoi (refresh_interval) > 0) {
+		f5vpn_plugin->refresh = f5vpn_refresh_begin (g_main_loop_get_context (main_loop), gateway,
+		                                             nm_setting_vpn_get_secret (s_vpn, "f5vpn-session-key"),
+		                                             atoi (refresh_interval), on_session_refreshed, f5vpn_plugin);
+		f5vpn_plugin->refresh_uuid = g_strdup (nm_connection_get_uuid (pch->nm_connection));
+		f5vpn_plugin->refresh_duration = refresh_duration ? (guint) atoi (refresh_duration) : REFRESH_DEFAULT_DURATION;
+	}
+	g_free (gateway);
+
+	configure_connection (f5vpn_plugin, pch->nm_connection, s_vpn);
+}
+
+static void
+on_connect_params (F5VpnConnectParams *params, void *userdata, GError *err)
+{
+	(void) params;
+
+	ParamsRequest *req = (ParamsRequest *) userdata;
+	req->done = TRUE;
+	req->done_at = g_get_monotonic_time ();
+	req->err = err;
+
+	if (req->waiting) {
+		PluginConnectionHandle *pch = req->waiting;
+		req->waiting = NULL;
+		connect_with_params (pch);
+	}
+}
+
+static gboolean
+real_connect (NMVpnServicePlugin *plugin, NMConnection *connection, gboolean interactive)
+{
+	NMF5VpnPlugin *f5vpn_plugin = NM_F5VPN_PLUGIN (plugin);
 	NMSettingVpn *s_vpn;
 
 	s_vpn = nm_connection_get_setting_vpn (connection);
@@ -180,14 +805,72 @@ nm_f5vpn_connect (NMVpnServicePlugin *plugin, NMConnection *connection, GError *
 	PluginConnectionHandle *pch = malloc (sizeof (PluginConnectionHandle));
 	pch->plugin = plugin;
 	pch->nm_connection = connection;
+	pch->interactive = interactive;
+	pch->was_up = FALSE;
 	g_object_ref_sink (connection);
-	NM_F5VPN_PLUGIN (plugin)->f5vpn =
-	    f5vpn_connect (g_main_loop_get_context (main_loop),
-	                   nm_setting_vpn_get_data_item (s_vpn, "hostname"),
-	                   nm_setting_vpn_get_secret (s_vpn, "f5vpn-session-key"),
-	                   nm_setting_vpn_get_secret (s_vpn, "f5vpn-tunnel-id"),
-	                   on_tunnel_status_change, pch);
-	nm_connection_clear_secrets (pch->nm_connection);
+	f5vpn_plugin->quit_requested = FALSE;
+
+	const char *attempts = nm_setting_vpn_get_data_item (s_vpn, "reconnect-attempts");
+	const char *max_delay = nm_setting_vpn_get_data_item (s_vpn, "reconnect-max-delay");
+	f5vpn_plugin->reconnect_attempts = attempts ? (guint) atoi (attempts) : RECONNECT_DEFAULT_ATTEMPTS;
+	f5vpn_plugin->reconnects_left = f5vpn_plugin->reconnect_attempts;
+	f5vpn_plugin->reconnects = 0;
+	f5vpn_backoff_init (&f5vpn_plugin->backoff, RECONNECT_BASE_DELAY_MS,
+	                    (max_delay ? (guint) atoi (max_delay) : RECONNECT_DEFAULT_MAX_DELAY) * 1000);
+	f5vpn_plugin->disconnect_requested = FALSE;
+
+	const char *idle_timeout = nm_setting_vpn_get_data_item (s_vpn, "on-demand-idle-timeout");
+	f5vpn_plugin->idle_timeout = idle_timeout && atoi (idle_timeout) > 0 ? (guint) atoi (idle_timeout) : 0;
+
+	apply_cached_session (connection, s_vpn);
+
+	/* Normally need_secrets has already started the request */
+	ParamsRequest *req = request_params (f5vpn_plugin, s_vpn);
+	if (req->done)
+		connect_with_params (pch);
+	else
+		req->waiting = pch;
+
+	return TRUE;
+}
+
+static gboolean
+nm_f5vpn_connect (NMVpnServicePlugin *plugin, NMConnection *connection, GError **error)
+{
+	(void) error;
+	return real_connect (plugin, connection, FALSE);
+}
+
+static gboolean
+nm_f5vpn_connect_interactive (NMVpnServicePlugin *plugin, NMConnection *connection, GVariant *details, GError **error)
+{
+	(void) details;
+	(void) error;
+	return real_connect (plugin, connection, TRUE);
+}
+
+static gboolean
+nm_f5vpn_new_secrets (NMVpnServicePlugin *plugin, NMConnection *connection, GError **error)
+{
+	NMF5VpnPlugin *f5vpn_plugin = NM_F5VPN_PLUGIN (plugin);
+	PluginConnectionHandle *pch = f5vpn_plugin->secrets_pending;
+	NMSettingVpn *s_vpn = nm_connection_get_setting_vpn (connection);
+
+	if (!pch || !s_vpn || !nm_setting_vpn_get_secret (s_vpn, "f5vpn-session-key")) {
+		g_set_error (error, NM_VPN_PLUGIN_ERROR, NM_VPN_PLUGIN_ERROR_INVALID_CONNECTION, "%s", "No new VPN session was provided.");
+		return FALSE;
+	}
+
+	f5vpn_plugin->secrets_pending = NULL;
+	g_object_unref (pch->nm_connection);
+	pch->nm_connection = connection;
+	g_object_ref_sink (connection);
+
+	ParamsRequest *req = request_params (f5vpn_plugin, s_vpn);
+	if (req->done)
+		connect_with_params (pch);
+	else
+		req->waiting = pch;
 
 	return TRUE;
 }
@@ -206,6 +889,8 @@ nm_f5vpn_need_secrets (NMVpnServicePlugin *plugin, NMConnection *connection, con
 		return FALSE;
 	}
 
+	apply_cached_session (connection, s_vpn);
+
 	if (nm_setting_vpn_get_secret (s_vpn, "f5vpn-tunnel-id") == NULL) {
 		*setting_name = "f5vpn-tunnel-id";
 		return TRUE;
@@ -216,30 +901,13 @@ nm_f5vpn_need_secrets (NMVpnServicePlugin *plugin, NMConnection *connection, con
 		return TRUE;
 	}
 
-	/* Synchronously call the connect endpoint, because we don't know if the session key is valid,
-	 * and I don't know how to report it when the connection fails asynchronously later */
-	gchar *url = g_strdup_printf ("https://%s/vdesk/vpn/connect.php3?resourcename=%s&outform=xml&client_version=1.1", nm_setting_vpn_get_data_item (s_vpn, "hostname"), nm_setting_vpn_get_secret (s_vpn, "f5vpn-tunnel-id"));
-	gchar *cookie = g_strdup_printf ("MRHSession=%s;", nm_setting_vpn_get_secret (s_vpn, "f5vpn-session-key"));
-
-	CURL *curl = curl_easy_init ();
-	curl_easy_setopt (curl, CURLOPT_COOKIE, cookie);
-	curl_easy_setopt (curl, CURLOPT_URL, url);
-
-	g_free (url);
-	g_free (cookie);
-
-	CURLcode ret = curl_easy_perform (curl);
-	if (ret != CURLE_OK) {
-		g_set_error (error, NM_VPN_PLUGIN_ERROR, NM_VPN_PLUGIN_ERROR_FAILED, "%s", curl_easy_strerror (ret));
-		curl_easy_cleanup (curl);
-		return TRUE;
-	}
-	curl_easy_cleanup (curl);
-
-	long response_code = 0;
-
-	curl_easy_getinfo (curl, CURLINFO_RESPONSE_CODE, &response_code);
-	if (response_code != 200) {
+	/* Validate the session by fetching the tunnel parameters, without blocking
+	 * the main loop: connect reuses the result. If an earlier validation of the
+	 * same session already failed, ask for a new one right away. */
+	ParamsRequest *req = request_params (NM_F5VPN_PLUGIN (plugin), s_vpn);
+	if (req->done && req->err && req->err->code == F5VPN_CONNECT_ERROR_BAD_HTTP_CODE) {
+		params_request_drop (NM_F5VPN_PLUGIN (plugin));
+		session_cache_expire (nm_connection_get_uuid (connection), nm_setting_vpn_get_secret (s_vpn, "f5vpn-session-key"));
 		/* Cannot set *error here because that prevents NM for asking for secrets again */
 		nm_connection_clear_secrets (connection);
 		*setting_name = "f5vpn-session-key";
@@ -255,8 +923,35 @@ nm_f5vpn_disconnect (NMVpnServicePlugin *plugin, GError **err)
 	(void) err;
 
 	NMF5VpnPlugin *f5vpn_plugin = NM_F5VPN_PLUGIN (plugin);
-	g_assert_nonnull (f5vpn_plugin->f5vpn);
 
+	/* Still waiting for the tunnel parameters, for a new session, to
+	 * reconnect or for traffic */
+	PluginConnectionHandle *pch = f5vpn_plugin->secrets_pending;
+	f5vpn_plugin->secrets_pending = NULL;
+	if (!pch && f5vpn_plugin->reconnect_pending) {
+		pch = f5vpn_plugin->reconnect_pending;
+		f5vpn_plugin->reconnect_pending = NULL;
+		g_source_remove (f5vpn_plugin->reconnect_id);
+		f5vpn_plugin->reconnect_id = 0;
+	}
+	if (!pch && f5vpn_plugin->params_req) {
+		pch = f5vpn_plugin->params_req->waiting;
+		f5vpn_plugin->params_req->waiting = NULL;
+	}
+	if (!pch && f5vpn_plugin->parked) {
+		pch = f5vpn_plugin->parked;
+		f5vpn_plugin->parked = NULL;
+	}
+	if (pch) {
+		stop_on_demand (f5vpn_plugin);
+		g_object_unref (pch->nm_connection);
+		free (pch);
+		return TRUE;
+	}
+
+	g_assert_nonnull (f5vpn_plugin->f5vpn);
+	f5vpn_plugin->disconnect_requested = TRUE;
+	f5vpn_plugin->parking = FALSE;
 	f5vpn_disconnect (f5vpn_plugin->f5vpn);
 
 	return TRUE;
@@ -267,6 +962,8 @@ nm_f5vpn_plugin_class_init (NMF5VpnPluginClass *klass)
 {
 	NMVpnServicePluginClass *parent_class = NM_VPN_SERVICE_PLUGIN_CLASS (klass);
 	parent_class->connect = nm_f5vpn_connect;
+	parent_class->connect_interactive = nm_f5vpn_connect_interactive;
+	parent_class->new_secrets = nm_f5vpn_new_secrets;
 	parent_class->need_secrets = nm_f5vpn_need_secrets;
 	parent_class->disconnect = nm_f5vpn_disconnect;
 }
@@ -277,14 +974,51 @@ nm_f5vpn_plugin_init (NMF5VpnPlugin *plugin)
 	(void) plugin;
 }
 
+/* NM asks the service to quit once it is idle; put that off while a
+ * session is being kept alive */
+static void
+on_quit (NMF5VpnPlugin *f5vpn_plugin)
+{
+	if (f5vpn_plugin->refresh) {
+		f5vpn_plugin->quit_requested = TRUE;
+		return;
+	}
+	g_main_loop_quit (main_loop);
+}
+
+/* SIGUSR1 dumps the forwarding latency histograms to the log */
+static gboolean
+on_dump_latency (gpointer user_data)
+{
+	NMF5VpnPlugin *f5vpn_plugin = NM_F5VPN_PLUGIN (user_data);
+	if (f5vpn_plugin->f5vpn) {
+		gchar *dump = f5vpn_connection_dump_latency (f5vpn_plugin->f5vpn);
+		g_message ("forwarding latency:\n%s", dump);
+		g_free (dump);
+	}
+	if (f5vpn_plugin->ondemand) {
+		gchar *dump = f5vpn_ondemand_dump (f5vpn_plugin->ondemand);
+		g_message ("%s", dump);
+		g_free (dump);
+	}
+	if (lag_monitor) {
+		gchar *dump = f5vpn_lag_monitor_dump (lag_monitor);
+		g_message ("dispatch lag:\n%s", dump);
+		g_free (dump);
+	}
+	return G_SOURCE_CONTINUE;
+}
+
 int
 main (int argc, char **argv)
 {
 	NMVpnServicePlugin *plugin;
 	const char *bus_name = "org.freedesktop.NetworkManager.f5vpn";
+	gint dispatch_lag = 0;
 	GOptionContext *opt_ctx = NULL;
 	GOptionEntry options[] = {
 		{ "bus-name", 0, 0, G_OPTION_ARG_STRING, &bus_name, "D-Bus name to use for this instance", NULL },
+		{ "dispatch-lag", 0, 0, G_OPTION_ARG_INT, &dispatch_lag, "Debugging: monitor how late the main loop dispatches, logging stalls of this many milliseconds (0 to disable)", NULL },
 		{ NULL }
 	};
 	GError *error = NULL;
@@ -299,14 +1033,21 @@ main (int argc, char **argv)
 	g_option_context_free (opt_ctx);
 
 	main_loop = g_main_loop_new (NULL, FALSE);
+	if (dispatch_lag > 0)
+		lag_monitor = f5vpn_lag_monitor_start (NULL, F5VPN_LAG_MONITOR_DEFAULT_INTERVAL_MS, dispatch_lag);
 
 	plugin = g_initable_new (NM_TYPE_F5VPN_PLUGIN, NULL, &error, NM_VPN_SERVICE_PLUGIN_DBUS_SERVICE_NAME, bus_name, NULL);
 	if (!plugin)
 		return EXIT_FAILURE;
 
-	g_signal_connect_swapped (plugin, "quit", G_CALLBACK (g_main_loop_quit), main_loop);
+	g_signal_connect_swapped (plugin, "quit", G_CALLBACK (on_quit), plugin);
+	g_unix_signal_add (SIGUSR1, on_dump_latency, plugin);
 	g_main_loop_run (main_loop);
 
+	if (lag_monitor) {
+		on_dump_latency (plugin);
+		f5vpn_lag_monitor_free (lag_monitor);
+	}
 	g_main_loop_unref (main_loop);
 	g_object_unref (plugin);
 
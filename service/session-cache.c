@@ -0,0 +1,205 @@
+/*
+ * NetworkManager-f5vpn
+ * Plugin for NetworkManager to access F5 Firepass SSL VPNs
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "session-cache.h"
+
+#define SESSION_CACHE_DIR "/run/NetworkManager-f5vpn/sessions"
+
+/* The [session] group holds the cached session; [profile] holds what was
+ * learnt about the connection's sessions and outlives them */
+#define GROUP_SESSION "session"
+#define GROUP_PROFILE "profile"
+
+/* An observed session lifetime is forgotten after this many seconds, so that
+ * one misjudged rejection does not stop sessions from being reused for good */
+#define LIFETIME_MAX_AGE (24 * 3600)
+
+static gchar *
+cache_path (const char *uuid)
+{
+	return g_strdup_printf (SESSION_CACHE_DIR "/%s", uuid);
+}
+
+static GKeyFile *
+cache_read (const char *uuid)
+{
+	GKeyFile *kf = g_key_file_new ();
+	gchar *path = cache_path (uuid);
+	g_key_file_load_from_file (kf, path, G_KEY_FILE_NONE, NULL);
+	g_free (path);
+	return kf;
+}
+
+static void
+cache_write (const char *uuid, GKeyFile *kf)
+{
+	gsize len;
+	gchar *data = g_key_file_to_data (kf, &len, NULL);
+	gchar *path = cache_path (uuid);
+	gchar *tmp = g_strconcat (path, ".tmp", NULL);
+
+	/* Session keys are as good as passwords, so never let the file be
+	 * readable by anyone else, not even briefly */
+	if (g_mkdir_with_parents (SESSION_CACHE_DIR, 0700) == -1) {
+		g_warning ("Could not create %s: %s", SESSION_CACHE_DIR, strerror (errno));
+		goto out;
+	}
+	int fd = open (tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd == -1 || write (fd, data, len) != (ssize_t) len || close (fd) == -1 || rename (tmp, path) == -1) {
+		g_warning ("Could not write the session cache %s: %s", path, strerror (errno));
+		unlink (tmp);
+	}
+
+out:
+	g_free (tmp);
+	g_free (path);
+	g_free (data);
+}
+
+static gint64
+now (void)
+{
+	return g_get_real_time () / G_USEC_PER_SEC;
+}
+
+gboolean
+session_cache_load (const char *uuid, CachedSession *session)
+{
+	GKeyFile *kf = cache_read (uuid);
+	gboolean ret = FALSE;
+
+	session->gateway = g_key_file_get_string (kf, GROUP_SESSION, "gateway", NULL);
+	session->tunnel_id = g_key_file_get_string (kf, GROUP_SESSION, "tunnel-id", NULL);
+	session->session_key = g_key_file_get_string (kf, GROUP_SESSION, "session-key", NULL);
+	session->created = g_key_file_get_int64 (kf, GROUP_SESSION, "created", NULL);
+	session->last_used = g_key_file_get_int64 (kf, GROUP_SESSION, "last-used", NULL);
+	gint64 lifetime = g_key_file_get_int64 (kf, GROUP_PROFILE, "idle-lifetime", NULL);
+	gint64 learnt = g_key_file_get_int64 (kf, GROUP_PROFILE, "learnt", NULL);
+	g_key_file_free (kf);
+
+	if (now () - learnt > LIFETIME_MAX_AGE)
+		lifetime = 0;
+
+	if (session->gateway && session->tunnel_id && session->session_key) {
+		/* A session idle for longer than one was seen to survive is not worth a
+		 * validation round trip */
+		if (lifetime > 0 && now () - session->last_used >= lifetime)
+			g_message ("Cached session unused for %" G_GINT64_FORMAT "s, sessions were seen to expire after %" G_GINT64_FORMAT "s",
+			           now () - session->last_used, lifetime);
+		else
+			ret = TRUE;
+	}
+
+	if (!ret)
+		cached_session_clear (session);
+	return ret;
+}
+
+void
+session_cache_store (const char *uuid, const char *gateway, const char *tunnel_id, const char *session_key)
+{
+	GKeyFile *kf = cache_read (uuid);
+	gchar *cached_key = g_key_file_get_string (kf, GROUP_SESSION, "session-key", NULL);
+
+	/* A session which survived longer than the observed lifetime proves it
+	 * too short */
+	gint64 idle = now () - g_key_file_get_int64 (kf, GROUP_SESSION, "last-used", NULL);
+	if (!g_strcmp0 (cached_key, session_key) && idle > g_key_file_get_int64 (kf, GROUP_PROFILE, "idle-lifetime", NULL)
+	    && g_key_file_has_key (kf, GROUP_PROFILE, "idle-lifetime", NULL)) {
+		g_key_file_set_int64 (kf, GROUP_PROFILE, "idle-lifetime", idle);
+		g_key_file_set_int64 (kf, GROUP_PROFILE, "learnt", now ());
+	}
+
+	if (g_strcmp0 (cached_key, session_key)) {
+		g_key_file_remove_group (kf, GROUP_SESSION, NULL);
+		g_key_file_set_string (kf, GROUP_SESSION, "gateway", gateway);
+		g_key_file_set_string (kf, GROUP_SESSION, "tunnel-id", tunnel_id);
+		g_key_file_set_string (kf, GROUP_SESSION, "session-key", session_key);
+		g_key_file_set_int64 (kf, GROUP_SESSION, "created", now ());
+	}
+	g_key_file_set_int64 (kf, GROUP_SESSION, "last-used", now ());
+
+	cache_write (uuid, kf);
+	g_free (cached_key);
+	g_key_file_free (kf);
+}
+
+void
+session_cache_touch (const char *uuid)
+{
+	GKeyFile *kf = cache_read (uuid);
+	if (g_key_file_has_group (kf, GROUP_SESSION)) {
+		g_key_file_set_int64 (kf, GROUP_SESSION, "last-used", now ());
+		cache_write (uuid, kf);
+	}
+	g_key_file_free (kf);
+}
+
+void
+session_cache_invalidate (const char *uuid)
+{
+	GKeyFile *kf = cache_read (uuid);
+	if (g_key_file_has_group (kf, GROUP_SESSION)) {
+		g_key_file_remove_group (kf, GROUP_SESSION, NULL);
+		cache_write (uuid, kf);
+	}
+	g_key_file_free (kf);
+}
+
+void
+session_cache_expire (const char *uuid, const char *session_key)
+{
+	GKeyFile *kf = cache_read (uuid);
+	gchar *cached_key = g_key_file_get_string (kf, GROUP_SESSION, "session-key", NULL);
+
+	if (cached_key && !g_strcmp0 (cached_key, session_key)) {
+		gint64 idle = now () - g_key_file_get_int64 (kf, GROUP_SESSION, "last-used", NULL);
+		gint64 age = now () - g_key_file_get_int64 (kf, GROUP_SESSION, "created", NULL);
+		gint64 lifetime = g_key_file_get_int64 (kf, GROUP_PROFILE, "idle-lifetime", NULL);
+		if (now () - g_key_file_get_int64 (kf, GROUP_PROFILE, "learnt", NULL) > LIFETIME_MAX_AGE)
+			lifetime = 0;
+
+		g_message ("Cached session rejected after %" G_GINT64_FORMAT "s, %" G_GINT64_FORMAT "s idle", age, idle);
+		/* Sessions may also end early, e.g. by an administrator, so the
+		 * longest idle time seen is kept */
+		if (idle > lifetime) {
+			g_key_file_set_int64 (kf, GROUP_PROFILE, "idle-lifetime", idle);
+			g_key_file_set_int64 (kf, GROUP_PROFILE, "learnt", now ());
+		}
+	}
+	g_key_file_remove_group (kf, GROUP_SESSION, NULL);
+	cache_write (uuid, kf);
+	g_free (cached_key);
+	g_key_file_free (kf);
+}
+
+void
+cached_session_clear (CachedSession *session)
+{
+	g_free (session->gateway);
+	g_free (session->tunnel_id);
+	g_free (session->session_key);
+	memset (session, 0, sizeof (*session));
+}
@@ -0,0 +1,74 @@
+/*
+ * NetworkManager-f5vpn
+ * Plugin for NetworkManager to access F5 Firepass SSL VPNs
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+#ifndef SESSION_CACHE_H
+#define SESSION_CACHE_H
+
+#include <glib.h>
+
+/* Sessions which connected successfully are remembered per connection UUID,
+ * so that a reconnect can reuse them instead of logging in again. The service
+ * process does not outlive a connection, so the cache lives in root-only
+ * files under /run. */
+
+typedef struct
+{
+	gchar *gateway;
+	gchar *tunnel_id;
+	gchar *session_key;
+	gint64 created;   /* wall clock seconds when first cached */
+	gint64 last_used; /* last time the session was known to be alive */
+} CachedSession;
+
+/**
+ * Looks up the session cached for uuid. Returns FALSE if there is none, or if
+ * it has been unused for longer than a session of this connection was
+ * observed to survive. On success, session should be cleared with
+ * cached_session_clear.
+ */
+gboolean session_cache_load (const char *uuid, CachedSession *session);
+
+/**
+ * Caches a session which was just found to be valid. If the same session is
+ * already cached, only its last use is updated.
+ */
+void session_cache_store (const char *uuid, const char *gateway, const char *tunnel_id, const char *session_key);
+
+/**
+ * Records that the cached session was alive until now, e.g. when its tunnel
+ * goes down.
+ */
+void session_cache_touch (const char *uuid);
+
+/**
+ * Discards the cached session, e.g. after the gateway ended it while in use.
+ */
+void session_cache_invalidate (const char *uuid);
+
+/**
+ * Discards the cached session after the gateway rejected session_key when
+ * validating it, which is taken as the session having expired. If the cached
+ * session is the rejected one, its idle time raises the observed session
+ * lifetime; the observation is forgotten after a day.
+ */
+void session_cache_expire (const char *uuid, const char *session_key);
+
+void cached_session_clear (CachedSession *session);
+
+#endif // SESSION_CACHE_H